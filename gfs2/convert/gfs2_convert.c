@@ -576,7 +576,11 @@ static int get_inode_metablocks(struct gfs2_sbd *sbp, struct gfs2_inode *ip, str
 			/* Free the block so we can reuse it. This allows us to
 			   convert a "full" file system. */
 			ip->i_blocks--;
-			gfs2_free_block(sbp, block);
+			if (gfs2_free_block(sbp, block) != 0) {
+				log_crit(_("Error: Can't free block %"PRIu64": %s\n"),
+				         block, strerror(errno));
+				return -1;
+			}
 		}
 	}
 	return 0;
@@ -678,7 +682,13 @@ static int fix_ind_jdata(struct gfs2_sbd *sbp, struct gfs2_inode *ip, uint32_t d
 		/* Free the block so we can reuse it. This allows us to
 		   convert a "full" file system */
 		ip->i_blocks--;
-		gfs2_free_block(sbp, block);
+		if (gfs2_free_block(sbp, block) != 0) {
+			log_crit(_("Error: Can't free block %"PRIu64": %s\n"),
+			         block, strerror(errno));
+			free(newblk->ptrbuf);
+			free(newblk);
+			return -1;
+		}
 
 		len = bufsize;
 		jdata_mp_gfs1_to_gfs2(sbp, di_height, gfs2_hgt, &newblk->mp, &gfs2mp,
@@ -383,7 +383,7 @@ static void print_block_details(struct iinfo *ind, int level, int cur_height,
 	}
 	while (thisblk) {
 		/* read in the desired block */
-		if (pread(sbd.device_fd, tmpbuf, sbd.sd_bsize, thisblk * sbd.sd_bsize) != sbd.sd_bsize) {
+		if (lgfs2_pread(&sbd, sbd.device_fd, tmpbuf, sbd.sd_bsize, thisblk * sbd.sd_bsize) != sbd.sd_bsize) {
 			fprintf(stderr, "bad read: %s from %s:%d: block %"PRIu64
 				" (0x%"PRIx64")\n", strerror(errno), __FUNCTION__,
 				__LINE__, ind->ii[pndx].block, ind->ii[pndx].block);
@@ -539,7 +539,7 @@ static int parse_rindex(struct gfs2_inode *dip, int print_rindex)
 				struct gfs2_rgrp r = {0};
 				ssize_t ret;
 
-				ret = pread(sbd.device_fd, &r, sizeof(r), rg.rt_addr * sbd.sd_bsize);
+				ret = lgfs2_pread(&sbd, sbd.device_fd, &r, sizeof(r), rg.rt_addr * sbd.sd_bsize);
 				if (ret != sizeof(r)) {
 					perror("Failed to read resource group");
 				} else if (sbd.gfs1) {
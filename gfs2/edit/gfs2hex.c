@@ -427,7 +427,7 @@ void display_gfs2(void *buf)
 			lgfs2_rgrp_print(buf);
 		break;
 	case GFS2_METATYPE_DI:
-		lgfs2_dinode_print(di);
+		lgfs2_dinode_print(buf);
 		break;
 	case GFS2_METATYPE_LF:
 		lgfs2_leaf_print(buf);
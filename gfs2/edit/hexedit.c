@@ -39,13 +39,40 @@ const char *allocdesc[2][5] = {
 static struct gfs2_buffer_head *bh;
 static int pgnum;
 static long int gziplevel = 9;
+static const char *iostats_spec;
 static int termcols;
 static struct lgfs2_inum gfs1_quota_di;
 static struct lgfs2_inum gfs1_license_di;
 
 int details = 0;
+int restore_sparse = 0;
 char *device = NULL;
 
+/* Bitmap memory to keep resource groups cached in between lookups */
+#define RGCACHE_LIMIT (16 << 20)
+
+/* ------------------------------------------------------------------------- */
+/* rgrp_get - read in a resource group, reusing its bitmaps if still cached */
+/* returns: 0 if no error, otherwise the block number that failed */
+/* ------------------------------------------------------------------------- */
+static uint64_t rgrp_get(struct rgrp_tree *rgd)
+{
+	if (rgd->rt_cache != NULL && lgfs2_rgrp_load(rgd) == 0)
+		return 0;
+	return gfs2_rgrp_read(&sbd, rgd);
+}
+
+/* ------------------------------------------------------------------------- */
+/* rgrp_put - done with a resource group for now */
+/* ------------------------------------------------------------------------- */
+static void rgrp_put(struct rgrp_tree *rgd)
+{
+	if (sbd.rgcache != NULL)
+		lgfs2_rgcache_trim(&sbd);
+	else
+		gfs2_rgrp_relse(&sbd, rgd);
+}
+
 /* ------------------------------------------------------------------------- */
 /* erase - clear the screen */
 /* ------------------------------------------------------------------------- */
@@ -357,7 +384,7 @@ int display_block_type(char *buf, uint64_t addr, int from_restore)
 
 		rgd = gfs2_blk2rgrpd(&sbd, block);
 		if (rgd) {
-			gfs2_rgrp_read(&sbd, rgd);
+			rgrp_get(rgd);
 			if ((be32_to_cpu(mh->mh_type) == GFS2_METATYPE_RG) ||
 			    (be32_to_cpu(mh->mh_type) == GFS2_METATYPE_RB))
 				type = 4;
@@ -432,8 +459,12 @@ int display_block_type(char *buf, uint64_t addr, int from_restore)
 				}
 			}
 		}
-		if (rgd)
+		/* Don't keep the bitmaps cached while they are on screen to be
+		   edited, so that they are read again afterwards */
+		if (rgd && block < rgd->rt_addr + rgd->rt_length)
 			gfs2_rgrp_relse(&sbd, rgd);
+		else if (rgd)
+			rgrp_put(rgd);
  	}
 	if (block == sbd.sd_root_dir.in_addr)
 		print_gfs2("--------------- Root directory ------------------");
@@ -892,10 +923,16 @@ static int block_has_extended_info(void)
 
 static void read_superblock(int fd)
 {
+	struct lgfs2_iostats *iostats = sbd.iostats; /* Set up by -I */
+	struct lgfs2_simdev *simdev = sbd.simdev; /* Set up in main() */
+	struct lgfs2_metaimg *metaimg = sbd.metaimg; /* Likewise */
 	struct gfs2_meta_header *mh;
 
 	ioctl(fd, BLKFLSBUF, 0);
 	memset(&sbd, 0, sizeof(struct gfs2_sbd));
+	sbd.iostats = iostats;
+	sbd.simdev = simdev;
+	sbd.metaimg = metaimg;
 	sbd.sd_bsize = GFS2_DEFAULT_BSIZE;
 	sbd.device_fd = fd;
 	bh = bread(&sbd, 0x10);
@@ -917,7 +954,12 @@ static void read_superblock(int fd)
 		sbd.gfs1 = FALSE;
 	if (!sbd.sd_bsize)
 		sbd.sd_bsize = GFS2_DEFAULT_BSIZE;
-	if (lgfs2_get_dev_info(fd, &sbd.dinfo)) {
+	if (sbd.metaimg != NULL) {
+		if (lgfs2_metaimg_dev_info(sbd.metaimg, &sbd.dinfo)) {
+			perror(device);
+			exit(-1);
+		}
+	} else if (lgfs2_get_dev_info(fd, &sbd.dinfo)) {
 		perror(device);
 		exit(-1);
 	}
@@ -966,6 +1008,8 @@ static int read_rindex(void)
 	if (!OSI_EMPTY_ROOT(&sbd.rgtree)) {
 		struct rgrp_tree *rg = (struct rgrp_tree *)osi_last(&sbd.rgtree);
 		sbd.fssize = rg->rt_data0 + rg->rt_data;
+		/* Without the cache, bitmaps are just read for every lookup */
+		lgfs2_rgcache_init(&sbd, RGCACHE_LIMIT);
 	}
 	return 0;
 }
@@ -1155,7 +1199,7 @@ static uint64_t find_metablockoftype_slow(uint64_t startblk, int metatype, int p
 	int found = 0;
 	struct gfs2_buffer_head *lbh;
 
-	last_fs_block = lseek(sbd.device_fd, 0, SEEK_END) / sbd.sd_bsize;
+	last_fs_block = lgfs2_dev_size(&sbd) / sbd.sd_bsize;
 	for (blk = startblk + 1; blk < last_fs_block; blk++) {
 		lbh = bread(&sbd, blk);
 		/* Can't use get_block_type here (returns false "none") */
@@ -1245,7 +1289,7 @@ static uint64_t find_metablockoftype_rg(uint64_t startblk, int metatype, int pri
 	}
 	for (; !found && next; next = osi_next(next)){
 		rgd = (struct rgrp_tree *)next;
-		errblk = gfs2_rgrp_read(&sbd, rgd);
+		errblk = rgrp_get(rgd);
 		if (errblk)
 			continue;
 
@@ -1253,7 +1297,7 @@ static uint64_t find_metablockoftype_rg(uint64_t startblk, int metatype, int pri
 		if (found)
 			break;
 
-		gfs2_rgrp_relse(&sbd, rgd);
+		rgrp_put(rgd);
 	}
 
 	if (!found)
@@ -1471,7 +1515,7 @@ static void hex_edit(int *exitch)
 					ch += (estring[i+1] - 'A' + 0x0a);
 				bh->b_data[offset + hexoffset] = ch;
 			}
-			if (pwrite(sbd.device_fd, bh->b_data, sbd.sd_bsize, dev_offset) !=
+			if (lgfs2_pwrite(&sbd, sbd.device_fd, bh->b_data, sbd.sd_bsize, dev_offset) !=
 			    sbd.sd_bsize) {
 				fprintf(stderr, "write error: %s from %s:%d: "
 					"offset %lld (0x%llx)\n",
@@ -1686,7 +1730,7 @@ static void find_change_block_alloc(int *newval)
 	else {
 		rgd = gfs2_blk2rgrpd(&sbd, ablock);
 		if (rgd) {
-			gfs2_rgrp_read(&sbd, rgd);
+			rgrp_get(rgd);
 			if (newval) {
 				if (gfs2_set_bitmap(rgd, ablock, *newval))
 					printf("-1 (block invalid or part of an rgrp).\n");
@@ -2099,6 +2143,8 @@ static void usage(void)
 	fprintf(stderr,"-z 0 do not use compression\n");
 	fprintf(stderr,"-s   specifies a starting block such as root, rindex, quota, inum.\n");
 	fprintf(stderr,"-x   print in hexmode.\n");
+	fprintf(stderr,"-I table|json[:file] print I/O statistics on exit.\n");
+	fprintf(stderr,"-sparse restoremeta to a sparse file, which only takes space for the metadata.\n");
 	fprintf(stderr,"-h   prints this help.\n\n");
 	fprintf(stderr,"Examples:\n");
 	fprintf(stderr,"   To run in interactive mode:\n");
@@ -2224,7 +2270,7 @@ static void rg_repair(void)
 	/* Walk through the resource groups saving everything within */
 	for (n = osi_first(&sbd.rgtree); n; n = osi_next(n)) {
 		rgd = (struct rgrp_tree *)n;
-		if (gfs2_rgrp_read(&sbd, rgd) == 0) { /* was read in okay */
+		if (rgrp_get(rgd) == 0) { /* was read in okay */
 			gfs2_rgrp_relse(&sbd, rgd);
 			continue; /* ignore it */
 		}
@@ -2284,6 +2330,25 @@ static void rg_repair(void)
 	exit(0);
 }
 
+static void exit_iostats(void)
+{
+	if (sbd.iostats == NULL)
+		return;
+	if (lgfs2_iostats_report(&sbd, iostats_spec) != 0)
+		perror("Failed to print I/O statistics");
+	lgfs2_iostats_free(&sbd);
+}
+
+static void exit_simdev(void)
+{
+	lgfs2_simdev_free(&sbd);
+}
+
+static void exit_metaimg(void)
+{
+	lgfs2_metaimg_free(&sbd);
+}
+
 /* ------------------------------------------------------------------------ */
 /* parameterpass1 - pre-processing for command-line parameters              */
 /* ------------------------------------------------------------------------ */
@@ -2305,6 +2370,22 @@ static void parameterpass1(int argc, char *argv[], int i)
 		i++;
 		color_scheme = atoi(argv[i]);
 	}
+	else if (!strcmp(argv[i], "-I")) {
+		if (i + 1 >= argc || lgfs2_iostats_format(argv[i + 1], NULL) < 0) {
+			fprintf(stderr, "Invalid I/O statistics format.\n");
+			usage();
+			exit(EXIT_FAILURE);
+		}
+		iostats_spec = argv[i + 1];
+		if (sbd.iostats == NULL) {
+			if (lgfs2_iostats_init(&sbd) != 0)
+				perror("Failed to set up I/O statistics");
+			lgfs2_iostats_phase(&sbd, "initialize");
+			atexit(exit_iostats);
+		}
+	}
+	else if (!strcmp(argv[i], "-sparse"))
+		restore_sparse = 1;
 	else if (!strcasecmp(argv[i], "-p") ||
 		 !strcasecmp(argv[i], "-print")) {
 		termlines = 0; /* initial value--we'll figure
@@ -2361,6 +2442,8 @@ static void process_parameters(int argc, char *argv[], int pass)
 	for (i = 1; i < argc; i++) {
 		if (!pass) { /* first pass */
 			parameterpass1(argc, argv, i);
+			if (!strcmp(argv[i], "-I"))
+				i++; /* Don't mistake a file name for the device */
 			continue;
 		}
 		/* second pass */
@@ -2399,6 +2482,8 @@ static void process_parameters(int argc, char *argv[], int pass)
 			push_block(keyword_blk);
 		else if (!strcasecmp(argv[i], "-x"))
 			dmode = HEX_MODE;
+		else if (!strcmp(argv[i], "-I"))
+			i++; /* The format was handled in pass 0 */
 		else if (argv[i][0] == '-') /* if it starts with a dash */
 			; /* ignore it--meant for pass == 0 */
 		else if (!strcmp(argv[i], "identify"))
@@ -2568,6 +2653,9 @@ int main(int argc, char *argv[])
 	edit_row[GFS2_MODE] = 10; /* Start off at root inode
 				     pointer in superblock */
 	termlines = 30;  /* assume interactive mode until we find -p */
+	if (lgfs2_simdev_init(&sbd, getenv("LGFS2_SIMDEV")) != 0)
+		die("Failed to set up the simulated device: %s\n", strerror(errno));
+	atexit(exit_simdev);
 	process_parameters(argc, argv, 0);
 	if (dmode == INIT_MODE)
 		dmode = HEX_MODE;
@@ -2575,17 +2663,22 @@ int main(int argc, char *argv[])
 	fd = open(device, O_RDWR);
 	if (fd < 0)
 		die("can't open %s: %s\n", device, strerror(errno));
-	max_block = lseek(fd, 0, SEEK_END) / sbd.sd_bsize;
+	sbd.device_fd = fd;
+	if (lgfs2_metaimg_open(&sbd) != 0)
+		die("can't read savemeta file %s: %s\n", device, strerror(errno));
+	atexit(exit_metaimg);
+	max_block = lgfs2_dev_size(&sbd) / sbd.sd_bsize;
 
 	read_superblock(fd);
 	if (read_rindex())
 		exit(-1);
-	max_block = lseek(fd, 0, SEEK_END) / sbd.sd_bsize;
+	max_block = lgfs2_dev_size(&sbd) / sbd.sd_bsize;
 	if (sbd.gfs1)
 		edit_row[GFS2_MODE]++;
 	else if (read_master_dir() != 0)
 		exit(-1);
 
+	lgfs2_iostats_phase(&sbd, "commands");
 	process_parameters(argc, argv, 1); /* get what to print from cmdline */
 
 	block = blockstack[0].block = starting_blk * (4096 / sbd.sd_bsize);
@@ -2613,6 +2706,7 @@ int main(int argc, char *argv[])
 	if (indirect)
 		free(indirect);
 	gfs2_rgrp_free(&sbd, &sbd.rgtree);
+	lgfs2_rgcache_free(&sbd);
  	exit(EXIT_SUCCESS);
 }
 #endif /* UNITTESTS */
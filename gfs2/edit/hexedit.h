@@ -59,6 +59,7 @@ extern int dsplines;
 extern int dsp_lines[DMODES];
 extern int combined_display;
 extern int details;
+extern int restore_sparse;
 extern const char *allocdesc[2][5];
 extern char *device;
 
@@ -14,11 +14,13 @@
 #include <curses.h>
 #include <term.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
 #include <limits.h>
 #include <sys/time.h>
 #include <zlib.h>
 #include <bzlib.h>
 #include <time.h>
+#include <pthread.h>
 
 #include <logging.h>
 #include "osi_list.h"
@@ -26,37 +28,30 @@
 #include "hexedit.h"
 #include "libgfs2.h"
 
+#ifndef FALLOC_FL_KEEP_SIZE
+#define FALLOC_FL_KEEP_SIZE 0x01
+#endif
+#ifndef FALLOC_FL_PUNCH_HOLE
+#define FALLOC_FL_PUNCH_HOLE 0x02
+#endif
+
 #define DFT_SAVE_FILE "/tmp/gfsmeta.XXXXXX"
 #define MAX_JOURNALS_SAVED 256
 
-/* Header for the savemeta output file */
-struct savemeta_header {
-#define SAVEMETA_MAGIC (0x01171970)
-	__be32 sh_magic;
-#define SAVEMETA_FORMAT (1)
-	__be32 sh_format; /* In case we want to change the layout */
-	__be64 sh_time; /* When savemeta was run */
-	__be64 sh_fs_bytes; /* Size of the fs */
-	uint8_t __reserved[104];
-};
-
 struct savemeta {
 	time_t sm_time;
 	unsigned sm_format;
 	size_t sm_fs_bytes;
 };
 
-struct saved_metablock {
-	__be64 blk;
-	__be16 siglen; /* significant data length */
-/* This needs to be packed because old versions of gfs2_edit read and write the
-   individual fields separately, so the hole after siglen must be eradicated
-   before the struct reflects what's on disk. */
-} __attribute__((__packed__));
+struct savemeta_zpool;
 
 struct metafd {
 	int fd;
 	gzFile gzfd;
+	struct savemeta_zpool *zpool;
+	struct lgfs2_savemeta_chunk *chunks; /* The index of a format 2 file */
+	uint32_t nchunks;
 	BZFILE *bzfd;
 	const char *filename;
 	int gziplevel;
@@ -433,6 +428,357 @@ static void report_progress(uint64_t pblock, int force)
 	}
 }
 
+/*
+ * Compressed savemeta output is written as a series of independent gzip
+ * members, one per chunk of input, so that the chunks can be compressed by a
+ * pool of threads. gzread() treats concatenated members as a single stream
+ * so restoremeta (and zcat) read the result the same as before. Records are not
+ * split between chunks and an index of the chunks' block ranges is written
+ * after them (savemeta format 2, see libgfs2.h) so that restoremeta can
+ * decompress the chunks in parallel and printsavedmeta can go straight to the
+ * chunks which might hold a block.
+ */
+#define ZCHUNK_SIZE (4 << 20)
+#define ZPOOL_MAX_THREADS (16)
+
+enum zchunk_state {
+	ZCHUNK_EMPTY = 0,
+	ZCHUNK_FILLED,
+	ZCHUNK_DONE
+};
+
+struct zchunk {
+	enum zchunk_state state;
+	char *in;
+	size_t inlen;
+	char *out;
+	size_t outlen;
+	size_t outsize;
+	uint64_t first; /* The range of blocks saved in the chunk */
+	uint64_t last;
+	int err;
+};
+
+struct savemeta_zpool {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t *threads;
+	unsigned nthreads;
+	struct zchunk *chunks;
+	unsigned nchunks;
+	uint64_t fill;     /* Chunk being filled by savemetawrite() */
+	uint64_t compress; /* Next chunk to be picked up by a worker */
+	uint64_t written;  /* Next chunk to be written out */
+	uint64_t offset;   /* Bytes written to the file so far */
+	struct savemeta_chunk *index; /* An entry for each chunk written */
+	int level;
+	int stop;
+};
+
+static int zchunk_compress(struct zchunk *zc, int level)
+{
+	z_stream zs = {0};
+	int ret;
+
+	/* windowBits + 16 gives us a gzip wrapper instead of a zlib one */
+	if (deflateInit2(&zs, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+		return -1;
+	zs.next_in = (Bytef *)zc->in;
+	zs.avail_in = zc->inlen;
+	zs.next_out = (Bytef *)zc->out;
+	zs.avail_out = zc->outsize;
+	ret = deflate(&zs, Z_FINISH);
+	zc->outlen = zc->outsize - zs.avail_out;
+	deflateEnd(&zs);
+	return (ret == Z_STREAM_END) ? 0 : -1;
+}
+
+static void *zpool_worker(void *arg)
+{
+	struct savemeta_zpool *zp = arg;
+
+	pthread_mutex_lock(&zp->lock);
+	for (;;) {
+		struct zchunk *zc;
+
+		while (!zp->stop && zp->compress == zp->fill)
+			pthread_cond_wait(&zp->cond, &zp->lock);
+		if (zp->compress == zp->fill)
+			break;
+		zc = &zp->chunks[zp->compress++ % zp->nchunks];
+		pthread_mutex_unlock(&zp->lock);
+
+		zc->err = zchunk_compress(zc, zp->level);
+
+		pthread_mutex_lock(&zp->lock);
+		zc->state = ZCHUNK_DONE;
+		pthread_cond_broadcast(&zp->cond);
+	}
+	pthread_mutex_unlock(&zp->lock);
+	return NULL;
+}
+
+static unsigned zpool_nthreads(void)
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (n < 1)
+		return 1;
+	if (n > ZPOOL_MAX_THREADS)
+		return ZPOOL_MAX_THREADS;
+	return n;
+}
+
+static struct savemeta_zpool *zpool_init(int level)
+{
+	struct savemeta_zpool *zp;
+	size_t outsize = deflateBound(NULL, ZCHUNK_SIZE) + 32; /* + gzip wrapper */
+
+	zp = calloc(1, sizeof(*zp));
+	if (zp == NULL)
+		return NULL;
+	zp->level = level;
+	zp->nthreads = zpool_nthreads();
+	/* Enough chunks to keep every worker busy while the oldest is written */
+	zp->nchunks = zp->nthreads * 2 + 1;
+	zp->threads = calloc(zp->nthreads, sizeof(*zp->threads));
+	zp->chunks = calloc(zp->nchunks, sizeof(*zp->chunks));
+	if (zp->threads == NULL || zp->chunks == NULL)
+		goto fail;
+	for (unsigned i = 0; i < zp->nchunks; i++) {
+		zp->chunks[i].in = malloc(ZCHUNK_SIZE);
+		zp->chunks[i].out = malloc(outsize);
+		zp->chunks[i].outsize = outsize;
+		zp->chunks[i].first = SAVEMETA_END_BLK;
+		if (zp->chunks[i].in == NULL || zp->chunks[i].out == NULL)
+			goto fail;
+	}
+	pthread_mutex_init(&zp->lock, NULL);
+	pthread_cond_init(&zp->cond, NULL);
+	for (unsigned i = 0; i < zp->nthreads; i++) {
+		errno = pthread_create(&zp->threads[i], NULL, zpool_worker, zp);
+		if (errno != 0) {
+			/* Make do with the threads we have */
+			if (i > 0) {
+				zp->nthreads = i;
+				break;
+			}
+			goto fail;
+		}
+	}
+	return zp;
+fail:
+	if (zp->chunks != NULL) {
+		for (unsigned i = 0; i < zp->nchunks; i++) {
+			free(zp->chunks[i].in);
+			free(zp->chunks[i].out);
+		}
+	}
+	free(zp->chunks);
+	free(zp->threads);
+	free(zp);
+	return NULL;
+}
+
+static int write_all(int fd, const char *buf, size_t len)
+{
+	while (len > 0) {
+		ssize_t ret = write(fd, buf, len);
+
+		if (ret < 0)
+			return -1;
+		buf += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+/* Add a chunk which is about to be written to the index */
+static int zpool_index_add(struct savemeta_zpool *zp, const struct zchunk *zc)
+{
+	struct savemeta_chunk *sc;
+
+	if ((zp->written & (zp->written - 1)) == 0) {
+		sc = realloc(zp->index, (zp->written ? zp->written * 2 : 1) * sizeof(*sc));
+		if (sc == NULL)
+			return -1;
+		zp->index = sc;
+	}
+	sc = &zp->index[zp->written];
+	sc->sc_offset = cpu_to_be64(zp->offset);
+	sc->sc_len = cpu_to_be32(zc->outlen);
+	sc->sc_size = cpu_to_be32(zc->inlen);
+	sc->sc_first = cpu_to_be64(zc->first);
+	sc->sc_last = cpu_to_be64(zc->last);
+	return 0;
+}
+
+/**
+ * Write out the compressed chunks which are ready, in order.
+ * wait: if non-zero, wait for the oldest outstanding chunk to be compressed
+ * Returns 0 on success or -1 on error with errno set
+ */
+static int zpool_write_done(struct savemeta_zpool *zp, int fd, int wait)
+{
+	pthread_mutex_lock(&zp->lock);
+	while (zp->written < zp->fill) {
+		struct zchunk *zc = &zp->chunks[zp->written % zp->nchunks];
+
+		if (zc->state != ZCHUNK_DONE) {
+			if (!wait)
+				break;
+			pthread_cond_wait(&zp->cond, &zp->lock);
+			continue;
+		}
+		pthread_mutex_unlock(&zp->lock);
+
+		if (zc->err) {
+			fprintf(stderr, "Error: zlib: failed to compress data\n");
+			errno = EIO;
+			return -1;
+		}
+		if (zpool_index_add(zp, zc) != 0 || write_all(fd, zc->out, zc->outlen) != 0)
+			return -1;
+		zp->offset += zc->outlen;
+		pthread_mutex_lock(&zp->lock);
+		zc->state = ZCHUNK_EMPTY;
+		zc->inlen = 0;
+		zc->first = SAVEMETA_END_BLK;
+		zc->last = 0;
+		zp->written++;
+		wait = 0;
+	}
+	pthread_mutex_unlock(&zp->lock);
+	return 0;
+}
+
+/**
+ * Queue the chunk being filled for compression and make sure the next one is
+ * free to be filled.
+ * Returns 0 on success or -1 on error with errno set
+ */
+static int zpool_submit(struct savemeta_zpool *zp, int fd)
+{
+	pthread_mutex_lock(&zp->lock);
+	zp->chunks[zp->fill % zp->nchunks].state = ZCHUNK_FILLED;
+	zp->fill++;
+	pthread_cond_broadcast(&zp->cond);
+	pthread_mutex_unlock(&zp->lock);
+
+	if (zpool_write_done(zp, fd, 0) != 0)
+		return -1;
+	/* The ring is full; the oldest chunk must be written before reuse */
+	if (zp->fill - zp->written == zp->nchunks)
+		return zpool_write_done(zp, fd, 1);
+	return 0;
+}
+
+/* Add a header or a record to the chunk being filled. Each write is kept
+   whole in one chunk. */
+static ssize_t zpool_write(struct savemeta_zpool *zp, int fd, const void *buf, size_t nbyte)
+{
+	struct zchunk *zc = &zp->chunks[zp->fill % zp->nchunks];
+
+	if (nbyte > ZCHUNK_SIZE) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (zc->inlen + nbyte > ZCHUNK_SIZE) {
+		if (zpool_submit(zp, fd) != 0)
+			return -1;
+		zc = &zp->chunks[zp->fill % zp->nchunks];
+	}
+	memcpy(zc->in + zc->inlen, buf, nbyte);
+	zc->inlen += nbyte;
+	return nbyte;
+}
+
+/* Note that a block was saved in the chunk being filled */
+static void zpool_add_block(struct savemeta_zpool *zp, uint64_t blk)
+{
+	struct zchunk *zc = &zp->chunks[zp->fill % zp->nchunks];
+
+	if (blk < zc->first)
+		zc->first = blk;
+	if (blk > zc->last)
+		zc->last = blk;
+}
+
+/**
+ * Write the index of the chunks written so far and the trailer which points
+ * to it. The index starts with a record which ends the stream of records.
+ * Returns 0 on success or -1 on error with errno set
+ */
+static int zpool_write_index(struct savemeta_zpool *zp, int fd)
+{
+	struct saved_metablock end = { .blk = cpu_to_be64(SAVEMETA_END_BLK) };
+	size_t len = zp->written * sizeof(*zp->index);
+	char trailer[SAVEMETA_TRAILER_LEN];
+	struct zchunk zc = {0};
+	int ret = -1;
+
+	zc.inlen = sizeof(end) + len;
+	zc.outsize = deflateBound(NULL, zc.inlen) + 32;
+	zc.in = malloc(zc.inlen);
+	zc.out = malloc(zc.outsize);
+	if (zc.in == NULL || zc.out == NULL)
+		goto out;
+	memcpy(zc.in, &end, sizeof(end));
+	if (len > 0)
+		memcpy(zc.in + sizeof(end), zp->index, len);
+	if (zchunk_compress(&zc, zp->level) != 0) {
+		fprintf(stderr, "Error: zlib: failed to compress data\n");
+		errno = EIO;
+		goto out;
+	}
+	lgfs2_savemeta_trailer(trailer, zp->offset, zc.outlen, zp->written);
+	if (write_all(fd, zc.out, zc.outlen) != 0 ||
+	    write_all(fd, trailer, sizeof(trailer)) != 0)
+		goto out;
+	ret = 0;
+out:
+	free(zc.in);
+	free(zc.out);
+	return ret;
+}
+
+/**
+ * Compress and write out any remaining data and stop the worker threads.
+ * Returns 0 on success or -1 on error with errno set
+ */
+static int zpool_finish(struct savemeta_zpool *zp, int fd)
+{
+	int ret = 0;
+
+	if (zp->chunks[zp->fill % zp->nchunks].inlen > 0)
+		ret = zpool_submit(zp, fd);
+	while (ret == 0 && zp->written < zp->fill)
+		ret = zpool_write_done(zp, fd, 1);
+	if (ret == 0)
+		ret = zpool_write_index(zp, fd);
+
+	pthread_mutex_lock(&zp->lock);
+	zp->stop = 1;
+	/* Don't leave work for the threads if we're bailing out */
+	zp->fill = zp->compress;
+	pthread_cond_broadcast(&zp->cond);
+	pthread_mutex_unlock(&zp->lock);
+	for (unsigned i = 0; i < zp->nthreads; i++)
+		pthread_join(zp->threads[i], NULL);
+
+	for (unsigned i = 0; i < zp->nchunks; i++) {
+		free(zp->chunks[i].in);
+		free(zp->chunks[i].out);
+	}
+	pthread_mutex_destroy(&zp->lock);
+	pthread_cond_destroy(&zp->cond);
+	free(zp->index);
+	free(zp->chunks);
+	free(zp->threads);
+	free(zp);
+	return ret;
+}
+
 /**
  * Open a file and prepare it for writing by savemeta()
  * out_fn: the path to the file, which will be truncated if it exists
@@ -443,7 +789,6 @@ static void report_progress(uint64_t pblock, int force)
 static struct metafd savemetaopen(char *out_fn, int gziplevel)
 {
 	struct metafd mfd = {0};
-	char gzmode[3] = "w9";
 	char dft_fn[] = DFT_SAVE_FILE;
 	mode_t mask = umask(S_IXUSR | S_IRWXG | S_IRWXO);
 	struct stat st;
@@ -473,13 +818,11 @@ static struct metafd savemetaopen(char *out_fn, int gziplevel)
 	}
 
 	if (gziplevel > 0) {
-		gzmode[1] = '0' + gziplevel;
-		mfd.gzfd = gzdopen(mfd.fd, gzmode);
-		if (!mfd.gzfd) {
-			fprintf(stderr, "gzdopen error: %s\n", strerror(errno));
+		mfd.zpool = zpool_init(gziplevel);
+		if (mfd.zpool == NULL) {
+			fprintf(stderr, "Failed to set up compression threads: %s\n", strerror(errno));
 			exit(1);
 		}
-		gzbuffer(mfd.gzfd, (1<<20)); /* Increase zlib's buffers to 1MB */
 	}
 
 	return mfd;
@@ -494,22 +837,10 @@ static struct metafd savemetaopen(char *out_fn, int gziplevel)
  */
 static ssize_t savemetawrite(struct metafd *mfd, const void *buf, size_t nbyte)
 {
-	ssize_t ret;
-	int gzerr;
-	const char *gzerrmsg;
-
 	if (mfd->gziplevel == 0) {
 		return write(mfd->fd, buf, nbyte);
 	}
-
-	ret = gzwrite(mfd->gzfd, buf, nbyte);
-	if (ret != nbyte) {
-		gzerrmsg = gzerror(mfd->gzfd, &gzerr);
-		if (gzerr != Z_ERRNO) {
-			fprintf(stderr, "Error: zlib: %s\n", gzerrmsg);
-		}
-	}
-	return ret;
+	return zpool_write(mfd->zpool, mfd->fd, buf, nbyte);
 }
 
 /**
@@ -519,13 +850,13 @@ static ssize_t savemetawrite(struct metafd *mfd, const void *buf, size_t nbyte)
  */
 static int savemetaclose(struct metafd *mfd)
 {
-	int gzret;
 	if (mfd->gziplevel > 0) {
-		gzret = gzclose(mfd->gzfd);
-		if (gzret == Z_STREAM_ERROR) {
-			fprintf(stderr, "gzclose: file is not valid\n");
-			return -1;
-		} else if (gzret == Z_ERRNO) {
+		int ret = zpool_finish(mfd->zpool, mfd->fd);
+
+		mfd->zpool = NULL;
+		if (ret != 0) {
+			fprintf(stderr, "Failed to write %s: %s\n", mfd->filename, strerror(errno));
+			close(mfd->fd);
 			return -1;
 		}
 	}
@@ -561,6 +892,8 @@ static int save_buf(struct metafd *mfd, const char *buf, uint64_t addr, unsigned
 		free(savedata);
 		exit(-1);
 	}
+	if (mfd->zpool != NULL)
+		zpool_add_block(mfd->zpool, addr);
 	blks_saved++;
 	free(savedata);
 	return 0;
@@ -668,7 +1001,7 @@ static int check_read_range(int fd, struct block_range *br, uint64_t owner)
 		return 1;
 
 	size = br->len * sbd.sd_bsize;
-	if (pread(sbd.device_fd, br->buf, size, sbd.sd_bsize * br->start) != size) {
+	if (lgfs2_pread(&sbd, sbd.device_fd, br->buf, size, sbd.sd_bsize * br->start) != size) {
 		fprintf(stderr, "Failed to read block range 0x%"PRIx64" (%u blocks): %s\n",
 		        br->start, br->len, strerror(errno));
 		free(br->buf);
@@ -807,7 +1140,7 @@ static int save_leaf_chain(struct metafd *mfd, struct gfs2_sbd *sdp, char *buf)
 		if (gfs2_check_range(sdp, blk) != 0)
 			return 0;
 
-		r = pread(sdp->device_fd, buf, sdp->sd_bsize, sdp->sd_bsize * blk);
+		r = lgfs2_pread(sdp, sdp->device_fd, buf, sdp->sd_bsize, sdp->sd_bsize * blk);
 		if (r != sdp->sd_bsize) {
 			fprintf(stderr, "Failed to read leaf block %"PRIx64": %s\n",
 			        blk, strerror(errno));
@@ -1048,19 +1381,164 @@ static char *rgrp_read(struct gfs2_sbd *sdp, uint64_t addr, unsigned blocks)
 	if (buf == NULL)
 		return NULL;
 
-	if (pread(sdp->device_fd, buf, len, off) != len) {
+	if (lgfs2_pread(sdp, sdp->device_fd, buf, len, off) != len) {
 		free(buf);
 		return NULL;
 	}
 	return buf;
 }
 
-static void save_rgrp(struct gfs2_sbd *sdp, struct metafd *mfd, struct rgrp_tree *rgd, int withcontents)
+/*
+ * Resource groups are read ahead of savemeta() by a separate thread so that
+ * the device is kept busy while the main thread saves the metadata and the
+ * compression threads deal with the output.
+ */
+#define RG_PREFETCH_DEPTH (8)
+
+struct rg_prefetch_entry {
+	struct rgrp_tree *rgd;
+	char *buf;
+};
+
+struct rg_prefetch {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t thread;
+	struct rg_prefetch_entry ents[RG_PREFETCH_DEPTH];
+	unsigned head; /* Next entry to be filled by the reader */
+	unsigned tail; /* Next entry to be taken by savemeta() */
+	int withcontents;
+	int done;
+	int stop;
+};
+
+/**
+ * Ask the kernel to start reading the dinodes in a resource group whose
+ * bitmaps have been read.
+ */
+static void rg_prefetch_dinodes(struct rgrp_tree *rgd, uint64_t *ibuf)
+{
+	for (unsigned i = 0; i < rgd->rt_length; i++) {
+		unsigned m = lgfs2_bm_scan(rgd, i, ibuf, GFS2_BLKST_DINODE);
+		uint64_t start = 0;
+		uint64_t len = 0;
+
+		for (unsigned j = 0; j <= m; j++) {
+			if (j < m && len > 0 && ibuf[j] == start + len) {
+				len++;
+				continue;
+			}
+			if (len > 0)
+				lgfs2_fadvise(&sbd, sbd.device_fd, start * sbd.sd_bsize,
+				              len * sbd.sd_bsize, POSIX_FADV_WILLNEED);
+			if (j < m) {
+				start = ibuf[j];
+				len = 1;
+			}
+		}
+	}
+}
+
+static void *rg_prefetch_thread(void *arg)
+{
+	struct rg_prefetch *rp = arg;
+	uint64_t *ibuf = NULL;
+	struct osi_node *n;
+
+	if (rp->withcontents)
+		ibuf = malloc(sbd.sd_bsize * GFS2_NBBY * sizeof(uint64_t));
+
+	for (n = osi_first(&sbd.rgtree); n; n = osi_next(n)) {
+		struct rgrp_tree *rgd = (struct rgrp_tree *)n;
+		struct rg_prefetch_entry *ent;
+		char *buf;
+
+		pthread_mutex_lock(&rp->lock);
+		while (!rp->stop && rp->head - rp->tail == RG_PREFETCH_DEPTH)
+			pthread_cond_wait(&rp->cond, &rp->lock);
+		pthread_mutex_unlock(&rp->lock);
+		if (rp->stop)
+			break;
+
+		buf = rgrp_read(&sbd, rgd->rt_addr, rgd->rt_length);
+		if (buf != NULL && ibuf != NULL) {
+			for (unsigned i = 0; i < rgd->rt_length; i++)
+				rgd->bits[i].bi_data = buf + (i * sbd.sd_bsize);
+			rg_prefetch_dinodes(rgd, ibuf);
+		}
+		pthread_mutex_lock(&rp->lock);
+		ent = &rp->ents[rp->head % RG_PREFETCH_DEPTH];
+		ent->rgd = rgd;
+		ent->buf = buf;
+		rp->head++;
+		pthread_cond_broadcast(&rp->cond);
+		pthread_mutex_unlock(&rp->lock);
+	}
+	free(ibuf);
+	pthread_mutex_lock(&rp->lock);
+	rp->done = 1;
+	pthread_cond_broadcast(&rp->cond);
+	pthread_mutex_unlock(&rp->lock);
+	return NULL;
+}
+
+static int rg_prefetch_start(struct rg_prefetch *rp, int withcontents)
+{
+	memset(rp, 0, sizeof(*rp));
+	rp->withcontents = withcontents;
+	pthread_mutex_init(&rp->lock, NULL);
+	pthread_cond_init(&rp->cond, NULL);
+	errno = pthread_create(&rp->thread, NULL, rg_prefetch_thread, rp);
+	if (errno != 0) {
+		pthread_mutex_destroy(&rp->lock);
+		pthread_cond_destroy(&rp->cond);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Get the next resource group, in rgtree order, from the read-ahead thread.
+ * bufp: set to the rgrp's header and bitmap blocks, or NULL if they couldn't be read
+ * Returns the resource group or NULL when there are no more
+ */
+static struct rgrp_tree *rg_prefetch_next(struct rg_prefetch *rp, char **bufp)
+{
+	struct rgrp_tree *rgd = NULL;
+
+	pthread_mutex_lock(&rp->lock);
+	while (!rp->done && rp->head == rp->tail)
+		pthread_cond_wait(&rp->cond, &rp->lock);
+	if (rp->head != rp->tail) {
+		struct rg_prefetch_entry *ent = &rp->ents[rp->tail % RG_PREFETCH_DEPTH];
+
+		rgd = ent->rgd;
+		*bufp = ent->buf;
+		rp->tail++;
+		pthread_cond_broadcast(&rp->cond);
+	}
+	pthread_mutex_unlock(&rp->lock);
+	return rgd;
+}
+
+static void rg_prefetch_stop(struct rg_prefetch *rp)
+{
+	pthread_mutex_lock(&rp->lock);
+	rp->stop = 1;
+	pthread_cond_broadcast(&rp->cond);
+	pthread_mutex_unlock(&rp->lock);
+	pthread_join(rp->thread, NULL);
+	while (rp->tail != rp->head)
+		free(rp->ents[rp->tail++ % RG_PREFETCH_DEPTH].buf);
+	pthread_mutex_destroy(&rp->lock);
+	pthread_cond_destroy(&rp->cond);
+}
+
+static void save_rgrp(struct gfs2_sbd *sdp, struct metafd *mfd, struct rgrp_tree *rgd,
+                      char *buf, int withcontents)
 {
 	uint64_t addr = rgd->rt_addr;
-	char *buf;
 
-	buf = rgrp_read(sdp, rgd->rt_addr, rgd->rt_length);
 	if (buf == NULL)
 		return;
 
@@ -1084,9 +1562,11 @@ static void save_rgrp(struct gfs2_sbd *sdp, struct metafd *mfd, struct rgrp_tree
 
 static int save_header(struct metafd *mfd, uint64_t fsbytes)
 {
+	/* Only compressed output is written in chunks with an index */
+	unsigned format = mfd->gziplevel > 0 ? SAVEMETA_FORMAT_CHUNKED : SAVEMETA_FORMAT_STREAM;
 	struct savemeta_header smh = {
 		.sh_magic = cpu_to_be32(SAVEMETA_MAGIC),
-		.sh_format = cpu_to_be32(SAVEMETA_FORMAT),
+		.sh_format = cpu_to_be32(format),
 		.sh_time = cpu_to_be64(time(NULL)),
 		.sh_fs_bytes = cpu_to_be64(fsbytes)
 	};
@@ -1118,6 +1598,7 @@ static int parse_header(char *buf, struct savemeta *sm)
 
 void savemeta(char *out_fn, int saveoption, int gziplevel)
 {
+	struct rg_prefetch rgp;
 	struct metafd mfd;
 	struct osi_node *n;
 	uint64_t sb_addr;
@@ -1125,6 +1606,7 @@ void savemeta(char *out_fn, int saveoption, int gziplevel)
 	char *buf;
 
 	sbd.md.journals = 1;
+	lgfs2_iostats_phase(&sbd, "savemeta");
 
 	mfd = savemetaopen(out_fn, gziplevel);
 
@@ -1187,11 +1669,19 @@ void savemeta(char *out_fn, int saveoption, int gziplevel)
 		}
 	}
 	/* Walk through the resource groups saving everything within */
-	for (n = osi_first(&sbd.rgtree); n; n = osi_next(n)) {
+	if (rg_prefetch_start(&rgp, (saveoption != 2)) == 0) {
 		struct rgrp_tree *rgd;
 
-		rgd = (struct rgrp_tree *)n;
-		save_rgrp(&sbd, &mfd, rgd, (saveoption != 2));
+		while ((rgd = rg_prefetch_next(&rgp, &buf)) != NULL)
+			save_rgrp(&sbd, &mfd, rgd, buf, (saveoption != 2));
+		rg_prefetch_stop(&rgp);
+	} else {
+		for (n = osi_first(&sbd.rgtree); n; n = osi_next(n)) {
+			struct rgrp_tree *rgd = (struct rgrp_tree *)n;
+
+			buf = rgrp_read(&sbd, rgd->rt_addr, rgd->rt_length);
+			save_rgrp(&sbd, &mfd, rgd, buf, (saveoption != 2));
+		}
 	}
 	/* Clean up */
 	/* There may be a gap between end of file system and end of device */
@@ -1203,7 +1693,8 @@ void savemeta(char *out_fn, int saveoption, int gziplevel)
 	} else {
 		printf("(uncompressed).\n");
 	}
-	savemetaclose(&mfd);
+	if (savemetaclose(&mfd) != 0)
+		exit(1);
 	close(sbd.device_fd);
 	destroy_per_node_lookup();
 	free(indirect);
@@ -1211,6 +1702,23 @@ void savemeta(char *out_fn, int saveoption, int gziplevel)
 	exit(0);
 }
 
+static int restore_check(uint64_t blk, uint16_t siglen)
+{
+	if (sbd.fssize && blk >= sbd.fssize) {
+		fprintf(stderr, "Error: File system is too small to restore this metadata.\n");
+		fprintf(stderr, "File system is %"PRIu64" blocks. Restore block = %"PRIu64"\n",
+		        sbd.fssize, blk);
+		return -1;
+	}
+
+	if (siglen > sbd.sd_bsize) {
+		fprintf(stderr, "Bad record length: %u for block %"PRIu64" (0x%"PRIx64").\n",
+			siglen, blk, blk);
+		return -1;
+	}
+	return 0;
+}
+
 static char *restore_block(struct metafd *mfd, uint64_t *blk, uint16_t *siglen)
 {
 	struct saved_metablock *svb;
@@ -1223,18 +1731,13 @@ static char *restore_block(struct metafd *mfd, uint64_t *blk, uint16_t *siglen)
 	*blk = be64_to_cpu(svb->blk);
 	*siglen = be16_to_cpu(svb->siglen);
 
-	if (sbd.fssize && *blk >= sbd.fssize) {
-		fprintf(stderr, "Error: File system is too small to restore this metadata.\n");
-		fprintf(stderr, "File system is %"PRIu64" blocks. Restore block = %"PRIu64"\n",
-		        sbd.fssize, *blk);
+	/* What follows in a format 2 file is its index */
+	if (*blk == SAVEMETA_END_BLK) {
+		mfd->eof = 1;
 		return NULL;
 	}
-
-	if (*siglen > sbd.sd_bsize) {
-		fprintf(stderr, "Bad record length: %u for block %"PRIu64" (0x%"PRIx64").\n",
-			*siglen, *blk, *blk);
+	if (restore_check(*blk, *siglen) != 0)
 		return NULL;
-	}
 
 	buf = restore_buf_next(mfd, *siglen);
 	if (buf != NULL) {
@@ -1249,7 +1752,7 @@ nobuffer:
 	return NULL;
 }
 
-static int restore_super(struct metafd *mfd, void *buf, int printonly)
+static int restore_super(struct metafd *mfd, void *buf, uint64_t printonly)
 {
 	int ret;
 
@@ -1270,60 +1773,614 @@ static int restore_super(struct metafd *mfd, void *buf, int printonly)
 	return 0;
 }
 
-static int restore_data(int fd, struct metafd *mfd, int printonly)
+/*
+ * restoremeta gathers the blocks it decodes into batches, sorts each batch by
+ * block number and writes the runs of adjacent blocks with pwritev() from a
+ * pool of threads while the next batch is decoded. A batch is completely
+ * written before the next one is started, and the last copy of a block saved
+ * more than once in a batch is the one written, so the result is the same as
+ * writing the blocks one at a time in the order they were saved.
+ */
+#define RESTORE_BATCH_SIZE (16 << 20)
+#define RESTORE_WRITERS (4)
+#define RESTORE_RUN_MAX (IOV_MAX < 256 ? IOV_MAX : 256)
+
+struct restore_ent {
+	uint64_t blk;
+	unsigned idx; /* Where the block's data is in the batch */
+};
+
+struct restore_run {
+	unsigned first; /* Index of the run's first entry */
+	unsigned len;
+};
+
+struct restore_batch {
+	char *data;
+	struct restore_ent *ents;
+	struct restore_run *runs;
+	unsigned count;
+	unsigned nruns;
+};
+
+struct restore_writer {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t threads[RESTORE_WRITERS];
+	unsigned nthreads;
+	int fd;
+	unsigned max_blocks; /* Blocks per batch */
+	struct restore_batch batches[2];
+	unsigned fill;       /* Batch being filled by restore_writer_add() */
+	struct restore_batch *busy; /* Batch being written, if any */
+	unsigned next_run;   /* Next run of the busy batch to be picked up */
+	unsigned writing;    /* Runs being written */
+	int err;             /* errno from the first failed write */
+	uint64_t err_blk;
+	int stop;
+};
+
+static int restore_ent_cmp(const void *a, const void *b)
 {
-	uint64_t writes = 0;
-	char *buf;
+	const struct restore_ent *x = a;
+	const struct restore_ent *y = b;
 
-	buf = calloc(1, sbd.sd_bsize);
-	if (buf == NULL) {
-		perror("Failed to restore data");
-		exit(1);
+	if (x->blk != y->blk)
+		return (x->blk > y->blk) - (x->blk < y->blk);
+	return (x->idx > y->idx) - (x->idx < y->idx);
+}
+
+/* Sort a batch, drop all but the last copy of each block and find the runs */
+static void restore_batch_prepare(struct restore_batch *rb)
+{
+	unsigned n = 0;
+
+	qsort(rb->ents, rb->count, sizeof(*rb->ents), restore_ent_cmp);
+	for (unsigned i = 0; i < rb->count; i++) {
+		if (i + 1 < rb->count && rb->ents[i + 1].blk == rb->ents[i].blk)
+			continue;
+		rb->ents[n++] = rb->ents[i];
+	}
+	rb->count = n;
+	rb->nruns = 0;
+	for (unsigned i = 0; i < rb->count; i++) {
+		struct restore_run *run = &rb->runs[rb->nruns];
+
+		if (rb->nruns > 0) {
+			run--;
+			if (rb->ents[run->first + run->len - 1].blk + 1 == rb->ents[i].blk &&
+			    run->len < RESTORE_RUN_MAX) {
+				run->len++;
+				continue;
+			}
+			run++;
+		}
+		run->first = i;
+		run->len = 1;
+		rb->nruns++;
+	}
+}
+
+static int restore_run_write(int fd, struct restore_batch *rb, struct restore_run *run)
+{
+	struct iovec iov[RESTORE_RUN_MAX];
+	uint64_t blk = rb->ents[run->first].blk;
+	ssize_t len = (ssize_t)run->len * sbd.sd_bsize;
+	ssize_t ret;
+
+	for (unsigned i = 0; i < run->len; i++) {
+		iov[i].iov_base = rb->data + (size_t)rb->ents[run->first + i].idx * sbd.sd_bsize;
+		iov[i].iov_len = sbd.sd_bsize;
+	}
+	ret = lgfs2_pwritev(&sbd, fd, iov, run->len, blk * sbd.sd_bsize);
+	if (ret == len)
+		return 0;
+	if (ret >= 0)
+		errno = EIO;
+	return -1;
+}
+
+static void *restore_worker(void *arg)
+{
+	struct restore_writer *rw = arg;
+
+	pthread_mutex_lock(&rw->lock);
+	for (;;) {
+		struct restore_batch *rb;
+		struct restore_run *run;
+		int ret, err;
+
+		while (!rw->stop && (rw->busy == NULL || rw->next_run == rw->busy->nruns))
+			pthread_cond_wait(&rw->cond, &rw->lock);
+		if (rw->stop)
+			break;
+		rb = rw->busy;
+		run = &rb->runs[rw->next_run++];
+		rw->writing++;
+		pthread_mutex_unlock(&rw->lock);
+
+		ret = restore_run_write(rw->fd, rb, run);
+		err = errno;
+
+		pthread_mutex_lock(&rw->lock);
+		if (ret != 0 && rw->err == 0) {
+			rw->err = err;
+			rw->err_blk = rb->ents[run->first].blk;
+		}
+		if (--rw->writing == 0 && rw->next_run == rb->nruns) {
+			rw->busy = NULL;
+			pthread_cond_broadcast(&rw->cond);
+		}
+	}
+	pthread_mutex_unlock(&rw->lock);
+	return NULL;
+}
+
+static int restore_writer_init(struct restore_writer *rw, int fd)
+{
+	memset(rw, 0, sizeof(*rw));
+	rw->fd = fd;
+	rw->max_blocks = RESTORE_BATCH_SIZE / sbd.sd_bsize;
+	for (unsigned i = 0; i < 2; i++) {
+		struct restore_batch *rb = &rw->batches[i];
+
+		rb->data = malloc((size_t)rw->max_blocks * sbd.sd_bsize);
+		rb->ents = calloc(rw->max_blocks, sizeof(*rb->ents));
+		rb->runs = calloc(rw->max_blocks, sizeof(*rb->runs));
+		if (rb->data == NULL || rb->ents == NULL || rb->runs == NULL)
+			return -1;
+	}
+	pthread_mutex_init(&rw->lock, NULL);
+	pthread_cond_init(&rw->cond, NULL);
+	/* With no threads, restore_writer_submit() writes the batches itself */
+	for (rw->nthreads = 0; rw->nthreads < RESTORE_WRITERS; rw->nthreads++)
+		if (pthread_create(&rw->threads[rw->nthreads], NULL, restore_worker, rw) != 0)
+			break;
+	return 0;
+}
+
+/* Wait for the batch being written to be finished */
+static int restore_writer_wait(struct restore_writer *rw)
+{
+	pthread_mutex_lock(&rw->lock);
+	while (rw->busy != NULL)
+		pthread_cond_wait(&rw->cond, &rw->lock);
+	pthread_mutex_unlock(&rw->lock);
+	return rw->err ? -1 : 0;
+}
+
+/* Start writing the batch being filled and switch to filling the other one */
+static int restore_writer_submit(struct restore_writer *rw)
+{
+	struct restore_batch *rb = &rw->batches[rw->fill];
+
+	restore_batch_prepare(rb);
+	if (restore_writer_wait(rw) != 0)
+		return -1;
+	if (rw->nthreads == 0) {
+		for (unsigned i = 0; i < rb->nruns; i++) {
+			if (restore_run_write(rw->fd, rb, &rb->runs[i]) != 0) {
+				rw->err = errno;
+				rw->err_blk = rb->ents[rb->runs[i].first].blk;
+				return -1;
+			}
+		}
+	} else if (rb->nruns > 0) {
+		pthread_mutex_lock(&rw->lock);
+		rw->busy = rb;
+		rw->next_run = 0;
+		pthread_cond_broadcast(&rw->cond);
+		pthread_mutex_unlock(&rw->lock);
 	}
+	rw->fill = !rw->fill;
+	rw->batches[rw->fill].count = 0;
+	return 0;
+}
+
+static int restore_writer_add(struct restore_writer *rw, uint64_t blk, const char *buf, uint16_t siglen)
+{
+	struct restore_batch *rb = &rw->batches[rw->fill];
+	char *data;
 
+	if (rb->count == rw->max_blocks) {
+		if (restore_writer_submit(rw) != 0)
+			return -1;
+		rb = &rw->batches[rw->fill];
+	}
+	data = rb->data + (size_t)rb->count * sbd.sd_bsize;
+	memcpy(data, buf, siglen);
+	memset(data + siglen, 0, sbd.sd_bsize - siglen);
+	rb->ents[rb->count].blk = blk;
+	rb->ents[rb->count].idx = rb->count;
+	rb->count++;
+	return 0;
+}
+
+/**
+ * Write out what's left, flush it to the device and free the writer.
+ * Returns 0 on success or -1 on error
+ */
+static int restore_writer_finish(struct restore_writer *rw)
+{
+	int ret = 0;
+
+	if (rw->batches[rw->fill].count > 0)
+		ret = restore_writer_submit(rw);
+	if (restore_writer_wait(rw) != 0)
+		ret = -1;
+	if (rw->err != 0)
+		fprintf(stderr, "write error: %s from %s:%d: block %"PRIu64" (0x%"PRIx64")\n",
+		        strerror(rw->err), __FUNCTION__, __LINE__, rw->err_blk, rw->err_blk);
+
+	pthread_mutex_lock(&rw->lock);
+	rw->stop = 1;
+	pthread_cond_broadcast(&rw->cond);
+	pthread_mutex_unlock(&rw->lock);
+	for (unsigned i = 0; i < rw->nthreads; i++)
+		pthread_join(rw->threads[i], NULL);
+	pthread_mutex_destroy(&rw->lock);
+	pthread_cond_destroy(&rw->cond);
+	for (unsigned i = 0; i < 2; i++) {
+		free(rw->batches[i].data);
+		free(rw->batches[i].ents);
+		free(rw->batches[i].runs);
+	}
+	/* Not every kind of file can be synced */
+	if (ret == 0 && fsync(rw->fd) != 0 && errno != EINVAL) {
+		perror("Failed to flush the restored metadata");
+		ret = -1;
+	}
+	return ret;
+}
+
+static int restore_record(struct restore_writer *rw, char *bp, uint64_t blk, uint16_t siglen,
+                          uint64_t printonly)
+{
+	if (printonly) {
+		if (printonly > 1 && printonly == blk) {
+			display_block_type(bp, blk, TRUE);
+			display_gfs2(bp);
+			return 1;
+		} else if (printonly == 1) {
+			print_gfs2("%"PRId64" (l=0x%x): ", blks_saved, siglen);
+			display_block_type(bp, blk, TRUE);
+		}
+	} else {
+		report_progress(blk, 0);
+		if (restore_writer_add(rw, blk, bp, siglen) != 0)
+			return -1;
+	}
+	blks_saved++;
+	return 0;
+}
+
+/* Restore the records of a format 1 file, or a format 2 file without an index */
+static int restore_stream(struct metafd *mfd, struct restore_writer *rw, uint64_t printonly)
+{
 	while (TRUE) {
 		uint16_t siglen = 0;
 		uint64_t blk = 0;
 		char *bp;
+		int ret;
 
 		bp = restore_block(mfd, &blk, &siglen);
 		if (bp == NULL && mfd->eof)
 			break;
-		if (bp == NULL) {
-			free(buf);
+		if (bp == NULL)
+			return -1;
+		ret = restore_record(rw, bp, blk, siglen, printonly);
+		if (ret < 0)
+			return -1;
+		if (ret > 0)
+			break;
+	}
+	return 0;
+}
+
+/*
+ * The chunks of a format 2 file are decompressed by a pool of threads, a few
+ * chunks ahead of the one being restored.
+ */
+#define UNZIP_MAX_THREADS (8)
+
+struct unzip_slot {
+	char *buf;
+	int done;
+	int err;
+};
+
+struct restore_unzip {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t threads[UNZIP_MAX_THREADS];
+	unsigned nthreads;
+	struct metafd *mfd;
+	struct unzip_slot *slots;
+	unsigned nslots;
+	uint32_t next; /* Next chunk to be decompressed */
+	uint32_t cur;  /* Chunk being restored */
+	int stop;
+};
+
+static void *unzip_worker(void *arg)
+{
+	struct restore_unzip *uz = arg;
+	struct metafd *mfd = uz->mfd;
+
+	pthread_mutex_lock(&uz->lock);
+	for (;;) {
+		const struct lgfs2_savemeta_chunk *c;
+		struct unzip_slot *slot;
+
+		while (!uz->stop && uz->next < mfd->nchunks && uz->next - uz->cur == uz->nslots)
+			pthread_cond_wait(&uz->cond, &uz->lock);
+		if (uz->stop || uz->next == mfd->nchunks)
+			break;
+		c = &mfd->chunks[uz->next];
+		slot = &uz->slots[uz->next++ % uz->nslots];
+		pthread_mutex_unlock(&uz->lock);
+
+		slot->err = 0;
+		slot->buf = malloc(c->size);
+		if (slot->buf == NULL || lgfs2_savemeta_chunk_read(mfd->fd, c, slot->buf) != 0)
+			slot->err = errno;
+
+		pthread_mutex_lock(&uz->lock);
+		slot->done = 1;
+		pthread_cond_broadcast(&uz->cond);
+	}
+	pthread_mutex_unlock(&uz->lock);
+	return NULL;
+}
+
+static int unzip_init(struct restore_unzip *uz, struct metafd *mfd)
+{
+	memset(uz, 0, sizeof(*uz));
+	uz->mfd = mfd;
+	uz->nthreads = zpool_nthreads();
+	if (uz->nthreads > UNZIP_MAX_THREADS)
+		uz->nthreads = UNZIP_MAX_THREADS;
+	uz->nslots = uz->nthreads * 2;
+	uz->slots = calloc(uz->nslots, sizeof(*uz->slots));
+	if (uz->slots == NULL)
+		return -1;
+	pthread_mutex_init(&uz->lock, NULL);
+	pthread_cond_init(&uz->cond, NULL);
+	for (unsigned i = 0; i < uz->nthreads; i++) {
+		errno = pthread_create(&uz->threads[i], NULL, unzip_worker, uz);
+		if (errno != 0) {
+			if (i > 0) {
+				uz->nthreads = i;
+				break;
+			}
+			pthread_mutex_destroy(&uz->lock);
+			pthread_cond_destroy(&uz->cond);
+			free(uz->slots);
 			return -1;
 		}
-		if (printonly) {
-			if (printonly > 1 && printonly == blk) {
-				display_block_type(bp, blk, TRUE);
-				display_gfs2(bp);
+	}
+	return 0;
+}
+
+/* Wait for the current chunk to be decompressed */
+static char *unzip_get(struct restore_unzip *uz)
+{
+	struct unzip_slot *slot = &uz->slots[uz->cur % uz->nslots];
+
+	pthread_mutex_lock(&uz->lock);
+	while (!slot->done)
+		pthread_cond_wait(&uz->cond, &uz->lock);
+	pthread_mutex_unlock(&uz->lock);
+	if (slot->err != 0) {
+		errno = slot->err;
+		return NULL;
+	}
+	return slot->buf;
+}
+
+/* Move on to the next chunk, freeing a slot for the workers */
+static void unzip_put(struct restore_unzip *uz)
+{
+	struct unzip_slot *slot = &uz->slots[uz->cur % uz->nslots];
+
+	pthread_mutex_lock(&uz->lock);
+	free(slot->buf);
+	slot->buf = NULL;
+	slot->done = 0;
+	uz->cur++;
+	pthread_cond_broadcast(&uz->cond);
+	pthread_mutex_unlock(&uz->lock);
+}
+
+static void unzip_finish(struct restore_unzip *uz)
+{
+	pthread_mutex_lock(&uz->lock);
+	uz->stop = 1;
+	pthread_cond_broadcast(&uz->cond);
+	pthread_mutex_unlock(&uz->lock);
+	for (unsigned i = 0; i < uz->nthreads; i++)
+		pthread_join(uz->threads[i], NULL);
+	for (unsigned i = 0; i < uz->nslots; i++)
+		free(uz->slots[i].buf);
+	pthread_mutex_destroy(&uz->lock);
+	pthread_cond_destroy(&uz->cond);
+	free(uz->slots);
+}
+
+/**
+ * Get the next record in a decompressed chunk.
+ * off: the offset of the record in the chunk, which is moved past it
+ * Returns the record's data, or NULL at the end of the chunk, when *off is
+ * set to its size, or on error.
+ */
+static char *chunk_record(char *data, size_t size, size_t *off, uint64_t *blk, uint16_t *siglen)
+{
+	struct saved_metablock svb;
+
+	if (*off == size)
+		return NULL;
+	if (size - *off < sizeof(svb))
+		goto bad;
+	memcpy(&svb, data + *off, sizeof(svb));
+	*blk = be64_to_cpu(svb.blk);
+	*siglen = be16_to_cpu(svb.siglen);
+	if (*blk == SAVEMETA_END_BLK) {
+		*off = size;
+		return NULL;
+	}
+	if (restore_check(*blk, *siglen) != 0)
+		return NULL;
+	if (size - *off - sizeof(svb) < *siglen)
+		goto bad;
+	*off += sizeof(svb) + *siglen;
+	return data + *off - *siglen;
+bad:
+	fprintf(stderr, "Truncated record at offset %zu of a %zu byte chunk\n", *off, size);
+	return NULL;
+}
+
+/* Restore the records of a format 2 file from its chunks */
+static int restore_chunks(struct metafd *mfd, struct restore_writer *rw, uint64_t printonly)
+{
+	/* restore_init() has read the header and the superblock's record */
+	size_t off = restore_off;
+	struct restore_unzip uz;
+	int ret = 0;
+
+	if (unzip_init(&uz, mfd) != 0) {
+		perror("Failed to start decompression threads");
+		return -1;
+	}
+	for (uint32_t i = 0; i < mfd->nchunks && ret == 0; i++, off = 0) {
+		size_t size = mfd->chunks[i].size;
+		uint16_t siglen;
+		uint64_t blk;
+		char *data;
+		char *bp;
+
+		data = unzip_get(&uz);
+		if (data == NULL) {
+			fprintf(stderr, "Failed to read chunk %"PRIu32" of %s: %s\n",
+			        i, mfd->filename, strerror(errno));
+			ret = -1;
+			break;
+		}
+		while ((bp = chunk_record(data, size, &off, &blk, &siglen)) != NULL) {
+			ret = restore_record(rw, bp, blk, siglen, printonly);
+			if (ret != 0)
 				break;
-			} else if (printonly == 1) {
-				print_gfs2("%"PRId64" (l=0x%x): ", blks_saved, siglen);
+		}
+		if (ret == 0 && off != size)
+			ret = -1;
+		unzip_put(&uz);
+	}
+	unzip_finish(&uz);
+	return ret < 0 ? -1 : 0;
+}
+
+/* Print the first copy of a block in a format 2 file, decompressing only the
+   chunks whose ranges of blocks include it */
+static int restore_chunks_print(struct metafd *mfd, uint64_t printonly)
+{
+	size_t off = restore_off;
+
+	for (uint32_t i = 0; i < mfd->nchunks; i++, off = 0) {
+		const struct lgfs2_savemeta_chunk *c = &mfd->chunks[i];
+		uint16_t siglen;
+		uint64_t blk;
+		char *data;
+		char *bp;
+
+		if (printonly < c->first || printonly > c->last)
+			continue;
+		data = malloc(c->size);
+		if (data == NULL || lgfs2_savemeta_chunk_read(mfd->fd, c, data) != 0) {
+			fprintf(stderr, "Failed to read chunk %"PRIu32" of %s: %s\n",
+			        i, mfd->filename, strerror(errno));
+			free(data);
+			return -1;
+		}
+		while ((bp = chunk_record(data, c->size, &off, &blk, &siglen)) != NULL) {
+			if (blk == printonly) {
 				display_block_type(bp, blk, TRUE);
+				display_gfs2(bp);
+				free(data);
+				return 0;
 			}
-		} else {
-			report_progress(blk, 0);
-			memcpy(buf, bp, siglen);
-			memset(buf + siglen, 0, sbd.sd_bsize - siglen);
-			if (pwrite(fd, buf, sbd.sd_bsize, blk * sbd.sd_bsize) != sbd.sd_bsize) {
-				fprintf(stderr, "write error: %s from %s:%d: block %"PRIu64" (0x%"PRIx64")\n",
-					strerror(errno), __FUNCTION__, __LINE__, blk, blk);
-				free(buf);
-				return -1;
-			}
-			writes++;
-			if (writes % 1000 == 0)
-				fsync(fd);
 		}
-		blks_saved++;
+		free(data);
+		if (off != c->size)
+			return -1;
 	}
-	if (!printonly)
-		report_progress(sbd.fssize, 1);
-	free(buf);
 	return 0;
 }
 
+static int restore_data(int fd, struct metafd *mfd, uint64_t printonly)
+{
+	struct restore_writer rw;
+	int ret;
+
+	if (mfd->chunks != NULL && printonly > 1)
+		return restore_chunks_print(mfd, printonly);
+
+	if (!printonly && restore_writer_init(&rw, fd) != 0) {
+		perror("Failed to restore data");
+		exit(1);
+	}
+	if (mfd->chunks != NULL)
+		ret = restore_chunks(mfd, &rw, printonly);
+	else
+		ret = restore_stream(mfd, &rw, printonly);
+	if (printonly)
+		return ret;
+	if (restore_writer_finish(&rw) != 0)
+		ret = -1;
+	if (ret == 0)
+		report_progress(sbd.fssize, 1);
+	return ret;
+}
+
+/**
+ * Free all of the space used by a regular file, leaving its size as it was,
+ * so that the blocks which are not restored take up no space.
+ * Returns 0 on success or -1 on error
+ */
+static int restore_sparse_punch(int fd, const char *path)
+{
+	struct stat st;
+
+	if (fstat(fd, &st) != 0) {
+		perror(path);
+		return -1;
+	}
+	if (!S_ISREG(st.st_mode)) {
+		fprintf(stderr, "Error: %s is not a regular file so it can't be made sparse.\n", path);
+		return -1;
+	}
+	if (st.st_size == 0)
+		return 0;
+	if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 0, st.st_size) == 0)
+		return 0;
+	/* No hole punching support, truncating has the same effect */
+	if (ftruncate(fd, 0) == 0 && ftruncate(fd, st.st_size) == 0)
+		return 0;
+	fprintf(stderr, "Failed to make %s sparse: %s\n", path, strerror(errno));
+	return -1;
+}
+
+/* Make a sparse destination file big enough for the saved file system */
+static int restore_sparse_extend(int fd, const char *path)
+{
+	off_t size = sbd.fssize * sbd.sd_bsize;
+
+	if (sbd.fssize == 0 || lseek(fd, 0, SEEK_END) >= size)
+		return 0;
+	if (ftruncate(fd, size) == 0)
+		return 0;
+	fprintf(stderr, "Failed to extend %s: %s\n", path, strerror(errno));
+	return -1;
+}
+
 static void complain(const char *complaint)
 {
 	fprintf(stderr, "%s\n", complaint);
@@ -1331,7 +2388,7 @@ static void complain(const char *complaint)
 	    "<dest file system>\n");
 }
 
-static int restore_init(const char *path, struct metafd *mfd, int printonly)
+static int restore_init(const char *path, struct metafd *mfd, uint64_t printonly)
 {
 	struct savemeta sm = {0};
 	struct gfs2_sb rsb;
@@ -1355,6 +2412,11 @@ static int restore_init(const char *path, struct metafd *mfd, int printonly)
 		perror("Could not open metadata file");
 		return 1;
 	}
+	ret = lgfs2_savemeta_index(mfd->fd, &mfd->chunks, &mfd->nchunks);
+	if (ret < 0) {
+		perror("Could not read the metadata file's index");
+		return -1;
+	}
 	if (restore_try_bzip(mfd) != 0 &&
 	    restore_try_gzip(mfd) != 0) {
 		fprintf(stderr, "Failed to read metadata file header and superblock\n");
@@ -1368,6 +2430,12 @@ static int restore_init(const char *path, struct metafd *mfd, int printonly)
 	} else if (ret == -1) {
 		return -1;
 	}
+	if (sm.sm_format < SAVEMETA_FORMAT_CHUNKED) {
+		free(mfd->chunks);
+		mfd->chunks = NULL;
+	} else if (mfd->chunks == NULL) {
+		printf("The metadata file has no index, it may be incomplete.\n");
+	}
 	/* Scan for the position of the superblock. Required to support old formats(?). */
 	end = &restore_buf[256 + sizeof(struct saved_metablock) + sizeof(struct gfs2_meta_header)];
 	while (bp <= end) {
@@ -1413,6 +2481,7 @@ void restoremeta(const char *in_fn, const char *out_device, uint64_t printonly)
 	int error;
 
 	termlines = 0;
+	lgfs2_iostats_phase(&sbd, printonly ? "printsavedmeta" : "restoremeta");
 	if (!in_fn)
 		complain("No source file specified.");
 	if (!printonly && !out_device)
@@ -1423,6 +2492,8 @@ void restoremeta(const char *in_fn, const char *out_device, uint64_t printonly)
 		if (sbd.device_fd < 0)
 			die("Can't open destination file system %s: %s\n",
 			    out_device, strerror(errno));
+		if (restore_sparse && restore_sparse_punch(sbd.device_fd, out_device) != 0)
+			exit(1);
 	} else if (out_device) /* for printsavedmeta, the out_device is an
 				  optional block no */
 		printonly = check_keywords(out_device);
@@ -1431,6 +2502,8 @@ void restoremeta(const char *in_fn, const char *out_device, uint64_t printonly)
 	if (error != 0)
 		exit(error);
 
+	if (!printonly && restore_sparse && restore_sparse_extend(sbd.device_fd, out_device) != 0)
+		exit(1);
 	if (!printonly) {
 		uint64_t space = lseek(sbd.device_fd, 0, SEEK_END) / sbd.sd_bsize;
 		printf("There are %"PRIu64" free blocks on the destination device.\n", space);
@@ -1442,6 +2515,7 @@ void restoremeta(const char *in_fn, const char *out_device, uint64_t printonly)
 	       (error ? "error" : "successful"));
 
 	mfd.close(&mfd);
+	free(mfd.chunks);
 	if (!printonly)
 		close(sbd.device_fd);
 	free(indirect);
@@ -1,4 +1,8 @@
+#include <stdlib.h>
 #include <check.h>
+#include "libgfs2.h"
+#include "fsck.h"
+#include "util.h"
 
 START_TEST(test_fsck_stub)
 {
@@ -6,12 +10,187 @@ START_TEST(test_fsck_stub)
 }
 END_TEST
 
+START_TEST(test_blockmap_word)
+{
+	struct gfs2_bmap bl = { .size = 1000 };
+	uint64_t blk;
+
+	bl.mapsize = BLOCKMAP_SIZE2(bl.size) + 1;
+	bl.map = malloc(bl.mapsize);
+	ck_assert(bl.map != NULL);
+	srandom(1);
+	for (blk = 0; blk < bl.mapsize; blk++)
+		bl.map[blk] = random();
+
+	for (blk = 0; blk < bl.size; blk++) {
+		uint64_t word;
+		int i;
+
+		if (!blockmap_has_word(&bl, blk)) {
+			/* It must only refuse near the end of the map */
+			ck_assert(blk + 64 > bl.size);
+			continue;
+		}
+		word = blockmap_word(&bl, blk);
+		for (i = 0; i < 32; i++)
+			ck_assert_int_eq((word >> (i * 2)) & 3, block_type(&bl, blk + i));
+	}
+	free(bl.map);
+}
+END_TEST
+
+START_TEST(test_compact_bmap)
+{
+	struct gfs2_bmap flat = { .size = 100000 };
+	struct gfs2_bmap cmp = {0};
+	uint64_t blk;
+	int i;
+
+	flat.mapsize = BLOCKMAP_SIZE2(flat.size) + 1;
+	flat.map = calloc(flat.mapsize, 1);
+	ck_assert(flat.map != NULL);
+	ck_assert(bmap_compact_create(&cmp, flat.size, flat.mapsize) == 0);
+	ck_assert(cmp.nchunks > 4);
+
+	/* Fill a whole chunk with one state, scatter others about */
+	for (blk = BMAP_CHUNK_BYTES * 4; blk < BMAP_CHUNK_BYTES * 8; blk++) {
+		bmap_update(&flat, BLOCKMAP_SIZE2(blk), 3 << BLOCKMAP_BYTE_OFFSET2(blk),
+		            1 << BLOCKMAP_BYTE_OFFSET2(blk));
+		bmap_update(&cmp, BLOCKMAP_SIZE2(blk), 3 << BLOCKMAP_BYTE_OFFSET2(blk),
+		            1 << BLOCKMAP_BYTE_OFFSET2(blk));
+	}
+	srandom(1);
+	for (i = 0; i < 1000; i++) {
+		unsigned mark = random() & 3;
+
+		blk = BMAP_CHUNK_BYTES * 8 + random() % (flat.size - BMAP_CHUNK_BYTES * 8);
+		bmap_update(&flat, BLOCKMAP_SIZE2(blk), 3 << BLOCKMAP_BYTE_OFFSET2(blk),
+		            mark << BLOCKMAP_BYTE_OFFSET2(blk));
+		bmap_update(&cmp, BLOCKMAP_SIZE2(blk), 3 << BLOCKMAP_BYTE_OFFSET2(blk),
+		            mark << BLOCKMAP_BYTE_OFFSET2(blk));
+	}
+	ck_assert(cmp.nalloc > 0);
+	ck_assert(cmp.nalloc < cmp.nchunks);
+	bmap_compact(&cmp, 0, cmp.mapsize);
+	ck_assert(cmp.chunks[1] == NULL);
+	ck_assert(cmp.fill[1] == 0x55);
+
+	for (blk = 0; blk < flat.size; blk++) {
+		ck_assert_int_eq(block_type(&cmp, blk), block_type(&flat, blk));
+		if (blockmap_has_word(&cmp, blk))
+			ck_assert(blockmap_word(&cmp, blk) == blockmap_word(&flat, blk));
+	}
+	bmap_free(&cmp);
+	ck_assert(cmp.chunks == NULL);
+	bmap_free(&flat);
+}
+END_TEST
+
+START_TEST(test_revoke_set)
+{
+	const unsigned nrevokes = 100000;
+	uint64_t blk;
+
+	/* Enough revokes to make the set grow several times */
+	for (blk = 0; blk < nrevokes; blk++)
+		ck_assert_int_eq(gfs2_revoke_add(NULL, blk * 3, 100), 1);
+	/* Adding one again only moves where it was revoked */
+	ck_assert_int_eq(gfs2_revoke_add(NULL, 42 * 3, 200), 0);
+
+	for (blk = 0; blk < nrevokes * 3; blk++) {
+		int revoked = (blk % 3 == 0);
+
+		/* Only blocks logged before the revoke are skipped */
+		ck_assert_int_eq(gfs2_revoke_check(NULL, blk, 50), revoked);
+		ck_assert_int_eq(gfs2_revoke_check(NULL, blk, 150), blk == 42 * 3);
+	}
+	gfs2_revoke_clean(NULL);
+	ck_assert_int_eq(gfs2_revoke_check(NULL, 0, 50), 0);
+}
+END_TEST
+
+static void dup_insert(struct osi_root *root, struct duptree *dt, uint64_t blk)
+{
+	struct osi_node **newn = &root->osi_node, *parent = NULL;
+
+	while (*newn) {
+		parent = *newn;
+		if (blk < ((struct duptree *)*newn)->block)
+			newn = &((*newn)->osi_left);
+		else
+			newn = &((*newn)->osi_right);
+	}
+	memset(dt, 0, sizeof(*dt));
+	dt->block = blk;
+	osi_link_node(&dt->node, parent, newn);
+	osi_insert_color(&dt->node, root);
+}
+
+START_TEST(test_owner_map)
+{
+	const uint64_t shard = 1ULL << OWNER_SHARD_SHIFT;
+	struct owner_map *om = owner_map_create(3 * shard, 1 << 20);
+	struct osi_root dups = { NULL };
+	struct duptree dt[4];
+	uint64_t *owners;
+	unsigned count;
+	uint64_t blk;
+
+	ck_assert(om != NULL);
+	/* Runs of blocks marked by one inode end up in one extent */
+	for (blk = 100; blk < 200; blk++)
+		owner_map_add(&om, blk, 10);
+	owner_map_add(&om, 150, 10);
+	ck_assert_int_eq(om->shards[0].count, 1);
+	for (blk = 200; blk < 300; blk++)
+		owner_map_add(&om, blk, 20);
+	/* Straddle a shard boundary */
+	for (blk = shard - 5; blk < shard + 5; blk++)
+		owner_map_add(&om, blk, 30);
+	owner_map_add(&om, 2 * shard + 7, 40);
+	/* A block freed by one inode and reused by another has two owners */
+	owner_map_add(&om, 250, 50);
+	ck_assert_int_eq(om->shards[0].count, 4);
+	ck_assert_int_eq(om->shards[1].count, 1);
+
+	dup_insert(&dups, &dt[0], 150);
+	dup_insert(&dups, &dt[1], 250);
+	dup_insert(&dups, &dt[2], shard + 1);
+	dup_insert(&dups, &dt[3], 2 * shard + 8);
+	owners = owner_map_owners(om, &dups, &count);
+	ck_assert(owners != NULL);
+	ck_assert_int_eq(count, 4);
+	ck_assert(owners[0] == 10);
+	ck_assert(owners[1] == 20);
+	ck_assert(owners[2] == 30);
+	ck_assert(owners[3] == 50);
+	free(owners);
+
+	/* Going over the limit gives up on the map */
+	om->limit = om->bytes;
+	for (blk = 0; blk < 1000; blk++)
+		owner_map_add(&om, 1000 + blk * 2, blk);
+	ck_assert(om == NULL);
+	owner_map_free(&om);
+}
+END_TEST
+
 static Suite *suite_fsck(void)
 {
 	Suite *s = suite_create("main.c");
 	TCase *tc_fsck = tcase_create("fsck.gfs2");
 	tcase_add_test(tc_fsck, test_fsck_stub);
 	suite_add_tcase(s, tc_fsck);
+
+	tc_fsck = tcase_create("util.h");
+	tcase_add_test(tc_fsck, test_blockmap_word);
+	tcase_add_test(tc_fsck, test_compact_bmap);
+	tcase_add_test(tc_fsck, test_owner_map);
+	suite_add_tcase(s, tc_fsck);
+
+	tc_fsck = tcase_create("fs_recovery.c");
+	tcase_add_test(tc_fsck, test_revoke_set);
+	suite_add_tcase(s, tc_fsck);
 	return s;
 }
 
@@ -2,10 +2,12 @@
 
 #include <errno.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
+#include <sys/uio.h>
 #include <libintl.h>
 #define _(String) gettext(String)
 
@@ -24,92 +26,148 @@ static unsigned int sd_replayed_jblocks = 0;
 static unsigned int sd_found_metablocks = 0;
 static unsigned int sd_replayed_metablocks = 0;
 static unsigned int sd_found_revokes = 0;
-static osi_list_t sd_revoke_list;
 static unsigned int sd_replay_tail;
 
-struct gfs2_revoke_replay {
-	osi_list_t rr_list;
-	uint64_t rr_blkno;
-	unsigned int rr_where;
+/*
+ * An open-addressed hash of block numbers. It holds the revoke set, mapping
+ * each revoked block to where in the journal it was revoked, and the replay
+ * set, mapping each block being replayed to its slot in sd_replay_data.
+ */
+struct blkhash_ent {
+	uint64_t key;
+	uint32_t val;
+	uint32_t used;
 };
 
-int gfs2_revoke_add(struct gfs2_sbd *sdp, uint64_t blkno, unsigned int where)
+struct blkhash {
+	struct blkhash_ent *ents;
+	unsigned shift;
+	uint32_t count;
+};
+
+#define BLKHASH_MIN_SHIFT (10)
+
+static struct blkhash sd_revokes;
+
+static inline uint32_t blkhash_slot(const struct blkhash *h, uint64_t key)
 {
-	osi_list_t *tmp, *head = &sd_revoke_list;
-	struct gfs2_revoke_replay *rr;
-	int found = 0;
-
-	osi_list_foreach(tmp, head) {
-		rr = osi_list_entry(tmp, struct gfs2_revoke_replay, rr_list);
-		if (rr->rr_blkno == blkno) {
-			found = 1;
-			break;
-		}
-	}
+	return (key * 0x9e3779b97f4a7c15ULL) >> (64 - h->shift);
+}
 
-	if (found) {
-		rr->rr_where = where;
-		return 0;
+static struct blkhash_ent *blkhash_find(const struct blkhash *h, uint64_t key)
+{
+	uint32_t mask;
+	uint32_t i;
+
+	if (h->ents == NULL)
+		return NULL;
+	mask = (1U << h->shift) - 1;
+	for (i = blkhash_slot(h, key); h->ents[i].used; i = (i + 1) & mask)
+		if (h->ents[i].key == key)
+			return &h->ents[i];
+	return NULL;
+}
+
+static int blkhash_grow(struct blkhash *h)
+{
+	struct blkhash new = { .shift = h->ents ? h->shift + 1 : BLKHASH_MIN_SHIFT };
+	uint32_t mask = (1U << new.shift) - 1;
+
+	new.ents = calloc(1U << new.shift, sizeof(*new.ents));
+	if (new.ents == NULL)
+		return -1;
+	for (uint32_t i = 0; h->ents && i < (1U << h->shift); i++) {
+		uint32_t j;
+
+		if (!h->ents[i].used)
+			continue;
+		for (j = blkhash_slot(&new, h->ents[i].key); new.ents[j].used; j = (j + 1) & mask);
+		new.ents[j] = h->ents[i];
 	}
+	new.count = h->count;
+	free(h->ents);
+	*h = new;
+	return 0;
+}
 
-	rr = malloc(sizeof(struct gfs2_revoke_replay));
-	if (!rr)
-		return -ENOMEM;
+/**
+ * Look up a key, adding it if it isn't already in the hash.
+ * isnew: set to 1 if the key was added, 0 if it was already there
+ * Returns the key's entry or NULL if the hash couldn't be grown
+ */
+static struct blkhash_ent *blkhash_insert(struct blkhash *h, uint64_t key, int *isnew)
+{
+	struct blkhash_ent *e = blkhash_find(h, key);
+	uint32_t mask;
+	uint32_t i;
+
+	*isnew = 0;
+	if (e != NULL)
+		return e;
+	/* Keep the load factor at or below 1/2 */
+	if ((h->ents == NULL || (h->count + 1) * 2 > (1U << h->shift)) && blkhash_grow(h))
+		return NULL;
+	mask = (1U << h->shift) - 1;
+	for (i = blkhash_slot(h, key); h->ents[i].used; i = (i + 1) & mask);
+	h->ents[i].key = key;
+	h->ents[i].used = 1;
+	h->count++;
+	*isnew = 1;
+	return &h->ents[i];
+}
 
-	rr->rr_blkno = blkno;
-	rr->rr_where = where;
-	osi_list_add(&rr->rr_list, head);
-	return 1;
+static void blkhash_free(struct blkhash *h)
+{
+	free(h->ents);
+	h->ents = NULL;
+	h->count = 0;
+}
+
+int gfs2_revoke_add(struct gfs2_sbd *sdp, uint64_t blkno, unsigned int where)
+{
+	struct blkhash_ent *e;
+	int isnew;
+
+	e = blkhash_insert(&sd_revokes, blkno, &isnew);
+	if (e == NULL)
+		return -ENOMEM;
+	e->val = where;
+	return isnew;
 }
 
 int gfs2_revoke_check(struct gfs2_sbd *sdp, uint64_t blkno, unsigned int where)
 {
-	osi_list_t *tmp;
-	struct gfs2_revoke_replay *rr;
+	struct blkhash_ent *e = blkhash_find(&sd_revokes, blkno);
 	int wrap, a, b;
-	int found = 0;
-
-	osi_list_foreach(tmp, &sd_revoke_list) {
-		rr = osi_list_entry(tmp, struct gfs2_revoke_replay, rr_list);
-		if (rr->rr_blkno == blkno) {
-			found = 1;
-			break;
-		}
-	}
 
-	if (!found)
+	if (e == NULL)
 		return 0;
 
-	wrap = (rr->rr_where < sd_replay_tail);
+	wrap = (e->val < sd_replay_tail);
 	a = (sd_replay_tail < where);
-	b = (where < rr->rr_where);
+	b = (where < e->val);
 	return (wrap) ? (a || b) : (a && b);
 }
 
 void gfs2_revoke_clean(struct gfs2_sbd *sdp)
 {
-	osi_list_t *head = &sd_revoke_list;
-	struct gfs2_revoke_replay *rr;
-
-	while (!osi_list_empty(head)) {
-		rr = osi_list_entry(head->next, struct gfs2_revoke_replay, rr_list);
-		osi_list_del(&rr->rr_list);
-		free(rr);
-	}
+	blkhash_free(&sd_revokes);
 }
 
 static void refresh_rgrp(struct gfs2_sbd *sdp, struct rgrp_tree *rgd,
-			 struct gfs2_buffer_head *bh, uint64_t blkno)
+			 const char *buf, uint64_t blkno)
 {
 	int i;
 
 	log_debug(_("Block is part of rgrp 0x%"PRIx64"; refreshing the rgrp.\n"),
 	          rgd->rt_addr);
+	if (lgfs2_rgrp_load(rgd) != 0)
+		return;
 	for (i = 0; i < rgd->rt_length; i++) {
 		if (rgd->rt_addr + i != blkno)
 			continue;
 
-		memcpy(rgd->bits[i].bi_data, bh->b_data, sdp->sd_bsize);
+		memcpy(rgd->bits[i].bi_data, buf, sdp->sd_bsize);
 		rgd->bits[i].bi_modified = 1;
 		if (i == 0) { /* this is the rgrp itself */
 			if (sdp->gfs1)
@@ -121,16 +179,143 @@ static void refresh_rgrp(struct gfs2_sbd *sdp, struct rgrp_tree *rgd,
 	}
 }
 
+/*
+ * Blocks being replayed are gathered here, keeping only the latest copy of
+ * each one, and written out together by replay_flush() in block order.
+ */
+#define REPLAY_MAX_BYTES (64 << 20)
+
+static struct blkhash sd_replay_blocks;
+static char *sd_replay_data;
+static uint32_t sd_replay_alloc;
+
+/**
+ * Get the buffer which will be written to a block when the replay set is
+ * flushed. It holds the block's previous replayed contents, if any.
+ * Returns the buffer or NULL if memory could not be allocated
+ */
+static char *replay_block(struct gfs2_sbd *sdp, uint64_t blkno)
+{
+	struct blkhash_ent *e = blkhash_find(&sd_replay_blocks, blkno);
+	int isnew;
+
+	if (e != NULL)
+		return sd_replay_data + (size_t)e->val * sdp->sd_bsize;
+
+	if (sd_replay_blocks.count == sd_replay_alloc) {
+		uint32_t alloc = sd_replay_alloc ? sd_replay_alloc * 2 : 64;
+		char *data = realloc(sd_replay_data, (size_t)alloc * sdp->sd_bsize);
+
+		if (data == NULL)
+			return NULL;
+		sd_replay_data = data;
+		sd_replay_alloc = alloc;
+	}
+	e = blkhash_insert(&sd_replay_blocks, blkno, &isnew);
+	if (e == NULL)
+		return NULL;
+	e->val = sd_replay_blocks.count - 1;
+	return sd_replay_data + (size_t)e->val * sdp->sd_bsize;
+}
+
+static int replay_cmp(const void *a, const void *b)
+{
+	uint64_t x = ((const struct blkhash_ent *)a)->key;
+	uint64_t y = ((const struct blkhash_ent *)b)->key;
+
+	return (x > y) - (x < y);
+}
+
+/**
+ * Write out the replay set in block order, coalescing runs of adjacent blocks
+ * into single writes, and refresh any in-core rgrps that were replayed.
+ * Returns 0 on success or -1 with errno set on error
+ */
+static int replay_flush(struct gfs2_sbd *sdp)
+{
+	struct blkhash_ent *ents = sd_replay_blocks.ents;
+	uint32_t n = 0;
+	struct iovec *iov;
+	int error = 0;
+
+	if (ents == NULL)
+		return 0;
+	/* Sort the entries in place, the hash isn't needed any more */
+	for (uint32_t i = 0; i < (1U << sd_replay_blocks.shift); i++)
+		if (ents[i].used)
+			ents[n++] = ents[i];
+	qsort(ents, n, sizeof(*ents), replay_cmp);
+
+	iov = malloc(IOV_MAX * sizeof(*iov));
+	if (iov == NULL) {
+		error = -1;
+		goto out;
+	}
+	for (uint32_t i = 0; i < n;) {
+		uint64_t start = ents[i].key;
+		ssize_t len = 0;
+		uint32_t j;
+
+		for (j = 0; i + j < n && j < IOV_MAX; j++) {
+			uint64_t blkno = ents[i + j].key;
+			char *buf = sd_replay_data + (size_t)ents[i + j].val * sdp->sd_bsize;
+			struct rgrp_tree *rgd;
+
+			if (blkno != start + j)
+				break;
+			iov[j].iov_base = buf;
+			iov[j].iov_len = sdp->sd_bsize;
+			len += sdp->sd_bsize;
+			rgd = gfs2_blk2rgrpd(sdp, blkno);
+			if (rgd && blkno < rgd->rt_data0)
+				refresh_rgrp(sdp, rgd, buf, blkno);
+		}
+		/* Don't let the block cache hold on to stale copies */
+		if (lgfs2_bcache_forget(sdp, start, j) != 0 ||
+		    lgfs2_pwritev(sdp, sdp->device_fd, iov, j, start * sdp->sd_bsize) != len) {
+			log_err(_("Failed to write replayed blocks %"PRIu64" to %"PRIu64": %s\n"),
+			        start, start + j - 1, strerror(errno));
+			error = -1;
+		}
+		i += j;
+	}
+	free(iov);
+out:
+	blkhash_free(&sd_replay_blocks);
+	free(sd_replay_data);
+	sd_replay_data = NULL;
+	sd_replay_alloc = 0;
+	return error;
+}
+
+/**
+ * Get a buffer to replay a block into, flushing the replay set first if it
+ * has grown too large.
+ */
+static char *replay_get(struct gfs2_sbd *sdp, uint64_t blkno)
+{
+	char *buf;
+
+	if (blkhash_find(&sd_replay_blocks, blkno) == NULL &&
+	    (uint64_t)sd_replay_blocks.count * sdp->sd_bsize >= REPLAY_MAX_BYTES &&
+	    replay_flush(sdp) != 0)
+		return NULL;
+	buf = replay_block(sdp, blkno);
+	if (buf == NULL)
+		log_err(_("Out of memory when replaying journals.\n"));
+	return buf;
+}
+
 static int buf_lo_scan_elements(struct gfs2_inode *ip, unsigned int start,
 				struct gfs2_log_descriptor *ld, __be64 *ptr,
 				int pass)
 {
 	struct gfs2_sbd *sdp = ip->i_sbd;
 	unsigned int blks = be32_to_cpu(ld->ld_data1);
-	struct gfs2_buffer_head *bh_log, *bh_ip;
+	struct gfs2_buffer_head *bh_log;
 	uint64_t blkno;
 	int error = 0;
-	struct rgrp_tree *rgd;
+	char *buf;
 
 	if (pass != 1 || be32_to_cpu(ld->ld_type) != GFS2_LOG_DESC_METADATA)
 		return 0;
@@ -155,31 +340,23 @@ static int buf_lo_scan_elements(struct gfs2_inode *ip, unsigned int start,
 			    "%lld (0x%llx) for journal+0x%x\n"),
 			  (unsigned long long)blkno, (unsigned long long)blkno,
 			  start);
-		bh_ip = bget(sdp, blkno);
-		if (!bh_ip) {
-			log_err(_("Out of memory when replaying journals.\n"));
-			return FSCK_ERROR;
-		}
-		memcpy(bh_ip->b_data, bh_log->b_data, sdp->sd_bsize);
-
-		mhp = (struct gfs2_meta_header *)bh_ip->b_data;
+		mhp = (struct gfs2_meta_header *)bh_log->b_data;
 		if (be32_to_cpu(mhp->mh_magic) != GFS2_MAGIC) {
 			log_err(_("Journal corruption detected at block #"
 				  "%lld (0x%llx) for journal+0x%x.\n"),
 				(unsigned long long)blkno, (unsigned long long)blkno,
 				start);
+			brelse(bh_log);
 			error = -EIO;
-		} else {
-			bmodified(bh_ip);
-			rgd = gfs2_blk2rgrpd(sdp, blkno);
-			if (rgd && blkno < rgd->rt_data0)
-				refresh_rgrp(sdp, rgd, bh_ip, blkno);
+			break;
 		}
-
+		buf = replay_get(sdp, blkno);
+		if (buf == NULL) {
+			brelse(bh_log);
+			return FSCK_ERROR;
+		}
+		memcpy(buf, bh_log->b_data, sdp->sd_bsize);
 		brelse(bh_log);
-		brelse(bh_ip);
-		if (error)
-			break;
 
 		sd_replayed_metablocks++;
 	}
@@ -245,10 +422,11 @@ static int databuf_lo_scan_elements(struct gfs2_inode *ip, unsigned int start,
 {
 	struct gfs2_sbd *sdp = ip->i_sbd;
 	unsigned int blks = be32_to_cpu(ld->ld_data1);
-	struct gfs2_buffer_head *bh_log, *bh_ip;
+	struct gfs2_buffer_head *bh_log;
 	uint64_t blkno;
 	uint64_t esc;
 	int error = 0;
+	char *buf;
 
 	if (pass != 1 || be32_to_cpu(ld->ld_type) != GFS2_LOG_DESC_JDATA)
 		return 0;
@@ -273,22 +451,20 @@ static int databuf_lo_scan_elements(struct gfs2_inode *ip, unsigned int start,
 			    " for journal+0x%x\n"),
 			  (unsigned long long)blkno, (unsigned long long)blkno,
 			  start);
-		bh_ip = bget(sdp, blkno);
-		if (!bh_ip) {
-			log_err(_("Out of memory when replaying journals.\n"));
+		buf = replay_get(sdp, blkno);
+		if (buf == NULL) {
+			brelse(bh_log);
 			return FSCK_ERROR;
 		}
-		memcpy(bh_ip->b_data, bh_log->b_data, sdp->sd_bsize);
+		memcpy(buf, bh_log->b_data, sdp->sd_bsize);
 
 		/* Unescape */
 		if (esc) {
-			__be32 *eptr = (__be32 *)bh_ip->b_data;
+			__be32 *eptr = (__be32 *)buf;
 			*eptr = cpu_to_be32(GFS2_MAGIC);
 		}
 
 		brelse(bh_log);
-		bmodified(bh_ip);
-		brelse(bh_ip);
 
 		sd_replayed_jblocks++;
 	}
@@ -496,7 +672,6 @@ static int gfs2_recover_journal(struct gfs2_inode *ip, int j, int preen,
 	*was_clean = 0;
 	log_info( _("jid=%u: Looking at journal...\n"), j);
 
-	osi_list_init(&sd_revoke_list);
 	error = lgfs2_find_jhead(ip, &head);
 	if (!error) {
 		error = check_journal_seq_no(ip, 0);
@@ -581,10 +756,16 @@ static int gfs2_recover_journal(struct gfs2_inode *ip, int j, int preen,
 	for (pass = 0; pass < 2; pass++) {
 		error = foreach_descriptor(ip, head.lh_tail,
 					   head.lh_blkno, pass);
-		if (error) {
-			log_err(_("Error found during journal replay.\n"));
-			goto out;
-		}
+		if (error)
+			break;
+	}
+	/* Write the blocks replayed so far, even if we hit an error */
+	if (replay_flush(sdp) != 0 && !error)
+		error = -EIO;
+	if (error) {
+		log_err(_("Error found during journal replay.\n"));
+		gfs2_revoke_clean(sdp);
+		goto out;
 	}
 	log_info( _("jid=%u: Found %u revoke tags\n"), j, sd_found_revokes);
 	gfs2_revoke_clean(sdp);
@@ -731,6 +912,10 @@ int replay_journals(struct gfs2_sbd *sdp, int preen, int force_check,
 		}
 	}
 	/* Sync the buffers to disk so we get a fresh start. */
+	if (lgfs2_bcache_sync(sdp) && !opts.no) {
+		log_err(_("Error writing cached blocks: %s\n"), strerror(errno));
+		error = -1;
+	}
 	fsync(sdp->device_fd);
 	return error;
 }
@@ -5,6 +5,8 @@
 #include "osi_tree.h"
 
 #define FSCK_MAX_FORMAT (1802)
+#define FSCK_MAX_QDEPTH (256) /* Max pass1 reads queued */
+#define FSCK_MAX_THREADS (64) /* Max pass1 worker threads */
 
 #define FSCK_HASH_SHIFT         (13)
 #define FSCK_HASH_SIZE          (1 << FSCK_HASH_SHIFT)
@@ -27,10 +29,45 @@
 
 #define BAD_POINTER_TOLERANCE 10 /* How many bad pointers is too many? */
 
+/* Compact block maps are split into chunks of this many bytes */
+#define BMAP_CHUNK_SHIFT 12
+#define BMAP_CHUNK_BYTES (1 << BMAP_CHUNK_SHIFT)
+#define BMAP_CHUNK_MASK (BMAP_CHUNK_BYTES - 1)
+
 struct gfs2_bmap {
 	uint64_t size;
 	uint64_t mapsize;
 	unsigned char *map;
+	/* Compact maps have chunks instead of map. A NULL chunk has every
+	   byte set to the corresponding fill value. */
+	unsigned char **chunks;
+	unsigned char *fill;
+	uint64_t nchunks;
+	uint64_t nalloc;
+};
+
+/* Pass1 records the inode which first marks each block in extents, sharded by
+   block number, so that pass1b can find the original references to
+   duplicate blocks without walking every inode. */
+#define OWNER_SHARD_SHIFT 20
+
+struct owner_ext {
+	uint32_t start; /* First block, relative to the start of the shard */
+	uint32_t len;
+	uint64_t owner;
+};
+
+struct owner_shard {
+	struct owner_ext *exts;
+	uint32_t count;
+	uint32_t alloc;
+};
+
+struct owner_map {
+	struct owner_shard *shards;
+	uint64_t nshards;
+	uint64_t bytes;
+	uint64_t limit;
 };
 
 struct inode_info
@@ -117,6 +154,8 @@ extern void fsck_inode_put(struct gfs2_inode **ip);
 extern int initialize(struct gfs2_sbd *sdp, int force_check, int preen,
 		      int *all_clean);
 extern void destroy(struct gfs2_sbd *sdp);
+extern void check_deferred_rgrp(struct gfs2_sbd *sdp, struct rgrp_tree *rgd);
+extern void report_deferred_rgrps(void);
 extern int pass1(struct gfs2_sbd *sdp);
 extern int pass1b(struct gfs2_sbd *sdp);
 extern int pass1c(struct gfs2_sbd *sdp);
@@ -125,6 +164,7 @@ extern int pass3(struct gfs2_sbd *sdp);
 extern int pass4(struct gfs2_sbd *sdp);
 extern int pass5(struct gfs2_sbd *sdp, struct gfs2_bmap *bl);
 extern int rindex_repair(struct gfs2_sbd *sdp, int trust_lvl, int *ok);
+extern int rewrite_rg_block(struct gfs2_sbd *sdp, struct rgrp_tree *rg, uint64_t errblock);
 extern int fsck_query(const char *format, ...)
 	__attribute__((format(printf,1,2)));
 extern struct dir_info *dirtree_find(uint64_t block);
@@ -140,6 +180,15 @@ struct gfs2_options {
 	unsigned int yes:1;
 	unsigned int no:1;
 	unsigned int query:1;
+	unsigned long cache_mb;
+	unsigned int qdepth;
+	unsigned int threads;
+	unsigned int bmap_limit:1;
+	unsigned long bmap_mb;
+	unsigned long rgcache_mb;
+	const char *iostats;
+	const char *stats_file;
+	int progress_fd;
 };
 
 extern struct gfs2_options opts;
@@ -152,6 +201,7 @@ extern int errors_found, errors_corrected;
 extern uint64_t last_data_block;
 extern uint64_t first_data_block;
 extern struct osi_root dup_blocks;
+extern struct owner_map *owner_map;
 extern struct osi_root dirtree;
 extern struct osi_root inodetree;
 extern int dups_found; /* How many duplicate references have we found? */
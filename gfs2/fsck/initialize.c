@@ -113,10 +113,12 @@ static void empty_super_block(struct gfs2_sbd *sdp)
 {
 	log_info( _("Freeing buffers.\n"));
 	gfs2_rgrp_free(sdp, &sdp->rgtree);
+	lgfs2_rgcache_free(sdp);
 
 	gfs2_inodetree_free();
 	gfs2_dirtree_free();
 	gfs2_dup_free();
+	owner_map_free(&owner_map);
 }
 
 
@@ -162,15 +164,8 @@ static int set_block_ranges(struct gfs2_sbd *sdp)
 	last_data_block = rmax;
 	first_data_block = rmin;
 
-	if (fsck_lseek(sdp->device_fd, (last_fs_block * sdp->sd_bsize))){
-		log_crit( _("Can't seek to last block in file system: %llu"
-			 " (0x%llx)\n"), (unsigned long long)last_fs_block,
-			 (unsigned long long)last_fs_block);
-		goto fail;
-	}
-
 	memset(buf, 0, sdp->sd_bsize);
-	error = read(sdp->device_fd, buf, sdp->sd_bsize);
+	error = lgfs2_pread(sdp, sdp->device_fd, buf, sdp->sd_bsize, last_fs_block * sdp->sd_bsize);
 	if (error != sdp->sd_bsize){
 		log_crit( _("Can't read last block in file system (error %u), "
 			 "last_fs_block: %llu (0x%llx)\n"), error,
@@ -403,6 +398,51 @@ static void check_rgrp_integrity(struct gfs2_sbd *sdp, struct rgrp_tree *rgd,
 	}*/
 }
 
+/* Resource group integrity check results, see check_rgrps_integrity() */
+static struct {
+	int good;
+	int bad;
+	int fixed;
+	int cleaned;
+	int reclaim_unlinked;
+	int deferred; /* Checked by pass1 as it reaches each resource group */
+} rgchk;
+
+static void check_one_rgrp(struct gfs2_sbd *sdp, struct rgrp_tree *rgd)
+{
+	int was_bad = 0, was_fixed = 0, was_cleaned = 0;
+
+	if (lgfs2_rgrp_load(rgd) != 0) {
+		log_err(_("Unable to read resource group at %"PRIu64" (0x%"PRIx64"): %s\n"),
+		        rgd->rt_addr, rgd->rt_addr, strerror(errno));
+		return;
+	}
+	check_rgrp_integrity(sdp, rgd, &rgchk.reclaim_unlinked,
+			     &was_fixed, &was_bad, &was_cleaned);
+	if (was_fixed)
+		rgchk.fixed++;
+	if (was_cleaned)
+		rgchk.cleaned++;
+	else if (was_bad)
+		rgchk.bad++;
+	else
+		rgchk.good++;
+}
+
+static void report_rgrps_integrity(void)
+{
+	if (rgchk.bad || rgchk.cleaned) {
+		log_err( _("RGs: Consistent: %d   Cleaned: %d   Inconsistent: "
+			   "%d   Fixed: %d   Total: %d\n"),
+			 rgchk.good, rgchk.cleaned, rgchk.bad, rgchk.fixed,
+			 rgchk.good + rgchk.bad + rgchk.cleaned);
+		if (rgchk.cleaned && blks_2free)
+			log_err(_("%lld blocks may need to be freed in pass 5 "
+				  "due to the cleaned resource groups.\n"),
+				blks_2free);
+	}
+}
+
 /**
  * check_rgrps_integrity - verify rgrp consistency
  * Note: We consider an rgrp "cleaned" if the unlinked meta blocks are
@@ -413,10 +453,7 @@ static void check_rgrp_integrity(struct gfs2_sbd *sdp, struct rgrp_tree *rgd,
 static void check_rgrps_integrity(struct gfs2_sbd *sdp)
 {
 	struct osi_node *n, *next = NULL;
-	int rgs_good = 0, rgs_bad = 0, rgs_fixed = 0, rgs_cleaned = 0;
-	int was_bad = 0, was_fixed = 0, was_cleaned = 0;
 	struct rgrp_tree *rgd;
-	int reclaim_unlinked = 0;
 
 	log_info( _("Checking the integrity of all resource groups.\n"));
 	for (n = osi_first(&sdp->rgtree); n; n = next) {
@@ -424,27 +461,60 @@ static void check_rgrps_integrity(struct gfs2_sbd *sdp)
 		rgd = (struct rgrp_tree *)n;
 		if (fsck_abort)
 			return;
-		check_rgrp_integrity(sdp, rgd, &reclaim_unlinked,
-				     &was_fixed, &was_bad, &was_cleaned);
-		if (was_fixed)
-			rgs_fixed++;
-		if (was_cleaned)
-			rgs_cleaned++;
-		else if (was_bad)
-			rgs_bad++;
-		else
-			rgs_good++;
+		check_one_rgrp(sdp, rgd);
+		lgfs2_rgcache_trim(sdp);
 	}
-	if (rgs_bad || rgs_cleaned) {
-		log_err( _("RGs: Consistent: %d   Cleaned: %d   Inconsistent: "
-			   "%d   Fixed: %d   Total: %d\n"),
-			 rgs_good, rgs_cleaned, rgs_bad, rgs_fixed,
-			 rgs_good + rgs_bad + rgs_cleaned);
-		if (rgs_cleaned && blks_2free)
-			log_err(_("%lld blocks may need to be freed in pass 5 "
-				  "due to the cleaned resource groups.\n"),
-				blks_2free);
+	report_rgrps_integrity();
+}
+
+/**
+ * bad_bitmap_block - find the bitmap block of a resource group which stops
+ * lgfs2_rgrp_load() from loading it
+ * Returns: the block's address or 0 if there is none
+ */
+static uint64_t bad_bitmap_block(struct gfs2_sbd *sdp, struct rgrp_tree *rgd)
+{
+	for (uint32_t i = 1; i < rgd->rt_length; i++) {
+		struct gfs2_buffer_head *bh = bread(sdp, rgd->rt_addr + i);
+		int bad = gfs2_check_meta(bh->b_data, GFS2_METATYPE_RB);
+
+		brelse(bh);
+		if (bad)
+			return rgd->rt_addr + i;
 	}
+	return 0;
+}
+
+/**
+ * check_deferred_rgrp - check a resource group whose bitmaps were left
+ * unread at startup
+ *
+ * When the resource group index is sane and the resource group cache is in
+ * use, only the resource group headers are read at startup. pass1 calls this
+ * for each resource group before it looks at its dinodes, so the bitmap
+ * blocks are checked and repaired, and the bitmaps compared with the header,
+ * as they are first read.
+ */
+void check_deferred_rgrp(struct gfs2_sbd *sdp, struct rgrp_tree *rgd)
+{
+	uint64_t errblock;
+
+	if (!rgchk.deferred)
+		return;
+	if (lgfs2_rgrp_load(rgd) != 0 &&
+	    (errblock = bad_bitmap_block(sdp, rgd)) != 0)
+		rewrite_rg_block(sdp, rgd, errblock);
+	check_one_rgrp(sdp, rgd);
+}
+
+/**
+ * report_deferred_rgrps - report on the resource groups check_deferred_rgrp()
+ * has checked
+ */
+void report_deferred_rgrps(void)
+{
+	if (rgchk.deferred)
+		report_rgrps_integrity();
 }
 
 /**
@@ -652,7 +722,7 @@ static unsigned gfs2_rgrp_reada(struct gfs2_sbd *sdp, unsigned cur_window,
 		rgd = (struct rgrp_tree *)n;
 		start = rgd->rt_addr * sdp->sd_bsize;
 		len = rgd->rt_length * sdp->sd_bsize;
-		posix_fadvise(sdp->device_fd, start, len, POSIX_FADV_WILLNEED);
+		lgfs2_fadvise(sdp, sdp->device_fd, start, len, POSIX_FADV_WILLNEED);
 	}
 
 	return i;
@@ -668,7 +738,7 @@ static unsigned gfs2_rgrp_reada(struct gfs2_sbd *sdp, unsigned cur_window,
  *
  * Returns: 0 on success, -1 on failure.
  */
-static int read_rgrps(struct gfs2_sbd *sdp, uint64_t expected)
+static int read_rgrps(struct gfs2_sbd *sdp, uint64_t expected, int headers_only)
 {
 	struct rgrp_tree *rgd;
 	uint64_t count = 0;
@@ -678,7 +748,7 @@ static int read_rgrps(struct gfs2_sbd *sdp, uint64_t expected)
 	unsigned ra_window = 0;
 
 	/* Turn off generic readhead */
-	posix_fadvise(sdp->device_fd, 0, 0, POSIX_FADV_RANDOM);
+	lgfs2_fadvise(sdp, sdp->device_fd, 0, 0, POSIX_FADV_RANDOM);
 
 	for (n = osi_first(&sdp->rgtree); n; n = next) {
 		next = osi_next(n);
@@ -687,9 +757,13 @@ static int read_rgrps(struct gfs2_sbd *sdp, uint64_t expected)
 		if (ra_window < RA_WINDOW/2)
 			ra_window = gfs2_rgrp_reada(sdp, ra_window, n);
 		/* Read resource group header */
-		errblock = gfs2_rgrp_read(sdp, rgd);
+		if (headers_only)
+			errblock = lgfs2_rgrp_read_header(sdp, rgd);
+		else
+			errblock = gfs2_rgrp_read(sdp, rgd);
 		if (errblock)
 			return errblock;
+		lgfs2_rgcache_trim(sdp);
 		ra_window--;
 		count++;
 		if (rgd->rt_data0 + rgd->rt_data - 1 > rmax)
@@ -700,11 +774,11 @@ static int read_rgrps(struct gfs2_sbd *sdp, uint64_t expected)
 	if (count != expected)
 		goto fail;
 
-	posix_fadvise(sdp->device_fd, 0, 0, POSIX_FADV_NORMAL);
+	lgfs2_fadvise(sdp, sdp->device_fd, 0, 0, POSIX_FADV_NORMAL);
 	return 0;
 
  fail:
-	posix_fadvise(sdp->device_fd, 0, 0, POSIX_FADV_NORMAL);
+	lgfs2_fadvise(sdp, sdp->device_fd, 0, 0, POSIX_FADV_NORMAL);
 	gfs2_rgrp_free(sdp, &sdp->rgtree);
 	return -1;
 }
@@ -736,7 +810,7 @@ static int fetch_rgrps_level(struct gfs2_sbd *sdp, enum rgindex_trust_level lvl,
 	if (rindex_read(sdp, count, ok) != 0 || !*ok)
 		goto fail;
 
-	ret = read_rgrps(sdp, *count);
+	ret = read_rgrps(sdp, *count, rgchk.deferred);
 	if (ret != 0)
 		goto fail;
 
@@ -761,12 +835,16 @@ static int fetch_rgrps(struct gfs2_sbd *sdp)
 	int ok = 1;
 
 	log_notice(_("Validating resource group index.\n"));
+	/* If the rindex can be trusted, the bitmaps can be left for the
+	   resource group cache to read when they are needed */
+	rgchk.deferred = (sdp->rgcache != NULL);
 	for (trust_lvl = BLIND_FAITH; trust_lvl <= INDIGNATION; trust_lvl++) {
 		int ret = 0;
 
 		ret = fetch_rgrps_level(sdp, trust_lvl, &rgcount, &ok);
 		if (ret == 0)
 			break;
+		rgchk.deferred = 0;
 		if (fsck_abort)
 			break;
 	}
@@ -777,7 +855,10 @@ static int fetch_rgrps(struct gfs2_sbd *sdp)
 	}
 	log_info( _("%"PRIu64" resource groups found.\n"), rgcount);
 
-	check_rgrps_integrity(sdp);
+	if (rgchk.deferred)
+		log_info(_("Resource group bitmaps will be checked as they are read.\n"));
+	else
+		check_rgrps_integrity(sdp);
 	return 0;
 }
 
@@ -1603,7 +1684,22 @@ int initialize(struct gfs2_sbd *sdp, int force_check, int preen,
 		was_mounted_ro = 1;
 	}
 
-	if (lgfs2_get_dev_info(sdp->device_fd, &sdp->dinfo)) {
+	if (lgfs2_metaimg_open(sdp) != 0) {
+		log_crit(_("Unable to read savemeta file %s: %s\n"), opts.device, strerror(errno));
+		return FSCK_ERROR;
+	}
+	if (sdp->metaimg != NULL) {
+		if (!opts.no) {
+			log_crit(_("%s is a savemeta file, which can only be checked with -n\n"),
+			         opts.device);
+			return FSCK_USAGE;
+		}
+		log_notice(_("Checking the metadata saved in %s\n"), opts.device);
+		if (lgfs2_metaimg_dev_info(sdp->metaimg, &sdp->dinfo)) {
+			perror(opts.device);
+			return FSCK_ERROR;
+		}
+	} else if (lgfs2_get_dev_info(sdp->device_fd, &sdp->dinfo)) {
 		perror(opts.device);
 		return FSCK_ERROR;
 	}
@@ -1613,6 +1709,13 @@ int initialize(struct gfs2_sbd *sdp, int force_check, int preen,
 	if (err != FSCK_OK)
 		return err;
 
+	if (opts.cache_mb && lgfs2_bcache_init(sdp, opts.cache_mb << 20))
+		log_warn(_("Unable to set up a %lu MB block cache: %s\n"),
+		         opts.cache_mb, strerror(errno));
+	if (opts.rgcache_mb && lgfs2_rgcache_init(sdp, opts.rgcache_mb << 20))
+		log_warn(_("Unable to limit resource group memory to %lu MB: %s\n"),
+		         opts.rgcache_mb, strerror(errno));
+
 	/* Change lock protocol to be fsck_* instead of lock_* */
 	if (!opts.no && preen_is_safe(sdp, preen, force_check)) {
 		if (block_mounters(sdp, 1)) {
@@ -1659,6 +1762,7 @@ int initialize(struct gfs2_sbd *sdp, int force_check, int preen,
 	/* We need to read in jindex in order to replay the journals. If
 	   there's an error, we may proceed and let init_system_inodes
 	   try to rebuild it. */
+	lgfs2_iostats_phase(sdp, "journals");
 	if (init_jindex(sdp, 1) == 0) {
 		/* If GFS, rebuild the journals. If GFS2, replay them. We don't
 		   have the smarts to replay GFS1 journals (neither did
@@ -1681,6 +1785,7 @@ int initialize(struct gfs2_sbd *sdp, int force_check, int preen,
 		if (!force_check && *all_clean && preen)
 			return FSCK_OK;
 	}
+	lgfs2_iostats_phase(sdp, "initialize");
 
 	if (init_system_inodes(sdp))
 		return FSCK_ERROR;
@@ -1696,6 +1801,19 @@ mount_fail:
 
 void destroy(struct gfs2_sbd *sdp)
 {
+	struct lgfs2_bcache_stats st;
+	struct lgfs2_rgcache_stats rst;
+
+	if (lgfs2_bcache_stats(sdp, &st) == 0)
+		log_info(_("Block cache: %"PRIu64" hits, %"PRIu64" misses, "
+		           "%"PRIu64" evictions, %"PRIu64" writebacks\n"),
+		         st.hits, st.misses, st.evictions, st.writebacks);
+	if (lgfs2_rgcache_stats(sdp, &rst) == 0)
+		log_info(_("Resource group bitmaps: %"PRIu64" loads, %"PRIu64" evictions, "
+		           "%"PRIu64" writebacks\n"),
+		         rst.loads, rst.evictions, rst.writebacks);
+	if (lgfs2_bcache_free(sdp) && !opts.no)
+		log_err(_("Error writing cached blocks: %s\n"), strerror(errno));
 	if (!opts.no) {
 		if (block_mounters(sdp, 0)) {
 			log_warn( _("Unable to unblock other mounters - manual intervention required\n"));
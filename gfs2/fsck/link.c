@@ -20,7 +20,6 @@ struct gfs2_bmap clink1map = { 0 }; /* map of dinodes w/counted links == 1 */
 
 int link1_set(struct gfs2_bmap *bmap, uint64_t bblock, int mark)
 {
-	static unsigned char *byte;
 	static uint64_t b;
 
 	if (!bmap)
@@ -28,11 +27,9 @@ int link1_set(struct gfs2_bmap *bmap, uint64_t bblock, int mark)
 	if (bblock > bmap->size)
 		return -1;
 
-	byte = bmap->map + BLOCKMAP_SIZE1(bblock);
 	b = BLOCKMAP_BYTE_OFFSET1(bblock);
-	*byte &= ~(BLOCKMAP_MASK1 << b);
-	*byte |= (mark & BLOCKMAP_MASK1) << b;
-	return 0;
+	return bmap_update(bmap, BLOCKMAP_SIZE1(bblock), BLOCKMAP_MASK1 << b,
+	                   (mark & BLOCKMAP_MASK1) << b);
 }
 
 int set_di_nlink(struct gfs2_inode *ip)
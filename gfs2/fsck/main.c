@@ -5,7 +5,9 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <libgen.h>
+#include <limits.h>
 #include <string.h>
+#include <errno.h>
 #include <stdarg.h>
 #include <ctype.h>
 #include <signal.h>
@@ -24,6 +26,7 @@
 #include "osi_list.h"
 #include "metawalk.h"
 #include "util.h"
+#include "stats.h"
 
 struct gfs2_options opts = {0};
 struct gfs2_inode *lf_dip = NULL; /* Lost and found directory inode */
@@ -35,6 +38,7 @@ int errors_found = 0, errors_corrected = 0;
 uint64_t last_data_block;
 uint64_t first_data_block;
 struct osi_root dup_blocks;
+struct owner_map *owner_map;
 struct osi_root dirtree;
 struct osi_root inodetree;
 int dups_found = 0, dups_found_first = 0;
@@ -44,6 +48,7 @@ int print_level = MSG_NOTICE;
 static int preen = 0;
 static int force_check = 0;
 static const char *pass_name = "";
+static int write_error = 0; /* Changes could not be written to the device */
 
 /* This function is for libgfs2's sake.                                      */
 void print_it(const char *label, const char *fmt, const char *fmt2, ...)
@@ -58,7 +63,7 @@ void print_it(const char *label, const char *fmt, const char *fmt2, ...)
 
 static void usage(char *name)
 {
-	printf("Usage: %s [-afhnpqvVy] <device> \n", basename(name));
+	printf("Usage: %s [-afhnpqvVy] [-C <MB>] [-I <format>[:<file>]] [-j <threads>] [-M <MB>] [-P <fd>] [-Q <depth>] [-R <MB>] [-S <file>] <device> \n", basename(name));
 }
 
 static void version(void)
@@ -70,9 +75,12 @@ static void version(void)
 
 static int read_cmdline(int argc, char **argv, struct gfs2_options *gopts)
 {
+	unsigned long val;
+	char *endptr;
 	int c;
 
-	while ((c = getopt(argc, argv, "afhnpqvyV")) != -1) {
+	gopts->progress_fd = -1;
+	while ((c = getopt(argc, argv, "afhnpqvyVC:I:j:M:P:Q:R:S:")) != -1) {
 		switch(c) {
 
 		case 'a':
@@ -84,6 +92,70 @@ static int read_cmdline(int argc, char **argv, struct gfs2_options *gopts)
 			preen = 1;
 			gopts->yes = 1;
 			break;
+		case 'C':
+			errno = 0;
+			gopts->cache_mb = strtoul(optarg, &endptr, 10);
+			if (errno || *endptr != '\0' || endptr == optarg) {
+				fprintf(stderr, _("Invalid cache size '%s'\n"), optarg);
+				return FSCK_USAGE;
+			}
+			break;
+		case 'I':
+			if (lgfs2_iostats_format(optarg, NULL) < 0) {
+				fprintf(stderr, _("Invalid I/O statistics format '%s'\n"), optarg);
+				return FSCK_USAGE;
+			}
+			gopts->iostats = optarg;
+			break;
+		case 'j':
+			errno = 0;
+			val = strtoul(optarg, &endptr, 10);
+			if (errno || *endptr != '\0' || endptr == optarg ||
+			    val < 1 || val > FSCK_MAX_THREADS) {
+				fprintf(stderr, _("Number of threads must be between 1 and %d\n"), FSCK_MAX_THREADS);
+				return FSCK_USAGE;
+			}
+			gopts->threads = val;
+			break;
+		case 'M':
+			errno = 0;
+			gopts->bmap_mb = strtoul(optarg, &endptr, 10);
+			if (errno || *endptr != '\0' || endptr == optarg) {
+				fprintf(stderr, _("Invalid block map memory limit '%s'\n"), optarg);
+				return FSCK_USAGE;
+			}
+			gopts->bmap_limit = 1;
+			break;
+		case 'P':
+			errno = 0;
+			val = strtoul(optarg, &endptr, 10);
+			if (errno || *endptr != '\0' || endptr == optarg || val > INT_MAX) {
+				fprintf(stderr, _("Invalid progress file descriptor '%s'\n"), optarg);
+				return FSCK_USAGE;
+			}
+			gopts->progress_fd = val;
+			break;
+		case 'Q':
+			errno = 0;
+			val = strtoul(optarg, &endptr, 10);
+			if (errno || *endptr != '\0' || endptr == optarg ||
+			    val < 1 || val > FSCK_MAX_QDEPTH) {
+				fprintf(stderr, _("Queue depth must be between 1 and %d\n"), FSCK_MAX_QDEPTH);
+				return FSCK_USAGE;
+			}
+			gopts->qdepth = val;
+			break;
+		case 'R':
+			errno = 0;
+			gopts->rgcache_mb = strtoul(optarg, &endptr, 10);
+			if (errno || *endptr != '\0' || endptr == optarg || gopts->rgcache_mb == 0) {
+				fprintf(stderr, _("Invalid resource group memory limit '%s'\n"), optarg);
+				return FSCK_USAGE;
+			}
+			break;
+		case 'S':
+			gopts->stats_file = optarg;
+			break;
 		case 'f':
 			force_check = 1;
 			break;
@@ -257,6 +329,8 @@ static int fsck_pass(const struct fsck_pass *p, struct gfs2_sbd *sdp)
 	pass_name = p->name;
 
 	log_notice( _("Starting %s\n"), p->name);
+	lgfs2_iostats_phase(sdp, p->name);
+	stats_pass_start(p->name);
 	gettimeofday(&timer, NULL);
 
 	ret = p->f(sdp);
@@ -268,15 +342,71 @@ static int fsck_pass(const struct fsck_pass *p, struct gfs2_sbd *sdp)
 		return FSCK_CANCELED;
 	}
 
+	if (lgfs2_bcache_sync(sdp) && !opts.no)
+		log_err(_("Error writing cached blocks: %s\n"), strerror(errno));
+	if (lgfs2_rgcache_trim(sdp) && !opts.no) {
+		log_err(_("Error writing resource group bitmaps: %s\n"), strerror(errno));
+		write_error = 1;
+	}
+	stats_bmap_mem(bmap_mem(&nlink1map) + bmap_mem(&clink1map));
+	stats_pass_end();
 	print_pass_duration(p->name, &timer);
 	return 0;
 }
 
+/* Write out and free the bitmaps of all resource groups */
+static int write_rgrps(struct gfs2_sbd *sdp)
+{
+	struct osi_node *n;
+	int error = 0;
+
+	for (n = osi_first(&sdp->rgtree); n; n = osi_next(n)) {
+		if (gfs2_rgrp_relse(sdp, (struct rgrp_tree *)n) != 0)
+			error = -1;
+	}
+	return error;
+}
+
 static void exitlog(int status, void *unused)
 {
 	syslog(LOG_INFO, "exit: %d", status);
 }
 
+/* Make sure cached changes are not lost when exiting early */
+static void exit_bcache(int status, void *sdp)
+{
+	lgfs2_bcache_free(sdp);
+}
+
+/* Runs after exit_bcache() so that the final writes are counted */
+static void exit_iostats(int status, void *p)
+{
+	struct gfs2_sbd *sdp = p;
+
+	if (sdp->iostats == NULL)
+		return;
+	if (opts.iostats && lgfs2_iostats_report(sdp, opts.iostats) != 0)
+		perror(_("Failed to print I/O statistics"));
+	lgfs2_iostats_free(sdp);
+}
+
+/* Runs after exit_bcache() and before exit_iostats() for the same reasons */
+static void exit_stats(int status, void *unused)
+{
+	if (stats_write(status) != 0)
+		perror(_("Failed to write the performance report"));
+}
+
+static void exit_simdev(int status, void *sdp)
+{
+	lgfs2_simdev_free(sdp);
+}
+
+static void exit_metaimg(int status, void *sdp)
+{
+	lgfs2_metaimg_free(sdp);
+}
+
 static void startlog(int argc, char **argv)
 {
 	int i;
@@ -321,13 +451,33 @@ int main(int argc, char **argv)
 	on_exit(exitlog, NULL);
 
 	memset(sdp, 0, sizeof(*sdp));
+	on_exit(exit_iostats, sdp);
+	on_exit(exit_stats, NULL);
+	on_exit(exit_metaimg, sdp);
+	on_exit(exit_simdev, sdp);
+	on_exit(exit_bcache, sdp);
 
 	if ((error = read_cmdline(argc, argv, &opts)))
 		exit(error);
+	if (opts.iostats) {
+		if (lgfs2_iostats_init(sdp) != 0)
+			perror(_("Failed to set up I/O statistics"));
+	}
+	if (stats_init(sdp, opts.stats_file, opts.progress_fd) != 0) {
+		perror(_("Failed to set up the performance report"));
+		exit(FSCK_ERROR);
+	}
+	lgfs2_iostats_phase(sdp, "initialize");
+	stats_pass_start("initialize");
+	if (lgfs2_simdev_init(sdp, getenv("LGFS2_SIMDEV")) != 0) {
+		perror(_("Failed to set up the simulated device"));
+		exit(FSCK_ERROR);
+	}
 	setbuf(stdout, NULL);
 	log_notice( _("Initializing fsck\n"));
 	if ((error = initialize(sdp, force_check, preen, &all_clean)))
 		exit(error);
+	stats_pass_end();
 
 	if (!force_check && all_clean && preen) {
 		log_err( _("%s: clean.\n"), opts.device);
@@ -340,6 +490,8 @@ int main(int argc, char **argv)
 	for (i = 0; passes[i].name; i++)
 		error = fsck_pass(passes + i, sdp);
 
+	lgfs2_iostats_phase(sdp, "finish");
+	stats_pass_start("finish");
 	/* Free up our system inodes */
 	if (!sdp->gfs1)
 		inode_put(&sdp->md.inum);
@@ -361,6 +513,14 @@ int main(int argc, char **argv)
 
 	if (!opts.no && errors_corrected)
 		log_notice( _("Writing changes to disk\n"));
+	if (write_rgrps(sdp) && !opts.no) {
+		log_err(_("Error writing resource group bitmaps: %s\n"), strerror(errno));
+		write_error = 1;
+	}
+	if (lgfs2_bcache_sync(sdp) && !opts.no) {
+		log_err(_("Error writing cached blocks: %s\n"), strerror(errno));
+		write_error = 1;
+	}
 	fsync(sdp->device_fd);
 	link1_destroy(&nlink1map);
 	link1_destroy(&clink1map);
@@ -378,6 +538,8 @@ int main(int argc, char **argv)
 		else
 			error = FSCK_UNCORRECTED;
 	}
+	if (write_error)
+		error = FSCK_ERROR;
 	exit(error);
 }
 #endif /* UNITTESTS */
@@ -21,8 +21,6 @@
 #include "metawalk.h"
 #include "inode_hash.h"
 
-#define COMFORTABLE_BLKS 5242880 /* 20GB in 4K blocks */
-
 /* There are two bitmaps: (1) The "blockmap" that fsck uses to keep track of
    what block type has been discovered, and (2) The rgrp bitmap.  Function
    gfs2_blockmap_set is used to set the former and gfs2_set_bitmap
@@ -680,7 +678,7 @@ static void dir_leaf_reada(struct gfs2_inode *ip, __be64 *tbl, unsigned hsize)
 	}
 	qsort(t, n, sizeof(uint64_t), u64cmp);
 	for (i = 0; i < n; i++)
-		posix_fadvise(sdp->device_fd, t[i], sdp->sd_bsize, POSIX_FADV_WILLNEED);
+		lgfs2_fadvise(sdp, sdp->device_fd, t[i], sdp->sd_bsize, POSIX_FADV_WILLNEED);
 }
 
 /* Checks exhash directory entries */
@@ -708,7 +706,7 @@ int check_leaf_blks(struct gfs2_inode *ip, struct metawalk_fxns *pass)
 	orig_di_blocks = ip->i_blocks;
 
 	/* Turn off system readahead */
-	posix_fadvise(sdp->device_fd, 0, 0, POSIX_FADV_RANDOM);
+	lgfs2_fadvise(sdp, sdp->device_fd, 0, 0, POSIX_FADV_RANDOM);
 
 	/* Readahead */
 	dir_leaf_reada(ip, tbl, hsize);
@@ -717,7 +715,7 @@ int check_leaf_blks(struct gfs2_inode *ip, struct metawalk_fxns *pass)
 		error = pass->check_hash_tbl(ip, tbl, hsize, pass->private);
 		if (error < 0) {
 			free(tbl);
-			posix_fadvise(sdp->device_fd, 0, 0, POSIX_FADV_NORMAL);
+			lgfs2_fadvise(sdp, sdp->device_fd, 0, 0, POSIX_FADV_NORMAL);
 			return error;
 		}
 		/* If hash table changes were made, read it in again. */
@@ -752,7 +750,7 @@ int check_leaf_blks(struct gfs2_inode *ip, struct metawalk_fxns *pass)
 		log_err(_("Directory #%"PRIu64" (0x%"PRIx64") has no valid leaf blocks\n"),
 		        ip->i_num.in_addr, ip->i_num.in_addr);
 		free(tbl);
-		posix_fadvise(sdp->device_fd, 0, 0, POSIX_FADV_NORMAL);
+		lgfs2_fadvise(sdp, sdp->device_fd, 0, 0, POSIX_FADV_NORMAL);
 		return 1;
 	}
 	lindex = 0;
@@ -796,7 +794,7 @@ int check_leaf_blks(struct gfs2_inode *ip, struct metawalk_fxns *pass)
 			struct lgfs2_leaf leaf;
 			if (fsck_abort) {
 				free(tbl);
-				posix_fadvise(sdp->device_fd, 0, 0, POSIX_FADV_NORMAL);
+				lgfs2_fadvise(sdp, sdp->device_fd, 0, 0, POSIX_FADV_NORMAL);
 				return 0;
 			}
 			error = check_leaf(ip, lindex, pass, &leaf_no, &leaf,
@@ -839,7 +837,7 @@ int check_leaf_blks(struct gfs2_inode *ip, struct metawalk_fxns *pass)
 		lindex += ref_count;
 	} /* for every leaf block */
 	free(tbl);
-	posix_fadvise(sdp->device_fd, 0, 0, POSIX_FADV_NORMAL);
+	lgfs2_fadvise(sdp, sdp->device_fd, 0, 0, POSIX_FADV_NORMAL);
 	return 0;
 }
 
@@ -1126,7 +1124,7 @@ static void file_ra(struct gfs2_inode *ip, struct gfs2_buffer_head *bh,
 			block = be64_to_cpu(*p);
 			extlen = block - sblock;
 			if (extlen > 1 && extlen <= maxptrs) {
-				posix_fadvise(sdp->device_fd,
+				lgfs2_fadvise(sdp, sdp->device_fd,
 					      sblock * sdp->sd_bsize,
 					      (extlen + 1) * sdp->sd_bsize,
 					      POSIX_FADV_WILLNEED);
@@ -1152,7 +1150,7 @@ static void file_ra(struct gfs2_inode *ip, struct gfs2_buffer_head *bh,
 		if (extlen && sblock) {
 			if (extlen > 1)
 				extlen--;
-			posix_fadvise(sdp->device_fd, sblock * sdp->sd_bsize,
+			lgfs2_fadvise(sdp, sdp->device_fd, sblock * sdp->sd_bsize,
 				      extlen * sdp->sd_bsize,
 				      POSIX_FADV_WILLNEED);
 			extlen = 0;
@@ -1160,7 +1158,7 @@ static void file_ra(struct gfs2_inode *ip, struct gfs2_buffer_head *bh,
 		}
 	}
 	if (extlen)
-		posix_fadvise(sdp->device_fd, sblock * sdp->sd_bsize,
+		lgfs2_fadvise(sdp, sdp->device_fd, sblock * sdp->sd_bsize,
 			      extlen * sdp->sd_bsize, POSIX_FADV_WILLNEED);
 }
 
@@ -1382,6 +1380,17 @@ static void report_data_error(uint64_t metablock, int offset, uint64_t block,
 		 block, block);
 }
 
+/* The number of pointers from ptr on which point to consecutive blocks */
+static unsigned data_extent_len(const __be64 *ptr, const __be64 *end)
+{
+	uint64_t block = be64_to_cpu(*ptr);
+	unsigned len = 1;
+
+	while (ptr + len < end && be64_to_cpu(ptr[len]) == block + len)
+		len++;
+	return len;
+}
+
 /**
  * check_data - check all data pointers for a given buffer
  *              This does not include "data" blocks that are really
@@ -1416,6 +1425,20 @@ static int metawalk_check_data(struct gfs2_inode *ip, struct metawalk_fxns *pass
 		if (skip_this_pass || fsck_abort)
 			return error;
 		block =  be64_to_cpu(*ptr);
+		if (pass->check_data_extent != NULL) {
+			unsigned len = data_extent_len(ptr, ptr_end);
+			unsigned done = 0;
+
+			if (len > 1)
+				done = pass->check_data_extent(ip, metablock, block, len, pass->private);
+			*blks_checked += done;
+			if (done == len) {
+				ptr += done - 1;
+				continue;
+			}
+			ptr += done;
+			block += done;
+		}
 		/* It's important that we don't call valid_block() and
 		   bypass calling check_data on invalid blocks because that
 		   would defeat the rangecheck_block related functions in
@@ -1500,27 +1523,383 @@ static unsigned int should_check(struct gfs2_buffer_head *bh, unsigned int heigh
 	return gfs2_check_meta(bh->b_data, iblk_type) == 0;
 }
 
+/*
+ * The metadata trees of files other than directories are walked depth first,
+ * checking the data blocks that each bottom level indirect block points to
+ * before moving on to the next one, so only one indirect block per height is
+ * held in memory at a time rather than every indirect block of the file.
+ * Directories still use build_and_check_metalist().
+ */
+struct skipped_ptr {
+	uint64_t parent; /* indirect block holding the pointer */
+	unsigned off; /* offset of the pointer in that block */
+};
+
+struct finished_blk {
+	uint64_t block;
+	unsigned height;
+};
+
+struct metawalk {
+	struct gfs2_inode *ip;
+	struct metawalk_fxns *pass;
+	unsigned height;
+	unsigned *pos; /* offset of the current pointer at each height */
+	int err_height; /* height of the block the walk stopped in, or -1 */
+	int error;
+	int data_error; /* the walk stopped because of a data block */
+	int err_undone; /* the error block's earlier pointers were undone */
+	int hit_error_blk;
+	struct error_block error_blk;
+	uint64_t blks_checked;
+	struct skipped_ptr *skipped; /* pointers check_metalist rejected */
+	unsigned nskipped;
+	struct finished_blk *finished; /* blocks checked by walk_finish() */
+	unsigned nfinished;
+};
+
+static unsigned walk_head_size(struct gfs2_sbd *sdp, unsigned h)
+{
+	if (h == 0)
+		return sizeof(struct gfs2_dinode);
+	if (sdp->gfs1)
+		return sizeof(struct gfs_indirect);
+	return sizeof(struct gfs2_meta_header);
+}
+
+static unsigned walk_max_ptrs(struct gfs2_sbd *sdp, unsigned h)
+{
+	if (h == 0)
+		return sdp->sd_diptrs;
+	if (sdp->gfs1)
+		return (sdp->sd_bsize - sizeof(struct gfs_indirect)) / sizeof(uint64_t);
+	return sdp->sd_inptrs;
+}
+
+static void walk_skip(struct metawalk *w, uint64_t parent, unsigned off)
+{
+	struct skipped_ptr *s;
+
+	s = realloc(w->skipped, (w->nskipped + 1) * sizeof(*s));
+	if (s == NULL) {
+		log_crit(_("Unable to allocate memory while checking inode %"PRIu64" (0x%"PRIx64").\n"),
+		         w->ip->i_num.in_addr, w->ip->i_num.in_addr);
+		exit(FSCK_ERROR);
+	}
+	w->skipped = s;
+	s[w->nskipped].parent = parent;
+	s[w->nskipped].off = off;
+	w->nskipped++;
+}
+
+static void walk_finished(struct metawalk *w, uint64_t block, unsigned h)
+{
+	struct finished_blk *f;
+
+	f = realloc(w->finished, (w->nfinished + 1) * sizeof(*f));
+	if (f == NULL) {
+		log_crit(_("Unable to allocate memory while checking inode %"PRIu64" (0x%"PRIx64").\n"),
+		         w->ip->i_num.in_addr, w->ip->i_num.in_addr);
+		exit(FSCK_ERROR);
+	}
+	w->finished = f;
+	f[w->nfinished].block = block;
+	f[w->nfinished].height = h;
+	w->nfinished++;
+}
+
+static int walk_skipped(struct metawalk *w, uint64_t parent, unsigned off)
+{
+	for (unsigned i = 0; i < w->nskipped; i++)
+		if (w->skipped[i].parent == parent && w->skipped[i].off == off)
+			return 1;
+	return 0;
+}
+
+static void walk_undo(struct metawalk *w, struct gfs2_buffer_head *bh, unsigned h, int on_path);
+
+static void walk_undo_ptr(struct metawalk *w, uint64_t block, unsigned h, int on_path)
+{
+	struct metawalk_fxns *pass = w->pass;
+	struct gfs2_buffer_head *bh;
+	int rc;
+
+	log_err(_("Undoing metadata work for block %"PRIu64" (0x%"PRIx64")\n"), block, block);
+	rc = pass->undo_check_meta(w->ip, block, h, pass->private);
+	if (rc != 0 && h == w->height - 1)
+		return;
+	bh = bread(w->ip->i_sbd, block);
+	walk_undo(w, bh, h, on_path);
+	brelse(bh);
+}
+
+/**
+ * walk_undo - Undo the work walk_meta() did in a block and the tree below it
+ * @on_path: The block is one the walk was in when it stopped, so only undo
+ *           the pointers before the one it stopped at
+ */
+static void walk_undo(struct metawalk *w, struct gfs2_buffer_head *bh, unsigned h, int on_path)
+{
+	struct gfs2_sbd *sdp = w->ip->i_sbd;
+	unsigned end = on_path ? w->pos[h] : sdp->sd_bsize;
+	unsigned off;
+
+	if (w->hit_error_blk || fsck_abort)
+		return;
+	if (h == w->height - 1) {
+		if (!should_check(bh, w->height) || w->pass->undo_check_data == NULL)
+			return;
+		if (undo_check_data(w->ip, w->pass, bh, w->height, &w->error_blk,
+		                    w->data_error ? w->error : 0) > 0) {
+			w->hit_error_blk = 1;
+			log_err("Reached the error block undoing work for inode %"PRIu64" (0x%"PRIx64").\n",
+			        w->ip->i_num.in_addr, w->ip->i_num.in_addr);
+		}
+		return;
+	}
+	if (gfs2_check_meta(bh->b_data, h ? GFS2_METATYPE_IN : GFS2_METATYPE_DI))
+		return;
+	/* The pointers before the error were undone when it was found */
+	if (on_path && h == w->err_height && w->err_undone)
+		return;
+	for (off = walk_head_size(sdp, h); off < end; off += sizeof(uint64_t)) {
+		uint64_t block = be64_to_cpu(*(__be64 *)(bh->b_data + off));
+
+		if (block == 0 || walk_skipped(w, bh->b_blocknr, off))
+			continue;
+		walk_undo_ptr(w, block, h + 1, 0);
+	}
+	if (on_path && (int)h < w->err_height)
+		walk_undo_ptr(w, be64_to_cpu(*(__be64 *)(bh->b_data + end)), h + 1, 1);
+}
+
+/**
+ * walk_finish - Check the indirect blocks after the walk's path, down to the
+ * height it stopped at, which a walk building the tree a height at a time
+ * would have checked before finding the error, so removing the inode frees
+ * them in pass1 as before.
+ * @on_path: The block is one the walk was in when it stopped
+ * Returns: 0 to carry on, or 1 if a check failed and finishing should stop
+ */
+static int walk_finish(struct metawalk *w, struct gfs2_buffer_head *bh, unsigned h, int on_path)
+{
+	struct gfs2_sbd *sdp = w->ip->i_sbd;
+	struct iptr iptr = { .ipt_ip = w->ip, .ipt_bh = bh, .ipt_off = walk_head_size(sdp, h) };
+	struct gfs2_buffer_head *nbh;
+	int error;
+
+	if ((int)h >= w->err_height)
+		return 0;
+	if (gfs2_check_meta(bh->b_data, h ? GFS2_METATYPE_IN : GFS2_METATYPE_DI))
+		return 0;
+	if (on_path) {
+		iptr.ipt_off = w->pos[h];
+		nbh = bread(sdp, iptr_block(iptr));
+		error = walk_finish(w, nbh, h + 1, 1);
+		brelse(nbh);
+		if (error)
+			return error;
+		iptr.ipt_off += sizeof(uint64_t);
+	}
+	for (; iptr.ipt_off < sdp->sd_bsize; iptr.ipt_off += sizeof(uint64_t)) {
+		if (skip_this_pass || fsck_abort)
+			return 1;
+		if (!iptr_block(iptr))
+			continue;
+
+		nbh = NULL;
+		error = do_check_metalist(iptr, h + 1, &nbh, w->pass);
+		if (error == META_ERROR || error == META_SKIP_FURTHER) {
+			if (nbh)
+				brelse(nbh);
+			return 1;
+		}
+		if (error == META_SKIP_ONE) {
+			if (nbh)
+				brelse(nbh);
+			continue;
+		}
+		walk_finished(w, iptr_block(iptr), h + 1);
+		if ((int)h + 1 < w->err_height) {
+			if (!nbh)
+				nbh = bread(sdp, iptr_block(iptr));
+			error = walk_finish(w, nbh, h + 1, 0);
+		}
+		if (nbh)
+			brelse(nbh);
+		if (error)
+			return error;
+	}
+	return 0;
+}
+
+/**
+ * walk_meta - Check the pointers in the block bh at height h and the tree below it
+ * Returns: 0 to carry on with the walk, or the error which stopped it
+ */
+static int walk_meta(struct metawalk *w, struct gfs2_buffer_head *bh, unsigned h)
+{
+	struct gfs2_inode *ip = w->ip;
+	struct gfs2_sbd *sdp = ip->i_sbd;
+	struct metawalk_fxns *pass = w->pass;
+	struct iptr iptr = { .ipt_ip = ip, .ipt_bh = bh, .ipt_off = walk_head_size(sdp, h) };
+	int error = 0;
+
+	w->pos[h] = iptr.ipt_off;
+	if (h == w->height - 1) {
+		if (!should_check(bh, w->height))
+			return 0;
+		if (pass->check_data)
+			error = metawalk_check_data(ip, pass, bh, w->height,
+			                            &w->blks_checked, &w->error_blk);
+		if (pass->big_file_msg && ip->i_blocks > COMFORTABLE_BLKS)
+			pass->big_file_msg(ip, w->blks_checked);
+		if (error) {
+			w->err_height = h;
+			w->data_error = 1;
+		}
+		return error;
+	}
+	if (gfs2_check_meta(bh->b_data, h ? GFS2_METATYPE_IN : GFS2_METATYPE_DI)) {
+		if (!pass->invalid_meta_is_fatal)
+			return 0;
+		w->err_height = h;
+		return META_ERROR;
+	}
+	if (pass->readahead)
+		file_ra(ip, bh, iptr.ipt_off, walk_max_ptrs(sdp, h), h + 1);
+
+	for (; iptr.ipt_off < sdp->sd_bsize; iptr.ipt_off += sizeof(uint64_t)) {
+		struct gfs2_buffer_head *nbh = NULL;
+
+		if (skip_this_pass || fsck_abort)
+			return 0;
+		if (!iptr_block(iptr))
+			continue;
+
+		w->pos[h] = iptr.ipt_off;
+		error = do_check_metalist(iptr, h + 1, &nbh, pass);
+		if (error == META_ERROR || error == META_SKIP_FURTHER) {
+			if (nbh)
+				brelse(nbh);
+			w->err_height = h;
+			w->error_blk.metablk = bh->b_blocknr;
+			w->error_blk.metaoff = iptr.ipt_off;
+			w->error_blk.errblk = iptr_block(iptr);
+			if (pass->undo_check_meta == NULL)
+				return error;
+			log_info(_("Undoing the work we did before the error on block %"PRIu64" (0x%"PRIx64").\n"),
+			         bh->b_blocknr, bh->b_blocknr);
+			walk_undo(w, bh, h, 1);
+			w->err_undone = 1;
+			return error;
+		}
+		if (error == META_SKIP_ONE) {
+			if (nbh)
+				brelse(nbh);
+			walk_skip(w, bh->b_blocknr, iptr.ipt_off);
+			continue;
+		}
+		if (!nbh)
+			nbh = bread(sdp, iptr_block(iptr));
+		error = walk_meta(w, nbh, h + 1);
+		brelse(nbh);
+		if (error)
+			return error;
+	}
+	return 0;
+}
+
+static int check_file_metatree(struct gfs2_inode *ip, struct metawalk_fxns *pass)
+{
+	struct metawalk w = {
+		.ip = ip,
+		.pass = pass,
+		.height = ip->i_height,
+		.pos = alloca(ip->i_height * sizeof(unsigned)),
+		.err_height = -1,
+	};
+	int error;
+
+	if (ip->i_blocks > COMFORTABLE_BLKS)
+		last_reported_fblock = -10000000;
+
+	error = walk_meta(&w, ip->i_bh, 0);
+	if (fsck_abort) {
+		free(w.skipped);
+		return 0;
+	}
+	if ((!error || w.data_error) &&
+	    pass->big_file_msg && ip->i_blocks > COMFORTABLE_BLKS) {
+		log_notice( _("\rLarge file at %"PRIu64" (0x%"PRIx64") - 100 percent "
+			      "complete.                                   "
+			      "\n"),
+			    ip->i_num.in_addr, ip->i_num.in_addr);
+		fflush(stdout);
+	}
+	if (!error)
+		goto out;
+	if (!w.data_error)
+		stack;
+	w.error = error;
+	if (pass->undo_check_meta)
+		walk_finish(&w, ip->i_bh, 0, 1);
+	log_err(_("Error: inode %"PRIu64" (0x%"PRIx64") had unrecoverable errors at "
+	          "metadata block %"PRIu64" (0x%"PRIx64"), offset %d (0x%x), block "
+	          "%"PRIu64" (0x%"PRIx64").\n"),
+	        ip->i_num.in_addr, ip->i_num.in_addr, w.error_blk.metablk, w.error_blk.metablk,
+		w.error_blk.metaoff, w.error_blk.metaoff, w.error_blk.errblk, w.error_blk.errblk);
+	if (!query( _("Remove the invalid inode? (y/n) "))) {
+		log_err(_("Invalid inode not deleted.\n"));
+		goto out;
+	}
+	if (pass->undo_check_meta) {
+		log_err(_("Undoing metadata work for block %"PRIu64" (0x%"PRIx64")\n"),
+		        ip->i_num.in_addr, ip->i_num.in_addr);
+		walk_undo(&w, ip->i_bh, 0, 1);
+		for (unsigned i = 0; i < w.nfinished && !fsck_abort; i++) {
+			uint64_t block = w.finished[i].block;
+
+			log_err(_("Undoing metadata work for block %"PRIu64" (0x%"PRIx64")\n"), block, block);
+			pass->undo_check_meta(ip, block, w.finished[i].height, pass->private);
+		}
+	}
+	/* There may be leftover duplicate records, as in check_metatree() */
+	delete_all_dups(ip);
+	/* Set the dinode as "bad" so it gets deleted */
+	fsck_bitmap_set(ip, ip->i_num.in_addr, "corrupt", GFS2_BLKST_FREE);
+	log_err(_("The corrupt inode was invalidated.\n"));
+out:
+	free(w.skipped);
+	free(w.finished);
+	return error;
+}
+
 /**
  * check_metatree
  * @ip: inode structure in memory
  * @pass: structure passed in from caller to determine the sub-functions
  *
+ * Directories' hash tables are built up a height at a time, other files'
+ * metadata trees are walked depth first by check_file_metatree().
  */
 int check_metatree(struct gfs2_inode *ip, struct metawalk_fxns *pass)
 {
 	unsigned int height = ip->i_height;
 	osi_list_t *metalist = alloca((height + 1) * sizeof(*metalist));
-	osi_list_t *list, *tmp;
+	osi_list_t *list;
 	struct gfs2_buffer_head *bh;
 	unsigned int i;
-	uint64_t blks_checked = 0;
 	int error, rc;
 	int metadata_clean = 0;
 	struct error_block error_blk = {0, 0, 0};
 	int hit_error_blk = 0;
 
-	if (!height && !is_dir(ip, ip->i_sbd->gfs1))
-		return 0;
+	if (!is_dir(ip, ip->i_sbd->gfs1)) {
+		if (!height)
+			return 0;
+		return check_file_metatree(ip, pass);
+	}
 
 	/* metalist has one extra element for directories (see build_and_check_metalist). */
 	for (i = 0; i <= height; i++)
@@ -1534,46 +1913,12 @@ int check_metatree(struct gfs2_inode *ip, struct metawalk_fxns *pass)
 	}
 
 	metadata_clean = 1;
-	/* For directories, we've already checked the "data" blocks which
-	 * comprise the directory hash table, so we perform the directory
-	 * checks and exit. */
-        if (is_dir(ip, ip->i_sbd->gfs1)) {
-		if (!(ip->i_flags & GFS2_DIF_EXHASH))
-			goto out;
-		/* check validity of leaf blocks and leaf chains */
-		error = check_leaf_blks(ip, pass);
-		if (error)
-			goto undo_metalist;
+	/* We've already checked the "data" blocks which comprise the
+	 * directory hash table, so we perform the directory checks and exit. */
+	if (!(ip->i_flags & GFS2_DIF_EXHASH))
 		goto out;
-	}
-
-	/* check data blocks */
-	list = &metalist[height - 1];
-	if (ip->i_blocks > COMFORTABLE_BLKS)
-		last_reported_fblock = -10000000;
-
-	for (tmp = list->next; !error && tmp != list; tmp = tmp->next) {
-		if (fsck_abort) {
-			free_metalist(ip, metalist);
-			return 0;
-		}
-		bh = osi_list_entry(tmp, struct gfs2_buffer_head, b_altlist);
-		if (!should_check(bh, height))
-			continue;
-
-		if (pass->check_data)
-			error = metawalk_check_data(ip, pass, bh, height,
-					   &blks_checked, &error_blk);
-		if (pass->big_file_msg && ip->i_blocks > COMFORTABLE_BLKS)
-			pass->big_file_msg(ip, blks_checked);
-	}
-	if (pass->big_file_msg && ip->i_blocks > COMFORTABLE_BLKS) {
-		log_notice( _("\rLarge file at %"PRIu64" (0x%"PRIx64") - 100 percent "
-			      "complete.                                   "
-			      "\n"),
-			    ip->i_num.in_addr, ip->i_num.in_addr);
-		fflush(stdout);
-	}
+	/* check validity of leaf blocks and leaf chains */
+	error = check_leaf_blks(ip, pass);
 undo_metalist:
 	if (!error)
 		goto out;
@@ -4,6 +4,8 @@
 #define DIR_LINEAR 1
 #define DIR_EXHASH 2
 
+#define COMFORTABLE_BLKS 5242880 /* 20GB in 4K blocks */
+
 #include "util.h"
 
 struct metawalk_fxns;
@@ -97,6 +99,12 @@ struct metawalk_fxns {
 	int (*check_data) (struct gfs2_inode *ip, uint64_t metablock,
 			   uint64_t block, void *private,
 			   struct gfs2_buffer_head *bh, __be64 *ptr);
+	/* check_data_extent: optional, checks the len data blocks from block,
+	   which consecutive pointers in metablock refer to, in one go.
+	   returns: how many blocks from the start of the extent were checked.
+	            The rest are passed to check_data one at a time. */
+	unsigned (*check_data_extent) (struct gfs2_inode *ip, uint64_t metablock,
+				       uint64_t block, unsigned len, void *private);
 	int (*check_eattr_indir) (struct gfs2_inode *ip, uint64_t block,
 				  uint64_t parent,
 				  struct gfs2_buffer_head **bh, void *private);
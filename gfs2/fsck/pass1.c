@@ -18,6 +18,7 @@
 #include <sys/ioctl.h>
 #include <inttypes.h>
 #include <libintl.h>
+#include <pthread.h>
 #define _(String) gettext(String)
 
 #include <logging.h>
@@ -28,6 +29,7 @@
 #include "link.h"
 #include "metawalk.h"
 #include "fs_recovery.h"
+#include "stats.h"
 
 static struct special_blocks gfs1_rindex_blks;
 static struct gfs2_bmap *bl = NULL;
@@ -46,6 +48,8 @@ static int undo_check_metalist(struct gfs2_inode *ip, uint64_t block,
 static int pass1_check_data(struct gfs2_inode *ip, uint64_t metablock,
 		      uint64_t block, void *private,
 		      struct gfs2_buffer_head *bh, __be64 *ptr);
+static unsigned pass1_check_data_extent(struct gfs2_inode *ip, uint64_t metablock,
+					uint64_t block, unsigned len, void *private);
 static int undo_check_data(struct gfs2_inode *ip, uint64_t block,
 			   void *private);
 static int check_eattr_indir(struct gfs2_inode *ip, uint64_t indirect,
@@ -75,7 +79,6 @@ static int delete_block(struct gfs2_inode *ip, uint64_t block,
 
 static int gfs2_blockmap_set(struct gfs2_bmap *bmap, uint64_t bblock, int mark)
 {
-	static unsigned char *byte;
 	static uint64_t b;
 
 	if (!bmap)
@@ -83,11 +86,29 @@ static int gfs2_blockmap_set(struct gfs2_bmap *bmap, uint64_t bblock, int mark)
 	if (bblock > bmap->size)
 		return -1;
 
-	byte = bmap->map + BLOCKMAP_SIZE2(bblock);
 	b = BLOCKMAP_BYTE_OFFSET2(bblock);
-	*byte &= ~(BLOCKMAP_MASK2 << b);
-	*byte |= (mark & BLOCKMAP_MASK2) << b;
-	return 0;
+	return bmap_update(bmap, BLOCKMAP_SIZE2(bblock), BLOCKMAP_MASK2 << b,
+	                   (mark & BLOCKMAP_MASK2) << b);
+}
+
+/* Mark len blocks from bblock, a byte at a time where possible. Returns the
+   number of blocks marked. */
+static unsigned gfs2_blockmap_set_extent(struct gfs2_bmap *bmap, uint64_t bblock,
+					 unsigned len, int mark)
+{
+	unsigned char val = (mark & BLOCKMAP_MASK2) * 0x55;
+	unsigned n = 0;
+
+	for (; n < len && (bblock + n) % 4 != 0; n++)
+		if (gfs2_blockmap_set(bmap, bblock + n, mark))
+			return n;
+	for (; bmap && len - n >= 4; n += 4)
+		if (bmap_update(bmap, BLOCKMAP_SIZE2(bblock + n), 0xff, val))
+			return n;
+	for (; n < len; n++)
+		if (gfs2_blockmap_set(bmap, bblock + n, mark))
+			return n;
+	return n;
 }
 
 /*
@@ -103,6 +124,8 @@ static int _fsck_blockmap_set(struct gfs2_inode *ip, uint64_t bblock,
 	if (error)
 		return error;
 
+	if (mark != GFS2_BLKST_FREE)
+		owner_map_add(&owner_map, bblock, ip->i_num.in_addr);
 	return gfs2_blockmap_set(bl, bblock, mark);
 }
 
@@ -169,6 +192,7 @@ static struct metawalk_fxns pass1_fxns = {
 	.check_leaf = p1check_leaf,
 	.check_metalist = pass1_check_metalist,
 	.check_data = pass1_check_data,
+	.check_data_extent = pass1_check_data_extent,
 	.check_eattr_indir = check_eattr_indir,
 	.check_eattr_leaf = check_eattr_leaf,
 	.check_dentry = NULL,
@@ -406,6 +430,8 @@ static int undo_reference(struct gfs2_inode *ip, uint64_t block, int meta,
 
 	if (meta)
 		bc->indir_count--;
+	else
+		bc->data_count--;
 	dt = dupfind(block);
 	if (dt) {
 		/* remove all duplicate reference structures from this inode */
@@ -602,6 +628,122 @@ static int pass1_check_data(struct gfs2_inode *ip, uint64_t metablock,
 	return 0;
 }
 
+/* The number of blocks from block on, up to len, which are free in the blockmap */
+static unsigned blockmap_free_run(struct gfs2_bmap *bmap, uint64_t block, unsigned len)
+{
+	unsigned n = 0;
+
+	while (n < len) {
+		if (len - n >= 32 && blockmap_has_word(bmap, block + n)) {
+			uint64_t word = blockmap_word(bmap, block + n);
+
+			if (word != 0)
+				return n + __builtin_ctzll(word) / GFS2_BIT_SIZE;
+			n += 32;
+			continue;
+		}
+		if (block_type(bmap, block + n) != GFS2_BLKST_FREE)
+			break;
+		n++;
+	}
+	return n;
+}
+
+/* The number of blocks from block on, up to len, which the rgrp bitmap says
+   are data. The blocks must all be in the rgrp's data area. */
+static unsigned rgrp_used_run(struct rgrp_tree *rgd, uint64_t block, unsigned len)
+{
+	uint64_t rel = block - rgd->rt_data0;
+	unsigned n = 0;
+
+	for (unsigned i = 0; i < rgd->rt_length && n < len; i++) {
+		struct gfs2_bitmap *bi = &rgd->bits[i];
+		uint64_t first = (uint64_t)bi->bi_start * GFS2_NBBY;
+		uint64_t end = first + (uint64_t)bi->bi_len * GFS2_NBBY;
+		const unsigned char *buf = (unsigned char *)bi->bi_data + bi->bi_offset;
+
+		while (n < len && rel + n < end) {
+			uint64_t e = rel + n - first;
+
+			if (e % GFS2_NBBY == 0 && len - n >= GFS2_NBBY &&
+			    buf[e / GFS2_NBBY] == 0x55) {
+				n += GFS2_NBBY;
+				continue;
+			}
+			if (((buf[e / GFS2_NBBY] >> (e % GFS2_NBBY * GFS2_BIT_SIZE)) &
+			     GFS2_BIT_MASK) != GFS2_BLKST_USED)
+				return n;
+			n++;
+		}
+	}
+	return n;
+}
+
+/* The number of blocks from block on, up to len and within one rgrp's data area,
+   which are data in the rgrp bitmap and free in the blockmap. *rgdp is a hint
+   which is updated to the rgrp the blocks are in. */
+static unsigned unclaimed_data_run(struct gfs2_sbd *sdp, struct rgrp_tree **rgdp,
+                                   uint64_t block, unsigned len)
+{
+	struct rgrp_tree *rgd = *rgdp;
+	uint64_t data_end;
+	unsigned n;
+
+	if (rgd == NULL || !rgrp_contains_block(rgd, block)) {
+		rgd = gfs2_blk2rgrpd(sdp, block);
+		if (rgd == NULL)
+			return 0;
+		*rgdp = rgd;
+	}
+	data_end = rgd->rt_data0 + rgd->rt_data;
+	if (block < rgd->rt_data0 || lgfs2_rgrp_load(rgd) != 0)
+		return 0;
+	if (block + len > data_end)
+		len = data_end - block;
+
+	n = rgrp_used_run(rgd, block, len);
+	return blockmap_free_run(bl, block, n);
+}
+
+/* Mark a run of unclaimed data blocks as belonging to ip */
+static unsigned blockmap_set_data_run(struct gfs2_inode *ip, uint64_t block, unsigned len)
+{
+	unsigned n = gfs2_blockmap_set_extent(bl, block, len, GFS2_BLKST_USED);
+
+	for (unsigned i = 0; i < n; i++)
+		owner_map_add(&owner_map, block + i, ip->i_num.in_addr);
+	return n;
+}
+
+/*
+ * pass1_check_data_extent - check a run of contiguous data blocks in one go
+ *
+ * A block which is free in the blockmap and already data in the rgrp bitmap
+ * needs nothing from pass1_check_data() beyond being counted and marked, so
+ * the longest run of such blocks at the start of the extent is handled here,
+ * a word or byte of the maps at a time. Duplicates, bitmap fixes and gfs1's
+ * special cases are left to pass1_check_data().
+ */
+static unsigned pass1_check_data_extent(struct gfs2_inode *ip, uint64_t metablock,
+					uint64_t block, unsigned len, void *private)
+{
+	struct block_count *bc = (struct block_count *)private;
+	struct gfs2_sbd *sdp = ip->i_sbd;
+	struct rgrp_tree *rgd = ip->i_rgd;
+	unsigned n;
+
+	/* Keep the block by block debug output */
+	if (print_level >= MSG_DEBUG)
+		return 0;
+	if (sdp->gfs1 && (ip == sdp->md.riinode || ip->i_flags & GFS2_DIF_JDATA))
+		return 0;
+
+	n = unclaimed_data_run(sdp, &rgd, block, len);
+	n = blockmap_set_data_run(ip, block, n);
+	bc->data_count += n;
+	return n;
+}
+
 static int ask_remove_inode_eattr(struct gfs2_inode *ip,
 				  struct block_count *bc)
 {
@@ -1340,6 +1482,11 @@ static int handle_ip(struct gfs2_sbd *sdp, struct gfs2_inode *ip)
 	if (fsck_abort)
 		return 0;
 
+	/* If the inode was removed for its errors, it has no block count left
+	   to fix. */
+	if (error && lgfs2_get_bitmap(sdp, ip->i_num.in_addr, NULL) == GFS2_BLKST_FREE)
+		return 0;
+
 	if (!error) {
 		error = check_inode_eattr(ip, &pass1_fxns);
 
@@ -1691,12 +1838,567 @@ static int check_system_inodes(struct gfs2_sbd *sdp)
 	return 0;
 }
 
-static int pass1_process_bitmap(struct gfs2_sbd *sdp, struct rgrp_tree *rgd, uint64_t *ibuf, unsigned n)
+/*
+ * Read-ahead for pass1. The bitmaps are scanned ahead of the block being
+ * processed, across resource group boundaries, and the dinode blocks found are
+ * queued on an asynchronous reader, or handed to the worker threads below. As
+ * the rgrps are processed in address order the queue is in ascending block
+ * order, so blocks which turn out not to be needed can simply be dropped when a
+ * later block is asked for. Blocks which become dinodes after they were scanned
+ * are read synchronously instead.
+ */
+struct pass1_pool;
+
+struct pass1_ra {
+	struct lgfs2_areader *ar;
+	struct pass1_pool *pool;
+	struct osi_node *rgn; /* Next rgrp to be scanned */
+	unsigned bitmap;      /* Next bitmap in rgn to be scanned */
+	uint64_t *blocks;     /* Results of the last scan */
+	unsigned count;
+	unsigned pos;         /* Next block in blocks to be queued */
+};
+
+/* Get the next dinode block from the scan without moving past it */
+static int pass1_ra_peek(struct pass1_ra *ra, uint64_t *block)
+{
+	while (ra->pos == ra->count) {
+		struct rgrp_tree *rgd;
+
+		if (ra->rgn == NULL)
+			return -1;
+		rgd = (struct rgrp_tree *)ra->rgn;
+		ra->count = lgfs2_bm_scan(rgd, ra->bitmap, ra->blocks, GFS2_BLKST_DINODE);
+		ra->pos = 0;
+		if (++ra->bitmap == rgd->rt_length) {
+			ra->bitmap = 0;
+			ra->rgn = osi_next(ra->rgn);
+		}
+	}
+	*block = ra->blocks[ra->pos];
+	return 0;
+}
+
+static void pass1_ra_fill(struct pass1_ra *ra)
+{
+	uint64_t block;
+
+	while (pass1_ra_peek(ra, &block) == 0 && lgfs2_areader_submit(ra->ar, block) == 0)
+		ra->pos++;
+}
+
+static struct gfs2_buffer_head *pass1_ra_get(struct pass1_ra *ra, uint64_t block)
+{
+	struct gfs2_buffer_head *bh = NULL;
+	uint64_t next;
+
+	while (lgfs2_areader_peek(ra->ar, &next) == 0 && next <= block) {
+		bh = lgfs2_areader_next(ra->ar);
+		if (next == block) {
+			if (bh == NULL)
+				log_err(_("Error reading block %"PRIu64" (0x%"PRIx64"), retrying: %s\n"),
+				        block, block, strerror(errno));
+			break;
+		}
+		if (bh != NULL)
+			brelse(bh);
+		bh = NULL;
+	}
+	pass1_ra_fill(ra);
+	return bh;
+}
+
+/*
+ * Worker threads for pass1 (-j). The dinodes found by the scan are handed out
+ * in batches. A worker reads each dinode and, if nothing about it needs
+ * handle_di()'s attention, walks its metadata tree and collects the blocks it
+ * references. Workers change nothing: the main thread takes the results in
+ * block order, checks the references against the blockmap and the rgrp bitmaps
+ * and marks them itself, so the blockmap, the inode trees and the output are
+ * the same as without -j. Anything out of the ordinary goes to handle_di().
+ *
+ * Workers read straight from the device, so the block cache is synced before a
+ * batch is queued and the results of a batch queued before blocks were last
+ * written are not used.
+ */
+#define PASS1_JOB_INODES (64)
+
+struct pass1_extent {
+	uint64_t start;
+	unsigned len;
+};
+
+struct pass1_refs {
+	struct pass1_extent *ext;
+	unsigned count;
+	unsigned size;
+};
+
+struct pass1_inode {
+	uint64_t block;
+	struct gfs2_buffer_head *bh; /* NULL if the block couldn't be read */
+	int clean;                   /* Nothing was found for handle_di() to fix */
+	struct pass1_refs meta;      /* Indirect blocks */
+	struct pass1_refs data;
+};
+
+struct pass1_job {
+	struct pass1_inode inodes[PASS1_JOB_INODES];
+	unsigned count;
+	unsigned next;   /* Next inode for the main thread to look at */
+	uint64_t blkgen; /* sdp->blkgen when the job was queued */
+	int done;
+};
+
+struct pass1_pool {
+	struct gfs2_sbd *sdp;
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	pthread_cond_t done;
+	pthread_t *threads;
+	unsigned nthreads;
+	struct pass1_job *jobs;
+	unsigned depth;
+	unsigned head;   /* Job the main thread is taking results from */
+	unsigned issue;  /* Next job for a worker to pick up */
+	unsigned tail;   /* Next free job slot */
+	uint64_t synced; /* sdp->blkgen when the block cache was last synced */
+	int stop;
+};
+
+static int pass1_refs_add(struct pass1_refs *r, uint64_t block)
+{
+	struct pass1_extent *e;
+
+	if (r->count > 0) {
+		e = &r->ext[r->count - 1];
+		if (e->start + e->len == block) {
+			e->len++;
+			return 0;
+		}
+	}
+	if (r->count == r->size) {
+		unsigned size = r->size ? r->size * 2 : 16;
+
+		e = realloc(r->ext, size * sizeof(*e));
+		if (e == NULL)
+			return -1;
+		r->ext = e;
+		r->size = size;
+	}
+	r->ext[r->count].start = block;
+	r->ext[r->count].len = 1;
+	r->count++;
+	return 0;
+}
+
+static uint64_t pass1_refs_blocks(const struct pass1_refs *r)
+{
+	uint64_t n = 0;
+
+	for (unsigned i = 0; i < r->count; i++)
+		n += r->ext[i].len;
+	return n;
+}
+
+static int extent_cmp(const void *a, const void *b)
+{
+	const struct pass1_extent *x = a;
+	const struct pass1_extent *y = b;
+
+	if (x->start < y->start)
+		return -1;
+	return x->start > y->start;
+}
+
+/* Whether the dinode references any block twice, or itself */
+static int pass1_refs_overlap(const struct pass1_inode *pi)
+{
+	unsigned n = 1 + pi->meta.count + pi->data.count;
+	struct pass1_extent *all = malloc(n * sizeof(*all));
+	int ret = 0;
+
+	if (all == NULL)
+		return 1;
+	all[0].start = pi->block;
+	all[0].len = 1;
+	if (pi->meta.count > 0)
+		memcpy(all + 1, pi->meta.ext, pi->meta.count * sizeof(*all));
+	if (pi->data.count > 0)
+		memcpy(all + 1 + pi->meta.count, pi->data.ext, pi->data.count * sizeof(*all));
+	qsort(all, n, sizeof(*all), extent_cmp);
+	for (unsigned i = 1; i < n && !ret; i++)
+		ret = all[i - 1].start + all[i - 1].len > all[i].start;
+	free(all);
+	return ret;
+}
+
+/* Collect the blocks referenced from height h of a file's metadata tree. bufs
+   has room for a block at each height below the dinode. */
+static int pass1_walk(struct gfs2_sbd *sdp, struct pass1_inode *pi, const char *buf,
+                      unsigned h, unsigned height, char *bufs)
+{
+	unsigned off = h ? sizeof(struct gfs2_meta_header) : sizeof(struct gfs2_dinode);
+	char *nbuf = bufs + h * sdp->sd_bsize;
+
+	for (; off < sdp->sd_bsize; off += sizeof(uint64_t)) {
+		uint64_t block = be64_to_cpu(*(__be64 *)(buf + off));
+
+		if (block == 0)
+			continue;
+		if (block <= LGFS2_SB_ADDR(sdp) || block > sdp->fssize)
+			return -1;
+		if (h == height - 1) {
+			if (pass1_refs_add(&pi->data, block))
+				return -1;
+			continue;
+		}
+		if (pass1_refs_add(&pi->meta, block) ||
+		    lgfs2_pread(sdp, sdp->device_fd, nbuf, sdp->sd_bsize,
+		                block * sdp->sd_bsize) != sdp->sd_bsize ||
+		    gfs2_check_meta(nbuf, GFS2_METATYPE_IN) ||
+		    pass1_walk(sdp, pi, nbuf, h + 1, height, bufs))
+			return -1;
+	}
+	return 0;
+}
+
+/* Whether handle_di() would find nothing to fix in the dinode itself. Only the
+   simple cases are dealt with by the workers. */
+static int pass1_dinode_sane(struct gfs2_sbd *sdp, const struct gfs2_inode *di, uint64_t block)
+{
+	switch (di->i_mode & S_IFMT) {
+	case S_IFDIR:
+		if (di->i_height > 0 || di->i_flags & GFS2_DIF_EXHASH)
+			return 0;
+		break;
+	case S_IFREG:
+	case S_IFLNK:
+	case S_IFBLK:
+	case S_IFCHR:
+	case S_IFIFO:
+	case S_IFSOCK:
+		break;
+	default:
+		return 0;
+	}
+	if (di->i_num.in_addr != block || di->i_eattr != 0 || di->i_flags & GFS2_DIF_JDATA)
+		return 0;
+	if (!(di->i_flags & GFS2_DIF_SYSTEM) &&
+	    (di->i_goal_meta <= LGFS2_SB_ADDR(sdp) || di->i_goal_meta > sdp->fssize))
+		return 0;
+	return di->i_height <= sdp->sd_max_height && di->i_blocks <= COMFORTABLE_BLKS;
+}
+
+static void pass1_read_inode(struct gfs2_sbd *sdp, struct pass1_inode *pi, char *bufs)
+{
+	struct gfs2_inode di = {0};
+	struct gfs2_buffer_head *bh;
+
+	pi->bh = NULL;
+	pi->clean = 0;
+	pi->meta.count = 0;
+	pi->data.count = 0;
+	bh = bget(sdp, pi->block);
+	if (bh == NULL)
+		return;
+	if (lgfs2_pread(sdp, sdp->device_fd, bh->b_data, sdp->sd_bsize,
+	                pi->block * sdp->sd_bsize) != sdp->sd_bsize) {
+		brelse(bh);
+		return;
+	}
+	pi->bh = bh;
+	if (sdp->gfs1 || bufs == NULL || gfs2_check_meta(bh->b_data, GFS2_METATYPE_DI))
+		return;
+	lgfs2_dinode_in(&di, bh->b_data);
+	if (!pass1_dinode_sane(sdp, &di, pi->block))
+		return;
+	if (di.i_height > 0 && pass1_walk(sdp, pi, bh->b_data, 0, di.i_height, bufs))
+		return;
+	if (di.i_blocks != 1 + pass1_refs_blocks(&pi->meta) + pass1_refs_blocks(&pi->data))
+		return;
+	pi->clean = !pass1_refs_overlap(pi);
+}
+
+static void *pass1_worker(void *arg)
+{
+	struct pass1_pool *pp = arg;
+	struct gfs2_sbd *sdp = pp->sdp;
+	char *bufs = malloc(sdp->sd_max_height * sdp->sd_bsize);
+
+	pthread_mutex_lock(&pp->lock);
+	for (;;) {
+		struct pass1_job *job;
+
+		while (!pp->stop && pp->issue == pp->tail)
+			pthread_cond_wait(&pp->work, &pp->lock);
+		if (pp->stop)
+			break;
+		job = &pp->jobs[pp->issue++ % pp->depth];
+		pthread_mutex_unlock(&pp->lock);
+
+		for (unsigned i = 0; i < job->count; i++)
+			pass1_read_inode(sdp, &job->inodes[i], bufs);
+
+		pthread_mutex_lock(&pp->lock);
+		job->done = 1;
+		pthread_cond_broadcast(&pp->done);
+	}
+	pthread_mutex_unlock(&pp->lock);
+	free(bufs);
+	return NULL;
+}
+
+static void pass1_job_wait(struct pass1_pool *pp, struct pass1_job *job)
+{
+	pthread_mutex_lock(&pp->lock);
+	while (!job->done)
+		pthread_cond_wait(&pp->done, &pp->lock);
+	pthread_mutex_unlock(&pp->lock);
+}
+
+/* Queue batches of the dinodes found by the scan */
+static void pass1_pool_fill(struct pass1_ra *ra)
+{
+	struct pass1_pool *pp = ra->pool;
+	struct gfs2_sbd *sdp = pp->sdp;
+	uint64_t block;
+
+	while (pp->tail - pp->head < pp->depth && pass1_ra_peek(ra, &block) == 0) {
+		struct pass1_job *job = &pp->jobs[pp->tail % pp->depth];
+
+		if (sdp->blkgen != pp->synced) {
+			if (lgfs2_bcache_sync(sdp) != 0)
+				return;
+			pp->synced = sdp->blkgen;
+		}
+		job->count = 0;
+		job->next = 0;
+		job->done = 0;
+		job->blkgen = sdp->blkgen;
+		while (job->count < PASS1_JOB_INODES && pass1_ra_peek(ra, &block) == 0) {
+			ra->pos++;
+			if (fsck_system_inode(sdp, block) == NULL)
+				job->inodes[job->count++].block = block;
+		}
+		pthread_mutex_lock(&pp->lock);
+		pp->tail++;
+		pthread_cond_signal(&pp->work);
+		pthread_mutex_unlock(&pp->lock);
+	}
+}
+
+static void pass1_job_clear(struct pass1_job *job)
+{
+	for (unsigned i = 0; i < job->count; i++) {
+		struct pass1_inode *pi = &job->inodes[i];
+
+		if (pi->bh != NULL)
+			brelse(pi->bh);
+		pi->bh = NULL;
+	}
+	job->count = 0;
+}
+
+/*
+ * Get the worker's results for a dinode block. Returns NULL if the block wasn't
+ * queued or blocks have been written since it was. The caller takes over the
+ * buffer in the results, which stay valid until the next call.
+ */
+static struct pass1_inode *pass1_pool_get(struct pass1_ra *ra, uint64_t block)
+{
+	struct pass1_pool *pp = ra->pool;
+
+	for (;;) {
+		struct pass1_job *job;
+
+		if (pp->head == pp->tail) {
+			pass1_pool_fill(ra);
+			if (pp->head == pp->tail)
+				return NULL;
+		}
+		job = &pp->jobs[pp->head % pp->depth];
+		while (job->next < job->count && job->inodes[job->next].block < block)
+			job->next++;
+		if (job->next < job->count) {
+			struct pass1_inode *pi = &job->inodes[job->next];
+
+			if (pi->block > block)
+				return NULL;
+			pass1_job_wait(pp, job);
+			job->next++;
+			if (job->blkgen != pp->sdp->blkgen)
+				return NULL;
+			return pi;
+		}
+		pass1_job_wait(pp, job);
+		pass1_job_clear(job);
+		pp->head++;
+		pass1_pool_fill(ra);
+	}
+}
+
+static void pass1_pool_free(struct pass1_pool **ppp)
+{
+	struct pass1_pool *pp = *ppp;
+
+	if (pp == NULL)
+		return;
+	pthread_mutex_lock(&pp->lock);
+	pp->stop = 1;
+	pthread_cond_broadcast(&pp->work);
+	pthread_mutex_unlock(&pp->lock);
+	for (unsigned i = 0; i < pp->nthreads; i++)
+		pthread_join(pp->threads[i], NULL);
+	for (unsigned j = pp->head; j != pp->issue; j++)
+		pass1_job_clear(&pp->jobs[j % pp->depth]);
+	for (unsigned j = 0; j < pp->depth; j++) {
+		for (unsigned i = 0; i < PASS1_JOB_INODES; i++) {
+			free(pp->jobs[j].inodes[i].meta.ext);
+			free(pp->jobs[j].inodes[i].data.ext);
+		}
+	}
+	pthread_cond_destroy(&pp->done);
+	pthread_cond_destroy(&pp->work);
+	pthread_mutex_destroy(&pp->lock);
+	free(pp->threads);
+	free(pp->jobs);
+	free(pp);
+	*ppp = NULL;
+}
+
+static struct pass1_pool *pass1_pool_init(struct gfs2_sbd *sdp, unsigned nthreads)
+{
+	struct pass1_pool *pp;
+
+	if (lgfs2_bcache_sync(sdp) != 0)
+		return NULL;
+	pp = calloc(1, sizeof(*pp));
+	if (pp == NULL)
+		return NULL;
+	pp->sdp = sdp;
+	pp->synced = sdp->blkgen;
+	pp->depth = nthreads * 4;
+	pp->jobs = calloc(pp->depth, sizeof(*pp->jobs));
+	pp->threads = calloc(nthreads, sizeof(*pp->threads));
+	if (pp->jobs == NULL || pp->threads == NULL) {
+		free(pp->jobs);
+		free(pp->threads);
+		free(pp);
+		return NULL;
+	}
+	pthread_mutex_init(&pp->lock, NULL);
+	pthread_cond_init(&pp->work, NULL);
+	pthread_cond_init(&pp->done, NULL);
+	for (unsigned i = 0; i < nthreads; i++) {
+		if (pthread_create(&pp->threads[i], NULL, pass1_worker, pp) != 0)
+			break;
+		pp->nthreads++;
+	}
+	if (pp->nthreads == 0)
+		pass1_pool_free(&pp);
+	return pp;
+}
+
+static int pass1_ra_init(struct gfs2_sbd *sdp, struct pass1_ra *ra)
+{
+	unsigned depth = opts.qdepth;
+
+	memset(ra, 0, sizeof(*ra));
+	if (depth <= 1 && opts.threads <= 1)
+		return 0;
+
+	ra->blocks = malloc(sdp->sd_bsize * GFS2_NBBY * sizeof(uint64_t));
+	if (ra->blocks == NULL)
+		return -1;
+	if (opts.threads > 1)
+		ra->pool = pass1_pool_init(sdp, opts.threads);
+	else
+		ra->ar = lgfs2_areader_init(sdp, depth, depth);
+	if (ra->pool == NULL && ra->ar == NULL) {
+		free(ra->blocks);
+		ra->blocks = NULL;
+		return -1;
+	}
+	ra->rgn = osi_first(&sdp->rgtree);
+	if (ra->pool != NULL) {
+		log_info(_("Checking inodes on %u threads.\n"), ra->pool->nthreads);
+		pass1_pool_fill(ra);
+	} else {
+		log_info(_("Reading up to %u inodes ahead.\n"), depth);
+		pass1_ra_fill(ra);
+	}
+	return 0;
+}
+
+static void pass1_ra_free(struct pass1_ra *ra)
+{
+	pass1_pool_free(&ra->pool);
+	lgfs2_areader_free(&ra->ar);
+	free(ra->blocks);
+	ra->blocks = NULL;
+}
+
+/*
+ * pass1_apply - account for a dinode which a worker found nothing wrong with
+ *
+ * As long as none of the blocks it references has been claimed yet and the
+ * rgrp bitmaps agree that they are in use, handle_di() would only mark the
+ * dinode and its blocks, so that is done here instead. Returns 1 if the dinode
+ * was dealt with, 0 if it needs handle_di() and -1 on error.
+ */
+static int pass1_apply(struct gfs2_sbd *sdp, struct rgrp_tree *rgd,
+                       struct gfs2_buffer_head *bh, const struct pass1_inode *pi)
+{
+	struct rgrp_tree *xrgd = rgd;
+	struct gfs2_inode *ip;
+	int error = 1;
+
+	/* Keep the block by block debug output */
+	if (!pi->clean || print_level >= MSG_DEBUG)
+		return 0;
+	for (unsigned i = 0; i < pi->meta.count; i++) {
+		const struct pass1_extent *e = &pi->meta.ext[i];
+
+		if (unclaimed_data_run(sdp, &xrgd, e->start, e->len) != e->len)
+			return 0;
+	}
+	for (unsigned i = 0; i < pi->data.count; i++) {
+		const struct pass1_extent *e = &pi->data.ext[i];
+
+		if (unclaimed_data_run(sdp, &xrgd, e->start, e->len) != e->len)
+			return 0;
+	}
+	ip = fsck_inode_get(sdp, rgd, bh);
+	if (ip == NULL)
+		return 0;
+	if (set_ip_blockmap(ip) || set_di_nlink(ip)) {
+		stack;
+		error = -1;
+		goto out;
+	}
+	for (unsigned i = 0; i < pi->meta.count; i++) {
+		const struct pass1_extent *e = &pi->meta.ext[i];
+
+		for (uint64_t b = e->start; b < e->start + e->len; b++)
+			fsck_blockmap_set(ip, b, _("indirect"), GFS2_BLKST_USED);
+	}
+	for (unsigned i = 0; i < pi->data.count; i++)
+		blockmap_set_data_run(ip, pi->data.ext[i].start, pi->data.ext[i].len);
+out:
+	fsck_inode_put(&ip);
+	return error;
+}
+
+static int pass1_process_bitmap(struct gfs2_sbd *sdp, struct rgrp_tree *rgd, uint64_t *ibuf, unsigned n,
+                                struct pass1_ra *ra)
 {
 	struct gfs2_buffer_head *bh;
+	struct pass1_inode *pi;
 	unsigned i;
 	uint64_t block;
 	struct gfs2_inode *ip;
+	int error;
 	int q;
 	/* Readahead numbers arrived at by experiment */
 	unsigned rawin = 50;
@@ -1709,8 +2411,8 @@ static int pass1_process_bitmap(struct gfs2_sbd *sdp, struct rgrp_tree *rgd, uin
 
 		block = ibuf[i];
 
-		if (r++ == rawin) {
-			posix_fadvise(sdp->device_fd, block * sdp->sd_bsize, ralen, POSIX_FADV_WILLNEED);
+		if (ra->ar == NULL && ra->pool == NULL && r++ == rawin) {
+			lgfs2_fadvise(sdp, sdp->device_fd, block * sdp->sd_bsize, ralen, POSIX_FADV_WILLNEED);
 			r = 0;
 		}
 
@@ -1723,6 +2425,7 @@ static int pass1_process_bitmap(struct gfs2_sbd *sdp, struct rgrp_tree *rgd, uin
 			continue;
 		}
 		warm_fuzzy_stuff(block);
+		blocks_visited++;
 
 		if (fsck_abort) { /* if asked to abort */
 			gfs2_special_free(&gfs1_rindex_blks);
@@ -1741,11 +2444,24 @@ static int pass1_process_bitmap(struct gfs2_sbd *sdp, struct rgrp_tree *rgd, uin
 			continue;
 		}
 
-		bh = bread(sdp, block);
+		bh = NULL;
+		pi = NULL;
+		if (ra->pool != NULL) {
+			pi = pass1_pool_get(ra, block);
+			if (pi != NULL) {
+				bh = pi->bh;
+				pi->bh = NULL;
+			}
+		} else if (ra->ar != NULL)
+			bh = pass1_ra_get(ra, block);
+		if (bh == NULL)
+			bh = bread(sdp, block);
 
 		is_inode = 0;
-		if (gfs2_check_meta(bh->b_data, GFS2_METATYPE_DI) == 0)
+		if (gfs2_check_meta(bh->b_data, GFS2_METATYPE_DI) == 0) {
 			is_inode = 1;
+			inodes_visited++;
+		}
 
 		check_magic = ((struct gfs2_meta_header *)
 			       (bh->b_data))->mh_magic;
@@ -1804,11 +2520,18 @@ static int pass1_process_bitmap(struct gfs2_sbd *sdp, struct rgrp_tree *rgd, uin
 				 (unsigned long long)block);
 			check_n_fix_bitmap(sdp, rgd, block, 0,
 					   GFS2_BLKST_FREE);
-		} else if (handle_di(sdp, rgd, bh) < 0) {
-			stack;
-			brelse(bh);
-			gfs2_special_free(&gfs1_rindex_blks);
-			return FSCK_ERROR;
+		} else {
+			error = 0;
+			if (pi != NULL)
+				error = pass1_apply(sdp, rgd, bh, pi);
+			if (error == 0)
+				error = handle_di(sdp, rgd, bh);
+			if (error < 0) {
+				stack;
+				brelse(bh);
+				gfs2_special_free(&gfs1_rindex_blks);
+				return FSCK_ERROR;
+			}
 		}
 		/* Ignore everything else - they should be hit by the
 		   handle_di step.  Don't check NONE either, because
@@ -1823,7 +2546,7 @@ static int pass1_process_bitmap(struct gfs2_sbd *sdp, struct rgrp_tree *rgd, uin
 	return 0;
 }
 
-static int pass1_process_rgrp(struct gfs2_sbd *sdp, struct rgrp_tree *rgd)
+static int pass1_process_rgrp(struct gfs2_sbd *sdp, struct rgrp_tree *rgd, struct pass1_ra *ra)
 {
 	unsigned k, n, i;
 	uint64_t *ibuf = malloc(sdp->sd_bsize * GFS2_NBBY * sizeof(uint64_t));
@@ -1836,7 +2559,7 @@ static int pass1_process_rgrp(struct gfs2_sbd *sdp, struct rgrp_tree *rgd)
 		n = lgfs2_bm_scan(rgd, k, ibuf, GFS2_BLKST_DINODE);
 
 		if (n) {
-			ret = pass1_process_bitmap(sdp, rgd, ibuf, n);
+			ret = pass1_process_bitmap(sdp, rgd, ibuf, n, ra);
 			if (ret)
 				goto out;
 		}
@@ -1864,7 +2587,7 @@ out:
 	return ret;
 }
 
-static int gfs2_blockmap_create(struct gfs2_bmap *bmap, uint64_t size)
+static int gfs2_blockmap_create(struct gfs2_bmap *bmap, uint64_t size, int compact)
 {
 	bmap->size = size;
 
@@ -1872,13 +2595,15 @@ static int gfs2_blockmap_create(struct gfs2_bmap *bmap, uint64_t size)
 	 * must be 1-based */
 	bmap->mapsize = BLOCKMAP_SIZE2(size) + 1;
 
+	if (compact)
+		return bmap_compact_create(bmap, size, bmap->mapsize);
 	if (!(bmap->map = calloc(bmap->mapsize, sizeof(char))))
 		return -ENOMEM;
 	return 0;
 }
 
 
-static int link1_create(struct gfs2_bmap *bmap, uint64_t size)
+static int link1_create(struct gfs2_bmap *bmap, uint64_t size, int compact)
 {
 	bmap->size = size;
 
@@ -1886,13 +2611,15 @@ static int link1_create(struct gfs2_bmap *bmap, uint64_t size)
 	 * must be 1-based */
 	bmap->mapsize = BLOCKMAP_SIZE1(size) + 1;
 
+	if (compact)
+		return bmap_compact_create(bmap, size, bmap->mapsize);
 	if (!(bmap->map = calloc(bmap->mapsize, sizeof(char))))
 		return -ENOMEM;
 	return 0;
 }
 
 static struct gfs2_bmap *gfs2_bmap_create(struct gfs2_sbd *sdp, uint64_t size,
-					  uint64_t *addl_mem_needed)
+					  int compact, uint64_t *addl_mem_needed)
 {
 	struct gfs2_bmap *il;
 
@@ -1901,7 +2628,7 @@ static struct gfs2_bmap *gfs2_bmap_create(struct gfs2_sbd *sdp, uint64_t size,
 	if (!il)
 		return NULL;
 
-	if (gfs2_blockmap_create(il, size)) {
+	if (gfs2_blockmap_create(il, size, compact)) {
 		*addl_mem_needed = il->mapsize;
 		free(il);
 		il = NULL;
@@ -1909,24 +2636,56 @@ static struct gfs2_bmap *gfs2_bmap_create(struct gfs2_sbd *sdp, uint64_t size,
 	return il;
 }
 
-static void gfs2_blockmap_destroy(struct gfs2_bmap *bmap)
-{
-	if (bmap->map)
-		free(bmap->map);
-	bmap->size = 0;
-	bmap->mapsize = 0;
-}
-
 static void *gfs2_bmap_destroy(struct gfs2_sbd *sdp, struct gfs2_bmap *il)
 {
 	if (il) {
-		gfs2_blockmap_destroy(il);
+		bmap_free(il);
 		free(il);
 		il = NULL;
 	}
 	return il;
 }
 
+/**
+ * use_compact_maps - Decide whether the block maps for a file system of a
+ * given size should be compact ones, which need less memory when large parts
+ * of the file system are in one state but are slower to update.
+ *
+ * Flat maps are used if they fit into the limit given with -M or, by default,
+ * into half of the physical memory.
+ */
+static int use_compact_maps(uint64_t size)
+{
+	uint64_t flat = (BLOCKMAP_SIZE2(size) + 1) + 2 * (BLOCKMAP_SIZE1(size) + 1);
+	uint64_t limit;
+
+	if (opts.bmap_limit) {
+		limit = (uint64_t)opts.bmap_mb << 20;
+	} else {
+		long pages = sysconf(_SC_PHYS_PAGES);
+		long pagesize = sysconf(_SC_PAGESIZE);
+
+		if (pages <= 0 || pagesize <= 0)
+			return 0;
+		limit = (uint64_t)pages * pagesize / 2;
+	}
+	return flat > limit;
+}
+
+/*
+ * The owner map only saves pass1b some time, so don't let it take more than
+ * an eighth of the physical memory.
+ */
+static uint64_t owner_map_limit(void)
+{
+	long pages = sysconf(_SC_PHYS_PAGES);
+	long pagesize = sysconf(_SC_PAGESIZE);
+
+	if (pages <= 0 || pagesize <= 0)
+		return 0;
+	return (uint64_t)pages * pagesize / 8;
+}
+
 static void enomem(uint64_t addl_mem_needed)
 {
 	log_crit( _("This system doesn't have enough memory and swap space to fsck this file system.\n"));
@@ -1951,32 +2710,35 @@ static void enomem(uint64_t addl_mem_needed)
 int pass1(struct gfs2_sbd *sdp)
 {
 	struct osi_node *n, *next = NULL;
+	struct pass1_ra ra;
 	struct rgrp_tree *rgd;
 	uint64_t i;
 	uint64_t rg_count = 0;
 	struct timeval timer;
 	int ret = FSCK_OK;
 	uint64_t addl_mem_needed;
+	int compact = use_compact_maps(last_fs_block + 1);
 
-	bl = gfs2_bmap_create(sdp, last_fs_block+1, &addl_mem_needed);
+	if (compact)
+		log_notice(_("Using compact block maps to save memory.\n"));
+	bl = gfs2_bmap_create(sdp, last_fs_block+1, compact, &addl_mem_needed);
 	if (!bl) {
 		enomem(addl_mem_needed);
 		return FSCK_ERROR;
 	}
-	addl_mem_needed = link1_create(&nlink1map, last_fs_block+1);
-	if (addl_mem_needed) {
-		enomem(addl_mem_needed);
+	if (link1_create(&nlink1map, last_fs_block+1, compact)) {
+		enomem(nlink1map.mapsize);
 		gfs2_bmap_destroy(sdp, bl);
 		return FSCK_ERROR;
 	}
-	addl_mem_needed = link1_create(&clink1map, last_fs_block+1);
-	if (addl_mem_needed) {
-		enomem(addl_mem_needed);
+	if (link1_create(&clink1map, last_fs_block+1, compact)) {
+		enomem(clink1map.mapsize);
 		link1_destroy(&nlink1map);
 		gfs2_bmap_destroy(sdp, bl);
 		return FSCK_ERROR;
 	}
 	osi_list_init(&gfs1_rindex_blks.list);
+	owner_map = owner_map_create(last_fs_block + 1, owner_map_limit());
 
 	/* FIXME: In the gfs fsck, we had to mark things like the
 	 * journals and indices and such as 'other_meta' - in gfs2,
@@ -1987,6 +2749,9 @@ int pass1(struct gfs2_sbd *sdp)
 	/* Make sure the system inodes are okay & represented in the bitmap. */
 	check_system_inodes(sdp);
 
+	if (pass1_ra_init(sdp, &ra) != 0)
+		log_warn(_("Unable to set up asynchronous reads: %s\n"), strerror(errno));
+
 	/* So, do we do a depth first search starting at the root
 	 * inode, or use the rg bitmaps, or just read every fs block
 	 * to find the inodes?  If we use the depth first search, why
@@ -2019,15 +2784,32 @@ int pass1(struct gfs2_sbd *sdp)
 			gfs2_meta_rgrp);*/
 		}
 
-		ret = pass1_process_rgrp(sdp, rgd);
+		check_deferred_rgrp(sdp, rgd);
+		ret = pass1_process_rgrp(sdp, rgd, &ra);
 		if (ret)
 			goto out;
-	}
+		stats_bmap_mem(bmap_mem(bl) + bmap_mem(&nlink1map) + bmap_mem(&clink1map));
+		lgfs2_rgcache_trim(sdp);
+		/* Most of an rgrp's blocks end up in the same state */
+		bmap_compact(bl, BLOCKMAP_SIZE2(rgd->rt_addr),
+		             BLOCKMAP_SIZE2(rgd->rt_data0 + rgd->rt_data));
+	}
+	report_deferred_rgrps();
+	if (bl->chunks)
+		log_info(_("Block map memory in use: %lluKB\n"),
+		         (unsigned long long)((bl->nalloc * BMAP_CHUNK_BYTES) >> 10));
+	if (owner_map)
+		log_info(_("Block owner map memory in use: %"PRIu64"KB\n"), owner_map->bytes >> 10);
 	log_notice(_("Reconciling bitmaps.\n"));
 	gettimeofday(&timer, NULL);
+	lgfs2_iostats_phase(sdp, "reconcile_bitmaps");
+	stats_pass_start("reconcile_bitmaps");
 	pass5(sdp, bl);
+	stats_pass_end();
+	lgfs2_iostats_phase(sdp, "pass1");
 	print_pass_duration("reconcile_bitmaps", &timer);
 out:
+	pass1_ra_free(&ra);
 	gfs2_special_free(&gfs1_rindex_blks);
 	if (bl)
 		gfs2_bmap_destroy(sdp, bl);
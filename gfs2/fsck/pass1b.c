@@ -17,6 +17,7 @@
 #include "metawalk.h"
 #include "inode_hash.h"
 #include "afterpass1_common.h"
+#include "stats.h"
 
 struct fxn_info {
 	uint64_t block;
@@ -900,31 +901,88 @@ out:
 	return error;
 }
 
+/* Looks for references to duplicates in the dinode at block i, if it is one.
+ * Returns 0 on success, 1 if the block is still marked unlinked or -1 on
+ * error. */
+static int check_dup_refs(struct gfs2_sbd *sdp, uint64_t i)
+{
+	int q = bitmap_type(sdp, i);
+
+	if (q == GFS2_BLKST_FREE || q == GFS2_BLKST_USED || q < 0)
+		return 0;
+
+	if (q == GFS2_BLKST_UNLINKED) {
+		log_debug( _("Error: block %lld (0x%llx) is still "
+			     "marked UNLINKED.\n"),
+			   (unsigned long long)i,
+			   (unsigned long long)i);
+		return 1;
+	}
+
+	warm_fuzzy_stuff(i);
+	inodes_visited++;
+	if (find_block_ref(sdp, i) < 0) {
+		stack;
+		return -1;
+	}
+	return 0;
+}
+
 /* Pass 1b handles finding the previous inode for a duplicate block
  * When found, store the inodes pointing to the duplicate block for
  * use in pass2 */
 int pass1b(struct gfs2_sbd *sdp)
 {
 	struct duptree *dt;
+	uint64_t *owners = NULL;
+	unsigned nowners = 0;
 	uint64_t i;
-	int q;
 	struct osi_node *n;
 	int rc = FSCK_OK;
+	int ret;
 
 	log_info( _("Looking for duplicate blocks...\n"));
 
 	/* If there were no dups in the bitmap, we don't need to do anymore */
 	if (dup_blocks.osi_node == NULL) {
+		owner_map_free(&owner_map);
 		log_info( _("No duplicate blocks found\n"));
 		return FSCK_OK;
 	}
 
+	/* Start with the inodes which pass1 saw marking the duplicates, which
+	 * usually hold all of the original references */
+	if (owner_map != NULL) {
+		owners = owner_map_owners(owner_map, &dup_blocks, &nowners);
+		owner_map_free(&owner_map);
+		log_info( _("Checking %u inodes which own duplicate blocks...\n"), nowners);
+	}
+	for (i = 0; i < nowners && dups_found_first != dups_found; i++) {
+		if (skip_this_pass || fsck_abort) {
+			free(owners);
+			goto out;
+		}
+		ret = check_dup_refs(sdp, owners[i]);
+		if (ret > 0) {
+			free(owners);
+			return FSCK_ERROR;
+		}
+		if (ret < 0) {
+			free(owners);
+			rc = FSCK_ERROR;
+			goto out;
+		}
+	}
+	free(owners);
+
 	/* Rescan the fs looking for pointers to blocks that are in
 	 * the duplicate block map */
-	log_info( _("Scanning filesystem for inodes containing duplicate blocks...\n"));
-	log_debug( _("Filesystem has %llu (0x%llx) blocks total\n"),
-		  (unsigned long long)last_fs_block,
-		  (unsigned long long)last_fs_block);
+	if (dups_found_first != dups_found) {
+		log_info( _("Scanning filesystem for inodes containing duplicate blocks...\n"));
+		log_debug( _("Filesystem has %llu (0x%llx) blocks total\n"),
+			  (unsigned long long)last_fs_block,
+			  (unsigned long long)last_fs_block);
+	}
 	for (i = 0; i < last_fs_block; i++) {
 		if (skip_this_pass || fsck_abort) /* if asked to skip the rest */
 			goto out;
@@ -934,22 +992,10 @@ int pass1b(struct gfs2_sbd *sdp)
 				    "duplicates.\n"), dups_found);
 			break;
 		}
-		q = bitmap_type(sdp, i);
-
-		if (q == GFS2_BLKST_FREE || q == GFS2_BLKST_USED || q < 0)
-			continue;
-
-		if (q == GFS2_BLKST_UNLINKED) {
-			log_debug( _("Error: block %lld (0x%llx) is still "
-				     "marked UNLINKED.\n"),
-				   (unsigned long long)i,
-				   (unsigned long long)i);
+		ret = check_dup_refs(sdp, i);
+		if (ret > 0)
 			return FSCK_ERROR;
-		}
-
-		warm_fuzzy_stuff(i);
-		if (find_block_ref(sdp, i) < 0) {
-			stack;
+		if (ret < 0) {
 			rc = FSCK_ERROR;
 			goto out;
 		}
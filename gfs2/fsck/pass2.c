@@ -18,6 +18,7 @@
 #include "lost_n_found.h"
 #include "inode_hash.h"
 #include "afterpass1_common.h"
+#include "stats.h"
 
 #define MAX_FILENAME 256
 
@@ -1340,11 +1341,15 @@ static int fix_hashtable(struct gfs2_inode *ip, __be64 *tbl, unsigned hsize,
 	if ((dentry.dr_rec_len == ip->i_sbd->sd_bsize - sizeof(struct gfs2_leaf)) &&
 	    (dentry.dr_inum.in_formal_ino == 0)) {
 		brelse(lbh);
-		gfs2_free_block(ip->i_sbd, leafblk);
-		log_err(_("Out of place leaf block %llu (0x%llx) had no "
-			"entries, so it was deleted.\n"),
-			(unsigned long long)leafblk,
-			(unsigned long long)leafblk);
+		if (gfs2_free_block(ip->i_sbd, leafblk) != 0)
+			log_err(_("Out of place leaf block %"PRIu64" (0x%"PRIx64") had no "
+			          "entries, but it could not be freed: %s\n"),
+			        leafblk, leafblk, strerror(errno));
+		else
+			log_err(_("Out of place leaf block %llu (0x%llx) had no "
+				"entries, so it was deleted.\n"),
+				(unsigned long long)leafblk,
+				(unsigned long long)leafblk);
 		pad_with_leafblks(ip, tbl, lindex, len);
 		log_err(_("Reprocessing index 0x%x (case 1).\n"), lindex);
 		return 1;
@@ -2144,6 +2149,7 @@ int pass2(struct gfs2_sbd *sdp)
 		dt = (struct dir_info *)tmp;
 		dirblk = dt->dinode.in_addr;
 		warm_fuzzy_stuff(dirblk);
+		inodes_visited++;
 		if (skip_this_pass || fsck_abort) /* if asked to skip the rest */
 			return FSCK_OK;
 
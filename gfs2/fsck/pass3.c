@@ -17,6 +17,7 @@
 #include "metawalk.h"
 #include "util.h"
 #include "afterpass1_common.h"
+#include "stats.h"
 
 static int attach_dotdot_to(struct gfs2_sbd *sdp, uint64_t newdotdot,
 			    uint64_t olddotdot, uint64_t block)
@@ -212,6 +213,7 @@ int pass3(struct gfs2_sbd *sdp)
 	for (tmp = osi_first(&dirtree); tmp; tmp = next) {
 		next = osi_next(tmp);
 		di = (struct dir_info *)tmp;
+		inodes_visited++;
 		while (!di->checked) {
 			/* FIXME: Change this so it returns success or
 			 * failure and put the parent inode in a
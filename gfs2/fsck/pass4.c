@@ -15,6 +15,7 @@
 #include "metawalk.h"
 #include "util.h"
 #include "afterpass1_common.h"
+#include "stats.h"
 
 static struct metawalk_fxns pass4_fxns_delete = {
 	.private = NULL,
@@ -184,6 +185,7 @@ static int scan_inode_list(struct gfs2_sbd *sdp)
 			return 0;
 		next = osi_next(tmp);
 		ii = (struct inode_info *)tmp;
+		inodes_visited++;
 		/* Don't check reference counts on the special gfs files */
 		if (sdp->gfs1 &&
 		    ((ii->num.in_addr == sdp->md.riinode->i_num.in_addr) ||
@@ -220,6 +222,7 @@ static int scan_dir_list(struct gfs2_sbd *sdp)
 			return 0;
 		next = osi_next(tmp);
 		di = (struct dir_info *)tmp;
+		inodes_visited++;
 		/* Don't check reference counts on the special gfs files */
 		if (sdp->gfs1 &&
 		    di->dinode.in_addr == sdp->md.jiinode->i_num.in_addr)
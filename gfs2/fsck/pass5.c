@@ -11,118 +11,167 @@
 #include "libgfs2.h"
 #include "fsck.h"
 #include "util.h"
+#include "stats.h"
 
 #define GFS1_BLKST_USEDMETA 4
 
+static void check_block(struct gfs2_sbd *sdp, struct gfs2_bmap *bl,
+                        unsigned char rg_status, uint64_t block, uint32_t *count)
+{
+	int q;
+
+	q = block_type(bl, block);
+	/* GFS1 file systems will have to suffer from slower fsck run
+	 * times because in GFS, there's no 1:1 relationship between
+	 * bits and counts. If a bit is marked "dinode" in GFS1, it
+	 * may be dinode -OR- any kind of metadata. I consider GFS1 to
+	 * be a rare exception, so acceptable loss at this point. So
+	 * we must determine whether it's really a dinode or other
+	 * metadata by reading it in. */
+	if (sdp->gfs1 && q == GFS2_BLKST_DINODE) {
+		struct gfs2_buffer_head *bh;
+
+		bh = bread(sdp, block);
+		if (gfs2_check_meta(bh->b_data, GFS2_METATYPE_DI) == 0)
+			count[GFS2_BLKST_DINODE]++;
+		else
+			count[GFS1_BLKST_USEDMETA]++;
+		brelse(bh);
+	} else {
+		count[q]++;
+	}
+
+	/* If one node opens a file and another node deletes it, we
+	   may be left with a block that appears to be "unlinked" in
+	   the bitmap, but nothing links to it. This is a valid case
+	   and should be cleaned up by the file system eventually.
+	   So we ignore it. */
+	if (q == GFS2_BLKST_UNLINKED) {
+		log_err( _("Unlinked inode found at block %llu "
+			   "(0x%llx).\n"),
+			 (unsigned long long)block,
+			 (unsigned long long)block);
+		if (query(_("Do you want to reclaim the block? "
+			   "(y/n) "))) {
+			lgfs2_rgrp_t rg = gfs2_blk2rgrpd(sdp, block);
+			if (gfs2_set_bitmap(rg, block, GFS2_BLKST_FREE))
+				log_err(_("Unlinked block %llu "
+					  "(0x%llx) bitmap not fixed."
+					  "\n"),
+					(unsigned long long)block,
+					(unsigned long long)block);
+			else {
+				log_err(_("Unlinked block %llu "
+					  "(0x%llx) bitmap fixed.\n"),
+					(unsigned long long)block,
+					(unsigned long long)block);
+				count[GFS2_BLKST_UNLINKED]--;
+				count[GFS2_BLKST_FREE]++;
+			}
+		} else {
+			log_info( _("Unlinked block found at block %llu"
+				    " (0x%llx), left unchanged.\n"),
+				(unsigned long long)block,
+				(unsigned long long)block);
+		}
+	} else if (rg_status != q) {
+		log_err( _("Block %llu (0x%llx) bitmap says %u (%s) "
+			   "but FSCK saw %u (%s)\n"),
+			 (unsigned long long)block,
+			 (unsigned long long)block, rg_status,
+			 block_type_string(rg_status), q,
+			 block_type_string(q));
+		if (q) /* Don't print redundant "free" */
+			log_err( _("Metadata type is %u (%s)\n"), q,
+				 block_type_string(q));
+
+		if (query(_("Fix bitmap for block %llu (0x%llx) ? (y/n) "),
+			 (unsigned long long)block,
+			 (unsigned long long)block)) {
+			lgfs2_rgrp_t rg = gfs2_blk2rgrpd(sdp, block);
+			if (gfs2_set_bitmap(rg, block, q))
+				log_err( _("Repair failed.\n"));
+			else
+				log_err( _("Fixed.\n"));
+		} else
+			log_err( _("Bitmap at block %llu (0x%llx) left inconsistent\n"),
+				(unsigned long long)block,
+				(unsigned long long)block);
+	}
+}
+
+/* Masks selecting the low and high bits of each 2-bit block state in a word */
+#define STATE_LO_BITS (0x5555555555555555ULL)
+#define STATE_HI_BITS (0xaaaaaaaaaaaaaaaaULL)
+
+/**
+ * Count the block states in a word of bitmap. Returns non-zero if the word
+ * contains states which need to be looked at block by block.
+ */
+static int count_word(struct gfs2_sbd *sdp, uint64_t word, uint32_t *count)
+{
+	uint64_t lo = word & STATE_LO_BITS;
+	uint64_t hi = (word & STATE_HI_BITS) >> 1;
+	unsigned used = __builtin_popcountll(lo & ~hi);
+	unsigned unlinked = __builtin_popcountll(hi & ~lo);
+	unsigned dinode = __builtin_popcountll(lo & hi);
+
+	if (unlinked || (sdp->gfs1 && dinode))
+		return 1;
+	count[GFS2_BLKST_USED] += used;
+	count[GFS2_BLKST_DINODE] += dinode;
+	count[GFS2_BLKST_FREE] += GFS2_NBBY * sizeof(word) - used - dinode;
+	return 0;
+}
+
+/**
+ * Compare a bitmap buffer with the fsck blockmap, fixing any differences and
+ * counting the block states. The fsck blockmap uses the same 2 bits per block
+ * layout as the on-disk bitmaps, so they are compared a word at a time and only
+ * the words which differ, or which contain states which need special handling,
+ * are checked block by block.
+ */
 static int check_block_status(struct gfs2_sbd *sdp,  struct gfs2_bmap *bl,
 			      char *buffer, unsigned int buflen,
 			      uint64_t *rg_block, uint64_t rg_data,
 			      uint32_t *count)
 {
-	unsigned char *byte, *end;
-	unsigned int bit;
-	unsigned char rg_status;
-	int q;
-	uint64_t block;
-
-	/* FIXME verify cast */
-	byte = (unsigned char *) buffer;
-	bit = 0;
-	end = (unsigned char *) buffer + buflen;
+	unsigned char *byte = (unsigned char *)buffer;
+	unsigned char *end = byte + buflen;
+	uint64_t block = rg_data + *rg_block;
 
 	while (byte < end) {
-		rg_status = ((*byte >> bit) & GFS2_BIT_MASK);
-		block = rg_data + *rg_block;
+		unsigned len = end - byte;
+		unsigned i, bit;
+
 		warm_fuzzy_stuff(block);
 		if (skip_this_pass || fsck_abort) /* if asked to skip the rest */
 			return 0;
 
-		q = block_type(bl, block);
-		/* GFS1 file systems will have to suffer from slower fsck run
-		 * times because in GFS, there's no 1:1 relationship between
-		 * bits and counts. If a bit is marked "dinode" in GFS1, it
-		 * may be dinode -OR- any kind of metadata. I consider GFS1 to
-		 * be a rare exception, so acceptable loss at this point. So
-		 * we must determine whether it's really a dinode or other
-		 * metadata by reading it in. */
-		if (sdp->gfs1 && q == GFS2_BLKST_DINODE) {
-			struct gfs2_buffer_head *bh;
-
-			bh = bread(sdp, block);
-			if (gfs2_check_meta(bh->b_data, GFS2_METATYPE_DI) == 0)
-				count[GFS2_BLKST_DINODE]++;
-			else
-				count[GFS1_BLKST_USEDMETA]++;
-			brelse(bh);
-		} else {
-			count[q]++;
-		}
+		if (len >= sizeof(uint64_t) && blockmap_has_word(bl, block)) {
+			uint64_t word;
 
-		/* If one node opens a file and another node deletes it, we
-		   may be left with a block that appears to be "unlinked" in
-		   the bitmap, but nothing links to it. This is a valid case
-		   and should be cleaned up by the file system eventually.
-		   So we ignore it. */
-		if (q == GFS2_BLKST_UNLINKED) {
-			log_err( _("Unlinked inode found at block %llu "
-				   "(0x%llx).\n"),
-				 (unsigned long long)block,
-				 (unsigned long long)block);
-			if (query(_("Do you want to reclaim the block? "
-				   "(y/n) "))) {
-				lgfs2_rgrp_t rg = gfs2_blk2rgrpd(sdp, block);
-				if (gfs2_set_bitmap(rg, block, GFS2_BLKST_FREE))
-					log_err(_("Unlinked block %llu "
-						  "(0x%llx) bitmap not fixed."
-						  "\n"),
-						(unsigned long long)block,
-						(unsigned long long)block);
-				else {
-					log_err(_("Unlinked block %llu "
-						  "(0x%llx) bitmap fixed.\n"),
-						(unsigned long long)block,
-						(unsigned long long)block);
-					count[GFS2_BLKST_UNLINKED]--;
-					count[GFS2_BLKST_FREE]++;
-				}
-			} else {
-				log_info( _("Unlinked block found at block %llu"
-					    " (0x%llx), left unchanged.\n"),
-					(unsigned long long)block,
-					(unsigned long long)block);
+			memcpy(&word, byte, sizeof(word));
+			word = le64_to_cpu(word);
+			if (word == blockmap_word(bl, block) && !count_word(sdp, word, count)) {
+				byte += sizeof(word);
+				block += GFS2_NBBY * sizeof(word);
+				*rg_block += GFS2_NBBY * sizeof(word);
+				continue;
 			}
-		} else if (rg_status != q) {
-			log_err( _("Block %llu (0x%llx) bitmap says %u (%s) "
-				   "but FSCK saw %u (%s)\n"),
-				 (unsigned long long)block,
-				 (unsigned long long)block, rg_status,
-				 block_type_string(rg_status), q,
-				 block_type_string(q));
-			if (q) /* Don't print redundant "free" */
-				log_err( _("Metadata type is %u (%s)\n"), q,
-					 block_type_string(q));
-
-			if (query(_("Fix bitmap for block %llu (0x%llx) ? (y/n) "),
-				 (unsigned long long)block,
-				 (unsigned long long)block)) {
-				lgfs2_rgrp_t rg = gfs2_blk2rgrpd(sdp, block);
-				if (gfs2_set_bitmap(rg, block, q))
-					log_err( _("Repair failed.\n"));
-				else
-					log_err( _("Fixed.\n"));
-			} else
-				log_err( _("Bitmap at block %llu (0x%llx) left inconsistent\n"),
-					(unsigned long long)block,
-					(unsigned long long)block);
 		}
-		(*rg_block)++;
-		bit += GFS2_BIT_SIZE;
-		if (bit >= 8){
-			bit = 0;
-			byte++;
+		if (len > sizeof(uint64_t))
+			len = sizeof(uint64_t);
+		for (i = 0; i < len; i++, byte++) {
+			for (bit = 0; bit < 8; bit += GFS2_BIT_SIZE) {
+				check_block(sdp, bl, (*byte >> bit) & GFS2_BIT_MASK, block, count);
+				if (skip_this_pass || fsck_abort)
+					return 0;
+				block++;
+				(*rg_block)++;
+			}
 		}
 	}
-
 	return 0;
 }
 
@@ -134,6 +183,11 @@ static void update_rgrp(struct gfs2_sbd *sdp, struct rgrp_tree *rgp,
 	uint64_t rg_block = 0;
 	int update = 0;
 
+	if (lgfs2_rgrp_load(rgp) != 0) {
+		log_err(_("Unable to read resource group at %"PRIu64" (0x%"PRIx64"): %s\n"),
+		        rgp->rt_addr, rgp->rt_addr, strerror(errno));
+		return;
+	}
 	for(i = 0; i < rgp->rt_length; i++) {
 		bits = &rgp->bits[i];
 
@@ -226,6 +280,8 @@ int pass5(struct gfs2_sbd *sdp, struct gfs2_bmap *bl)
 		rg_count++;
 		/* Compare the bitmaps and report the differences */
 		update_rgrp(sdp, rgp, bl, count);
+		blocks_visited += rgp->rt_data;
+		lgfs2_rgcache_trim(sdp);
 	}
 	/* Fix up superblock info based on this - don't think there's
 	 * anything to do here... */
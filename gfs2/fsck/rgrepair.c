@@ -858,8 +858,7 @@ static int gfs2_rindex_calculate(struct gfs2_sbd *sdp, int *num_rgs)
  * rewrite_rg_block - rewrite ("fix") a buffer with rg or bitmap data
  * returns: 0 if the rg was repaired, otherwise 1
  */
-static int rewrite_rg_block(struct gfs2_sbd *sdp, struct rgrp_tree *rg,
-			    uint64_t errblock)
+int rewrite_rg_block(struct gfs2_sbd *sdp, struct rgrp_tree *rg, uint64_t errblock)
 {
 	int x = errblock - rg->rt_addr;
 	const char *typedesc = x ? "GFS2_METATYPE_RB" : "GFS2_METATYPE_RG";
@@ -878,7 +877,8 @@ static int rewrite_rg_block(struct gfs2_sbd *sdp, struct rgrp_tree *rg,
 		log_err(_("Failed to allocate resource group block: %s"), strerror(errno));
 		return 1;
 	}
-	ret = pread(sdp->device_fd, buf, sdp->sd_bsize, errblock * sdp->sd_bsize);
+	lgfs2_bcache_forget(sdp, errblock, 1);
+	ret = lgfs2_pread(sdp, sdp->device_fd, buf, sdp->sd_bsize, errblock * sdp->sd_bsize);
 	if (ret != sdp->sd_bsize) {
 		log_err(_("Failed to read resource group block %"PRIu64": %s\n"),
 		        errblock, strerror(errno));
@@ -899,7 +899,7 @@ static int rewrite_rg_block(struct gfs2_sbd *sdp, struct rgrp_tree *rg,
 		else
 			lgfs2_rgrp_out(rg, buf);
 	}
-	ret = pwrite(sdp->device_fd, buf, sdp->sd_bsize, errblock * sdp->sd_bsize);
+	ret = lgfs2_pwrite(sdp, sdp->device_fd, buf, sdp->sd_bsize, errblock * sdp->sd_bsize);
 	if (ret != sdp->sd_bsize) {
 		log_err(_("Failed to write resource group block %"PRIu64": %s\n"),
 		        errblock, strerror(errno));
@@ -0,0 +1,332 @@
+#include "clusterautoconfig.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "libgfs2.h"
+#include "fsck.h"
+#include "stats.h"
+
+/* The performance report: -S writes one record per pass to a file when fsck
+   exits and -P streams progress records to a file descriptor while it runs.
+   Both are JSON, the progress records one object per line. */
+
+#define STATS_DEPTH (4) /* How deeply passes may be nested */
+#define PROGRESS_NSECS (1000000000ULL) /* How often to print progress */
+
+uint64_t blocks_visited = 0;
+uint64_t inodes_visited = 0;
+
+struct stats_sample {
+	uint64_t nsecs;
+	struct timeval utime;
+	struct timeval stime;
+	uint64_t blocks;
+	uint64_t inodes;
+	uint64_t count[2];
+	uint64_t bytes[2];
+};
+
+struct stats_pass {
+	const char *name;
+	struct stats_sample delta;
+	long maxrss;
+	uint64_t inodetree;
+	uint64_t dirtree;
+	uint64_t dup_blocks;
+	uint64_t bmap_bytes;
+};
+
+static struct {
+	struct gfs2_sbd *sdp;
+	FILE *file;
+	int progress_fd;
+	struct stats_sample begin;
+	struct {
+		const char *name;
+		struct stats_sample start;
+		uint64_t bmap_peak;
+	} stack[STATS_DEPTH];
+	unsigned depth;
+	uint64_t bmap_bytes;
+	uint64_t last_progress;
+	struct stats_pass *passes;
+	unsigned npasses;
+} stats = { .progress_fd = -1 };
+
+static uint64_t stats_now(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/* Sum the counts of every call site which lgfs2 has accounted I/O for */
+static void stats_io(struct stats_sample *s)
+{
+	struct lgfs2_iostat st;
+
+	memset(s->count, 0, sizeof(s->count));
+	memset(s->bytes, 0, sizeof(s->bytes));
+	for (unsigned i = 0; lgfs2_iostats_get(stats.sdp, i, &st) == 0; i++) {
+		for (int dir = LGFS2_IO_READ; dir <= LGFS2_IO_WRITE; dir++) {
+			s->count[dir] += st.count[dir];
+			s->bytes[dir] += st.bytes[dir];
+		}
+	}
+}
+
+static void stats_sample(struct stats_sample *s, long *maxrss)
+{
+	struct rusage ru;
+
+	memset(s, 0, sizeof(*s));
+	s->nsecs = stats_now(CLOCK_MONOTONIC);
+	if (getrusage(RUSAGE_SELF, &ru) == 0) {
+		s->utime = ru.ru_utime;
+		s->stime = ru.ru_stime;
+		if (maxrss != NULL)
+			*maxrss = ru.ru_maxrss;
+	}
+	s->blocks = blocks_visited;
+	s->inodes = inodes_visited;
+	stats_io(s);
+}
+
+static void stats_sub(struct stats_sample *d, const struct stats_sample *a,
+                      const struct stats_sample *b)
+{
+	d->nsecs = a->nsecs - b->nsecs;
+	timersub(&a->utime, &b->utime, &d->utime);
+	timersub(&a->stime, &b->stime, &d->stime);
+	d->blocks = a->blocks - b->blocks;
+	d->inodes = a->inodes - b->inodes;
+	for (int dir = LGFS2_IO_READ; dir <= LGFS2_IO_WRITE; dir++) {
+		d->count[dir] = a->count[dir] - b->count[dir];
+		d->bytes[dir] = a->bytes[dir] - b->bytes[dir];
+	}
+}
+
+static uint64_t tree_size(struct osi_root *root)
+{
+	uint64_t n = 0;
+
+	for (struct osi_node *node = osi_first(root); node != NULL; node = osi_next(node))
+		n++;
+	return n;
+}
+
+/**
+ * stats_init - Set up the performance report
+ * path: The file to write the per-pass report to, or NULL
+ * progress_fd: The file descriptor to stream progress records to, or -1
+ * Returns 0 on success or -1 with errno set on failure.
+ */
+int stats_init(struct gfs2_sbd *sdp, const char *path, int progress_fd)
+{
+	if (path == NULL && progress_fd < 0)
+		return 0;
+	/* The I/O counts come from the I/O statistics */
+	if (sdp->iostats == NULL && lgfs2_iostats_init(sdp) != 0)
+		return -1;
+	if (path != NULL) {
+		stats.file = fopen(path, "w");
+		if (stats.file == NULL)
+			return -1;
+	}
+	stats.sdp = sdp;
+	stats.progress_fd = progress_fd;
+	stats_sample(&stats.begin, NULL);
+	return 0;
+}
+
+static void progress_json(const char *event, uint64_t block)
+{
+	struct stats_sample now, d;
+
+	if (stats.depth == 0)
+		return;
+	stats_sample(&now, NULL);
+	stats_sub(&d, &now, &stats.stack[stats.depth - 1].start);
+	dprintf(stats.progress_fd,
+	        "{\"event\": \"%s\", \"pass\": \"%s\", \"time\": %.3f, \"elapsed\": %.3f, "
+	        "\"block\": %"PRIu64", \"last_block\": %"PRIu64", "
+	        "\"blocks\": %"PRIu64", \"inodes\": %"PRIu64", "
+	        "\"read_bytes\": %"PRIu64", \"write_bytes\": %"PRIu64"}\n",
+	        event, stats.stack[stats.depth - 1].name,
+	        (now.nsecs - stats.begin.nsecs) / 1e9, d.nsecs / 1e9,
+	        block, last_fs_block, d.blocks, d.inodes,
+	        d.bytes[LGFS2_IO_READ], d.bytes[LGFS2_IO_WRITE]);
+}
+
+/**
+ * stats_pass_start - Start counting for a pass, which may be nested in
+ * another one, in which case its figures are included in the outer pass's.
+ * name: Must remain valid until stats_write() is called
+ */
+void stats_pass_start(const char *name)
+{
+	if (stats.sdp == NULL || stats.depth == STATS_DEPTH)
+		return;
+	stats.stack[stats.depth].name = name;
+	stats.stack[stats.depth].bmap_peak = stats.bmap_bytes;
+	stats_sample(&stats.stack[stats.depth].start, NULL);
+	stats.depth++;
+	if (stats.progress_fd >= 0) {
+		progress_json("start", 0);
+		stats.last_progress = stats_now(CLOCK_MONOTONIC_COARSE);
+	}
+}
+
+/**
+ * stats_pass_end - Record the figures for the innermost pass
+ */
+void stats_pass_end(void)
+{
+	struct stats_pass *p;
+	struct stats_sample now;
+	long maxrss = 0;
+
+	if (stats.sdp == NULL || stats.depth == 0)
+		return;
+	if (stats.progress_fd >= 0)
+		progress_json("end", last_fs_block);
+	stats.depth--;
+	if (stats.file == NULL)
+		return;
+	p = realloc(stats.passes, (stats.npasses + 1) * sizeof(*p));
+	if (p == NULL)
+		return;
+	stats.passes = p;
+	p += stats.npasses++;
+	stats_sample(&now, &maxrss);
+	p->name = stats.stack[stats.depth].name;
+	stats_sub(&p->delta, &now, &stats.stack[stats.depth].start);
+	p->maxrss = maxrss;
+	p->inodetree = tree_size(&inodetree);
+	p->dirtree = tree_size(&dirtree);
+	p->dup_blocks = tree_size(&dup_blocks);
+	p->bmap_bytes = stats.stack[stats.depth].bmap_peak;
+}
+
+/**
+ * stats_bmap_mem - Tell the report how much memory the block maps use now
+ */
+void stats_bmap_mem(uint64_t bytes)
+{
+	stats.bmap_bytes = bytes;
+	for (unsigned i = 0; i < stats.depth; i++)
+		if (bytes > stats.stack[i].bmap_peak)
+			stats.stack[i].bmap_peak = bytes;
+}
+
+/**
+ * stats_progress - Print a progress record if it's time for one
+ * block: The block the current pass has reached
+ */
+void stats_progress(uint64_t block)
+{
+	uint64_t now;
+
+	if (stats.progress_fd < 0)
+		return;
+	now = stats_now(CLOCK_MONOTONIC_COARSE);
+	if (now - stats.last_progress < PROGRESS_NSECS)
+		return;
+	stats.last_progress = now;
+	progress_json("progress", block);
+}
+
+static void json_str(FILE *f, const char *s)
+{
+	fputc('"', f);
+	for (; *s != '\0'; s++) {
+		unsigned char c = *s;
+
+		if (c == '"' || c == '\\')
+			fprintf(f, "\\%c", c);
+		else if (c < 0x20)
+			fprintf(f, "\\u%04x", c);
+		else
+			fputc(c, f);
+	}
+	fputc('"', f);
+}
+
+static void json_times(FILE *f, const struct stats_sample *s)
+{
+	fprintf(f, "\"wall\": %.6f, \"cpu_user\": %ld.%06ld, \"cpu_sys\": %ld.%06ld",
+	        s->nsecs / 1e9, (long)s->utime.tv_sec, (long)s->utime.tv_usec,
+	        (long)s->stime.tv_sec, (long)s->stime.tv_usec);
+}
+
+static void json_counts(FILE *f, const struct stats_sample *s)
+{
+	fprintf(f, "\"blocks\": %"PRIu64", \"inodes\": %"PRIu64", "
+	        "\"reads\": %"PRIu64", \"read_bytes\": %"PRIu64", "
+	        "\"writes\": %"PRIu64", \"write_bytes\": %"PRIu64,
+	        s->blocks, s->inodes,
+	        s->count[LGFS2_IO_READ], s->bytes[LGFS2_IO_READ],
+	        s->count[LGFS2_IO_WRITE], s->bytes[LGFS2_IO_WRITE]);
+}
+
+/**
+ * stats_write - Finish any passes in progress and write the report
+ * status: The exit status of fsck
+ * Returns 0 on success or -1 with errno set on failure.
+ */
+int stats_write(int status)
+{
+	struct stats_sample now, total;
+	long maxrss = 0;
+	FILE *f = stats.file;
+	int ret = 0;
+
+	while (stats.depth > 0)
+		stats_pass_end();
+	if (f == NULL)
+		goto out;
+	stats_sample(&now, &maxrss);
+	stats_sub(&total, &now, &stats.begin);
+
+	fprintf(f, "{\"device\": ");
+	json_str(f, opts.device ? opts.device : "");
+	fprintf(f, ", \"block_size\": %u, \"fs_blocks\": %"PRIu64", \"exit_status\": %d,\n ",
+	        stats.sdp->sd_bsize, stats.sdp->fssize, status);
+	json_times(f, &total);
+	fprintf(f, ", ");
+	json_counts(f, &total);
+	fprintf(f, ", \"peak_rss_kb\": %ld,\n \"passes\": [", maxrss);
+	for (unsigned i = 0; i < stats.npasses; i++) {
+		const struct stats_pass *p = &stats.passes[i];
+
+		fprintf(f, "%s\n  {\"name\": ", i ? "," : "");
+		json_str(f, p->name);
+		fprintf(f, ", ");
+		json_times(f, &p->delta);
+		fprintf(f, ", ");
+		json_counts(f, &p->delta);
+		fprintf(f, ", \"peak_rss_kb\": %ld, \"inodetree\": %"PRIu64", \"dirtree\": %"PRIu64
+		        ", \"dup_blocks\": %"PRIu64", \"blockmap_bytes\": %"PRIu64"}",
+		        p->maxrss, p->inodetree, p->dirtree, p->dup_blocks, p->bmap_bytes);
+	}
+	fprintf(f, "\n ]}\n");
+	if (fflush(f) != 0 || ferror(f)) {
+		errno = EIO;
+		ret = -1;
+	}
+	if (fclose(f) != 0 && ret == 0)
+		ret = -1;
+out:
+	free(stats.passes);
+	memset(&stats, 0, sizeof(stats));
+	stats.progress_fd = -1;
+	return ret;
+}
@@ -0,0 +1,17 @@
+#ifndef _STATS_H
+#define _STATS_H
+
+#include "libgfs2.h"
+
+/* Counted by the passes for the performance report */
+extern uint64_t blocks_visited;
+extern uint64_t inodes_visited;
+
+extern int stats_init(struct gfs2_sbd *sdp, const char *path, int progress_fd);
+extern void stats_pass_start(const char *name);
+extern void stats_pass_end(void);
+extern void stats_bmap_mem(uint64_t bytes);
+extern void stats_progress(uint64_t block);
+extern int stats_write(int status);
+
+#endif /* _STATS_H */
@@ -1,5 +1,6 @@
 #include "clusterautoconfig.h"
 
+#include <errno.h>
 #include <inttypes.h>
 #include <stdlib.h>
 #include <string.h>
@@ -16,6 +17,7 @@
 #include "libgfs2.h"
 #include "metawalk.h"
 #include "util.h"
+#include "stats.h"
 
 const char *reftypes[REF_TYPES + 1] = {"data", "metadata",
 				       "an extended attribute", "an inode",
@@ -64,6 +66,7 @@ void warm_fuzzy_stuff(uint64_t block)
 	static struct timeval tv;
 	static uint32_t seconds = 0;
 
+	stats_progress(block);
 	if (!one_percent)
 		one_percent = last_fs_block / 100;
 	if (!last_reported_block ||
@@ -681,3 +684,275 @@ void print_pass_duration(const char *name, struct timeval *start)
 	log_notice(_("%s completed in %s\n"), name, duration);
 }
 
+
+/**
+ * bmap_compact_create - Set up a block map which only allocates memory for
+ * the chunks that aren't filled with one repeated byte value.
+ */
+int bmap_compact_create(struct gfs2_bmap *bl, uint64_t size, uint64_t mapsize)
+{
+	bl->size = size;
+	bl->mapsize = mapsize;
+	bl->map = NULL;
+	bl->nalloc = 0;
+	bl->nchunks = (mapsize + BMAP_CHUNK_MASK) >> BMAP_CHUNK_SHIFT;
+	bl->chunks = calloc(bl->nchunks, sizeof(*bl->chunks));
+	if (bl->chunks == NULL)
+		return -ENOMEM;
+	bl->fill = calloc(bl->nchunks, sizeof(*bl->fill));
+	if (bl->fill == NULL) {
+		free(bl->chunks);
+		bl->chunks = NULL;
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+/**
+ * bmap_chunk_alloc - Give a compact block map chunk its own memory
+ *
+ * We can't carry on with a block map we can't update, so this exits if the
+ * memory can't be allocated.
+ */
+unsigned char *bmap_chunk_alloc(struct gfs2_bmap *bl, uint64_t chunk)
+{
+	unsigned char *c = malloc(BMAP_CHUNK_BYTES);
+
+	if (c == NULL) {
+		log_crit(_("This system doesn't have enough memory and swap space to fsck this file system.\n"));
+		log_crit(_("Block map memory in use: %lluMB\n"),
+		         (unsigned long long)((bl->nalloc * BMAP_CHUNK_BYTES) >> 20));
+		exit(FSCK_ERROR);
+	}
+	memset(c, bl->fill[chunk], BMAP_CHUNK_BYTES);
+	bl->chunks[chunk] = c;
+	bl->nalloc++;
+	return c;
+}
+
+/**
+ * bmap_compact - Free the chunks of a compact block map that lie entirely
+ * below byte number end (or the end of the map), starting with the one that holds byte number start,
+ * and which have become filled with one repeated byte value.
+ */
+void bmap_compact(struct gfs2_bmap *bl, uint64_t start, uint64_t end)
+{
+	uint64_t last = (end >= bl->mapsize) ? bl->nchunks : end >> BMAP_CHUNK_SHIFT;
+	uint64_t c;
+
+	if (bl->map != NULL)
+		return;
+
+	for (c = start >> BMAP_CHUNK_SHIFT; c < last; c++) {
+		unsigned char *chunk = bl->chunks[c];
+
+		if (chunk == NULL || memcmp(chunk, chunk + 1, BMAP_CHUNK_BYTES - 1) != 0)
+			continue;
+		bl->fill[c] = chunk[0];
+		bl->chunks[c] = NULL;
+		bl->nalloc--;
+		free(chunk);
+	}
+}
+
+void bmap_free(struct gfs2_bmap *bl)
+{
+	uint64_t c;
+
+	if (bl->chunks) {
+		for (c = 0; c < bl->nchunks; c++)
+			free(bl->chunks[c]);
+		free(bl->chunks);
+		free(bl->fill);
+		bl->chunks = NULL;
+		bl->fill = NULL;
+	}
+	if (bl->map)
+		free(bl->map);
+	bl->map = NULL;
+	bl->size = 0;
+	bl->mapsize = 0;
+	bl->nchunks = 0;
+	bl->nalloc = 0;
+}
+
+/**
+ * bmap_mem - Return the number of bytes of memory a block map uses
+ */
+uint64_t bmap_mem(const struct gfs2_bmap *bl)
+{
+	if (bl->map)
+		return bl->mapsize;
+	return bl->nalloc * BMAP_CHUNK_BYTES +
+	       bl->nchunks * (sizeof(*bl->chunks) + sizeof(*bl->fill));
+}
+
+/**
+ * owner_map_create - Set up an owner map for a file system of size blocks
+ * limit: the most memory the map may use before it is given up on
+ */
+struct owner_map *owner_map_create(uint64_t size, uint64_t limit)
+{
+	struct owner_map *om = calloc(1, sizeof(*om));
+
+	if (om == NULL)
+		return NULL;
+	om->nshards = (size >> OWNER_SHARD_SHIFT) + 1;
+	om->shards = calloc(om->nshards, sizeof(*om->shards));
+	if (om->shards == NULL) {
+		free(om);
+		return NULL;
+	}
+	om->bytes = om->nshards * sizeof(*om->shards);
+	om->limit = limit;
+	return om;
+}
+
+void owner_map_free(struct owner_map **omp)
+{
+	struct owner_map *om = *omp;
+
+	if (om == NULL)
+		return;
+	for (uint64_t i = 0; i < om->nshards; i++)
+		free(om->shards[i].exts);
+	free(om->shards);
+	free(om);
+	*omp = NULL;
+}
+
+/**
+ * owner_map_add - Record that a block was marked on behalf of an inode
+ *
+ * Blocks are usually marked in runs by the same inode, so a block which
+ * extends the last extent in its shard is merged into it. If the map can't
+ * grow, it is freed and *omp is set to NULL, and pass1b falls back to
+ * walking every inode.
+ */
+void owner_map_add(struct owner_map **omp, uint64_t blk, uint64_t owner)
+{
+	struct owner_map *om = *omp;
+	struct owner_shard *sh;
+	struct owner_ext *ext;
+	uint32_t off;
+
+	if (om == NULL || (blk >> OWNER_SHARD_SHIFT) >= om->nshards)
+		return;
+	sh = &om->shards[blk >> OWNER_SHARD_SHIFT];
+	off = blk & ((1 << OWNER_SHARD_SHIFT) - 1);
+	if (sh->count > 0) {
+		ext = &sh->exts[sh->count - 1];
+		if (ext->owner == owner && off >= ext->start && off <= ext->start + ext->len) {
+			if (off == ext->start + ext->len)
+				ext->len++;
+			return;
+		}
+	}
+	if (sh->count == sh->alloc) {
+		uint32_t alloc = sh->alloc ? sh->alloc * 2 : 16;
+		uint64_t bytes = om->bytes + (alloc - sh->alloc) * sizeof(*ext);
+
+		ext = NULL;
+		if (bytes <= om->limit)
+			ext = realloc(sh->exts, alloc * sizeof(*ext));
+		if (ext == NULL) {
+			log_info(_("Too many extents to keep track of block owners (%"PRIu64"KB).\n"),
+			         om->bytes >> 10);
+			owner_map_free(omp);
+			return;
+		}
+		sh->exts = ext;
+		sh->alloc = alloc;
+		om->bytes = bytes;
+	}
+	sh->exts[sh->count++] = (struct owner_ext){ .start = off, .len = 1, .owner = owner };
+}
+
+static int owner_cmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+/**
+ * owner_map_owners - Find the inodes which marked any of the duplicate blocks
+ * dups: the tree of duplicate blocks, in block order
+ * count: set to the number of inodes found
+ *
+ * Returns a sorted array of inode addresses, without repeats, to be freed by
+ * the caller, or NULL if there are none or memory can't be allocated.
+ */
+uint64_t *owner_map_owners(struct owner_map *om, struct osi_root *dups, unsigned *count)
+{
+	uint64_t *blks = NULL, *owners = NULL;
+	unsigned nblks = 0, nowners = 0, alloc = 0;
+	struct osi_node *n;
+	unsigned b, i;
+
+	*count = 0;
+	for (n = osi_first(dups); n; n = osi_next(n))
+		nblks++;
+	if (nblks == 0)
+		return NULL;
+	blks = malloc(nblks * sizeof(*blks));
+	if (blks == NULL)
+		return NULL;
+	nblks = 0;
+	for (n = osi_first(dups); n; n = osi_next(n))
+		blks[nblks++] = ((struct duptree *)n)->block;
+
+	/* Check each shard holding duplicates against its extents once */
+	for (b = 0; b < nblks; b = i) {
+		uint64_t shard = blks[b] >> OWNER_SHARD_SHIFT;
+		uint64_t base = shard << OWNER_SHARD_SHIFT;
+		struct owner_shard *sh;
+
+		for (i = b; i < nblks && (blks[i] >> OWNER_SHARD_SHIFT) == shard; i++);
+		if (shard >= om->nshards)
+			continue;
+		sh = &om->shards[shard];
+		for (uint32_t e = 0; e < sh->count; e++) {
+			uint64_t start = base + sh->exts[e].start;
+			uint64_t end = start + sh->exts[e].len;
+			unsigned lo = b, hi = i;
+
+			/* Find the first duplicate at or after the extent's start */
+			while (lo < hi) {
+				unsigned mid = lo + (hi - lo) / 2;
+
+				if (blks[mid] < start)
+					lo = mid + 1;
+				else
+					hi = mid;
+			}
+			if (lo == i || blks[lo] >= end)
+				continue;
+			if (nowners == alloc) {
+				uint64_t *p;
+
+				alloc = alloc ? alloc * 2 : 64;
+				p = realloc(owners, alloc * sizeof(*owners));
+				if (p == NULL) {
+					free(owners);
+					free(blks);
+					return NULL;
+				}
+				owners = p;
+			}
+			owners[nowners++] = sh->exts[e].owner;
+		}
+	}
+	free(blks);
+	if (nowners == 0) {
+		free(owners);
+		return NULL;
+	}
+	qsort(owners, nowners, sizeof(*owners), owner_cmp);
+	for (b = 1, i = 1; b < nowners; b++)
+		if (owners[b] != owners[i - 1])
+			owners[i++] = owners[b];
+	*count = i;
+	return owners;
+}
@@ -2,13 +2,11 @@
 #define __UTIL_H__
 
 #include <sys/stat.h>
+#include <string.h>
 
 #include "fsck.h"
 #include "libgfs2.h"
 
-#define fsck_lseek(fd, off) \
-  ((lseek((fd), (off), SEEK_SET) == (off)) ? 0 : -1)
-
 #define INODE_VALID 1
 #define INODE_INVALID 0
 
@@ -35,36 +33,120 @@ struct fsck_pass {
 	int (*f)(struct gfs2_sbd *sdp);
 };
 
+extern unsigned char *bmap_chunk_alloc(struct gfs2_bmap *bl, uint64_t chunk);
+extern int bmap_compact_create(struct gfs2_bmap *bl, uint64_t size, uint64_t mapsize);
+extern void bmap_compact(struct gfs2_bmap *bl, uint64_t start, uint64_t end);
+extern void bmap_free(struct gfs2_bmap *bl);
+extern uint64_t bmap_mem(const struct gfs2_bmap *bl);
+extern struct owner_map *owner_map_create(uint64_t size, uint64_t limit);
+extern void owner_map_add(struct owner_map **omp, uint64_t blk, uint64_t owner);
+extern uint64_t *owner_map_owners(struct owner_map *om, struct osi_root *dups, unsigned *count);
+extern void owner_map_free(struct owner_map **omp);
+
+/* Get byte number off of a block map */
+static inline unsigned char bmap_byte(struct gfs2_bmap *bl, uint64_t off)
+{
+	unsigned char *chunk;
+
+	if (bl->map)
+		return bl->map[off];
+	chunk = bl->chunks[off >> BMAP_CHUNK_SHIFT];
+	if (chunk == NULL)
+		return bl->fill[off >> BMAP_CHUNK_SHIFT];
+	return chunk[off & BMAP_CHUNK_MASK];
+}
+
+/* Set the bits in mask of byte number off of a block map to val */
+static inline int bmap_update(struct gfs2_bmap *bl, uint64_t off,
+                              unsigned char mask, unsigned char val)
+{
+	unsigned char *byte;
+
+	if (bl->map) {
+		byte = bl->map + off;
+	} else {
+		uint64_t c = off >> BMAP_CHUNK_SHIFT;
+		unsigned char *chunk = bl->chunks[c];
+
+		if (chunk == NULL) {
+			if ((bl->fill[c] & mask) == val)
+				return 0;
+			chunk = bmap_chunk_alloc(bl, c);
+			if (chunk == NULL)
+				return -1;
+		}
+		byte = chunk + (off & BMAP_CHUNK_MASK);
+	}
+	*byte &= ~mask;
+	*byte |= val;
+	return 0;
+}
+
 static inline int block_type(struct gfs2_bmap *bl, uint64_t bblock)
 {
-	static unsigned char *byte;
+	static unsigned char byte;
 	static uint64_t b;
 	static int btype;
 
-	byte = bl->map + BLOCKMAP_SIZE2(bblock);
+	byte = bmap_byte(bl, BLOCKMAP_SIZE2(bblock));
 	b = BLOCKMAP_BYTE_OFFSET2(bblock);
-	btype = (*byte & (BLOCKMAP_MASK2 << b )) >> b;
+	btype = (byte & (BLOCKMAP_MASK2 << b )) >> b;
 	return btype;
 }
 
+/* Whether blockmap_word() can be used for a given block */
+static inline int blockmap_has_word(struct gfs2_bmap *bl, uint64_t bblock)
+{
+	uint64_t need = BLOCKMAP_BYTE_OFFSET2(bblock) ? 2 * sizeof(uint64_t) : sizeof(uint64_t);
+	uint64_t off = BLOCKMAP_SIZE2(bblock);
+
+	if (bl->map == NULL && (off & BMAP_CHUNK_MASK) + need > BMAP_CHUNK_BYTES)
+		return 0;
+	return off + need <= bl->mapsize;
+}
+
+/* Get the states of the 32 blocks starting at bblock, in on-disk bitmap order */
+static inline uint64_t blockmap_word(struct gfs2_bmap *bl, uint64_t bblock)
+{
+	uint64_t off = BLOCKMAP_SIZE2(bblock);
+	unsigned shift = BLOCKMAP_BYTE_OFFSET2(bblock);
+	const unsigned char *byte;
+	uint64_t w[2];
+
+	if (bl->map) {
+		byte = bl->map + off;
+	} else {
+		byte = bl->chunks[off >> BMAP_CHUNK_SHIFT];
+		if (byte == NULL) {
+			w[0] = bl->fill[off >> BMAP_CHUNK_SHIFT] * 0x0101010101010101ULL;
+			if (shift == 0)
+				return w[0];
+			return (w[0] >> shift) | (w[0] << (64 - shift));
+		}
+		byte += off & BMAP_CHUNK_MASK;
+	}
+	memcpy(&w[0], byte, sizeof(w[0]));
+	if (shift == 0)
+		return le64_to_cpu(w[0]);
+	memcpy(&w[1], byte + sizeof(w[0]), sizeof(w[1]));
+	return (le64_to_cpu(w[0]) >> shift) | (le64_to_cpu(w[1]) << (64 - shift));
+}
+
 static inline int link1_type(struct gfs2_bmap *bl, uint64_t bblock)
 {
-	static unsigned char *byte;
+	static unsigned char byte;
 	static uint64_t b;
 	static int btype;
 
-	byte = bl->map + BLOCKMAP_SIZE1(bblock);
+	byte = bmap_byte(bl, BLOCKMAP_SIZE1(bblock));
 	b = BLOCKMAP_BYTE_OFFSET1(bblock);
-	btype = (*byte & (BLOCKMAP_MASK1 << b )) >> b;
+	btype = (byte & (BLOCKMAP_MASK1 << b )) >> b;
 	return btype;
 }
 
 static inline void link1_destroy(struct gfs2_bmap *bmap)
 {
-	if (bmap->map)
-		free(bmap->map);
-	bmap->size = 0;
-	bmap->mapsize = 0;
+	bmap_free(bmap);
 }
 
 static inline int bitmap_type(struct gfs2_sbd *sdp, uint64_t bblock)
@@ -0,0 +1,60 @@
+#include <stdlib.h>
+#include <string.h>
+#include <check.h>
+#include "crc32c.h"
+
+Suite *suite_crc32c(void);
+
+/* Large enough for the long blocks of the three stream implementation */
+#define BUF_LEN (3 * 8192 * 2 + 1000)
+
+START_TEST(test_crc32c_check_value)
+{
+	const struct crc32c_impl *impl;
+	const unsigned char *check = (const unsigned char *)"123456789";
+
+	for (impl = crc32c_impls(); impl->name != NULL; impl++)
+		ck_assert_msg((impl->fn(~0, check, 9) ^ ~0U) == 0xE3069283, "%s", impl->name);
+	ck_assert((crc32c(~0, check, 9) ^ ~0U) == 0xE3069283);
+	ck_assert(crc32c(0x12345678, check, 0) == 0x12345678);
+}
+END_TEST
+
+START_TEST(test_crc32c_impls_agree)
+{
+	const size_t lens[] = { 1, 7, 8, 9, 255, 767, 768, 769, 4040, 4096,
+	                        3 * 8192 - 1, 3 * 8192, 3 * 8192 + 768 + 5, BUF_LEN - 8 };
+	const struct crc32c_impl *impl;
+	unsigned char *buf = malloc(BUF_LEN);
+
+	ck_assert(buf != NULL);
+	srandom(1);
+	for (size_t i = 0; i < BUF_LEN; i++)
+		buf[i] = random();
+
+	for (unsigned l = 0; l < sizeof(lens) / sizeof(lens[0]); l++) {
+		/* Check unaligned buffers too */
+		for (unsigned off = 0; off < 8; off += 3) {
+			uint32_t expected = crc32c_impls()->fn(~0, buf + off, lens[l]);
+
+			for (impl = crc32c_impls(); impl->name != NULL; impl++)
+				ck_assert_msg(impl->fn(~0, buf + off, lens[l]) == expected,
+				              "%s len %zu off %u", impl->name, lens[l], off);
+			ck_assert(crc32c(~0, buf + off, lens[l]) == expected);
+		}
+	}
+	free(buf);
+}
+END_TEST
+
+Suite *suite_crc32c(void)
+{
+	Suite *s = suite_create("crc32c.c");
+
+	TCase *tc = tcase_create("CRC32C implementations");
+	tcase_add_test(tc, test_crc32c_check_value);
+	tcase_add_test(tc, test_crc32c_impls_agree);
+	suite_add_tcase(s, tc);
+
+	return s;
+}
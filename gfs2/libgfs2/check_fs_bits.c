@@ -0,0 +1,99 @@
+#include <stdlib.h>
+#include <string.h>
+#include <check.h>
+#include "libgfs2.h"
+
+Suite *suite_fs_bits(void);
+
+#define BITMAP_MAX_LEN (4096)
+
+/* The reference implementation: call gfs2_bitfit() until nothing is found */
+static unsigned bitfit_scan(const unsigned char *buf, unsigned len, uint8_t state,
+                            uint64_t base, uint64_t *out)
+{
+	unsigned long blk = 0;
+	unsigned n = 0;
+
+	while (blk < len * GFS2_NBBY) {
+		blk = gfs2_bitfit(buf, len, blk, state);
+		if (blk == BFITNOENT)
+			break;
+		out[n++] = base + blk;
+		blk++;
+	}
+	return n;
+}
+
+static void check_scan(const unsigned char *buf, unsigned len)
+{
+	static uint64_t expected[BITMAP_MAX_LEN * GFS2_NBBY];
+	static uint64_t found[BITMAP_MAX_LEN * GFS2_NBBY];
+	uint8_t state;
+
+	for (state = 0; state < 4; state++) {
+		unsigned n = bitfit_scan(buf, len, state, 1000, expected);
+		unsigned m = lgfs2_bitmap_scan(buf, len, state, 1000, found);
+
+		ck_assert_int_eq(n, m);
+		ck_assert(memcmp(expected, found, n * sizeof(*found)) == 0);
+	}
+}
+
+START_TEST(test_bitmap_scan_random)
+{
+	/* Allocate to a multiple of 8 bytes as bitmaps are read a word at a time */
+	unsigned char *buf = malloc(BITMAP_MAX_LEN);
+	unsigned len, i;
+
+	ck_assert(buf != NULL);
+	srandom(1);
+	for (i = 0; i < BITMAP_MAX_LEN; i++)
+		buf[i] = random();
+	for (len = 1; len <= 80; len++)
+		check_scan(buf, len);
+	check_scan(buf, BITMAP_MAX_LEN - 24);
+	check_scan(buf, BITMAP_MAX_LEN);
+	free(buf);
+}
+END_TEST
+
+START_TEST(test_bitmap_scan_uniform)
+{
+	unsigned char *buf = malloc(BITMAP_MAX_LEN);
+	uint64_t *out = malloc(BITMAP_MAX_LEN * GFS2_NBBY * sizeof(*out));
+	unsigned n;
+
+	ck_assert(buf != NULL && out != NULL);
+	/* Every block is a dinode */
+	memset(buf, 0xff, BITMAP_MAX_LEN);
+	n = lgfs2_bitmap_scan(buf, 100, GFS2_BLKST_DINODE, 0, out);
+	ck_assert_int_eq(n, 100 * GFS2_NBBY);
+	ck_assert(out[0] == 0 && out[n - 1] == n - 1);
+	ck_assert_int_eq(lgfs2_bitmap_scan(buf, 100, GFS2_BLKST_FREE, 0, out), 0);
+	check_scan(buf, BITMAP_MAX_LEN);
+
+	/* Every block is free */
+	memset(buf, 0, BITMAP_MAX_LEN);
+	ck_assert_int_eq(lgfs2_bitmap_scan(buf, 100, GFS2_BLKST_DINODE, 0, out), 0);
+	ck_assert_int_eq(lgfs2_bitmap_scan(buf, 100, GFS2_BLKST_FREE, 0, out), 100 * GFS2_NBBY);
+	check_scan(buf, BITMAP_MAX_LEN);
+
+	/* Invalid state */
+	ck_assert_int_eq(lgfs2_bitmap_scan(buf, 100, 4, 0, out), 0);
+	free(out);
+	free(buf);
+}
+END_TEST
+
+Suite *suite_fs_bits(void)
+{
+	Suite *s = suite_create("fs_bits.c");
+	TCase *tc;
+
+	tc = tcase_create("lgfs2_bitmap_scan");
+	tcase_add_test(tc, test_bitmap_scan_random);
+	tcase_add_test(tc, test_bitmap_scan_uniform);
+	suite_add_tcase(s, tc);
+
+	return s;
+}
@@ -0,0 +1,242 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <check.h>
+#include "libgfs2.h"
+
+#define MOCK_BSIZE (4096)
+#define MOCK_DEV_SIZE (64 << 20)
+
+Suite *suite_fs_ops(void);
+
+static struct gfs2_inode *tc_ip;
+
+static void write_ptrs(struct gfs2_sbd *sdp, uint64_t addr, unsigned first, unsigned count,
+                       uint64_t dblock)
+{
+	char *buf = calloc(1, sdp->sd_bsize);
+	__be64 *ptr = (__be64 *)(buf + sizeof(struct gfs2_meta_header));
+	struct gfs2_meta_header *mh = (void *)buf;
+
+	ck_assert(buf != NULL);
+	ck_assert(pread(sdp->device_fd, buf, sdp->sd_bsize, addr * sdp->sd_bsize) == sdp->sd_bsize);
+	mh->mh_magic = cpu_to_be32(GFS2_MAGIC);
+	mh->mh_type = cpu_to_be32(GFS2_METATYPE_IN);
+	mh->mh_format = cpu_to_be32(GFS2_FORMAT_IN);
+	for (unsigned i = first; i < first + count; i++)
+		ptr[i] = cpu_to_be64(dblock ? dblock++ : 0);
+	ck_assert(pwrite(sdp->device_fd, buf, sdp->sd_bsize, addr * sdp->sd_bsize) == sdp->sd_bsize);
+	free(buf);
+}
+
+/*
+ * A height 2 file whose dinode points to indirect blocks 100, 101, nothing and
+ * 102. Block 100 maps a run starting at 1000 which continues for the first 10
+ * pointers of block 101, which are followed by a hole up to block 102, which
+ * maps a run starting at 7000.
+ */
+static void mockup_inode(void)
+{
+	char tmpnam[] = "mockdev-XXXXXX";
+	struct gfs2_sbd *sdp;
+	struct gfs2_inode *ip;
+	__be64 *ptr;
+	unsigned inptrs;
+
+	sdp = calloc(1, sizeof(*sdp));
+	ck_assert(sdp != NULL);
+	sdp->device_fd = mkstemp(tmpnam);
+	ck_assert(sdp->device_fd >= 0);
+	ck_assert(unlink(tmpnam) == 0);
+	ck_assert(ftruncate(sdp->device_fd, MOCK_DEV_SIZE) == 0);
+	sdp->sd_bsize = MOCK_BSIZE;
+	ck_assert(compute_constants(sdp) == 0);
+	inptrs = sdp->sd_inptrs;
+
+	ip = calloc(1, sizeof(*ip));
+	ck_assert(ip != NULL);
+	ip->i_sbd = sdp;
+	ip->i_num.in_addr = 10;
+	ip->i_mode = S_IFREG | 0644;
+	ip->i_height = 2;
+	ip->i_size = 4ULL * inptrs * sdp->sd_bsize;
+	ip->i_bh = bget(sdp, ip->i_num.in_addr);
+	ck_assert(ip->i_bh != NULL);
+	ip->bh_owned = 1;
+
+	ptr = (__be64 *)(ip->i_bh->b_data + sizeof(struct gfs2_dinode));
+	ptr[0] = cpu_to_be64(100);
+	ptr[1] = cpu_to_be64(101);
+	ptr[3] = cpu_to_be64(102);
+	write_ptrs(sdp, 100, 0, inptrs, 1000);
+	write_ptrs(sdp, 101, 0, 10, 1000 + inptrs);
+	write_ptrs(sdp, 102, 0, inptrs, 7000);
+	tc_ip = ip;
+}
+
+static void teardown_inode(void)
+{
+	struct gfs2_sbd *sdp = tc_ip->i_sbd;
+
+	inode_put(&tc_ip);
+	close(sdp->device_fd);
+	free(sdp);
+}
+
+START_TEST(test_map_extent)
+{
+	struct gfs2_inode *ip = tc_ip;
+	struct gfs2_sbd *sdp = ip->i_sbd;
+	unsigned inptrs = sdp->sd_inptrs;
+	uint64_t dblock, extlen;
+
+	/* A run which crosses from one indirect block into the next */
+	ck_assert(lgfs2_map_extent(ip, 0, UINT64_MAX, &dblock, &extlen) == 0);
+	ck_assert(dblock == 1000);
+	ck_assert(extlen == inptrs + 10);
+	ck_assert(lgfs2_map_extent(ip, 5, 20, &dblock, &extlen) == 0);
+	ck_assert(dblock == 1005);
+	ck_assert(extlen == 20);
+
+	/* A hole which continues through a missing indirect block */
+	ck_assert(lgfs2_map_extent(ip, inptrs + 10, UINT64_MAX, &dblock, &extlen) == 0);
+	ck_assert(dblock == 0);
+	ck_assert(extlen == 2 * inptrs - 10);
+
+	ck_assert(lgfs2_map_extent(ip, 3 * inptrs + 1, 5, &dblock, &extlen) == 0);
+	ck_assert(dblock == 7001);
+	ck_assert(extlen == 5);
+
+	/* Beyond the reach of the tree */
+	ck_assert(lgfs2_map_extent(ip, sdp->sd_diptrs * inptrs, 7, &dblock, &extlen) == 0);
+	ck_assert(dblock == 0);
+	ck_assert(extlen == 7);
+}
+END_TEST
+
+START_TEST(test_map_extent_cache)
+{
+	struct gfs2_inode *ip = tc_ip;
+	struct gfs2_sbd *sdp = ip->i_sbd;
+	uint64_t dblock, extlen;
+
+	ck_assert(lgfs2_map_extent(ip, 0, 1, &dblock, &extlen) == 0);
+	ck_assert(dblock == 1000);
+	ck_assert(ip->i_mapcache != NULL);
+
+	/* Changes made behind libgfs2's back aren't seen... */
+	write_ptrs(sdp, 100, 0, 1, 3000);
+	ck_assert(lgfs2_map_extent(ip, 0, 1, &dblock, &extlen) == 0);
+	ck_assert(dblock == 1000);
+
+	/* ...until it is told about them */
+	ck_assert(lgfs2_bcache_forget(sdp, 100, 1) == 0);
+	ck_assert(lgfs2_map_extent(ip, 0, 2, &dblock, &extlen) == 0);
+	ck_assert(dblock == 3000);
+	ck_assert(extlen == 1);
+}
+END_TEST
+
+START_TEST(test_readi)
+{
+	struct gfs2_inode *ip = tc_ip;
+	struct gfs2_sbd *sdp = ip->i_sbd;
+	unsigned inptrs = sdp->sd_inptrs;
+	uint64_t start = (inptrs - 1) * (uint64_t)sdp->sd_bsize;
+	size_t len = 12 * sdp->sd_bsize;
+	uint64_t blk;
+	char *buf;
+
+	buf = malloc(len);
+	ck_assert(buf != NULL);
+	/* Label the data blocks from the end of the first run into the hole */
+	for (unsigned i = 0; i < 12; i++) {
+		blk = 1000 + inptrs - 1 + i;
+		memset(buf, 0, sdp->sd_bsize);
+		memcpy(buf, &blk, sizeof(blk));
+		ck_assert(pwrite(sdp->device_fd, buf, sdp->sd_bsize, blk * sdp->sd_bsize) == sdp->sd_bsize);
+	}
+	memset(buf, 0xff, len);
+	ck_assert(gfs2_readi(ip, buf, start + 8, len - 8) == len - 8);
+	/* The label of the first block is skipped */
+	for (unsigned i = 1; i < 11; i++) {
+		blk = 1000 + inptrs - 1 + i;
+		ck_assert(memcmp(buf + i * sdp->sd_bsize - 8, &blk, sizeof(blk)) == 0);
+	}
+	for (size_t i = 0; i < len - 8; i++) {
+		if (i % sdp->sd_bsize < sdp->sd_bsize - 8 || i >= 11 * sdp->sd_bsize - 8)
+			ck_assert(buf[i] == 0);
+	}
+	ck_assert(buf[len - 8] == (char)0xff);
+	free(buf);
+}
+END_TEST
+
+START_TEST(test_bcache_writeback_error)
+{
+	struct gfs2_sbd *sdp = tc_ip->i_sbd;
+	struct gfs2_buffer_head *bh;
+	char path[64];
+	int rw_fd = sdp->device_fd;
+	char *buf;
+
+	buf = malloc(sdp->sd_bsize);
+	ck_assert(buf != NULL);
+	/* Room for 16 blocks */
+	ck_assert(lgfs2_bcache_init(sdp, 16 * (sdp->sd_bsize + 64)) == 0);
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", rw_fd);
+	sdp->device_fd = open(path, O_RDONLY);
+	ck_assert(sdp->device_fd >= 0);
+
+	/* Fill the cache with 8 dirty blocks and then 8 clean ones */
+	for (uint64_t blk = 5000; blk < 5016; blk++) {
+		bh = bread(sdp, blk);
+		ck_assert(bh != NULL);
+		if (blk < 5008) {
+			memset(bh->b_data, 0xaa, sdp->sd_bsize);
+			bmodified(bh);
+		}
+		brelse(bh);
+	}
+	/* Evicting a block for this one fails to write back the dirty ones */
+	bh = bread(sdp, 5016);
+	ck_assert(bh != NULL);
+	brelse(bh);
+
+	/* They are kept, and the failure is reported by the next sync */
+	close(sdp->device_fd);
+	sdp->device_fd = rw_fd;
+	ck_assert(lgfs2_bcache_sync(sdp) == -1);
+	ck_assert(errno == EBADF);
+	for (uint64_t blk = 5000; blk < 5008; blk++) {
+		ck_assert(pread(rw_fd, buf, sdp->sd_bsize, blk * sdp->sd_bsize) == sdp->sd_bsize);
+		ck_assert(buf[0] == (char)0xaa && buf[sdp->sd_bsize - 1] == (char)0xaa);
+	}
+	ck_assert(lgfs2_bcache_free(sdp) == 0);
+	free(buf);
+}
+END_TEST
+
+Suite *suite_fs_ops(void)
+{
+	Suite *s = suite_create("fs_ops.c");
+
+	TCase *tc = tcase_create("Block mapping");
+	tcase_add_checked_fixture(tc, mockup_inode, teardown_inode);
+	tcase_add_test(tc, test_map_extent);
+	tcase_add_test(tc, test_map_extent_cache);
+	tcase_add_test(tc, test_readi);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("Block cache");
+	tcase_add_checked_fixture(tc, mockup_inode, teardown_inode);
+	tcase_add_test(tc, test_bcache_writeback_error);
+	suite_add_tcase(s, tc);
+
+	return s;
+}
@@ -0,0 +1,50 @@
+#include <stdlib.h>
+#include <string.h>
+#include <check.h>
+#include "libgfs2.h"
+
+Suite *suite_gfs2_disk_hash(void);
+
+START_TEST(test_disk_hash_values)
+{
+	/* The standard CRC32 check value and the hashes of the dot entries */
+	ck_assert(gfs2_disk_hash("", 0) == 0);
+	ck_assert(gfs2_disk_hash("123456789", 9) == 0xCBF43926);
+	ck_assert(gfs2_disk_hash(".", 1) == 0x0ED4E242);
+	ck_assert(gfs2_disk_hash("..", 2) == 0x9608161C);
+}
+END_TEST
+
+START_TEST(test_disk_hash_impls_agree)
+{
+	const struct lgfs2_hash_impl *impls = lgfs2_disk_hash_impls();
+	unsigned char name[GFS2_FNAMESIZE + 16];
+
+	srandom(1);
+	for (unsigned i = 0; i < 20000; i++) {
+		size_t len = random() % GFS2_FNAMESIZE + 1;
+		unsigned off = random() % 16;
+		uint32_t expected;
+
+		for (size_t j = 0; j < len; j++)
+			name[off + j] = random();
+		expected = ~impls[0].fn(~0U, name + off, len);
+		for (const struct lgfs2_hash_impl *impl = impls + 1; impl->name != NULL; impl++)
+			ck_assert_msg(~impl->fn(~0U, name + off, len) == expected,
+			              "%s len %zu off %u", impl->name, len, off);
+		ck_assert(gfs2_disk_hash((char *)name + off, len) == expected);
+	}
+}
+END_TEST
+
+Suite *suite_gfs2_disk_hash(void)
+{
+	Suite *s = suite_create("gfs2_disk_hash.c");
+
+	TCase *tc = tcase_create("Directory name hashing");
+	tcase_add_test(tc, test_disk_hash_values);
+	tcase_add_test(tc, test_disk_hash_impls_agree);
+	suite_add_tcase(s, tc);
+
+	return s;
+}
@@ -0,0 +1,137 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <check.h>
+#include "libgfs2.h"
+
+Suite *suite_iostats(void);
+
+static struct gfs2_sbd *tc_sdp;
+
+static void mockup_sbd(void)
+{
+	char tmpnam[] = "mockdev-XXXXXX";
+	struct gfs2_sbd *sdp;
+
+	sdp = calloc(1, sizeof(*sdp));
+	ck_assert(sdp != NULL);
+	sdp->device_fd = mkstemp(tmpnam);
+	ck_assert(sdp->device_fd >= 0);
+	ck_assert(unlink(tmpnam) == 0);
+	ck_assert(ftruncate(sdp->device_fd, 1 << 20) == 0);
+	sdp->sd_bsize = 4096;
+	ck_assert(compute_constants(sdp) == 0);
+	tc_sdp = sdp;
+}
+
+static void teardown_sbd(void)
+{
+	lgfs2_iostats_free(tc_sdp);
+	close(tc_sdp->device_fd);
+	free(tc_sdp);
+}
+
+static void write_blocks(struct gfs2_sbd *sdp, const char *buf, unsigned n)
+{
+	for (unsigned i = 0; i < n; i++)
+		ck_assert(lgfs2_pwrite(sdp, sdp->device_fd, buf, 512, i * 512) == 512);
+}
+
+START_TEST(test_iostats_count)
+{
+	struct gfs2_sbd *sdp = tc_sdp;
+	struct gfs2_buffer_head *bh;
+	struct lgfs2_iostat st;
+	char buf[512] = {0};
+	uint64_t n;
+
+	/* Nothing is counted until accounting is enabled */
+	write_blocks(sdp, buf, 1);
+	ck_assert(lgfs2_iostats_get(sdp, 0, &st) == -1);
+
+	ck_assert(lgfs2_iostats_init(sdp) == 0);
+	ck_assert(lgfs2_iostats_init(sdp) == -1);
+	lgfs2_iostats_phase(sdp, "one");
+	write_blocks(sdp, buf, 3);
+	lgfs2_iostats_phase(sdp, "two");
+	bh = bread(sdp, 2);
+	ck_assert(bh != NULL);
+	brelse(bh);
+	lgfs2_iostats_phase(sdp, "one");
+	write_blocks(sdp, buf, 2);
+
+	ck_assert(lgfs2_iostats_get(sdp, 0, &st) == 0);
+	ck_assert(strcmp(st.phase, "one") == 0);
+	ck_assert(strcmp(st.caller, "write_blocks") == 0);
+	ck_assert(st.count[LGFS2_IO_WRITE] == 5);
+	ck_assert(st.bytes[LGFS2_IO_WRITE] == 5 * 512);
+	ck_assert(st.count[LGFS2_IO_READ] == 0);
+	n = 0;
+	for (unsigned b = 0; b < LGFS2_IOSTAT_BUCKETS; b++)
+		n += st.hist[LGFS2_IO_WRITE][b];
+	ck_assert(n == 5);
+
+	/* Block reads are counted against the caller of bread() */
+	ck_assert(lgfs2_iostats_get(sdp, 1, &st) == 0);
+	ck_assert(strcmp(st.phase, "two") == 0);
+	ck_assert(strcmp(st.caller, __func__) == 0);
+	ck_assert(st.count[LGFS2_IO_READ] == 1);
+	ck_assert(st.bytes[LGFS2_IO_READ] == sdp->sd_bsize);
+	ck_assert(lgfs2_iostats_get(sdp, 2, &st) == -1);
+}
+END_TEST
+
+START_TEST(test_iostats_dump)
+{
+	struct gfs2_sbd *sdp = tc_sdp;
+	char buf[512] = {0};
+	char out[32];
+	FILE *f;
+
+	ck_assert(lgfs2_iostats_dump(sdp, stdout, LGFS2_IOSTATS_TABLE) == -1);
+	ck_assert(lgfs2_iostats_init(sdp) == 0);
+	write_blocks(sdp, buf, 1);
+	f = tmpfile();
+	ck_assert(f != NULL);
+	ck_assert(lgfs2_iostats_dump(sdp, f, LGFS2_IOSTATS_JSON) == 0);
+	rewind(f);
+	ck_assert(fgets(out, sizeof(out), f) != NULL);
+	ck_assert(strncmp(out, "{\"bucket_limits_us\": [1, 2, 4", 29) == 0);
+	fclose(f);
+	lgfs2_iostats_free(sdp);
+	ck_assert(sdp->iostats == NULL);
+}
+END_TEST
+
+START_TEST(test_iostats_format)
+{
+	const char *path;
+
+	ck_assert(lgfs2_iostats_format("table", &path) == LGFS2_IOSTATS_TABLE);
+	ck_assert(path == NULL);
+	ck_assert(lgfs2_iostats_format("json:/tmp/x", &path) == LGFS2_IOSTATS_JSON);
+	ck_assert(strcmp(path, "/tmp/x") == 0);
+	ck_assert(lgfs2_iostats_format("json:", &path) == -1);
+	ck_assert(lgfs2_iostats_format("tab", NULL) == -1);
+	ck_assert(lgfs2_iostats_format("tablex", NULL) == -1);
+	ck_assert(lgfs2_iostats_format("", NULL) == -1);
+}
+END_TEST
+
+Suite *suite_iostats(void)
+{
+	Suite *s = suite_create("iostats.c");
+
+	TCase *tc = tcase_create("I/O accounting");
+	tcase_add_checked_fixture(tc, mockup_sbd, teardown_sbd);
+	tcase_add_test(tc, test_iostats_count);
+	tcase_add_test(tc, test_iostats_dump);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("lgfs2_iostats_format");
+	tcase_add_test(tc, test_iostats_format);
+	suite_add_tcase(s, tc);
+
+	return s;
+}
@@ -7,6 +7,14 @@ void print_it(const char *label, const char *fmt, const char *fmt2, ...) {}
 extern Suite *suite_meta(void);
 extern Suite *suite_ondisk(void);
 extern Suite *suite_rgrp(void);
+extern Suite *suite_fs_bits(void);
+extern Suite *suite_structures(void);
+extern Suite *suite_fs_ops(void);
+extern Suite *suite_iostats(void);
+extern Suite *suite_simdev(void);
+extern Suite *suite_metaimg(void);
+extern Suite *suite_crc32c(void);
+extern Suite *suite_gfs2_disk_hash(void);
 
 int main(void)
 {
@@ -15,6 +23,14 @@ int main(void)
 	SRunner *runner = srunner_create(suite_meta());
 	srunner_add_suite(runner, suite_ondisk());
 	srunner_add_suite(runner, suite_rgrp());
+	srunner_add_suite(runner, suite_fs_bits());
+	srunner_add_suite(runner, suite_structures());
+	srunner_add_suite(runner, suite_fs_ops());
+	srunner_add_suite(runner, suite_iostats());
+	srunner_add_suite(runner, suite_simdev());
+	srunner_add_suite(runner, suite_metaimg());
+	srunner_add_suite(runner, suite_crc32c());
+	srunner_add_suite(runner, suite_gfs2_disk_hash());
 
 	srunner_run_all(runner, CK_ENV);
 	failures = srunner_ntests_failed(runner);
@@ -0,0 +1,301 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <zlib.h>
+#include <bzlib.h>
+#include <check.h>
+#include "libgfs2.h"
+
+Suite *suite_metaimg(void);
+
+#define TC_BSIZE (1024)
+#define TC_FS_BYTES (256 * TC_BSIZE)
+
+static struct gfs2_sbd *tc_sdp;
+static char *tc_stream;
+static size_t tc_len;
+static size_t tc_recs[8]; /* Where each record starts */
+static unsigned tc_nrecs;
+
+static void add_record(uint64_t blk, const void *data, uint16_t len)
+{
+	struct saved_metablock svb = {
+		.blk = cpu_to_be64(blk),
+		.siglen = cpu_to_be16(len),
+	};
+
+	tc_stream = realloc(tc_stream, tc_len + sizeof(svb) + len);
+	ck_assert(tc_stream != NULL);
+	tc_recs[tc_nrecs++] = tc_len;
+	memcpy(tc_stream + tc_len, &svb, sizeof(svb));
+	memcpy(tc_stream + tc_len + sizeof(svb), data, len);
+	tc_len += sizeof(svb) + len;
+}
+
+/* A header, the superblock and three blocks, one of them saved twice */
+static void mockup_stream(void)
+{
+	struct savemeta_header smh = {
+		.sh_magic = cpu_to_be32(SAVEMETA_MAGIC),
+		.sh_format = cpu_to_be32(SAVEMETA_FORMAT_STREAM),
+		.sh_fs_bytes = cpu_to_be64(TC_FS_BYTES),
+	};
+	struct gfs2_sb sb = {
+		.sb_header.mh_magic = cpu_to_be32(GFS2_MAGIC),
+		.sb_header.mh_type = cpu_to_be32(GFS2_METATYPE_SB),
+		.sb_header.mh_format = cpu_to_be32(GFS2_FORMAT_SB),
+		.sb_bsize = cpu_to_be32(TC_BSIZE),
+		.sb_bsize_shift = cpu_to_be32(10),
+	};
+	char buf[TC_BSIZE];
+
+	tc_sdp = calloc(1, sizeof(*tc_sdp));
+	ck_assert(tc_sdp != NULL);
+	tc_sdp->device_fd = -1;
+	tc_stream = malloc(sizeof(smh));
+	ck_assert(tc_stream != NULL);
+	memcpy(tc_stream, &smh, sizeof(smh));
+	tc_len = sizeof(smh);
+	add_record(GFS2_SB_ADDR * GFS2_BASIC_BLOCK / TC_BSIZE, &sb, sizeof(sb));
+	memset(buf, 0xaa, sizeof(buf));
+	add_record(100, buf, sizeof(buf));
+	memset(buf, 0xbb, sizeof(buf));
+	add_record(101, buf, 10);
+	memset(buf, 0xcc, sizeof(buf));
+	add_record(100, buf, 20);
+	add_record(200, buf, sizeof(buf));
+}
+
+static void teardown_stream(void)
+{
+	lgfs2_metaimg_free(tc_sdp);
+	if (tc_sdp->device_fd >= 0)
+		close(tc_sdp->device_fd);
+	free(tc_sdp);
+	free(tc_stream);
+	tc_stream = NULL;
+	tc_len = 0;
+	tc_nrecs = 0;
+}
+
+static int open_image(const void *buf, size_t len)
+{
+	char tmpnam[] = "mockimg-XXXXXX";
+
+	tc_sdp->device_fd = mkstemp(tmpnam);
+	ck_assert(tc_sdp->device_fd >= 0);
+	ck_assert(unlink(tmpnam) == 0);
+	ck_assert(write(tc_sdp->device_fd, buf, len) == (ssize_t)len);
+	return lgfs2_metaimg_open(tc_sdp);
+}
+
+static size_t gzip_member(char *out, size_t outsize, const void *in, size_t len)
+{
+	z_stream zs = {0};
+
+	ck_assert(deflateInit2(&zs, 6, Z_DEFLATED, 16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY) == Z_OK);
+	zs.next_in = (unsigned char *)in;
+	zs.avail_in = len;
+	zs.next_out = (unsigned char *)out;
+	zs.avail_out = outsize;
+	ck_assert(deflate(&zs, Z_FINISH) == Z_STREAM_END);
+	deflateEnd(&zs);
+	return zs.total_out;
+}
+
+/* Compress the stream in gzip members of 'split' bytes each */
+static int open_gzip(size_t split)
+{
+	char *out = malloc(2 * tc_len + 1024);
+	size_t outlen = 0;
+	int ret;
+
+	ck_assert(out != NULL);
+	for (size_t off = 0; off < tc_len; off += split) {
+		size_t len = off + split < tc_len ? split : tc_len - off;
+
+		outlen += gzip_member(out + outlen, 2 * tc_len + 1024 - outlen, tc_stream + off, len);
+	}
+	ret = open_image(out, outlen);
+	free(out);
+	return ret;
+}
+
+/* Write the stream in format 2, as two chunks with the second copy of block 100
+   in the second, and open it. If 'trailer' is 0, leave the trailer off. */
+static int open_chunked(int trailer)
+{
+	struct saved_metablock end = { .blk = cpu_to_be64(SAVEMETA_END_BLK) };
+	struct savemeta_chunk sc[2] = {
+		{ .sc_first = cpu_to_be64(GFS2_SB_ADDR * GFS2_BASIC_BLOCK / TC_BSIZE),
+		  .sc_last = cpu_to_be64(101) },
+		{ .sc_first = cpu_to_be64(100), .sc_last = cpu_to_be64(200) }
+	};
+	size_t split[3] = { 0, tc_recs[3], tc_len };
+	char index[sizeof(end) + sizeof(sc)];
+	size_t outsize = 2 * tc_len + 1024;
+	char *out = malloc(outsize);
+	size_t outlen = 0;
+	size_t len;
+	int ret;
+
+	ck_assert(out != NULL);
+	((struct savemeta_header *)tc_stream)->sh_format = cpu_to_be32(SAVEMETA_FORMAT_CHUNKED);
+	for (unsigned i = 0; i < 2; i++) {
+		len = gzip_member(out + outlen, outsize - outlen, tc_stream + split[i], split[i + 1] - split[i]);
+		sc[i].sc_offset = cpu_to_be64(outlen);
+		sc[i].sc_len = cpu_to_be32(len);
+		sc[i].sc_size = cpu_to_be32(split[i + 1] - split[i]);
+		outlen += len;
+	}
+	memcpy(index, &end, sizeof(end));
+	memcpy(index + sizeof(end), sc, sizeof(sc));
+	len = gzip_member(out + outlen, outsize - outlen, index, sizeof(index));
+	if (trailer) {
+		lgfs2_savemeta_trailer(out + outlen + len, outlen, len, 2);
+		len += SAVEMETA_TRAILER_LEN;
+	}
+	ret = open_image(out, outlen + len);
+	free(out);
+	return ret;
+}
+
+static void check_image(struct gfs2_sbd *sdp)
+{
+	char buf[3 * TC_BSIZE];
+	char expected[3 * TC_BSIZE];
+	struct iovec iov[2];
+	struct gfs2_sb sb;
+
+	ck_assert(sdp->metaimg != NULL);
+	ck_assert(lgfs2_dev_size(sdp) == TC_FS_BYTES);
+
+	ck_assert(lgfs2_pread(sdp, sdp->device_fd, &sb, sizeof(sb), GFS2_SB_ADDR * GFS2_BASIC_BLOCK) == sizeof(sb));
+	ck_assert(be32_to_cpu(sb.sb_header.mh_magic) == GFS2_MAGIC);
+	ck_assert(be32_to_cpu(sb.sb_bsize) == TC_BSIZE);
+
+	/* The last copy of block 100, block 101 padded with zeroes and an unsaved block */
+	memset(expected, 0, sizeof(expected));
+	memset(expected, 0xcc, 20);
+	memset(expected + TC_BSIZE, 0xbb, 10);
+	ck_assert(lgfs2_pread(sdp, sdp->device_fd, buf, sizeof(buf), 100 * TC_BSIZE) == sizeof(buf));
+	ck_assert(memcmp(buf, expected, sizeof(buf)) == 0);
+
+	/* Unaligned reads, split over iovecs */
+	iov[0].iov_base = buf;
+	iov[0].iov_len = 15;
+	iov[1].iov_base = buf + 15;
+	iov[1].iov_len = TC_BSIZE;
+	ck_assert(lgfs2_preadv(sdp, sdp->device_fd, iov, 2, 100 * TC_BSIZE + 5) == TC_BSIZE + 15);
+	ck_assert(memcmp(buf, expected + 5, TC_BSIZE + 15) == 0);
+
+	/* Reads stop at the end of the saved file system */
+	ck_assert(lgfs2_pread(sdp, sdp->device_fd, buf, sizeof(buf), TC_FS_BYTES - TC_BSIZE) == TC_BSIZE);
+	ck_assert(lgfs2_pread(sdp, sdp->device_fd, buf, sizeof(buf), TC_FS_BYTES) == 0);
+
+	memset(expected, 0xcc, TC_BSIZE);
+	ck_assert(lgfs2_pread(sdp, sdp->device_fd, buf, TC_BSIZE, 200 * TC_BSIZE) == TC_BSIZE);
+	ck_assert(memcmp(buf, expected, TC_BSIZE) == 0);
+
+	ck_assert(lgfs2_pwrite(sdp, sdp->device_fd, buf, TC_BSIZE, 0) == -1);
+	ck_assert(errno == EROFS);
+}
+
+START_TEST(test_metaimg_raw)
+{
+	ck_assert(open_image(tc_stream, tc_len) == 0);
+	check_image(tc_sdp);
+}
+END_TEST
+
+START_TEST(test_metaimg_gzip)
+{
+	ck_assert(open_gzip(tc_len) == 0);
+	check_image(tc_sdp);
+	lgfs2_metaimg_free(tc_sdp);
+	close(tc_sdp->device_fd);
+
+	/* Records span the members */
+	ck_assert(open_gzip(300) == 0);
+	check_image(tc_sdp);
+}
+END_TEST
+
+START_TEST(test_metaimg_bzip2)
+{
+	unsigned outlen = 2 * tc_len + 1024;
+	char *out = malloc(outlen);
+
+	ck_assert(out != NULL);
+	ck_assert(BZ2_bzBuffToBuffCompress(out, &outlen, tc_stream, tc_len, 9, 0, 0) == BZ_OK);
+	ck_assert(open_image(out, outlen) == 0);
+	free(out);
+	check_image(tc_sdp);
+}
+END_TEST
+
+START_TEST(test_metaimg_chunked)
+{
+	struct lgfs2_savemeta_chunk *c;
+	uint32_t count;
+	char *buf;
+
+	ck_assert(open_chunked(1) == 0);
+	check_image(tc_sdp);
+
+	ck_assert(lgfs2_savemeta_index(tc_sdp->device_fd, &c, &count) == 0);
+	ck_assert(count == 2);
+	ck_assert(c[0].offset == 0);
+	ck_assert(c[1].offset == c[0].len);
+	ck_assert(c[0].size + c[1].size == tc_len);
+	ck_assert(c[1].first == 100 && c[1].last == 200);
+	buf = malloc(c[1].size);
+	ck_assert(buf != NULL);
+	ck_assert(lgfs2_savemeta_chunk_read(tc_sdp->device_fd, &c[1], buf) == 0);
+	ck_assert(memcmp(buf, tc_stream + tc_recs[3], c[1].size) == 0);
+	free(buf);
+	free(c);
+	lgfs2_metaimg_free(tc_sdp);
+	close(tc_sdp->device_fd);
+
+	/* Without the trailer, the records are read up to the index */
+	ck_assert(open_chunked(0) == 0);
+	ck_assert(lgfs2_savemeta_index(tc_sdp->device_fd, &c, &count) == 1);
+	check_image(tc_sdp);
+}
+END_TEST
+
+START_TEST(test_metaimg_not_image)
+{
+	char buf[TC_BSIZE] = {0};
+
+	ck_assert(open_image(buf, sizeof(buf)) == 0);
+	ck_assert(tc_sdp->metaimg == NULL);
+
+	/* Compressed files must be savemeta files */
+	close(tc_sdp->device_fd);
+	memset(tc_stream, 0, tc_len);
+	tc_sdp->device_fd = -1;
+	ck_assert(open_gzip(tc_len) == -1);
+	ck_assert(errno == EINVAL);
+	ck_assert(tc_sdp->metaimg == NULL);
+}
+END_TEST
+
+Suite *suite_metaimg(void)
+{
+	Suite *s = suite_create("metaimg.c");
+
+	TCase *tc = tcase_create("Savemeta images");
+	tcase_add_checked_fixture(tc, mockup_stream, teardown_stream);
+	tcase_add_test(tc, test_metaimg_raw);
+	tcase_add_test(tc, test_metaimg_gzip);
+	tcase_add_test(tc, test_metaimg_bzip2);
+	tcase_add_test(tc, test_metaimg_chunked);
+	tcase_add_test(tc, test_metaimg_not_image);
+	suite_add_tcase(s, tc);
+
+	return s;
+}
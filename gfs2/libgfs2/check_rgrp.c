@@ -1,3 +1,4 @@
+#include <errno.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <sys/types.h>
@@ -158,6 +159,286 @@ START_TEST(test_rgrps_write_final)
 }
 END_TEST
 
+static struct rgrp_tree *add_rg(struct gfs2_sbd *sdp, uint64_t addr, uint32_t len)
+{
+	struct rgrp_tree *rgd = rgrp_insert(&sdp->rgtree, addr);
+
+	ck_assert(rgd != NULL);
+	rgd->rt_length = 1;
+	rgd->rt_data0 = addr + 1;
+	rgd->rt_data = len - 1;
+	return rgd;
+}
+
+/* Check gfs2_blk2rgrpd() against a linear search of the tree */
+static void check_blk2rgrpd(struct gfs2_sbd *sdp, uint64_t max)
+{
+	uint64_t blk;
+
+	for (blk = 0; blk < max; blk++) {
+		struct rgrp_tree *expected = NULL;
+		struct osi_node *n;
+
+		for (n = osi_first(&sdp->rgtree); n; n = osi_next(n)) {
+			struct rgrp_tree *rgd = (struct rgrp_tree *)n;
+
+			if (blk >= rgd->rt_addr && blk < rgd->rt_data0 + rgd->rt_data)
+				expected = rgd;
+		}
+		ck_assert(gfs2_blk2rgrpd(sdp, blk) == expected);
+	}
+}
+
+START_TEST(test_rgrp_index)
+{
+	struct gfs2_sbd sbd = {0};
+	uint64_t addr = 17;
+	struct rgrp_tree *rgd;
+	int i;
+
+	/* Mostly regular with a gap, a small rgrp and a short last rgrp */
+	for (i = 0; i < 50; i++, addr += 1000)
+		add_rg(&sbd, addr, 1000);
+	addr += 123;
+	add_rg(&sbd, addr, 3);
+	addr += 3;
+	for (i = 0; i < 50; i++, addr += 1000)
+		add_rg(&sbd, addr, 1000);
+	add_rg(&sbd, addr, 500);
+
+	ck_assert(lgfs2_rgrp_index_build(&sbd) == 0);
+	ck_assert(sbd.rgindex != NULL);
+	check_blk2rgrpd(&sbd, addr + 1000);
+
+	/* Rgrps added after the index was built must still be found */
+	add_rg(&sbd, 50 * 1000 + 17, 100);
+	check_blk2rgrpd(&sbd, addr + 1000);
+
+	/* Overlapping rgrps can't be indexed */
+	rgd = add_rg(&sbd, 5, 100);
+	ck_assert(lgfs2_rgrp_index_build(&sbd) == -1);
+	ck_assert(sbd.rgindex == NULL);
+	rgd->rt_data = 1;
+	ck_assert(lgfs2_rgrp_index_build(&sbd) == 0);
+	check_blk2rgrpd(&sbd, addr + 1000);
+
+	gfs2_rgrp_free(&sbd, &sbd.rgtree);
+	ck_assert(sbd.rgindex == NULL);
+	ck_assert(gfs2_blk2rgrpd(&sbd, 100) == NULL);
+}
+END_TEST
+
+static struct rgrp_tree *write_rg(struct gfs2_sbd *sdp, uint64_t addr)
+{
+	struct rgrp_tree *rgd = add_rg(sdp, addr, 2001);
+	char *buf = calloc(1, sdp->sd_bsize);
+
+	ck_assert(buf != NULL);
+	rgd->rt_bitbytes = rgd->rt_data / GFS2_NBBY;
+	ck_assert(gfs2_compute_bitstructs(sdp->sd_bsize, rgd) == 0);
+	lgfs2_rgrp_out(rgd, buf);
+	ck_assert(pwrite(sdp->device_fd, buf, sdp->sd_bsize, addr * sdp->sd_bsize) == sdp->sd_bsize);
+	free(buf);
+	return rgd;
+}
+
+START_TEST(test_rgcache)
+{
+	char tmpnam[] = "mockdev-XXXXXX";
+	struct lgfs2_rgcache_stats st;
+	struct gfs2_sbd sbd = {0};
+	struct rgrp_tree *rgs[3];
+	uint64_t blk;
+
+	sbd.device_fd = mkstemp(tmpnam);
+	ck_assert(sbd.device_fd >= 0);
+	ck_assert(unlink(tmpnam) == 0);
+	sbd.sd_bsize = 4096;
+	compute_constants(&sbd);
+	sbd.fssize = 10000;
+	ck_assert(ftruncate(sbd.device_fd, sbd.fssize * sbd.sd_bsize) == 0);
+	for (int i = 0; i < 3; i++)
+		rgs[i] = write_rg(&sbd, 100 + i * 2001);
+	blk = rgs[0]->rt_data0 + 5;
+
+	/* Room for one resource group only */
+	ck_assert(lgfs2_rgcache_init(&sbd, sbd.sd_bsize) == 0);
+	for (int i = 0; i < 3; i++)
+		ck_assert(gfs2_rgrp_read(&sbd, rgs[i]) == 0);
+	lgfs2_rgcache_trim(&sbd);
+	ck_assert(rgs[0]->bits[0].bi_data == NULL);
+	ck_assert(rgs[1]->bits[0].bi_data == NULL);
+	ck_assert(rgs[2]->bits[0].bi_data != NULL);
+
+	/* Evicted bitmaps are loaded when they are used... */
+	ck_assert(gfs2_set_bitmap(rgs[0], blk, GFS2_BLKST_USED) == 0);
+	lgfs2_rgcache_trim(&sbd);
+	ck_assert(rgs[2]->bits[0].bi_data == NULL);
+	ck_assert(lgfs2_get_bitmap(&sbd, rgs[1]->rt_data0, rgs[1]) == GFS2_BLKST_FREE);
+	lgfs2_rgcache_trim(&sbd);
+	ck_assert(rgs[0]->bits[0].bi_data == NULL);
+
+	/* ...and changes to them are written out when they are evicted */
+	ck_assert(lgfs2_get_bitmap(&sbd, blk, rgs[0]) == GFS2_BLKST_USED);
+	ck_assert(lgfs2_rgcache_stats(&sbd, &st) == 0);
+	ck_assert(st.loads == 3);
+	ck_assert(st.evictions == 4);
+	ck_assert(st.writebacks == 1);
+
+	lgfs2_rgcache_free(&sbd);
+	ck_assert(sbd.rgcache == NULL);
+	ck_assert(lgfs2_rgcache_stats(&sbd, &st) == -1);
+	ck_assert(lgfs2_rgrp_load(rgs[2]) == -1);
+	ck_assert(lgfs2_rgrp_load(rgs[0]) == 0);
+
+	gfs2_rgrp_free(&sbd, &sbd.rgtree);
+	close(sbd.device_fd);
+}
+END_TEST
+
+START_TEST(test_rgcache_write_error)
+{
+	char tmpnam[] = "mockdev-XXXXXX";
+	struct lgfs2_rgcache_stats st;
+	struct gfs2_sbd sbd = {0};
+	struct rgrp_tree *rgs[2];
+	uint64_t blk;
+	int fd;
+
+	sbd.device_fd = mkstemp(tmpnam);
+	ck_assert(sbd.device_fd >= 0);
+	ck_assert(unlink(tmpnam) == 0);
+	sbd.sd_bsize = 4096;
+	compute_constants(&sbd);
+	sbd.fssize = 10000;
+	ck_assert(ftruncate(sbd.device_fd, sbd.fssize * sbd.sd_bsize) == 0);
+	for (int i = 0; i < 2; i++)
+		rgs[i] = write_rg(&sbd, 100 + i * 2001);
+	blk = rgs[0]->rt_data0 + 5;
+
+	/* Room for one resource group only */
+	ck_assert(lgfs2_rgcache_init(&sbd, sbd.sd_bsize) == 0);
+	ck_assert(gfs2_rgrp_read(&sbd, rgs[0]) == 0);
+	ck_assert(gfs2_set_bitmap(rgs[0], blk, GFS2_BLKST_USED) == 0);
+	ck_assert(gfs2_rgrp_read(&sbd, rgs[1]) == 0);
+
+	/* A modified rgrp which can't be written out stays in the cache... */
+	fd = sbd.device_fd;
+	sbd.device_fd = -1;
+	ck_assert(lgfs2_rgcache_trim(&sbd) == -1);
+	ck_assert(errno == EBADF);
+	ck_assert(rgs[0]->bits[0].bi_data != NULL);
+	ck_assert(rgs[0]->bits[0].bi_modified);
+	ck_assert(gfs2_rgrp_relse(&sbd, rgs[0]) == -1);
+	ck_assert(rgs[0]->bits[0].bi_data != NULL);
+
+	/* ...until it can be */
+	sbd.device_fd = fd;
+	ck_assert(lgfs2_rgcache_trim(&sbd) == 0);
+	ck_assert(rgs[0]->bits[0].bi_data == NULL);
+	ck_assert(lgfs2_get_bitmap(&sbd, blk, rgs[0]) == GFS2_BLKST_USED);
+	ck_assert(lgfs2_rgcache_stats(&sbd, &st) == 0);
+	ck_assert(st.evictions == 1);
+	ck_assert(st.writebacks == 1);
+
+	lgfs2_rgcache_free(&sbd);
+	gfs2_rgrp_free(&sbd, &sbd.rgtree);
+	close(sbd.device_fd);
+}
+END_TEST
+
+START_TEST(test_free_block_load_error)
+{
+	char tmpnam[] = "mockdev-XXXXXX";
+	struct gfs2_sbd sbd = {0};
+	struct rgrp_tree *rgs[2];
+	uint32_t rgfree;
+	int fd;
+
+	sbd.device_fd = mkstemp(tmpnam);
+	ck_assert(sbd.device_fd >= 0);
+	ck_assert(unlink(tmpnam) == 0);
+	sbd.sd_bsize = 4096;
+	compute_constants(&sbd);
+	sbd.fssize = 10000;
+	ck_assert(ftruncate(sbd.device_fd, sbd.fssize * sbd.sd_bsize) == 0);
+	for (int i = 0; i < 2; i++)
+		rgs[i] = write_rg(&sbd, 100 + i * 2001);
+
+	ck_assert(lgfs2_rgcache_init(&sbd, sbd.sd_bsize) == 0);
+	for (int i = 0; i < 2; i++)
+		ck_assert(gfs2_rgrp_read(&sbd, rgs[i]) == 0);
+	lgfs2_rgcache_trim(&sbd);
+	ck_assert(rgs[0]->bits[0].bi_data == NULL);
+
+	/* An evicted rgrp which can't be loaded again is left alone */
+	fd = sbd.device_fd;
+	sbd.device_fd = -1;
+	rgfree = rgs[0]->rt_free;
+	ck_assert(gfs2_free_block(&sbd, rgs[0]->rt_data0 + 5) == -1);
+	ck_assert(rgs[0]->rt_free == rgfree);
+	ck_assert(rgs[0]->bits[0].bi_data == NULL);
+	sbd.device_fd = fd;
+	ck_assert(gfs2_free_block(&sbd, rgs[0]->rt_data0 + 5) == 0);
+	ck_assert(rgs[0]->rt_free == rgfree + 1);
+
+	lgfs2_rgcache_free(&sbd);
+	gfs2_rgrp_free(&sbd, &sbd.rgtree);
+	close(sbd.device_fd);
+}
+END_TEST
+
+START_TEST(test_rgrp_read_header)
+{
+	char tmpnam[] = "mockdev-XXXXXX";
+	struct lgfs2_rgcache_stats st;
+	struct gfs2_sbd sbd = {0};
+	struct rgrp_tree *rgs[2];
+	char *zeroes;
+
+	sbd.device_fd = mkstemp(tmpnam);
+	ck_assert(sbd.device_fd >= 0);
+	ck_assert(unlink(tmpnam) == 0);
+	sbd.sd_bsize = 4096;
+	compute_constants(&sbd);
+	sbd.fssize = 10000;
+	ck_assert(ftruncate(sbd.device_fd, sbd.fssize * sbd.sd_bsize) == 0);
+	for (int i = 0; i < 2; i++)
+		rgs[i] = write_rg(&sbd, 100 + i * 2001);
+
+	/* Without a cache the bitmaps could never be loaded */
+	ck_assert(lgfs2_rgrp_read_header(&sbd, rgs[0]) == (uint64_t)-1);
+
+	ck_assert(lgfs2_rgcache_init(&sbd, 2 * sbd.sd_bsize) == 0);
+	for (int i = 0; i < 2; i++) {
+		uint32_t rgfree = rgs[i]->rt_free;
+
+		rgs[i]->rt_free = rgfree + 1;
+		ck_assert(lgfs2_rgrp_read_header(&sbd, rgs[i]) == 0);
+		ck_assert(rgs[i]->rt_free == rgfree);
+		ck_assert(rgs[i]->bits[0].bi_data == NULL);
+	}
+
+	/* The bitmaps are loaded when they are first used */
+	ck_assert(lgfs2_get_bitmap(&sbd, rgs[1]->rt_data0, rgs[1]) == GFS2_BLKST_FREE);
+	ck_assert(rgs[0]->bits[0].bi_data == NULL);
+	ck_assert(rgs[1]->bits[0].bi_data != NULL);
+	ck_assert(lgfs2_rgcache_stats(&sbd, &st) == 0);
+	ck_assert(st.loads == 1);
+
+	/* A bad header is reported by its address */
+	zeroes = calloc(1, sbd.sd_bsize);
+	ck_assert(zeroes != NULL);
+	ck_assert(pwrite(sbd.device_fd, zeroes, sbd.sd_bsize, rgs[0]->rt_addr * sbd.sd_bsize) == sbd.sd_bsize);
+	free(zeroes);
+	ck_assert(lgfs2_rgrp_read_header(&sbd, rgs[0]) == rgs[0]->rt_addr);
+
+	lgfs2_rgcache_free(&sbd);
+	gfs2_rgrp_free(&sbd, &sbd.rgtree);
+	close(sbd.device_fd);
+}
+END_TEST
+
 Suite *suite_rgrp(void)
 {
 
@@ -177,5 +458,16 @@ Suite *suite_rgrp(void)
 	tcase_add_test(tc, test_rgrps_write_final);
 	suite_add_tcase(s, tc);
 
+	tc = tcase_create("gfs2_blk2rgrpd");
+	tcase_add_test(tc, test_rgrp_index);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("lgfs2_rgcache");
+	tcase_add_test(tc, test_rgcache);
+	tcase_add_test(tc, test_rgrp_read_header);
+	tcase_add_test(tc, test_free_block_load_error);
+	tcase_add_test(tc, test_rgcache_write_error);
+	suite_add_tcase(s, tc);
+
 	return s;
 }
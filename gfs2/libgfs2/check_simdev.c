@@ -0,0 +1,180 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <check.h>
+#include "libgfs2.h"
+
+Suite *suite_simdev(void);
+
+static struct gfs2_sbd *tc_sdp;
+
+static void mockup_sbd(void)
+{
+	char tmpnam[] = "mockdev-XXXXXX";
+	struct gfs2_sbd *sdp;
+
+	sdp = calloc(1, sizeof(*sdp));
+	ck_assert(sdp != NULL);
+	sdp->device_fd = mkstemp(tmpnam);
+	ck_assert(sdp->device_fd >= 0);
+	ck_assert(unlink(tmpnam) == 0);
+	ck_assert(ftruncate(sdp->device_fd, 1 << 20) == 0);
+	sdp->sd_bsize = 4096;
+	ck_assert(compute_constants(sdp) == 0);
+	tc_sdp = sdp;
+}
+
+static void teardown_sbd(void)
+{
+	lgfs2_simdev_free(tc_sdp);
+	close(tc_sdp->device_fd);
+	free(tc_sdp);
+}
+
+static uint64_t now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+START_TEST(test_simdev_spec)
+{
+	struct gfs2_sbd *sdp = tc_sdp;
+	struct lgfs2_simdev_stats st;
+
+	ck_assert(lgfs2_simdev_init(sdp, NULL) == 0);
+	ck_assert(sdp->simdev == NULL);
+	ck_assert(lgfs2_simdev_stats(sdp, &st) == -1);
+
+	ck_assert(lgfs2_simdev_init(sdp, "lat") == -1);
+	ck_assert(errno == EINVAL);
+	ck_assert(lgfs2_simdev_init(sdp, "speed=1") == -1);
+	ck_assert(lgfs2_simdev_init(sdp, "qd=0") == -1);
+	ck_assert(lgfs2_simdev_init(sdp, "lat=1ms") == -1);
+	ck_assert(sdp->simdev == NULL);
+
+	ck_assert(lgfs2_simdev_init(sdp, "lat=10,bw=100,qd=2,maxio=64,cache=1") == 0);
+	ck_assert(sdp->simdev != NULL);
+	ck_assert(lgfs2_simdev_init(sdp, "") == -1);
+	ck_assert(lgfs2_simdev_stats(sdp, &st) == 0);
+	ck_assert(st.requests == 0);
+}
+END_TEST
+
+START_TEST(test_simdev_queue)
+{
+	struct gfs2_sbd *sdp = tc_sdp;
+	struct lgfs2_simdev_stats st;
+	uint64_t start, due1, due2, due3;
+
+	ck_assert(lgfs2_simdev_init(sdp, "lat=1000,bw=1024,qd=1,cache=1") == 0);
+	start = now();
+	due1 = lgfs2_simdev_submit(sdp->simdev, LGFS2_IO_READ, 0, 4096);
+	ck_assert(due1 >= start + 1000000);
+	/* With one request at a time, the second waits for the first */
+	due2 = lgfs2_simdev_submit(sdp->simdev, LGFS2_IO_READ, 8192, 4096);
+	ck_assert(due2 >= due1 + 1000000);
+	/* Cached, so it only has to wait for the first read to finish */
+	due3 = lgfs2_simdev_submit(sdp->simdev, LGFS2_IO_READ, 0, 512);
+	ck_assert(due3 == due1);
+	ck_assert(lgfs2_simdev_stats(sdp, &st) == 0);
+	ck_assert(st.requests == 2);
+	ck_assert(st.misses == 2);
+	ck_assert(st.hits == 1);
+	lgfs2_simdev_free(sdp);
+
+	ck_assert(lgfs2_simdev_init(sdp, "lat=1000,bw=1024,qd=2,cache=1") == 0);
+	due1 = lgfs2_simdev_submit(sdp->simdev, LGFS2_IO_READ, 0, 4096);
+	due2 = lgfs2_simdev_submit(sdp->simdev, LGFS2_IO_READ, 8192, 4096);
+	ck_assert(due2 < due1 + 1000000);
+	/* Large requests are split over the queue */
+	start = now();
+	due3 = lgfs2_simdev_submit(sdp->simdev, LGFS2_IO_WRITE, 1 << 16, 1 << 20);
+	ck_assert(due3 < start + 2 * 1000000 + 1000000000ULL / 1024);
+}
+END_TEST
+
+START_TEST(test_simdev_ahead)
+{
+	struct gfs2_sbd *sdp = tc_sdp;
+	struct lgfs2_simdev_stats st;
+	uint64_t due1, due2;
+
+	ck_assert(lgfs2_simdev_init(sdp, "lat=1000,qd=1,cache=1") == 0);
+	ck_assert(lgfs2_fadvise(sdp, sdp->device_fd, 0, 65536, POSIX_FADV_WILLNEED) == 0);
+	due1 = lgfs2_simdev_submit(sdp->simdev, LGFS2_IO_READ, 4096, 8192);
+	due2 = lgfs2_simdev_submit(sdp->simdev, LGFS2_IO_READ, 65536, 4096);
+	ck_assert(due2 >= due1 + 1000000);
+	ck_assert(lgfs2_simdev_stats(sdp, &st) == 0);
+	ck_assert(st.requests == 2);
+	ck_assert(st.ahead == 16);
+	ck_assert(st.ahead_used == 2);
+	ck_assert(st.misses == 1);
+
+	ck_assert(lgfs2_fadvise(sdp, sdp->device_fd, 0, 0, POSIX_FADV_DONTNEED) == 0);
+	lgfs2_simdev_submit(sdp->simdev, LGFS2_IO_READ, 4096, 4096);
+	ck_assert(lgfs2_simdev_stats(sdp, &st) == 0);
+	ck_assert(st.misses == 2);
+}
+END_TEST
+
+START_TEST(test_simdev_io)
+{
+	char tmpnam[] = "simtrace-XXXXXX";
+	struct gfs2_sbd *sdp = tc_sdp;
+	char spec[64], line[128];
+	char buf[512], rbuf[512];
+	unsigned reads = 0;
+	uint64_t start;
+	FILE *f;
+	int fd;
+
+	fd = mkstemp(tmpnam);
+	ck_assert(fd >= 0);
+	close(fd);
+	snprintf(spec, sizeof(spec), "lat=2000,trace=%s", tmpnam);
+	ck_assert(lgfs2_simdev_init(sdp, spec) == 0);
+
+	memset(buf, 0x5a, sizeof(buf));
+	ck_assert(lgfs2_pwrite(sdp, sdp->device_fd, buf, sizeof(buf), 4096) == sizeof(buf));
+	ck_assert(lgfs2_fadvise(sdp, sdp->device_fd, 0, 0, POSIX_FADV_DONTNEED) == 0);
+	start = now();
+	ck_assert(lgfs2_pread(sdp, sdp->device_fd, rbuf, sizeof(rbuf), 4096) == sizeof(rbuf));
+	ck_assert(now() >= start + 2000000);
+	ck_assert(memcmp(buf, rbuf, sizeof(buf)) == 0);
+	lgfs2_simdev_free(sdp);
+
+	f = fopen(tmpnam, "r");
+	ck_assert(f != NULL);
+	ck_assert(fgets(line, sizeof(line), f) != NULL);
+	ck_assert(strstr(line, " W 4096 512 ") != NULL);
+	while (fgets(line, sizeof(line), f) != NULL)
+		reads += strstr(line, " R 4096 512 4096 ") != NULL;
+	ck_assert(reads == 1);
+	ck_assert(strncmp(line, "# requests 2 ", 13) == 0);
+	fclose(f);
+	unlink(tmpnam);
+}
+END_TEST
+
+Suite *suite_simdev(void)
+{
+	Suite *s = suite_create("simdev.c");
+
+	TCase *tc = tcase_create("Simulated device");
+	tcase_add_checked_fixture(tc, mockup_sbd, teardown_sbd);
+	tcase_add_test(tc, test_simdev_spec);
+	tcase_add_test(tc, test_simdev_queue);
+	tcase_add_test(tc, test_simdev_ahead);
+	tcase_add_test(tc, test_simdev_io);
+	suite_add_tcase(s, tc);
+
+	return s;
+}
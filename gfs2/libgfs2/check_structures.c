@@ -0,0 +1,53 @@
+#include <stdlib.h>
+#include <string.h>
+#include <check.h>
+#include "libgfs2.h"
+
+Suite *suite_structures(void);
+
+#define LH_BSIZE (1024)
+#define LH_COUNT (8)
+
+START_TEST(test_log_headers_fill)
+{
+	char *buf = calloc(LH_COUNT, LH_BSIZE);
+	uint64_t seq;
+	unsigned i;
+
+	ck_assert(buf != NULL);
+	/* Fill twice to check that the buffer can be reused */
+	seq = lgfs2_log_headers_fill(buf, LH_BSIZE, LH_COUNT, 1234, 0, 5000, 3, 10);
+	ck_assert(seq == 1);
+	seq = lgfs2_log_headers_fill(buf, LH_BSIZE, LH_COUNT, 1234, 8, 6000, 7, 10);
+	ck_assert(seq == 5);
+
+	for (i = 0; i < LH_COUNT; i++) {
+		char *b = buf + i * LH_BSIZE;
+		struct gfs2_log_header *lh = (void *)b;
+		uint32_t hash = be32_to_cpu(lh->lh_hash);
+		uint32_t crc = be32_to_cpu(lh->lh_crc);
+
+		ck_assert(be32_to_cpu(lh->lh_header.mh_magic) == GFS2_MAGIC);
+		ck_assert(be32_to_cpu(lh->lh_header.mh_type) == GFS2_METATYPE_LH);
+		ck_assert(be64_to_cpu(lh->lh_jinode) == 1234);
+		ck_assert(be64_to_cpu(lh->lh_sequence) == (7 + i) % 10);
+		ck_assert(be32_to_cpu(lh->lh_blkno) == 8 + i);
+		ck_assert(be64_to_cpu(lh->lh_addr) == 6000 + i);
+		ck_assert(crc == lgfs2_log_header_crc(b, LH_BSIZE));
+		lh->lh_hash = 0;
+		ck_assert(hash == lgfs2_log_header_hash(b));
+	}
+	free(buf);
+}
+END_TEST
+
+Suite *suite_structures(void)
+{
+	Suite *s = suite_create("structures.c");
+
+	TCase *tc = tcase_create("Log headers");
+	tcase_add_test(tc, test_log_headers_fill);
+	suite_add_tcase(s, tc);
+
+	return s;
+}
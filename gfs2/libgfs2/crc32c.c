@@ -9,14 +9,32 @@
  *
  */
 #include <stdlib.h>
+#include <string.h>
 #include <inttypes.h>
 #include "crc32c.h"
 
 static uint32_t __crc32c_le(uint32_t crc, unsigned char const *data, size_t length);
+static uint32_t crc32c_sb8(uint32_t crc, unsigned char const *data, size_t length);
+static void crc32c_sb8_init(void);
 static uint32_t (*crc_function)(uint32_t crc, unsigned char const *data, size_t length) = __crc32c_le;
 
+/* The CRC-32C polynomial in reflected form */
+#define CRC32C_POLY_LE (0x82F63B78)
+
+static struct crc32c_impl crc32c_impl_list[] = {
+	{ .name = "table", .fn = __crc32c_le },
+	{ .name = "slice8", .fn = crc32c_sb8 },
+	{ .name = NULL },
+	{ .name = NULL },
+	{ .name = NULL },
+};
+static unsigned crc32c_nimpls = 2;
+
 #ifdef __x86_64__
 
+#include <nmmintrin.h>
+#include <wmmintrin.h>
+
 /*
  * Based on a posting to lkml by Austin Zhang <austin.zhang@intel.com>
  *
@@ -37,6 +55,7 @@ static uint32_t (*crc_function)(uint32_t crc, unsigned char const *data, size_t
 
 static int crc32c_probed = 0;
 static int crc32c_intel_available = 0;
+static int crc32c_pclmul_available = 0;
 
 static uint32_t crc32c_intel_le_hw_byte(uint32_t crc, unsigned char const *data,
 					unsigned long length)
@@ -54,28 +73,117 @@ static uint32_t crc32c_intel_le_hw_byte(uint32_t crc, unsigned char const *data,
 }
 
 /*
- * Steps through buffer one byte at at time, calculates reflected 
- * crc using table.
+ * Steps through buffer one word at a time using the crc32 instruction.
  */
-static uint32_t crc32c_intel(uint32_t crc, unsigned char const *data, unsigned long length)
+static uint32_t crc32c_intel(uint32_t crc, unsigned char const *data, size_t length)
 {
-	unsigned int iquotient = length / SCALE_F;
-	unsigned int iremainder = length % SCALE_F;
-	unsigned long *ptmp = (unsigned long *)data;
+	unsigned long iquotient = length / SCALE_F;
+	unsigned long iremainder = length % SCALE_F;
 
 	while (iquotient--) {
+		unsigned long word;
+
+		memcpy(&word, data, sizeof(word));
 		__asm__ __volatile__(
 			".byte 0xf2, " REX_PRE "0xf, 0x38, 0xf1, 0xf1;"
 			:"=S"(crc)
-			:"0"(crc), "c"(*ptmp)
+			:"0"(crc), "c"(word)
 		);
-		ptmp++;
+		data += SCALE_F;
 	}
 
 	if (iremainder)
-		crc = crc32c_intel_le_hw_byte(crc, (unsigned char *)ptmp,
-				 iremainder);
+		crc = crc32c_intel_le_hw_byte(crc, data, iremainder);
+
+	return crc;
+}
+
+/*
+ * A single chain of crc32 instructions can only complete one every three
+ * cycles, as each depends on the last. Splitting the buffer into three streams
+ * keeps three in flight. The crcs of the streams are then combined by
+ * shifting the first two past the data that follows them, which is a
+ * carry-less multiplication by x^(8 * bytes) mod P.
+ *
+ * Blocks of CRC32C_LONG bytes are used for large buffers and CRC32C_SHORT for
+ * the rest, such as most of a log header.
+ */
+#define CRC32C_LONG (8192)
+#define CRC32C_SHORT (256)
+
+/* Shift constants for the first and second streams */
+static uint64_t crc32c_k_long[2];
+static uint64_t crc32c_k_short[2];
+
+/* Returns x^n mod P in reflected form */
+static uint32_t crc32c_xpow(uint64_t n)
+{
+	uint32_t v = 0x80000000;
+
+	while (n--)
+		v = (v >> 1) ^ ((v & 1) ? CRC32C_POLY_LE : 0);
+	return v;
+}
+
+static void crc32c_pcl_init(void)
+{
+	/* The multiplication and the crc32 of its 64 bit result contribute
+	   x^33, which the constants make up for */
+	crc32c_k_long[0] = crc32c_xpow(CRC32C_LONG * 8 * 2 - 33);
+	crc32c_k_long[1] = crc32c_xpow(CRC32C_LONG * 8 - 33);
+	crc32c_k_short[0] = crc32c_xpow(CRC32C_SHORT * 8 * 2 - 33);
+	crc32c_k_short[1] = crc32c_xpow(CRC32C_SHORT * 8 - 33);
+}
+
+__attribute__((target("sse4.2,pclmul")))
+static uint32_t crc32c_shift(uint64_t crc, uint64_t k)
+{
+	__m128i prod = _mm_clmulepi64_si128(_mm_cvtsi64_si128(crc), _mm_cvtsi64_si128(k), 0);
+
+	return _mm_crc32_u64(0, _mm_cvtsi128_si64(prod));
+}
+
+__attribute__((target("sse4.2,pclmul")))
+static unsigned char const *crc32c_3way(uint32_t *crc, unsigned char const *data,
+                                        size_t block, const uint64_t *k)
+{
+	unsigned char const *end = data + block;
+	uint64_t c0 = *crc, c1 = 0, c2 = 0;
+
+	for (; data < end; data += 8) {
+		uint64_t w0, w1, w2;
+
+		memcpy(&w0, data, 8);
+		memcpy(&w1, data + block, 8);
+		memcpy(&w2, data + 2 * block, 8);
+		c0 = _mm_crc32_u64(c0, w0);
+		c1 = _mm_crc32_u64(c1, w1);
+		c2 = _mm_crc32_u64(c2, w2);
+	}
+	*crc = crc32c_shift(c0, k[0]) ^ crc32c_shift(c1, k[1]) ^ (uint32_t)c2;
+	return end + 2 * block;
+}
+
+__attribute__((target("sse4.2,pclmul")))
+static uint32_t crc32c_pcl(uint32_t crc, unsigned char const *data, size_t length)
+{
+	uint64_t c;
+
+	for (; length >= 3 * CRC32C_LONG; length -= 3 * CRC32C_LONG)
+		data = crc32c_3way(&crc, data, CRC32C_LONG, crc32c_k_long);
+	for (; length >= 3 * CRC32C_SHORT; length -= 3 * CRC32C_SHORT)
+		data = crc32c_3way(&crc, data, CRC32C_SHORT, crc32c_k_short);
 
+	c = crc;
+	for (; length >= 8; length -= 8, data += 8) {
+		uint64_t w;
+
+		memcpy(&w, data, 8);
+		c = _mm_crc32_u64(c, w);
+	}
+	crc = c;
+	while (length--)
+		crc = _mm_crc32_u8(crc, *data++);
 	return crc;
 }
 
@@ -104,20 +212,41 @@ static void crc32c_intel_probe(void)
 
 		do_cpuid(&eax, &ebx, &ecx, &edx);
 		crc32c_intel_available = (ecx & (1 << 20)) != 0;
+		crc32c_pclmul_available = crc32c_intel_available && (ecx & (1 << 1)) != 0;
 		crc32c_probed = 1;
 	}
 }
 
 void crc32c_optimization_init(void)
 {
+	if (crc32c_probed)
+		return;
+	crc32c_sb8_init();
+	crc_function = crc32c_sb8;
 	crc32c_intel_probe();
-	if (crc32c_intel_available)
+	if (crc32c_intel_available) {
+		crc32c_impl_list[crc32c_nimpls].name = "sse4.2";
+		crc32c_impl_list[crc32c_nimpls++].fn = crc32c_intel;
 		crc_function = crc32c_intel;
+	}
+	if (crc32c_pclmul_available) {
+		crc32c_pcl_init();
+		crc32c_impl_list[crc32c_nimpls].name = "sse4.2-3way";
+		crc32c_impl_list[crc32c_nimpls++].fn = crc32c_pcl;
+		crc_function = crc32c_pcl;
+	}
 }
 #else
 
+static int crc32c_probed = 0;
+
 void crc32c_optimization_init(void)
 {
+	if (crc32c_probed)
+		return;
+	crc32c_sb8_init();
+	crc_function = crc32c_sb8;
+	crc32c_probed = 1;
 }
 
 #endif /* __x86_64__ */
@@ -211,11 +340,53 @@ static uint32_t __crc32c_le(uint32_t crc, unsigned char const *data, size_t leng
 	return crc;
 }
 
-uint32_t crc32c(uint32_t crc, unsigned char const *data, size_t length)
+/*
+ * Slicing-by-8: crc32c_sb8_table[n][b] is the crc of byte b followed by n
+ * zero bytes, so eight bytes can be looked up independently of each other.
+ */
+static uint32_t crc32c_sb8_table[8][256];
+
+static void crc32c_sb8_init(void)
 {
-	/* Use by-byte access for unaligned buffers */
-	if ((unsigned long)data % sizeof(unsigned long))
-		return __crc32c_le(crc, data, length);
+	unsigned i, n;
+
+	for (i = 0; i < 256; i++) {
+		uint32_t crc = crc32c_table[i];
 
+		crc32c_sb8_table[0][i] = crc;
+		for (n = 1; n < 8; n++) {
+			crc = crc32c_table[crc & 0xff] ^ (crc >> 8);
+			crc32c_sb8_table[n][i] = crc;
+		}
+	}
+}
+
+static uint32_t crc32c_sb8(uint32_t crc, unsigned char const *data, size_t length)
+{
+	const uint32_t (*t)[256] = (const uint32_t (*)[256])crc32c_sb8_table;
+
+	for (; length >= 8; length -= 8, data += 8) {
+		uint32_t lo = crc ^ (data[0] | data[1] << 8 | data[2] << 16 | (uint32_t)data[3] << 24);
+
+		crc = t[7][lo & 0xff] ^ t[6][(lo >> 8) & 0xff] ^
+		      t[5][(lo >> 16) & 0xff] ^ t[4][lo >> 24] ^
+		      t[3][data[4]] ^ t[2][data[5]] ^ t[1][data[6]] ^ t[0][data[7]];
+	}
+	return __crc32c_le(crc, data, length);
+}
+
+/**
+ * Returns the implementations which can be used on this machine, fastest
+ * last, in an array terminated by an entry with a NULL name. For testing and
+ * benchmarking.
+ */
+const struct crc32c_impl *crc32c_impls(void)
+{
+	crc32c_optimization_init();
+	return crc32c_impl_list;
+}
+
+uint32_t crc32c(uint32_t crc, unsigned char const *data, size_t length)
+{
 	return crc_function(crc, data, length);
 }
@@ -3,7 +3,13 @@
 #include <stdlib.h>
 #include <inttypes.h>
 
+struct crc32c_impl {
+	const char *name;
+	uint32_t (*fn)(uint32_t crc, unsigned char const *data, size_t length);
+};
+
 uint32_t crc32c(uint32_t seed, unsigned char const *data, size_t length);
 void crc32c_optimization_init(void);
+const struct crc32c_impl *crc32c_impls(void);
 
 #endif
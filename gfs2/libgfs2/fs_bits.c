@@ -98,6 +98,49 @@ unsigned long gfs2_bitfit(const unsigned char *buf, const unsigned int len,
 	return (((const unsigned char *)ptr - buf) * GFS2_NBBY) + bit;
 }
 
+static inline unsigned bit_extract(uint64_t tmp, uint64_t base, uint64_t *out)
+{
+	unsigned n = 0;
+
+	while (tmp != 0) {
+		/* Matches are on even bit positions, two bits per entry */
+		out[n++] = base + (__builtin_ctzll(tmp) >> 1);
+		tmp &= tmp - 1;
+	}
+	return n;
+}
+
+/**
+ * Find all of the blocks in a bitmap which are in a given state, in a single
+ * pass. This gives the same results as calling gfs2_bitfit() repeatedly but
+ * each word of the bitmap is only searched once.
+ * buf: The bitmap data, readable up to the next 8 byte boundary after len
+ * len: The length of the bitmap data in bytes
+ * state: The block state to search for
+ * base: A value to add to the offset of each block found
+ * out: An array of at least len * GFS2_NBBY entries to hold the results
+ * Returns the number of blocks found.
+ */
+unsigned lgfs2_bitmap_scan(const unsigned char *buf, unsigned len, uint8_t state,
+                           uint64_t base, uint64_t *out)
+{
+	const __le64 *ptr = (const __le64 *)buf;
+	const __le64 *end = ptr + (len / sizeof(uint64_t));
+	unsigned tail = len & (sizeof(uint64_t) - 1);
+	unsigned n = 0;
+
+	if (state > 3)
+		return 0;
+
+	for (; ptr < end; ptr++, base += 4 * sizeof(uint64_t))
+		n += bit_extract(gfs2_bit_search(ptr, 0x5555555555555555ULL, state), base, out + n);
+	/* Mask off any bits which are more than len bytes from the start */
+	if (tail)
+		n += bit_extract(gfs2_bit_search(ptr, 0x5555555555555555ULL >> (64 - 8 * tail), state),
+		                 base, out + n);
+	return n;
+}
+
 /*
  * check_range - check if blkno is within FS limits
  * @sdp: super block
@@ -147,6 +190,8 @@ int gfs2_set_bitmap(lgfs2_rgrp_t rgd, uint64_t blkno, int state)
 
 	if (bits == NULL)
 		return -1;
+	if (bits->bi_data == NULL && lgfs2_rgrp_load(rgd) != 0)
+		return -1;
 	byte = (unsigned char *)(bits->bi_data + bits->bi_offset) +
 		(rgrp_block/GFS2_NBBY - bits->bi_start);
 	bit = (rgrp_block % GFS2_NBBY) * GFS2_BIT_SIZE;
@@ -206,7 +251,7 @@ int lgfs2_get_bitmap(struct gfs2_sbd *sdp, uint64_t blkno, struct rgrp_tree *rgd
 	}
 
 	bi = &rgd->bits[i];
-	if (bi->bi_data == NULL)
+	if (bi->bi_data == NULL && (rgd->rt_cache == NULL || lgfs2_rgrp_load(rgd) != 0))
 		return GFS2_BLKST_FREE;
 
 	byte = (bi->bi_data + bi->bi_offset) + (offset/GFS2_NBBY);
@@ -10,6 +10,8 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
+#include <limits.h>
+#include <sys/uio.h>
 
 #include "libgfs2.h"
 #include "rgrp.h"
@@ -24,6 +26,24 @@ static __inline__ __be64 *metapointer(char *buf,
 	return ((__be64 *)(buf + head_size)) + mp->mp_list[height];
 }
 
+/* The indirect blocks last walked through by lgfs2_map_extent(), one for
+   each level of the metadata tree below the dinode. */
+struct lgfs2_mapcache {
+	uint64_t blkgen; /* The value of sdp->blkgen when the blocks were read */
+	struct gfs2_buffer_head *bh[GFS2_MAX_META_HEIGHT];
+};
+
+static void mapcache_drop(struct lgfs2_mapcache *mc)
+{
+	unsigned x;
+
+	for (x = 0; x < GFS2_MAX_META_HEIGHT; x++) {
+		if (mc->bh[x] != NULL)
+			brelse(mc->bh[x]);
+		mc->bh[x] = NULL;
+	}
+}
+
 /* Detect directory is a stuffed inode */
 static int inode_is_stuffed(const struct gfs2_inode *ip)
 {
@@ -103,6 +123,10 @@ void inode_put(struct gfs2_inode **ip_in)
 			brelse(ip->i_bh);
 		ip->i_bh = NULL;
 	}
+	if (ip->i_mapcache != NULL) {
+		mapcache_drop(ip->i_mapcache);
+		free(ip->i_mapcache);
+	}
 	free(ip);
 	*ip_in = NULL; /* make sure the memory isn't accessed again */
 }
@@ -178,9 +202,14 @@ static int block_alloc(struct gfs2_sbd *sdp, const uint64_t blksreq, int state,
 		return -1;
 
 	if (rgt->bits[0].bi_data == NULL) {
-		if (gfs2_rgrp_read(sdp, rgt))
-			return -1;
-		release = 1;
+		if (rgt->rt_cache != NULL) {
+			if (lgfs2_rgrp_load(rgt))
+				return -1;
+		} else {
+			if (gfs2_rgrp_read(sdp, rgt))
+				return -1;
+			release = 1;
+		}
 	}
 
 	bn = find_free_block(rgt);
@@ -461,6 +490,179 @@ void lookup_block(struct gfs2_inode *ip, struct gfs2_buffer_head *bh,
 	*new = 1;
 }
 
+/**
+ * Get the contents of an indirect block at a given level of an inode's
+ * metadata tree, reading it only if it isn't the one last read at that level
+ * or blocks have been written since.
+ * Returns the block's data or NULL with errno set on failure.
+ */
+static char *mapcache_block(struct gfs2_inode *ip, unsigned level, uint64_t addr)
+{
+	struct gfs2_sbd *sdp = ip->i_sbd;
+	struct lgfs2_mapcache *mc = ip->i_mapcache;
+	struct gfs2_buffer_head *bh;
+
+	if (addr == ip->i_num.in_addr)
+		return ip->i_bh->b_data;
+	if (mc == NULL) {
+		mc = calloc(1, sizeof(*mc));
+		if (mc == NULL)
+			return NULL;
+		mc->blkgen = sdp->blkgen;
+		ip->i_mapcache = mc;
+	}
+	if (mc->blkgen != sdp->blkgen) {
+		mapcache_drop(mc);
+		mc->blkgen = sdp->blkgen;
+	}
+	bh = mc->bh[level];
+	if (bh != NULL) {
+		if (bh->b_blocknr == addr)
+			return bh->b_data;
+		brelse(bh);
+		mc->bh[level] = NULL;
+	}
+	bh = bread(sdp, addr);
+	if (bh == NULL)
+		return NULL;
+	mc->bh[level] = bh;
+	return bh->b_data;
+}
+
+/**
+ * Walk down an inode's metadata tree to the block holding the data block
+ * pointer for a metapath.
+ * buf: Set to the block holding the pointer, or NULL if a pointer on the way
+ *      down is zero
+ * level: Set to the level of buf, or of the zero pointer
+ * Returns 0 on success or -1 with errno set on failure.
+ */
+static int map_walk(struct gfs2_inode *ip, struct metapath *mp, char **buf, unsigned *level)
+{
+	char *b = ip->i_bh->b_data;
+	unsigned x;
+
+	for (x = 0; x + 1 < ip->i_height; x++) {
+		uint64_t addr = be64_to_cpu(*metapointer(b, x, mp));
+
+		if (addr == 0) {
+			*buf = NULL;
+			*level = x;
+			return 0;
+		}
+		b = mapcache_block(ip, x + 1, addr);
+		if (b == NULL)
+			return -1;
+	}
+	*buf = b;
+	*level = x;
+	return 0;
+}
+
+/* The number of data blocks addressed by one pointer at a given height above
+   the data blocks, saturating at UINT64_MAX */
+static uint64_t map_span(struct gfs2_sbd *sdp, unsigned height)
+{
+	uint64_t span = 1;
+
+	while (height--) {
+		if (span > UINT64_MAX / sdp->sd_inptrs)
+			return UINT64_MAX;
+		span *= sdp->sd_inptrs;
+	}
+	return span;
+}
+
+/**
+ * Map a range of an inode's logical blocks to the longest run of physically
+ * contiguous blocks, or of unallocated blocks, at its start. Nothing is
+ * allocated. The indirect blocks walked through are kept with the inode so
+ * that mapping a file sequentially only reads each of them once.
+ * lblock: The first logical block to map
+ * maxlen: The largest number of blocks to map
+ * dblock: Set to the physical address of lblock, or 0 if it is not allocated
+ * extlen: Set to the length of the run, at most maxlen
+ * Returns 0 on success or -1 with errno set on failure.
+ */
+int lgfs2_map_extent(struct gfs2_inode *ip, uint64_t lblock, uint64_t maxlen,
+                     uint64_t *dblock, uint64_t *extlen)
+{
+	struct gfs2_sbd *sdp = ip->i_sbd;
+	unsigned bsize = S_ISDIR(ip->i_mode) ? sdp->sd_jbsize : sdp->sd_bsize;
+	unsigned height = ip->i_height;
+	uint64_t span, limit, n = 0;
+	struct metapath mp;
+
+	*dblock = 0;
+	*extlen = 0;
+	if (maxlen == 0)
+		return 0;
+	if (inode_is_stuffed(ip)) {
+		if (lblock == 0) {
+			*dblock = ip->i_num.in_addr;
+			*extlen = 1;
+		} else {
+			*extlen = maxlen;
+		}
+		return 0;
+	}
+	if (sdp->gfs1) {
+		uint32_t len = 0;
+		int new = 0;
+
+		gfs1_block_map(ip, lblock, &new, dblock, &len, 0);
+		*extlen = *dblock ? (len < maxlen ? len : maxlen) : 1;
+		return 0;
+	}
+	span = map_span(sdp, height - 1);
+	limit = (span > UINT64_MAX / sdp->sd_diptrs) ? UINT64_MAX : span * sdp->sd_diptrs;
+	/* Blocks beyond the reach of the tree aren't allocated */
+	if (lblock >= limit || calc_tree_height(ip, (lblock + 1) * bsize) > height) {
+		*extlen = maxlen;
+		return 0;
+	}
+	limit -= lblock;
+	if (limit > maxlen)
+		limit = maxlen;
+
+	while (n < limit) {
+		unsigned level, nptrs, i;
+		__be64 *ptr;
+		char *buf;
+
+		find_metapath(ip, lblock + n, &mp);
+		if (map_walk(ip, &mp, &buf, &level) != 0) {
+			if (n == 0)
+				return -1;
+			break;
+		}
+		if (buf == NULL) {
+			if (n > 0 && *dblock != 0)
+				break;
+			span = map_span(sdp, height - 1 - level);
+			span -= (lblock + n) % span;
+			n = (span < limit - n) ? n + span : limit;
+			continue;
+		}
+		nptrs = level ? sdp->sd_inptrs : sdp->sd_diptrs;
+		ptr = metapointer(buf, level, &mp);
+		for (i = mp.mp_list[level]; i < nptrs && n < limit; i++, ptr++, n++) {
+			uint64_t addr = be64_to_cpu(*ptr);
+
+			if (n == 0)
+				*dblock = addr;
+			else if (addr != (*dblock ? *dblock + n : 0))
+				goto out;
+		}
+	}
+	/* A hole runs on past the end of the tree */
+	if (*dblock == 0 && n >= limit)
+		n = maxlen;
+out:
+	*extlen = n < maxlen ? n : maxlen;
+	return 0;
+}
+
 void block_map(struct gfs2_inode *ip, uint64_t lblock, int *new,
 	       uint64_t *dblock, uint32_t *extlen, int prealloc)
 {
@@ -478,6 +680,15 @@ void block_map(struct gfs2_inode *ip, uint64_t lblock, int *new,
 	if (extlen)
 		*extlen = 0;
 
+	if (!create && !prealloc && !sdp->gfs1) {
+		uint64_t len;
+
+		if (lgfs2_map_extent(ip, lblock, extlen ? UINT32_MAX : 1, dblock, &len) == 0 &&
+		    extlen && *dblock)
+			*extlen = len;
+		return;
+	}
+
 	if (inode_is_stuffed(ip)) {
 		if (!lblock) {
 			*dblock = ip->i_num.in_addr;
@@ -569,16 +780,65 @@ copy2mem(struct gfs2_buffer_head *bh, void **buf, unsigned int offset,
 	*p += size;
 }
 
+#define READI_IOVECS (64)
+
+/**
+ * Read part of a run of contiguous blocks of an inode into a buffer with as
+ * few reads as possible, leaving out the meta header of each block after the
+ * first if there is one.
+ * o: The offset in the first block of the first byte to read
+ * hdr: The size of the header at the start of each block, or 0
+ * Returns 0 on success or -1 on failure.
+ */
+static int readi_extent(struct gfs2_sbd *sdp, uint64_t dblock, uint64_t extlen,
+                        unsigned o, unsigned hdr, char *buf, size_t len)
+{
+	char sink[sizeof(struct gfs2_meta_header)];
+	struct iovec iov[READI_IOVECS];
+
+	if (lgfs2_bcache_flush(sdp, dblock, extlen) != 0)
+		return -1;
+	while (len > 0) {
+		off_t pos = dblock * sdp->sd_bsize + o;
+		ssize_t total = 0;
+		int n = 0;
+
+		while (len > 0 && n + 2 <= READI_IOVECS) {
+			size_t amount = sdp->sd_bsize - o;
+
+			if (amount > len)
+				amount = len;
+			if (total > 0 && hdr > 0) {
+				iov[n].iov_base = sink;
+				iov[n++].iov_len = hdr;
+				total += hdr;
+			}
+			if (n > 0 && hdr == 0) {
+				iov[n - 1].iov_len += amount;
+			} else {
+				iov[n].iov_base = buf;
+				iov[n++].iov_len = amount;
+			}
+			total += amount;
+			buf += amount;
+			len -= amount;
+			dblock++;
+			o = hdr;
+		}
+		if (lgfs2_preadv(sdp, sdp->device_fd, iov, n, pos) != total)
+			return -1;
+	}
+	return 0;
+}
+
 int gfs2_readi(struct gfs2_inode *ip, void *buf,
 			   uint64_t offset, unsigned int size)
 {
 	struct gfs2_sbd *sdp = ip->i_sbd;
 	struct gfs2_buffer_head *bh;
-	uint64_t lblock, dblock;
-	unsigned int o;
-	uint32_t extlen = 0;
-	unsigned int amount;
-	int not_new = 0;
+	uint64_t lblock, dblock, extlen;
+	unsigned int o, hdr = 0;
+	size_t amount;
 	int isdir = !!(S_ISDIR(ip->i_mode));
 	int journaled = ip->i_flags & GFS2_DIF_JDATA;
 	int copied = 0;
@@ -596,6 +856,7 @@ int gfs2_readi(struct gfs2_inode *ip, void *buf,
 		lblock = offset;
 		o = lblock % sdp->sd_jbsize;
 		lblock /= sdp->sd_jbsize;
+		hdr = sizeof(struct gfs2_meta_header);
 	} else {
 		lblock = offset >> sdp->sd_bsize_shift;
 		o = offset & (sdp->sd_bsize - 1);
@@ -603,44 +864,53 @@ int gfs2_readi(struct gfs2_inode *ip, void *buf,
 
 	if (inode_is_stuffed(ip))
 		o += sizeof(struct gfs2_dinode);
-	else if ((sdp->gfs1 && journaled) || (!sdp->gfs1 && isdir))
-		o += sizeof(struct gfs2_meta_header);
+	else
+		o += hdr;
 
 	while (copied < size) {
-		amount = size - copied;
-		if (amount > sdp->sd_bsize - o)
-			amount = sdp->sd_bsize - o;
-
-		if (!extlen) {
-			if (sdp->gfs1)
-				gfs1_block_map(ip, lblock, &not_new, &dblock,
-					       &extlen, 0);
-			else
-				block_map(ip, lblock, &not_new, &dblock,
-					  &extlen, 0);
+		uint64_t blocks = 1;
+
+		/* Map as many of the remaining blocks as possible in one go */
+		amount = sdp->sd_bsize - o;
+		if (size - copied > amount)
+			blocks += (size - copied - amount + sdp->sd_bsize - hdr - 1) /
+			          (sdp->sd_bsize - hdr);
+		if (lgfs2_map_extent(ip, lblock, blocks, &dblock, &extlen) != 0) {
+			dblock = 0;
+			extlen = 1;
 		}
-
-		if (dblock) {
-			if (dblock == ip->i_num.in_addr)
-				bh = ip->i_bh;
-			else
-				bh = bread(sdp, dblock);
-			dblock++;
-			extlen--;
-		} else
-			bh = NULL;
-
-		copy2mem(bh, &buf, o, amount);
-		if (bh && bh != ip->i_bh)
-			brelse(bh);
-
+		if (dblock == ip->i_num.in_addr)
+			extlen = 1;
+		amount += (extlen - 1) * (sdp->sd_bsize - hdr);
+		if (amount > size - copied)
+			amount = size - copied;
+
+		if (dblock == 0) {
+			memset(buf, 0, amount);
+		} else if (dblock == ip->i_num.in_addr) {
+			memcpy(buf, ip->i_bh->b_data + o, amount);
+		} else if (readi_extent(sdp, dblock, extlen, o, hdr, buf, amount) != 0) {
+			/* Fall back to reading the blocks one at a time, treating
+			   the ones which can't be read as holes */
+			char *p = buf;
+			size_t left = amount;
+
+			for (uint64_t b = 0; left > 0; b++) {
+				unsigned int len = sdp->sd_bsize - (b ? hdr : o);
+
+				if (len > left)
+					len = left;
+				bh = bread(sdp, dblock + b);
+				copy2mem(bh, (void **)&p, b ? hdr : o, len);
+				if (bh)
+					brelse(bh);
+				left -= len;
+			}
+		}
+		buf = (char *)buf + amount;
 		copied += amount;
-		lblock++;
-
-		if (sdp->gfs1)
-			o = (journaled) ? sizeof(struct gfs2_meta_header) : 0;
-		else
-			o = (isdir) ? sizeof(struct gfs2_meta_header) : 0;
+		lblock += extlen;
+		o = hdr;
 	}
 
 	return copied;
@@ -1895,23 +2165,29 @@ int gfs2_lookupi(struct gfs2_inode *dip, const char *filename, int len,
 
 /**
  * gfs2_free_block - free up a block given its block number
+ * Returns 0 on success or -1 if the block's resource group could not be found
+ * or its bitmaps could not be read.
  */
-void gfs2_free_block(struct gfs2_sbd *sdp, uint64_t block)
+int gfs2_free_block(struct gfs2_sbd *sdp, uint64_t block)
 {
 	struct rgrp_tree *rgd;
 
 	/* Adjust the free space count for the freed block */
 	rgd = gfs2_blk2rgrpd(sdp, block); /* find the rg for indir block */
-	if (rgd) {
-		gfs2_set_bitmap(rgd, block, GFS2_BLKST_FREE);
-		rgd->rt_free++; /* adjust the free count */
-		if (sdp->gfs1)
-			lgfs2_gfs_rgrp_out(rgd, rgd->bits[0].bi_data);
-		else
-			lgfs2_rgrp_out(rgd, rgd->bits[0].bi_data);
-		rgd->bits[0].bi_modified = 1;
-		sdp->blks_alloced--;
+	if (rgd == NULL) {
+		errno = EINVAL;
+		return -1;
 	}
+	if (gfs2_set_bitmap(rgd, block, GFS2_BLKST_FREE) != 0)
+		return -1;
+	rgd->rt_free++; /* adjust the free count */
+	if (sdp->gfs1)
+		lgfs2_gfs_rgrp_out(rgd, rgd->bits[0].bi_data);
+	else
+		lgfs2_rgrp_out(rgd, rgd->bits[0].bi_data);
+	rgd->bits[0].bi_modified = 1;
+	sdp->blks_alloced--;
+	return 0;
 }
 
 /**
@@ -1958,7 +2234,10 @@ int gfs2_freedi(struct gfs2_sbd *sdp, uint64_t diblock)
 					continue;
 
 				block = be64_to_cpu(*ptr);
-				gfs2_free_block(sdp, block);
+				if (gfs2_free_block(sdp, block) != 0) {
+					inode_put(&ip);
+					return -1;
+				}
 				if (h == height - 1) /* if not metadata */
 					continue; /* don't queue it up */
 				/* Read the next metadata block in the chain */
@@ -1969,7 +2248,10 @@ int gfs2_freedi(struct gfs2_sbd *sdp, uint64_t diblock)
 		}
 	}
 	rgd = gfs2_blk2rgrpd(sdp, diblock);
-	gfs2_set_bitmap(rgd, diblock, GFS2_BLKST_FREE);
+	if (gfs2_set_bitmap(rgd, diblock, GFS2_BLKST_FREE) != 0) {
+		inode_put(&ip);
+		return -1;
+	}
 	inode_put(&ip);
 	/* inode_put deallocated the extra block used by the disk inode, */
 	/* so adjust it in the superblock struct */
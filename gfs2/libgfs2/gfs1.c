@@ -294,13 +294,9 @@ struct gfs2_inode *lgfs2_gfs_inode_read(struct gfs2_sbd *sdp, uint64_t di_addr)
 	struct gfs2_buffer_head *bh;
 	struct gfs2_inode *ip;
 
-	bh = bget(sdp, di_addr);
+	bh = bread(sdp, di_addr);
 	if (bh == NULL)
 		return NULL;
-	if (pread(sdp->device_fd, bh->b_data, sdp->sd_bsize, di_addr * sdp->sd_bsize) != sdp->sd_bsize) {
-		brelse(bh);
-		return NULL;
-	}
 	ip = __gfs_inode_get(sdp, bh->b_data);
 	ip->i_bh = bh;
 	ip->bh_owned = 1;
@@ -1,6 +1,8 @@
 #include "clusterautoconfig.h"
 
 #include <stdio.h>
+#include <string.h>
+#include <pthread.h>
 #include "libgfs2.h"
 
 static const uint32_t crc_32_tab[] =
@@ -39,6 +41,148 @@ static const uint32_t crc_32_tab[] =
   0xb3667a2e, 0xc4614ab8, 0x5d681b02, 0x2a6f2b94, 0xb40bbe37, 0xc30c8ea1, 0x5a05df1b, 0x2d02ef8d
 };
 
+static uint32_t crc32_le_byte(uint32_t crc, const unsigned char *data, size_t len)
+{
+	for (; len--; data++)
+		crc = crc_32_tab[(crc ^ *data) & 0xFF] ^ (crc >> 8);
+	return crc;
+}
+
+/*
+ * Slicing-by-8: crc32_sb8_tab[n][b] is the crc of byte b followed by n zero
+ * bytes, so that eight bytes can be looked up independently of each other.
+ */
+static uint32_t crc32_sb8_tab[8][256];
+
+static void crc32_sb8_init(void)
+{
+	unsigned i, n;
+
+	for (i = 0; i < 256; i++) {
+		uint32_t crc = crc_32_tab[i];
+
+		crc32_sb8_tab[0][i] = crc;
+		for (n = 1; n < 8; n++) {
+			crc = crc_32_tab[crc & 0xff] ^ (crc >> 8);
+			crc32_sb8_tab[n][i] = crc;
+		}
+	}
+}
+
+static uint32_t crc32_le_sb8(uint32_t crc, const unsigned char *data, size_t len)
+{
+	const uint32_t (*t)[256] = (const uint32_t (*)[256])crc32_sb8_tab;
+
+	for (; len >= 8; len -= 8, data += 8) {
+		uint32_t lo = crc ^ (data[0] | data[1] << 8 | data[2] << 16 | (uint32_t)data[3] << 24);
+
+		crc = t[7][lo & 0xff] ^ t[6][(lo >> 8) & 0xff] ^
+		      t[5][(lo >> 16) & 0xff] ^ t[4][lo >> 24] ^
+		      t[3][data[4]] ^ t[2][data[5]] ^ t[1][data[6]] ^ t[0][data[7]];
+	}
+	return crc32_le_byte(crc, data, len);
+}
+
+static struct lgfs2_hash_impl crc32_impls[] = {
+	{ .name = "table", .fn = crc32_le_byte },
+	{ .name = "slice8", .fn = crc32_le_sb8 },
+	{ .name = NULL },
+	{ .name = NULL },
+};
+static unsigned crc32_nimpls = 2;
+static uint32_t (*crc32_le)(uint32_t crc, const unsigned char *data, size_t len) = crc32_le_byte;
+static pthread_once_t crc32_once = PTHREAD_ONCE_INIT;
+
+#ifdef __x86_64__
+
+#include <wmmintrin.h>
+
+/*
+ * Folds 16 bytes at a time into a 128 bit remainder with carry-less
+ * multiplications and reduces it to the crc at the end, using the constants
+ * from "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ
+ * Instruction" (Intel, 2009) for the bit-reflected CRC32 polynomial, as the
+ * kernel's crc32-pclmul does. Names shorter than CRC32_PCL_MIN are quicker to
+ * look up in the tables.
+ */
+#define CRC32_PCL_MIN (32)
+
+__attribute__((target("sse2,pclmul")))
+static uint32_t crc32_le_pcl(uint32_t crc, const unsigned char *data, size_t len)
+{
+	const __m128i r4r3 = _mm_set_epi64x(0xccaa009eULL, 0x1751997d0ULL);
+	const __m128i r5 = _mm_set_epi64x(0, 0x163cd6124ULL);
+	const __m128i upoly = _mm_set_epi64x(0x1f7011641ULL, 0x1db710641ULL);
+	const __m128i mask32 = _mm_set_epi32(0, 0, 0, -1);
+	__m128i x, t;
+
+	if (len < CRC32_PCL_MIN)
+		return crc32_le_sb8(crc, data, len);
+
+	x = _mm_xor_si128(_mm_loadu_si128((const __m128i *)data), _mm_cvtsi32_si128(crc));
+	for (data += 16, len -= 16; len >= 16; data += 16, len -= 16) {
+		t = _mm_clmulepi64_si128(x, r4r3, 0x00);
+		x = _mm_clmulepi64_si128(x, r4r3, 0x11);
+		x = _mm_xor_si128(_mm_xor_si128(x, t), _mm_loadu_si128((const __m128i *)data));
+	}
+	/* 128 bits to 64 */
+	t = _mm_srli_si128(x, 8);
+	x = _mm_xor_si128(_mm_clmulepi64_si128(x, r4r3, 0x10), t);
+	/* 64 bits to 32 */
+	t = _mm_srli_si128(x, 4);
+	x = _mm_xor_si128(_mm_clmulepi64_si128(_mm_and_si128(x, mask32), r5, 0x00), t);
+	/* Barrett reduction */
+	t = _mm_and_si128(_mm_clmulepi64_si128(_mm_and_si128(x, mask32), upoly, 0x10), mask32);
+	x = _mm_xor_si128(_mm_clmulepi64_si128(t, upoly, 0x00), x);
+	crc = _mm_cvtsi128_si32(_mm_srli_si128(x, 4));
+
+	return crc32_le_sb8(crc, data, len);
+}
+
+static int crc32_have_pclmul(void)
+{
+	unsigned int eax = 1, ebx, ecx, edx;
+
+	__asm__("cpuid" : "+a" (eax), "=b" (ebx), "=c" (ecx), "=d" (edx));
+	return (ecx & (1 << 1)) != 0;
+}
+
+static void crc32_init_arch(void)
+{
+	if (crc32_have_pclmul()) {
+		crc32_impls[crc32_nimpls].name = "pclmul";
+		crc32_impls[crc32_nimpls++].fn = crc32_le_pcl;
+		crc32_le = crc32_le_pcl;
+	}
+}
+
+#else
+
+static void crc32_init_arch(void)
+{
+}
+
+#endif /* __x86_64__ */
+
+static void crc32_init(void)
+{
+	crc32_sb8_init();
+	crc32_le = crc32_le_sb8;
+	crc32_init_arch();
+}
+
+/**
+ * Returns the implementations of gfs2_disk_hash() which can be used on this
+ * machine, fastest last, in an array terminated by an entry with a NULL
+ * name. Each takes and returns the crc without the inversions. For testing
+ * and benchmarking.
+ */
+const struct lgfs2_hash_impl *lgfs2_disk_hash_impls(void)
+{
+	pthread_once(&crc32_once, crc32_init);
+	return crc32_impls;
+}
+
 /**
  * gfs2_disk_hash - hash an array of data
  * @data: the data to be hashed
@@ -49,8 +193,8 @@ static const uint32_t crc_32_tab[] =
  *
  * Take some data and convert it to a 32-bit hash.
  *
- * The hash function is a 32-bit CRC of the data.  The algorithm uses
- * the crc_32_tab table above.
+ * The hash function is a 32-bit CRC of the data.  The implementation is
+ * chosen when it is first called, see lgfs2_disk_hash_impls().
  *
  * This may not be the fastest hash function, but it does a fair bit better
  * at providing uniform results than the others I've looked at.  That's
@@ -61,14 +205,8 @@ static const uint32_t crc_32_tab[] =
 
 uint32_t gfs2_disk_hash(const char *data, int len)
 {
-	uint32_t hash = 0xFFFFFFFF;
-
-	for (; len--; data++)
-		hash = crc_32_tab[(hash ^ *data) & 0xFF] ^ (hash >> 8);
-
-	hash = ~hash;
-
-	return hash;
+	pthread_once(&crc32_once, crc32_init);
+	return ~crc32_le(0xFFFFFFFF, (const unsigned char *)data, len);
 }
 
 
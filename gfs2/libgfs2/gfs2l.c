@@ -125,7 +125,15 @@ static int openfs(const char *path, struct gfs2_sbd *sdp)
 		perror("Bad constants");
 		return 1;
 	}
-	ret = lgfs2_get_dev_info(fd, &sdp->dinfo);
+	ret = lgfs2_metaimg_open(sdp);
+	if (ret != 0) {
+		perror("Failed to read savemeta file");
+		return 1;
+	}
+	if (sdp->metaimg != NULL)
+		ret = lgfs2_metaimg_dev_info(sdp->metaimg, &sdp->dinfo);
+	else
+		ret = lgfs2_get_dev_info(fd, &sdp->dinfo);
 	if (ret != 0) {
 		perror("Failed to gather device info");
 		return 1;
@@ -194,6 +202,7 @@ int main(int argc, char *argv[])
 	inode_put(&sbd.md.riinode);
 	inode_put(&sbd.master_dir);
 	lgfs2_lang_free(&state);
+	lgfs2_metaimg_free(&sbd);
 	free(opts.fspath);
 	return 0;
 }
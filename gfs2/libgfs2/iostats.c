@@ -0,0 +1,574 @@
+#include "clusterautoconfig.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "libgfs2.h"
+
+/*
+ * I/O accounting
+ *
+ * Once lgfs2_iostats_init() has been called, the lgfs2_pread() family of
+ * wrappers time each I/O and count it against the function and line it was
+ * issued from and the phase last set with lgfs2_iostats_phase(). bread(),
+ * bwrite() and brelse() pass their callers' locations through, so block I/O is
+ * counted against the code which asked for the block rather than buf.c. The
+ * wrappers also hold I/O back for the simulated device (see simdev.c) and
+ * serve the device from a savemeta file (see metaimg.c). When none of them is
+ * enabled they only add three pointer tests.
+ */
+
+#define IOS_NONE (0xffffffffU)
+#define IOS_HASH_SIZE (256)
+
+struct iostats_site {
+	struct lgfs2_iostat st;
+	uint32_t phase; /* Index into phases[], for ordering the output */
+	uint32_t next;  /* Next site in the hash chain, or IOS_NONE */
+};
+
+struct lgfs2_iostats {
+	pthread_mutex_t lock;
+	struct iostats_site *sites;
+	uint32_t nsites;
+	uint32_t size;
+	const char **phases; /* In the order they were first used */
+	uint32_t nphases;
+	uint32_t cur;
+	uint32_t buckets[IOS_HASH_SIZE];
+};
+
+static uint64_t ios_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static unsigned ios_bucket(uint64_t nsecs)
+{
+	uint64_t us = nsecs / 1000;
+	unsigned b = 0;
+
+	while (us > 0 && b < LGFS2_IOSTAT_BUCKETS - 1) {
+		us >>= 1;
+		b++;
+	}
+	return b;
+}
+
+static uint32_t ios_hash(uint32_t phase, const char *caller, int line)
+{
+	uint64_t h = ((uintptr_t)caller >> 3) ^ ((uint64_t)phase << 16) ^ (uint64_t)line;
+
+	return (uint32_t)((h * 0x9e3779b97f4a7c15ULL) >> 32) & (IOS_HASH_SIZE - 1);
+}
+
+/* Find or add the site for a call in the current phase. Called with the lock held. */
+static struct iostats_site *ios_site(struct lgfs2_iostats *ios, const char *caller, int line)
+{
+	uint32_t h = ios_hash(ios->cur, caller, line);
+	struct iostats_site *s;
+	uint32_t i;
+
+	for (i = ios->buckets[h]; i != IOS_NONE; i = ios->sites[i].next) {
+		s = &ios->sites[i];
+		if (s->st.caller == caller && s->st.line == line && s->phase == ios->cur)
+			return s;
+	}
+	if (ios->nsites == ios->size) {
+		uint32_t size = ios->size ? ios->size * 2 : 64;
+
+		s = realloc(ios->sites, size * sizeof(*s));
+		if (s == NULL)
+			return NULL;
+		ios->sites = s;
+		ios->size = size;
+	}
+	i = ios->nsites++;
+	s = &ios->sites[i];
+	memset(s, 0, sizeof(*s));
+	s->st.phase = ios->phases[ios->cur];
+	s->st.caller = caller;
+	s->st.line = line;
+	s->phase = ios->cur;
+	s->next = ios->buckets[h];
+	ios->buckets[h] = i;
+	return s;
+}
+
+static void ios_account(struct lgfs2_iostats *ios, int dir, ssize_t ret, uint64_t start,
+                        int line, const char *caller)
+{
+	uint64_t nsecs = ios_now() - start;
+	int saved_errno = errno;
+	struct iostats_site *s;
+
+	pthread_mutex_lock(&ios->lock);
+	s = ios_site(ios, caller, line);
+	if (s != NULL) {
+		s->st.count[dir]++;
+		if (ret > 0)
+			s->st.bytes[dir] += ret;
+		s->st.nsecs[dir] += nsecs;
+		s->st.hist[dir][ios_bucket(nsecs)]++;
+	}
+	pthread_mutex_unlock(&ios->lock);
+	errno = saved_errno;
+}
+
+/*
+ * Called before each I/O when accounting or a simulated device is enabled.
+ * Returns the start time and sets *due to when the simulated device, if it is
+ * the one being used, would complete the I/O.
+ */
+static uint64_t io_begin(const struct gfs2_sbd *sdp, int fd, int dir, off_t offset, size_t len,
+                         uint64_t *due)
+{
+	*due = 0;
+	if (sdp->simdev != NULL && fd == sdp->device_fd)
+		*due = lgfs2_simdev_submit(sdp->simdev, dir, offset, len);
+	return sdp->iostats != NULL ? ios_now() : 0;
+}
+
+static void io_end(const struct gfs2_sbd *sdp, int dir, ssize_t ret, uint64_t start, uint64_t due,
+                   int line, const char *caller)
+{
+	if (due != 0)
+		lgfs2_simdev_wait(due);
+	if (sdp->iostats != NULL)
+		ios_account(sdp->iostats, dir, ret, start, line, caller);
+}
+
+static ssize_t dev_pread(const struct gfs2_sbd *sdp, int fd, void *buf, size_t count, off_t offset)
+{
+	if (sdp->metaimg != NULL && fd == sdp->device_fd)
+		return lgfs2_metaimg_pread(sdp->metaimg, buf, count, offset);
+	return pread(fd, buf, count, offset);
+}
+
+static ssize_t dev_preadv(const struct gfs2_sbd *sdp, int fd, const struct iovec *iov, int iovcnt,
+                          off_t offset)
+{
+	ssize_t total = 0;
+
+	if (sdp->metaimg == NULL || fd != sdp->device_fd)
+		return preadv(fd, iov, iovcnt, offset);
+	for (int i = 0; i < iovcnt; i++) {
+		ssize_t ret = lgfs2_metaimg_pread(sdp->metaimg, iov[i].iov_base, iov[i].iov_len,
+		                                  offset + total);
+		if (ret < 0)
+			return ret;
+		total += ret;
+		if ((size_t)ret < iov[i].iov_len)
+			break;
+	}
+	return total;
+}
+
+/* Savemeta files are read-only */
+static int dev_readonly(const struct gfs2_sbd *sdp, int fd)
+{
+	if (sdp->metaimg != NULL && fd == sdp->device_fd) {
+		errno = EROFS;
+		return 1;
+	}
+	return 0;
+}
+
+static size_t iov_len(const struct iovec *iov, int iovcnt)
+{
+	size_t len = 0;
+
+	for (int i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+	return len;
+}
+
+ssize_t __lgfs2_pread(const struct gfs2_sbd *sdp, int fd, void *buf, size_t count, off_t offset,
+                      int line, const char *caller)
+{
+	uint64_t start, due;
+	ssize_t ret;
+
+	if (sdp->iostats == NULL && sdp->simdev == NULL && sdp->metaimg == NULL)
+		return pread(fd, buf, count, offset);
+	start = io_begin(sdp, fd, LGFS2_IO_READ, offset, count, &due);
+	ret = dev_pread(sdp, fd, buf, count, offset);
+	io_end(sdp, LGFS2_IO_READ, ret, start, due, line, caller);
+	return ret;
+}
+
+ssize_t __lgfs2_pwrite(const struct gfs2_sbd *sdp, int fd, const void *buf, size_t count, off_t offset,
+                       int line, const char *caller)
+{
+	uint64_t start, due;
+	ssize_t ret;
+
+	if (sdp->iostats == NULL && sdp->simdev == NULL && sdp->metaimg == NULL)
+		return pwrite(fd, buf, count, offset);
+	if (dev_readonly(sdp, fd))
+		return -1;
+	start = io_begin(sdp, fd, LGFS2_IO_WRITE, offset, count, &due);
+	ret = pwrite(fd, buf, count, offset);
+	io_end(sdp, LGFS2_IO_WRITE, ret, start, due, line, caller);
+	return ret;
+}
+
+ssize_t __lgfs2_preadv(const struct gfs2_sbd *sdp, int fd, const struct iovec *iov, int iovcnt,
+                       off_t offset, int line, const char *caller)
+{
+	uint64_t start, due;
+	ssize_t ret;
+
+	if (sdp->iostats == NULL && sdp->simdev == NULL && sdp->metaimg == NULL)
+		return preadv(fd, iov, iovcnt, offset);
+	start = io_begin(sdp, fd, LGFS2_IO_READ, offset, iov_len(iov, iovcnt), &due);
+	ret = dev_preadv(sdp, fd, iov, iovcnt, offset);
+	io_end(sdp, LGFS2_IO_READ, ret, start, due, line, caller);
+	return ret;
+}
+
+ssize_t __lgfs2_pwritev(const struct gfs2_sbd *sdp, int fd, const struct iovec *iov, int iovcnt,
+                        off_t offset, int line, const char *caller)
+{
+	uint64_t start, due;
+	ssize_t ret;
+
+	if (sdp->iostats == NULL && sdp->simdev == NULL && sdp->metaimg == NULL)
+		return pwritev(fd, iov, iovcnt, offset);
+	if (dev_readonly(sdp, fd))
+		return -1;
+	start = io_begin(sdp, fd, LGFS2_IO_WRITE, offset, iov_len(iov, iovcnt), &due);
+	ret = pwritev(fd, iov, iovcnt, offset);
+	io_end(sdp, LGFS2_IO_WRITE, ret, start, due, line, caller);
+	return ret;
+}
+
+/**
+ * Start accounting the I/O done through a file system. The initial phase
+ * is "".
+ * Returns 0 on success or -1 with errno set on failure.
+ */
+int lgfs2_iostats_init(struct gfs2_sbd *sdp)
+{
+	struct lgfs2_iostats *ios;
+
+	if (sdp->iostats != NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	ios = calloc(1, sizeof(*ios));
+	if (ios == NULL)
+		return -1;
+	ios->phases = malloc(sizeof(*ios->phases));
+	if (ios->phases == NULL) {
+		free(ios);
+		return -1;
+	}
+	ios->phases[ios->nphases++] = "";
+	memset(ios->buckets, 0xff, sizeof(ios->buckets));
+	pthread_mutex_init(&ios->lock, NULL);
+	sdp->iostats = ios;
+	return 0;
+}
+
+/**
+ * Count the I/O which follows against a phase, such as a pass of fsck. I/O in
+ * a phase which is returned to is added to what was counted for it before.
+ * phase: A name for the phase, which must stay valid until the statistics
+ *        are freed
+ */
+void lgfs2_iostats_phase(struct gfs2_sbd *sdp, const char *phase)
+{
+	struct lgfs2_iostats *ios = sdp->iostats;
+	const char **p;
+
+	if (ios == NULL)
+		return;
+	pthread_mutex_lock(&ios->lock);
+	for (uint32_t i = 0; i < ios->nphases; i++) {
+		if (strcmp(ios->phases[i], phase) == 0) {
+			ios->cur = i;
+			goto out;
+		}
+	}
+	p = realloc(ios->phases, (ios->nphases + 1) * sizeof(*p));
+	if (p != NULL) {
+		ios->phases = p;
+		ios->phases[ios->nphases] = phase;
+		ios->cur = ios->nphases++;
+	}
+out:
+	pthread_mutex_unlock(&ios->lock);
+}
+
+/**
+ * Get the statistics of one of the call sites which have been counted.
+ * i: The index of the call site, from 0
+ * Returns 0 on success or -1 if there is no such call site.
+ */
+int lgfs2_iostats_get(const struct gfs2_sbd *sdp, unsigned i, struct lgfs2_iostat *st)
+{
+	struct lgfs2_iostats *ios = sdp->iostats;
+	int ret = -1;
+
+	if (ios == NULL)
+		return -1;
+	pthread_mutex_lock(&ios->lock);
+	if (i < ios->nsites) {
+		*st = ios->sites[i].st;
+		ret = 0;
+	}
+	pthread_mutex_unlock(&ios->lock);
+	return ret;
+}
+
+/**
+ * Parse a report specification of the form <format>[:<file>], where the format
+ * is "table" or "json".
+ * path: Set to the file name, or NULL if there is none, unless NULL
+ * Returns the format or -1 if the specification is not valid.
+ */
+int lgfs2_iostats_format(const char *spec, const char **path)
+{
+	const char *sep = strchr(spec, ':');
+	size_t len = sep ? (size_t)(sep - spec) : strlen(spec);
+	int format = -1;
+
+	if (len == 5 && strncmp(spec, "table", len) == 0)
+		format = LGFS2_IOSTATS_TABLE;
+	else if (len == 4 && strncmp(spec, "json", len) == 0)
+		format = LGFS2_IOSTATS_JSON;
+	if (format < 0 || (sep != NULL && sep[1] == '\0'))
+		return -1;
+	if (path != NULL)
+		*path = sep ? sep + 1 : NULL;
+	return format;
+}
+
+/* Phases in the order they were first used, then the most expensive sites first */
+static int ios_cmp(const void *a, const void *b)
+{
+	const struct iostats_site *x = *(struct iostats_site * const *)a;
+	const struct iostats_site *y = *(struct iostats_site * const *)b;
+	uint64_t tx = x->st.nsecs[LGFS2_IO_READ] + x->st.nsecs[LGFS2_IO_WRITE];
+	uint64_t ty = y->st.nsecs[LGFS2_IO_READ] + y->st.nsecs[LGFS2_IO_WRITE];
+	int c;
+
+	if (x->phase != y->phase)
+		return (x->phase > y->phase) - (x->phase < y->phase);
+	if (tx != ty)
+		return (tx < ty) - (tx > ty);
+	c = strcmp(x->st.caller, y->st.caller);
+	if (c != 0)
+		return c;
+	return (x->st.line > y->st.line) - (x->st.line < y->st.line);
+}
+
+static void ios_add(struct lgfs2_iostat *total, const struct lgfs2_iostat *st)
+{
+	for (int dir = LGFS2_IO_READ; dir <= LGFS2_IO_WRITE; dir++) {
+		total->count[dir] += st->count[dir];
+		total->bytes[dir] += st->bytes[dir];
+		total->nsecs[dir] += st->nsecs[dir];
+		for (unsigned b = 0; b < LGFS2_IOSTAT_BUCKETS; b++)
+			total->hist[dir][b] += st->hist[dir][b];
+	}
+}
+
+/* Describe the upper limit of the bucket which a percentile of I/Os fall in */
+static void ios_percentile(const struct lgfs2_iostat *st, unsigned pct, char *str, size_t len)
+{
+	uint64_t total = st->count[LGFS2_IO_READ] + st->count[LGFS2_IO_WRITE];
+	uint64_t target = (total * pct + 99) / 100;
+	uint64_t n = 0;
+	unsigned b;
+
+	for (b = 0; b < LGFS2_IOSTAT_BUCKETS - 1; b++) {
+		n += st->hist[LGFS2_IO_READ][b] + st->hist[LGFS2_IO_WRITE][b];
+		if (n >= target)
+			break;
+	}
+	if (total == 0)
+		snprintf(str, len, "-");
+	else if (b == LGFS2_IOSTAT_BUCKETS - 1)
+		snprintf(str, len, ">%llu", 1ULL << (b - 1));
+	else
+		snprintf(str, len, "%llu", 1ULL << b);
+}
+
+static void ios_row(FILE *f, const char *phase, const char *site, const struct lgfs2_iostat *st)
+{
+	uint64_t count = st->count[LGFS2_IO_READ] + st->count[LGFS2_IO_WRITE];
+	uint64_t nsecs = st->nsecs[LGFS2_IO_READ] + st->nsecs[LGFS2_IO_WRITE];
+	char p50[24], p99[24];
+
+	ios_percentile(st, 50, p50, sizeof(p50));
+	ios_percentile(st, 99, p99, sizeof(p99));
+	fprintf(f, "%-12s %-36s %9"PRIu64" %10"PRIu64" %9"PRIu64" %10"PRIu64" %10"PRIu64" %8"PRIu64" %8s %8s\n",
+	        *phase ? phase : "-", site,
+	        st->count[LGFS2_IO_READ], st->bytes[LGFS2_IO_READ] >> 10,
+	        st->count[LGFS2_IO_WRITE], st->bytes[LGFS2_IO_WRITE] >> 10,
+	        nsecs / 1000000, count ? nsecs / 1000 / count : 0, p50, p99);
+}
+
+static void ios_table(FILE *f, struct iostats_site **sites, uint32_t n)
+{
+	struct lgfs2_iostat total;
+	char site[128];
+
+	fprintf(f, "%-12s %-36s %9s %10s %9s %10s %10s %8s %8s %8s\n",
+	        "Phase", "Call site", "Reads", "Read KiB", "Writes", "Write KiB",
+	        "Time (ms)", "Avg (us)", "p50 (us)", "p99 (us)");
+	for (uint32_t i = 0; i < n; i++) {
+		const struct lgfs2_iostat *st = &sites[i]->st;
+
+		if (i == 0 || sites[i]->phase != sites[i - 1]->phase)
+			memset(&total, 0, sizeof(total));
+		snprintf(site, sizeof(site), "%s:%d", st->caller, st->line);
+		ios_row(f, st->phase, site, st);
+		ios_add(&total, st);
+		if (i == n - 1 || sites[i]->phase != sites[i + 1]->phase)
+			ios_row(f, st->phase, "(total)", &total);
+	}
+}
+
+static void json_str(FILE *f, const char *s)
+{
+	fputc('"', f);
+	for (; *s != '\0'; s++) {
+		unsigned char c = *s;
+
+		if (c == '"' || c == '\\')
+			fprintf(f, "\\%c", c);
+		else if (c < 0x20)
+			fprintf(f, "\\u%04x", c);
+		else
+			fputc(c, f);
+	}
+	fputc('"', f);
+}
+
+static void json_hist(FILE *f, const uint64_t *hist)
+{
+	fputc('[', f);
+	for (unsigned b = 0; b < LGFS2_IOSTAT_BUCKETS; b++)
+		fprintf(f, "%s%"PRIu64, b ? ", " : "", hist[b]);
+	fputc(']', f);
+}
+
+static void ios_json(FILE *f, struct iostats_site **sites, uint32_t n)
+{
+	const char *dirs[] = { "read", "write" };
+
+	fprintf(f, "{\"bucket_limits_us\": [");
+	for (unsigned b = 0; b < LGFS2_IOSTAT_BUCKETS - 1; b++)
+		fprintf(f, "%s%llu", b ? ", " : "", 1ULL << b);
+	fprintf(f, "],\n \"sites\": [");
+	for (uint32_t i = 0; i < n; i++) {
+		const struct lgfs2_iostat *st = &sites[i]->st;
+
+		fprintf(f, "%s\n  {\"phase\": ", i ? "," : "");
+		json_str(f, st->phase);
+		fprintf(f, ", \"caller\": ");
+		json_str(f, st->caller);
+		fprintf(f, ", \"line\": %d", st->line);
+		for (int dir = LGFS2_IO_READ; dir <= LGFS2_IO_WRITE; dir++) {
+			fprintf(f, ", \"%ss\": %"PRIu64", \"%s_bytes\": %"PRIu64", \"%s_nsecs\": %"PRIu64
+			        ", \"%s_histogram\": ", dirs[dir], st->count[dir], dirs[dir],
+			        st->bytes[dir], dirs[dir], st->nsecs[dir], dirs[dir]);
+			json_hist(f, st->hist[dir]);
+		}
+		fputc('}', f);
+	}
+	fprintf(f, "\n ]}\n");
+}
+
+/**
+ * Print the statistics counted so far, grouped by phase.
+ * format: LGFS2_IOSTATS_TABLE or LGFS2_IOSTATS_JSON
+ * Returns 0 on success or -1 with errno set on failure.
+ */
+int lgfs2_iostats_dump(const struct gfs2_sbd *sdp, FILE *f, int format)
+{
+	struct lgfs2_iostats *ios = sdp->iostats;
+	struct iostats_site **sites;
+
+	if (ios == NULL || (format != LGFS2_IOSTATS_TABLE && format != LGFS2_IOSTATS_JSON)) {
+		errno = EINVAL;
+		return -1;
+	}
+	pthread_mutex_lock(&ios->lock);
+	sites = malloc((ios->nsites + 1) * sizeof(*sites));
+	if (sites == NULL) {
+		pthread_mutex_unlock(&ios->lock);
+		return -1;
+	}
+	for (uint32_t i = 0; i < ios->nsites; i++)
+		sites[i] = &ios->sites[i];
+	qsort(sites, ios->nsites, sizeof(*sites), ios_cmp);
+	if (format == LGFS2_IOSTATS_JSON)
+		ios_json(f, sites, ios->nsites);
+	else
+		ios_table(f, sites, ios->nsites);
+	pthread_mutex_unlock(&ios->lock);
+	free(sites);
+	if (fflush(f) != 0 || ferror(f)) {
+		errno = EIO;
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Print the statistics counted so far as described by a specification which
+ * lgfs2_iostats_format() accepts, to standard error if it has no file name.
+ * Returns 0 on success or -1 with errno set on failure.
+ */
+int lgfs2_iostats_report(const struct gfs2_sbd *sdp, const char *spec)
+{
+	const char *path;
+	int format;
+	FILE *f;
+	int ret;
+
+	format = lgfs2_iostats_format(spec, &path);
+	if (format < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (path == NULL)
+		return lgfs2_iostats_dump(sdp, stderr, format);
+	f = fopen(path, "w");
+	if (f == NULL)
+		return -1;
+	ret = lgfs2_iostats_dump(sdp, f, format);
+	if (fclose(f) != 0)
+		ret = -1;
+	return ret;
+}
+
+/**
+ * Stop accounting I/O and free the statistics.
+ */
+void lgfs2_iostats_free(struct gfs2_sbd *sdp)
+{
+	struct lgfs2_iostats *ios = sdp->iostats;
+
+	if (ios == NULL)
+		return;
+	sdp->iostats = NULL;
+	pthread_mutex_destroy(&ios->lock);
+	free(ios->sites);
+	free(ios->phases);
+	free(ios);
+}
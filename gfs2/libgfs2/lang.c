@@ -402,8 +402,9 @@ static void result_lookup_mtype(struct lgfs2_lang_result *result, int gfs1)
 		fprintf(stderr, "Could not determine meta type for block %"PRIu64"\n", addr);
 }
 
-static char *lang_read_block(int fd, unsigned bsize, uint64_t addr)
+static char *lang_read_block(struct gfs2_sbd *sbd, uint64_t addr)
 {
+	unsigned bsize = sbd->sd_bsize;
 	off_t off = addr * bsize;
 	char *buf;
 
@@ -412,7 +413,7 @@ static char *lang_read_block(int fd, unsigned bsize, uint64_t addr)
 		perror("Failed to read block");
 		return NULL;
 	}
-	if (pread(fd, buf, bsize, off) != bsize) {
+	if (lgfs2_pread(sbd, sbd->device_fd, buf, bsize, off) != bsize) {
 		fprintf(stderr, "Failed to read block %"PRIu64": %s\n", addr, strerror(errno));
 		free(buf);
 		return NULL;
@@ -438,7 +439,7 @@ static struct lgfs2_lang_result *ast_interp_get(struct lgfs2_lang_state *state,
 			free(result);
 			return NULL;
 		}
-		result->lr_buf = lang_read_block(sbd->device_fd, sbd->sd_bsize, result->lr_blocknr);
+		result->lr_buf = lang_read_block(sbd, result->lr_blocknr);
 		if (result->lr_buf == NULL) {
 			free(result);
 			return NULL;
@@ -505,11 +506,12 @@ static const struct lgfs2_metadata *lang_find_mtype(struct ast_node *node, const
 	return mtype;
 }
 
-static int lang_write_result(int fd, unsigned bsize, struct lgfs2_lang_result *result)
+static int lang_write_result(struct gfs2_sbd *sbd, struct lgfs2_lang_result *result)
 {
+	unsigned bsize = sbd->sd_bsize;
 	off_t off = bsize * result->lr_blocknr;
 
-	if (pwrite(fd, result->lr_buf, bsize, off) != bsize) {
+	if (lgfs2_pwrite(sbd, sbd->device_fd, result->lr_buf, bsize, off) != bsize) {
 		fprintf(stderr, "Failed to write modified block %"PRIu64": %s\n",
 		                result->lr_blocknr, strerror(errno));
 		return -1;
@@ -539,7 +541,7 @@ static struct lgfs2_lang_result *ast_interp_set(struct lgfs2_lang_state *state,
 	result->lr_blocknr = ast_lookup_block(lookup, sbd);
 	if (result->lr_blocknr == 0)
 		goto out_err;
-	result->lr_buf = lang_read_block(sbd->device_fd, sbd->sd_bsize, result->lr_blocknr);
+	result->lr_buf = lang_read_block(sbd, result->lr_blocknr);
 	if (result->lr_buf == NULL)
 		goto out_err;
 
@@ -580,7 +582,7 @@ static struct lgfs2_lang_result *ast_interp_set(struct lgfs2_lang_state *state,
 		}
 	}
 
-	ret = lang_write_result(sbd->device_fd, sbd->sd_bsize, result);
+	ret = lang_write_result(sbd, result);
 	if (ret != 0)
 		goto out_err;
 
@@ -170,6 +170,13 @@ struct gfs2_bitmap
 };
 
 struct gfs2_sbd;
+struct lgfs2_bcache;
+struct lgfs2_rgcache;
+struct lgfs2_iostats;
+struct lgfs2_simdev;
+struct lgfs2_metaimg;
+struct lgfs2_rgindex;
+struct lgfs2_mapcache;
 struct gfs2_inode;
 typedef struct _lgfs2_rgrps *lgfs2_rgrps_t;
 
@@ -177,6 +184,8 @@ struct rgrp_tree {
 	struct osi_node node;
 	struct gfs2_bitmap *bits;
 	lgfs2_rgrps_t rgrps;
+	struct lgfs2_rgcache *rt_cache; /* Loads evicted bitmaps on demand, see rgrp.c */
+	osi_list_t rt_lru;
 
 	/* Native-endian counterparts of the on-disk rindex struct */
 	uint64_t rt_addr;
@@ -254,6 +263,7 @@ struct gfs2_inode {
 	struct gfs2_buffer_head *i_bh;
 	struct gfs2_sbd *i_sbd;
 	struct rgrp_tree *i_rgd; /* performance hint */
+	struct lgfs2_mapcache *i_mapcache; /* Last indirect blocks mapped through, see fs_ops.c */
 	int bh_owned; /* Is this bh owned, iow, should we release it later? */
 
 	/* Native-endian versions of the dinode fields */
@@ -365,6 +375,13 @@ struct gfs2_sbd {
 
 	int device_fd;
 	int path_fd;
+	struct lgfs2_bcache *bcache; /* Optional block cache, see buf.c */
+	uint64_t blkgen; /* Bumped whenever blocks are written, see buf.c */
+	struct lgfs2_rgindex *rgindex; /* Resource group lookup index, see rgrp.c */
+	struct lgfs2_rgcache *rgcache; /* Optional resource group cache, see rgrp.c */
+	struct lgfs2_iostats *iostats; /* Optional I/O accounting, see iostats.c */
+	struct lgfs2_simdev *simdev; /* Optional simulated device, see simdev.c */
+	struct lgfs2_metaimg *metaimg; /* Set when the device is a savemeta file, see metaimg.c */
 
 	uint64_t fssize;
 	uint64_t blks_total;
@@ -462,14 +479,36 @@ extern struct gfs2_buffer_head *bget(struct gfs2_sbd *sdp, uint64_t num);
 extern struct gfs2_buffer_head *__bread(struct gfs2_sbd *sdp, uint64_t num,
 					int line, const char *caller);
 extern int __breadm(struct gfs2_sbd *sdp, struct gfs2_buffer_head **bhs, size_t n, uint64_t block, int line, const char *caller);
-extern int bwrite(struct gfs2_buffer_head *bh);
-extern int brelse(struct gfs2_buffer_head *bh);
+extern int __bwrite(struct gfs2_buffer_head *bh, int line, const char *caller);
+extern int __brelse(struct gfs2_buffer_head *bh, int line, const char *caller);
 extern uint32_t lgfs2_get_block_type(const char *buf);
 
+struct lgfs2_bcache_stats {
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evictions;
+	uint64_t writebacks;
+};
+extern int lgfs2_bcache_init(struct gfs2_sbd *sdp, size_t size);
+extern int lgfs2_bcache_sync(struct gfs2_sbd *sdp);
+extern int lgfs2_bcache_forget(struct gfs2_sbd *sdp, uint64_t start, uint64_t count);
+extern int lgfs2_bcache_flush(struct gfs2_sbd *sdp, uint64_t start, uint64_t count);
+extern int lgfs2_bcache_free(struct gfs2_sbd *sdp);
+extern int lgfs2_bcache_stats(const struct gfs2_sbd *sdp, struct lgfs2_bcache_stats *st);
+
+struct lgfs2_areader;
+extern struct lgfs2_areader *lgfs2_areader_init(struct gfs2_sbd *sdp, unsigned depth, unsigned nthreads);
+extern int lgfs2_areader_submit(struct lgfs2_areader *ar, uint64_t blkno);
+extern int lgfs2_areader_peek(struct lgfs2_areader *ar, uint64_t *blkno);
+extern struct gfs2_buffer_head *lgfs2_areader_next(struct lgfs2_areader *ar);
+extern void lgfs2_areader_free(struct lgfs2_areader **arp);
+
 #define bmodified(bh) do { bh->b_modified = 1; } while(0)
 
 #define bread(bl, num) __bread(bl, num, __LINE__, __FUNCTION__)
 #define breadm(bl, bhs, n, block) __breadm(bl, bhs, n, block, __LINE__, __FUNCTION__)
+#define bwrite(bh) __bwrite(bh, __LINE__, __FUNCTION__)
+#define brelse(bh) __brelse(bh, __LINE__, __FUNCTION__)
 
 /* config.c */
 extern void lgfs2_set_debug(int enable);
@@ -485,6 +524,8 @@ extern void fix_device_geometry(struct gfs2_sbd *sdp);
 extern unsigned long gfs2_bitfit(const unsigned char *buffer,
 				 const unsigned int buflen,
 				 unsigned long goal, unsigned char old_state);
+extern unsigned lgfs2_bitmap_scan(const unsigned char *buf, unsigned len, uint8_t state,
+                                  uint64_t base, uint64_t *out);
 
 /* functions with blk #'s that are rgrp relative */
 extern uint32_t gfs2_blkalloc_internal(struct rgrp_tree *rgd, uint32_t goal,
@@ -544,10 +585,12 @@ extern int gfs2_dirent_del(struct gfs2_inode *dip, const char *filename,
 			   int filename_len);
 extern void block_map(struct gfs2_inode *ip, uint64_t lblock, int *new,
 		      uint64_t *dblock, uint32_t *extlen, int prealloc);
+extern int lgfs2_map_extent(struct gfs2_inode *ip, uint64_t lblock, uint64_t maxlen,
+                            uint64_t *dblock, uint64_t *extlen);
 extern int lgfs2_get_leaf_ptr(struct gfs2_inode *dip, uint32_t index, uint64_t *ptr) __attribute__((warn_unused_result));
 extern void dir_split_leaf(struct gfs2_inode *dip, uint32_t start,
 			   uint64_t leaf_no, struct gfs2_buffer_head *obh);
-extern void gfs2_free_block(struct gfs2_sbd *sdp, uint64_t block);
+extern int gfs2_free_block(struct gfs2_sbd *sdp, uint64_t block);
 extern int gfs2_freedi(struct gfs2_sbd *sdp, uint64_t block);
 extern int gfs2_get_leaf(struct gfs2_inode *dip, uint64_t leaf_no,
 			 struct gfs2_buffer_head **bhp);
@@ -564,6 +607,8 @@ extern int lgfs2_write_journal_data(struct gfs2_inode *ip);
 extern int lgfs2_write_filemeta(struct gfs2_inode *ip);
 extern uint32_t lgfs2_log_header_hash(char *buf);
 extern uint32_t lgfs2_log_header_crc(char *buf, unsigned bsize);
+extern uint64_t lgfs2_log_headers_fill(char *buf, unsigned bsize, unsigned count, uint64_t jinode,
+                                       uint32_t lbn, uint64_t addr, uint64_t seq, uint64_t blocks);
 
 /* gfs1.c - GFS1 backward compatibility structures and functions */
 
@@ -734,6 +779,113 @@ extern struct gfs2_inode *lgfs2_gfs_inode_read(struct gfs2_sbd *sdp, uint64_t di
 extern void lgfs2_gfs_rgrp_in(const lgfs2_rgrp_t rg, void *buf);
 extern void lgfs2_gfs_rgrp_out(const lgfs2_rgrp_t rg, void *buf);
 
+/* iostats.c */
+#define LGFS2_IO_READ (0)
+#define LGFS2_IO_WRITE (1)
+
+/* Bucket 0 counts I/Os which took under 1us and bucket i > 0 those which took
+   from 2^(i-1) up to 2^i us, except the last, which has no upper limit. */
+#define LGFS2_IOSTAT_BUCKETS (24)
+
+struct lgfs2_iostat {
+	const char *phase;
+	const char *caller;
+	int line;
+	uint64_t count[2]; /* Indexed by LGFS2_IO_READ/LGFS2_IO_WRITE */
+	uint64_t bytes[2];
+	uint64_t nsecs[2];
+	uint64_t hist[2][LGFS2_IOSTAT_BUCKETS];
+};
+
+#define LGFS2_IOSTATS_TABLE (0)
+#define LGFS2_IOSTATS_JSON (1)
+
+extern int lgfs2_iostats_init(struct gfs2_sbd *sdp);
+extern void lgfs2_iostats_phase(struct gfs2_sbd *sdp, const char *phase);
+extern int lgfs2_iostats_get(const struct gfs2_sbd *sdp, unsigned i, struct lgfs2_iostat *st);
+extern int lgfs2_iostats_format(const char *spec, const char **path);
+extern int lgfs2_iostats_dump(const struct gfs2_sbd *sdp, FILE *f, int format);
+extern int lgfs2_iostats_report(const struct gfs2_sbd *sdp, const char *spec);
+extern void lgfs2_iostats_free(struct gfs2_sbd *sdp);
+extern ssize_t __lgfs2_pread(const struct gfs2_sbd *sdp, int fd, void *buf, size_t count, off_t offset,
+                             int line, const char *caller);
+extern ssize_t __lgfs2_pwrite(const struct gfs2_sbd *sdp, int fd, const void *buf, size_t count, off_t offset,
+                              int line, const char *caller);
+extern ssize_t __lgfs2_preadv(const struct gfs2_sbd *sdp, int fd, const struct iovec *iov, int iovcnt,
+                              off_t offset, int line, const char *caller);
+extern ssize_t __lgfs2_pwritev(const struct gfs2_sbd *sdp, int fd, const struct iovec *iov, int iovcnt,
+                               off_t offset, int line, const char *caller);
+
+#define lgfs2_pread(sdp, fd, buf, count, offset) \
+	__lgfs2_pread(sdp, fd, buf, count, offset, __LINE__, __FUNCTION__)
+#define lgfs2_pwrite(sdp, fd, buf, count, offset) \
+	__lgfs2_pwrite(sdp, fd, buf, count, offset, __LINE__, __FUNCTION__)
+#define lgfs2_preadv(sdp, fd, iov, iovcnt, offset) \
+	__lgfs2_preadv(sdp, fd, iov, iovcnt, offset, __LINE__, __FUNCTION__)
+#define lgfs2_pwritev(sdp, fd, iov, iovcnt, offset) \
+	__lgfs2_pwritev(sdp, fd, iov, iovcnt, offset, __LINE__, __FUNCTION__)
+
+/* metaimg.c */
+
+/* Header for the savemeta output file */
+struct savemeta_header {
+#define SAVEMETA_MAGIC (0x01171970)
+	__be32 sh_magic;
+#define SAVEMETA_FORMAT_STREAM (1)  /* One stream of saved_metablock records */
+#define SAVEMETA_FORMAT_CHUNKED (2) /* Chunks of records and an index of them */
+#define SAVEMETA_FORMAT SAVEMETA_FORMAT_CHUNKED /* The newest format understood */
+	__be32 sh_format; /* In case we want to change the layout */
+	__be64 sh_time; /* When savemeta was run */
+	__be64 sh_fs_bytes; /* Size of the fs */
+	uint8_t __reserved[104];
+};
+
+struct saved_metablock {
+	__be64 blk;
+	__be16 siglen; /* significant data length */
+/* This needs to be packed because old versions of gfs2_edit read and write the
+   individual fields separately, so the hole after siglen must be eradicated
+   before the struct reflects what's on disk. */
+} __attribute__((__packed__));
+
+/*
+ * A format 2 savemeta file is a series of gzip members, or chunks, each of which
+ * holds only whole records and can be decompressed on its own. The first one
+ * starts with the header. Then comes a member holding a record with block
+ * number SAVEMETA_END_BLK, which stops readers of the stream, followed by a
+ * savemeta_chunk for each chunk, in order. The file ends with an empty gzip
+ * member, SAVEMETA_TRAILER_LEN bytes long, which says where the index is in
+ * its extra field.
+ */
+#define SAVEMETA_END_BLK (~(uint64_t)0)
+
+struct savemeta_chunk {
+	__be64 sc_offset; /* Where the chunk's gzip member starts in the file */
+	__be32 sc_len;    /* Length of the gzip member */
+	__be32 sc_size;   /* Length of its contents */
+	__be64 sc_first;  /* Lowest and highest block numbers saved in the chunk */
+	__be64 sc_last;
+};
+
+#define SAVEMETA_TRAILER_LEN (42)
+
+struct lgfs2_savemeta_chunk {
+	uint64_t offset;
+	uint32_t len;
+	uint32_t size;
+	uint64_t first;
+	uint64_t last;
+};
+
+extern void lgfs2_savemeta_trailer(char *buf, uint64_t index, uint32_t index_len, uint32_t chunks);
+extern int lgfs2_savemeta_index(int fd, struct lgfs2_savemeta_chunk **chunks, uint32_t *count);
+extern int lgfs2_savemeta_chunk_read(int fd, const struct lgfs2_savemeta_chunk *c, char *buf);
+extern int lgfs2_metaimg_open(struct gfs2_sbd *sdp);
+extern int lgfs2_metaimg_dev_info(const struct lgfs2_metaimg *mi, struct lgfs2_dev_info *i);
+extern off_t lgfs2_dev_size(const struct gfs2_sbd *sdp);
+extern ssize_t lgfs2_metaimg_pread(struct lgfs2_metaimg *mi, void *buf, size_t count, off_t offset);
+extern void lgfs2_metaimg_free(struct gfs2_sbd *sdp);
+
 /* misc.c */
 extern int compute_heightsize(unsigned bsize, uint64_t *heightsize,
 		uint32_t *maxheight, uint32_t bsize1, int diptrs, int inptrs);
@@ -758,10 +910,24 @@ extern int lgfs2_clean_journal(struct gfs2_inode *ip, struct lgfs2_log_header *h
 /* rgrp.c */
 extern int gfs2_compute_bitstructs(const uint32_t bsize, struct rgrp_tree *rgd);
 extern struct rgrp_tree *gfs2_blk2rgrpd(struct gfs2_sbd *sdp, uint64_t blk);
+extern int lgfs2_rgrp_index_build(struct gfs2_sbd *sdp);
+extern void lgfs2_rgrp_index_free(struct gfs2_sbd *sdp);
 extern int lgfs2_rgrp_crc_check(char *buf);
 extern void lgfs2_rgrp_crc_set(char *buf);
 extern uint64_t gfs2_rgrp_read(struct gfs2_sbd *sdp, struct rgrp_tree *rgd);
-extern void gfs2_rgrp_relse(struct gfs2_sbd *sdp, struct rgrp_tree *rgd);
+extern uint64_t lgfs2_rgrp_read_header(struct gfs2_sbd *sdp, struct rgrp_tree *rgd);
+extern int gfs2_rgrp_relse(struct gfs2_sbd *sdp, struct rgrp_tree *rgd);
+extern int lgfs2_rgrp_load(struct rgrp_tree *rgd);
+
+struct lgfs2_rgcache_stats {
+	uint64_t loads;
+	uint64_t evictions;
+	uint64_t writebacks;
+};
+extern int lgfs2_rgcache_init(struct gfs2_sbd *sdp, size_t limit);
+extern int lgfs2_rgcache_trim(struct gfs2_sbd *sdp);
+extern int lgfs2_rgcache_stats(const struct gfs2_sbd *sdp, struct lgfs2_rgcache_stats *st);
+extern void lgfs2_rgcache_free(struct gfs2_sbd *sdp);
 extern struct rgrp_tree *rgrp_insert(struct osi_root *rgtree,
 				     uint64_t rgblock);
 extern void gfs2_rgrp_free(struct gfs2_sbd *sdp, struct osi_root *rgrp_tree);
@@ -771,6 +937,24 @@ static inline unsigned int rgrp_size(struct rgrp_tree *rgrp)
 	return rgrp->rt_data + rgrp->rt_length;
 }
 
+/* simdev.c */
+struct lgfs2_simdev_stats {
+	uint64_t requests;   /* Requests queued on the device */
+	uint64_t hits;       /* Pages read from the cache */
+	uint64_t misses;     /* Pages read from the device */
+	uint64_t ahead;      /* Pages read ahead */
+	uint64_t ahead_used; /* Pages read ahead and then read */
+	uint64_t written;    /* Bytes written */
+	uint64_t waited;     /* Nanoseconds spent waiting for the device */
+};
+
+extern int lgfs2_simdev_init(struct gfs2_sbd *sdp, const char *spec);
+extern uint64_t lgfs2_simdev_submit(struct lgfs2_simdev *sd, int dir, uint64_t offset, uint64_t len);
+extern void lgfs2_simdev_wait(uint64_t due);
+extern int lgfs2_simdev_stats(const struct gfs2_sbd *sdp, struct lgfs2_simdev_stats *st);
+extern void lgfs2_simdev_free(struct gfs2_sbd *sdp);
+extern int lgfs2_fadvise(const struct gfs2_sbd *sdp, int fd, off_t offset, off_t len, int advice);
+
 /* structures.c */
 extern int build_master(struct gfs2_sbd *sdp);
 extern int lgfs2_sb_write(const struct gfs2_sbd *sdp, int fd);
@@ -800,7 +984,13 @@ extern int rindex_read(struct gfs2_sbd *sdp, uint64_t *rgcount, int *ok);
 extern int write_sb(struct gfs2_sbd *sdp);
 
 /* ondisk.c */
+struct lgfs2_hash_impl {
+	const char *name;
+	uint32_t (*fn)(uint32_t crc, const unsigned char *data, size_t len);
+};
+
 extern uint32_t gfs2_disk_hash(const char *data, int len);
+extern const struct lgfs2_hash_impl *lgfs2_disk_hash_impls(void);
 extern void print_it(const char *label, const char *fmt, const char *fmt2, ...)
 	__attribute__((format(printf,2,4)));
 
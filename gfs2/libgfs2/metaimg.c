@@ -0,0 +1,1123 @@
+#include "clusterautoconfig.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include <bzlib.h>
+
+#include "libgfs2.h"
+
+/*
+ * Savemeta images
+ *
+ * lgfs2_metaimg_open() lets the tools read a file written by gfs2_edit
+ * savemeta as if it were the device it was saved from. The file holds a stream
+ * of saved_metablock records, either uncompressed, gzipped (possibly in many
+ * members) or bzip2ed. Opening it decompresses the stream once to index where
+ * each block's data is in it, after which the lgfs2_pread() family of wrappers
+ * serve blocks from the stream, padded with the zeroes which savemeta leaves
+ * out. Blocks which were not saved read as zeroes and writes fail with EROFS.
+ *
+ * A gzip member is inflated again whenever a block in it is read, and the last
+ * few are kept, so savemeta's output, which starts a new member every 4MiB, is
+ * read without scratch space. Streams which can't be read that way, bzip2 and
+ * gzip with larger members, are decompressed into an unlinked file in $TMPDIR
+ * instead, which is the size of the saved metadata rather than of the file
+ * system.
+ *
+ * Format 2 files have an index of their chunks, so they are opened without
+ * decompressing anything but the first chunk. The records in a chunk are only
+ * indexed when a block in the chunk's range of blocks is first read.
+ */
+
+#define METAIMG_CHUNK (1 << 20)        /* Bytes read from the file at a time */
+#define METAIMG_PREAMBLE (1024)        /* Where the superblock record must start */
+#define METAIMG_MEMBER_MAX (16 << 20)  /* Largest gzip member inflated on demand */
+#define METAIMG_CACHED (4)             /* Inflated gzip members kept */
+
+enum {
+	METAIMG_RAW = 0,
+	METAIMG_GZIP,
+	METAIMG_BZIP2,
+};
+
+struct metaimg_ent {
+	uint64_t blk;
+	uint64_t loc; /* Offset of the block's data in the stream << 16 | its length */
+};
+
+struct metaimg_member {
+	uint64_t in;    /* Offset of the gzip member in the file */
+	uint64_t inlen;
+	uint64_t start; /* Offset of its contents in the stream */
+	uint64_t len;
+};
+
+struct metaimg_chunk {
+	uint64_t first;  /* The range of blocks saved in the chunk */
+	uint64_t last;
+	struct metaimg_ent *ents;
+	uint64_t nents;
+	int indexed;
+};
+
+struct metaimg_cached {
+	char *buf;
+	uint64_t member;
+	uint64_t used;  /* For choosing the least recently used one */
+};
+
+struct lgfs2_metaimg {
+	pthread_mutex_t lock;
+	int fd;
+	int type;
+	int spill_fd;   /* The decompressed stream, or -1 */
+	unsigned bsize;
+	uint64_t size;
+	struct metaimg_ent *ents;
+	uint64_t nents;
+	struct metaimg_member *members;
+	uint64_t nmembers;
+	struct metaimg_chunk *chunks; /* Format 2 only, one per member */
+	uint32_t *by_first;   /* Chunk numbers sorted by the first block saved */
+	uint64_t *last_max;   /* Highest last block of the chunks up to each in by_first */
+	uint64_t rec_start;   /* Where the records start in the first chunk */
+	struct metaimg_cached cache[METAIMG_CACHED];
+	uint64_t tick;
+};
+
+struct metaimg_in {
+	int fd;
+	unsigned char *buf;
+	size_t len;     /* Bytes in buf */
+	size_t used;    /* Bytes of them consumed */
+	uint64_t off;   /* File offset of buf[0] */
+	int eof;
+};
+
+struct metaimg_scan {
+	struct lgfs2_metaimg *mi;
+	uint64_t alloc;    /* Index entries allocated */
+	uint64_t fed;      /* Bytes of the stream seen so far */
+	uint64_t pos;      /* Stream offset of the next record byte */
+	char pre[METAIMG_PREAMBLE];
+	size_t pre_len;
+	int found;         /* The superblock record has been found */
+	int done;          /* The end of the records has been found */
+	uint64_t fs_bytes; /* From the savemeta header, if there is one */
+	struct saved_metablock rec;
+	size_t rec_len;    /* Bytes of the record header seen */
+	uint64_t skip;     /* Bytes of the record's data still to come */
+	uint64_t member_max;
+};
+
+static int in_fill(struct metaimg_in *in)
+{
+	ssize_t n;
+
+	memmove(in->buf, in->buf + in->used, in->len - in->used);
+	in->off += in->used;
+	in->len -= in->used;
+	in->used = 0;
+	n = pread(in->fd, in->buf + in->len, METAIMG_CHUNK - in->len, in->off + in->len);
+	if (n < 0)
+		return -1;
+	if (n == 0)
+		in->eof = 1;
+	in->len += n;
+	return 0;
+}
+
+static int ents_add(struct metaimg_ent **ents, uint64_t *nents, uint64_t *alloc,
+                    uint64_t blk, uint64_t off, uint16_t len)
+{
+	if (*nents == *alloc) {
+		uint64_t n = *alloc ? *alloc * 2 : 4096;
+		struct metaimg_ent *e = realloc(*ents, n * sizeof(*e));
+
+		if (e == NULL)
+			return -1;
+		*ents = e;
+		*alloc = n;
+	}
+	(*ents)[*nents].blk = blk;
+	(*ents)[*nents].loc = off << 16 | len;
+	(*nents)++;
+	return 0;
+}
+
+static int scan_records(struct metaimg_scan *sc, const char *buf, size_t len)
+{
+	while (len > 0 && !sc->done) {
+		size_t n;
+
+		if (sc->skip > 0) {
+			n = len < sc->skip ? len : sc->skip;
+			sc->skip -= n;
+		} else {
+			uint16_t siglen;
+
+			n = sizeof(sc->rec) - sc->rec_len;
+			if (n > len)
+				n = len;
+			memcpy((char *)&sc->rec + sc->rec_len, buf, n);
+			sc->rec_len += n;
+			if (sc->rec_len == sizeof(sc->rec)) {
+				siglen = be16_to_cpu(sc->rec.siglen);
+				/* What follows in a format 2 file is its index */
+				if (be64_to_cpu(sc->rec.blk) == SAVEMETA_END_BLK) {
+					sc->rec_len = 0;
+					sc->done = 1;
+					break;
+				}
+				if (siglen > sc->mi->bsize) {
+					errno = EBADMSG;
+					return -1;
+				}
+				if (ents_add(&sc->mi->ents, &sc->mi->nents, &sc->alloc,
+				             be64_to_cpu(sc->rec.blk), sc->pos + n, siglen) != 0)
+					return -1;
+				sc->rec_len = 0;
+				sc->skip = siglen;
+			}
+		}
+		sc->pos += n;
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* Parse the header, if there is one, and look for the superblock's record in
+   the same way as gfs2_edit restoremeta, to support old formats. Sets the block
+   size, the file system size if the header has it and where the superblock's
+   record starts. */
+static int preamble_parse(struct lgfs2_metaimg *mi, const char *buf, size_t buflen,
+                          uint64_t *fs_bytes, size_t *startp)
+{
+	const struct savemeta_header *smh = (const void *)buf;
+	size_t start = 0;
+
+	if (buflen >= sizeof(*smh) && be32_to_cpu(smh->sh_magic) == SAVEMETA_MAGIC) {
+		if (be32_to_cpu(smh->sh_format) > SAVEMETA_FORMAT) {
+			errno = EOPNOTSUPP;
+			return -1;
+		}
+		*fs_bytes = be64_to_cpu(smh->sh_fs_bytes);
+		start = sizeof(*smh);
+	}
+	for (; start <= 256 + sizeof(struct saved_metablock) + sizeof(struct gfs2_meta_header); start++) {
+		const struct saved_metablock *svb = (const void *)(buf + start);
+		struct gfs2_sb sb = {0};
+		size_t len;
+
+		if (start + sizeof(*svb) + offsetof(struct gfs2_sb, sb_bsize_shift) > buflen)
+			break;
+		len = be16_to_cpu(svb->siglen);
+		if (len < offsetof(struct gfs2_sb, sb_bsize_shift))
+			continue;
+		if (len > sizeof(sb))
+			len = sizeof(sb);
+		if (len > buflen - start - sizeof(*svb))
+			len = buflen - start - sizeof(*svb);
+		memcpy(&sb, svb + 1, len);
+		if (be32_to_cpu(sb.sb_header.mh_magic) != GFS2_MAGIC ||
+		    be32_to_cpu(sb.sb_header.mh_type) != GFS2_METATYPE_SB)
+			continue;
+		mi->bsize = be32_to_cpu(sb.sb_bsize);
+		if (mi->bsize < GFS2_BASIC_BLOCK || mi->bsize > (1 << 16) ||
+		    (mi->bsize & (mi->bsize - 1)) != 0)
+			break;
+		*startp = start;
+		return 0;
+	}
+	errno = EINVAL;
+	return -1;
+}
+
+static int scan_preamble(struct metaimg_scan *sc)
+{
+	size_t start;
+
+	if (preamble_parse(sc->mi, sc->pre, sc->pre_len, &sc->fs_bytes, &start) != 0)
+		return -1;
+	sc->found = 1;
+	sc->pos = start;
+	return scan_records(sc, sc->pre + start, sc->pre_len - start);
+}
+
+static int scan_feed(struct metaimg_scan *sc, const char *buf, size_t len)
+{
+	int spill_fd = sc->mi->spill_fd;
+
+	if (spill_fd >= 0) {
+		for (size_t done = 0; done < len;) {
+			ssize_t n = pwrite(spill_fd, buf + done, len - done, sc->fed + done);
+
+			if (n < 0)
+				return -1;
+			done += n;
+		}
+	}
+	sc->fed += len;
+	if (!sc->found) {
+		size_t n = sizeof(sc->pre) - sc->pre_len;
+
+		if (n > len)
+			n = len;
+		memcpy(sc->pre + sc->pre_len, buf, n);
+		sc->pre_len += n;
+		buf += n;
+		len -= n;
+		if (sc->pre_len < sizeof(sc->pre))
+			return 0;
+		if (scan_preamble(sc) != 0)
+			return -1;
+	}
+	return scan_records(sc, buf, len);
+}
+
+static int scan_raw(struct metaimg_scan *sc, struct metaimg_in *in)
+{
+	while (!in->eof) {
+		if (in_fill(in) != 0 || scan_feed(sc, (char *)in->buf, in->len) != 0)
+			return -1;
+		in->used = in->len;
+	}
+	return 0;
+}
+
+static int scan_add_member(struct metaimg_scan *sc, uint64_t in, uint64_t inlen, uint64_t start)
+{
+	struct lgfs2_metaimg *mi = sc->mi;
+	struct metaimg_member *m;
+
+	if ((mi->nmembers & (mi->nmembers - 1)) == 0) {
+		m = realloc(mi->members, (mi->nmembers ? mi->nmembers * 2 : 1) * sizeof(*m));
+		if (m == NULL)
+			return -1;
+		mi->members = m;
+	}
+	m = &mi->members[mi->nmembers++];
+	m->in = in;
+	m->inlen = inlen;
+	m->start = start;
+	m->len = sc->fed - start;
+	if (m->len > sc->member_max)
+		sc->member_max = m->len;
+	return 0;
+}
+
+static int scan_gzip(struct metaimg_scan *sc, struct metaimg_in *in)
+{
+	z_stream zs = {0};
+	uint64_t member_in = 0;
+	uint64_t member_start = 0;
+	int pending = 0; /* Output may be held back for lack of space */
+	char *out;
+	int ret = -1;
+
+	out = malloc(METAIMG_CHUNK);
+	if (out == NULL)
+		return -1;
+	if (inflateInit2(&zs, 16 + MAX_WBITS) != Z_OK) {
+		free(out);
+		errno = ENOMEM;
+		return -1;
+	}
+	for (;;) {
+		int zret;
+
+		if (in->len - in->used < 2 && !in->eof && in_fill(in) != 0)
+			goto out;
+		if (in->used == in->len && !pending)
+			break;
+		zs.next_in = in->buf + in->used;
+		zs.avail_in = in->len - in->used;
+		zs.next_out = (unsigned char *)out;
+		zs.avail_out = METAIMG_CHUNK;
+		zret = inflate(&zs, Z_NO_FLUSH);
+		in->used = in->len - zs.avail_in;
+		pending = zs.avail_out == 0;
+		if (zret != Z_OK && zret != Z_STREAM_END && zret != Z_BUF_ERROR) {
+			errno = EINVAL;
+			goto out;
+		}
+		if (scan_feed(sc, out, METAIMG_CHUNK - zs.avail_out) != 0)
+			goto out;
+		if (zret == Z_BUF_ERROR && in->eof)
+			break;
+		if (zret != Z_STREAM_END)
+			continue;
+		if (scan_add_member(sc, member_in, in->off + in->used - member_in, member_start) != 0)
+			goto out;
+		member_in = in->off + in->used;
+		member_start = sc->fed;
+		if (in->len - in->used < 2 && !in->eof && in_fill(in) != 0)
+			goto out;
+		/* Anything after the last member is ignored, as gzip does */
+		if (in->len - in->used < 2 || in->buf[in->used] != 0x1f || in->buf[in->used + 1] != 0x8b)
+			break;
+		inflateReset(&zs);
+		pending = 0;
+	}
+	/* A truncated last member can still be read as far as it goes */
+	if (sc->fed > member_start &&
+	    scan_add_member(sc, member_in, in->off + in->len - member_in, member_start) != 0)
+		goto out;
+	ret = 0;
+out:
+	inflateEnd(&zs);
+	free(out);
+	return ret;
+}
+
+static int scan_bzip2(struct metaimg_scan *sc, struct metaimg_in *in)
+{
+	bz_stream bs = {0};
+	int pending = 0;
+	char *out;
+	int ret = -1;
+
+	out = malloc(METAIMG_CHUNK);
+	if (out == NULL)
+		return -1;
+	if (BZ2_bzDecompressInit(&bs, 0, 0) != BZ_OK) {
+		free(out);
+		errno = ENOMEM;
+		return -1;
+	}
+	for (;;) {
+		int bzret;
+
+		if (in->len - in->used < 3 && !in->eof && in_fill(in) != 0)
+			goto out;
+		if (in->used == in->len && !pending)
+			break;
+		bs.next_in = (char *)in->buf + in->used;
+		bs.avail_in = in->len - in->used;
+		bs.next_out = out;
+		bs.avail_out = METAIMG_CHUNK;
+		bzret = BZ2_bzDecompress(&bs);
+		in->used = in->len - bs.avail_in;
+		pending = bs.avail_out == 0;
+		if (bzret != BZ_OK && bzret != BZ_STREAM_END) {
+			errno = EINVAL;
+			goto out;
+		}
+		if (scan_feed(sc, out, METAIMG_CHUNK - bs.avail_out) != 0)
+			goto out;
+		if (bzret != BZ_STREAM_END)
+			continue;
+		/* Parallel bzip2 tools write one stream after another */
+		if (in->len - in->used < 3 && !in->eof && in_fill(in) != 0)
+			goto out;
+		if (in->len - in->used < 3 || memcmp(in->buf + in->used, "BZh", 3) != 0)
+			break;
+		BZ2_bzDecompressEnd(&bs);
+		if (BZ2_bzDecompressInit(&bs, 0, 0) != BZ_OK) {
+			errno = ENOMEM;
+			goto out;
+		}
+		pending = 0;
+	}
+	ret = 0;
+out:
+	BZ2_bzDecompressEnd(&bs);
+	free(out);
+	return ret;
+}
+
+static int ent_cmp(const void *a, const void *b)
+{
+	const struct metaimg_ent *ea = a;
+	const struct metaimg_ent *eb = b;
+
+	if (ea->blk != eb->blk)
+		return ea->blk < eb->blk ? -1 : 1;
+	/* Later copies of a block are further into the stream */
+	if (ea->loc != eb->loc)
+		return ea->loc < eb->loc ? -1 : 1;
+	return 0;
+}
+
+/* Sort an index by block, keeping the last copy of blocks saved more than once
+   as restoremeta would. Returns the new number of entries. */
+static uint64_t ents_sort(struct metaimg_ent *ents, uint64_t nents)
+{
+	uint64_t n = 0;
+
+	qsort(ents, nents, sizeof(*ents), ent_cmp);
+	for (uint64_t i = 0; i < nents; i++) {
+		if (i + 1 < nents && ents[i + 1].blk == ents[i].blk)
+			continue;
+		ents[n++] = ents[i];
+	}
+	return n;
+}
+
+static void scan_finish(struct metaimg_scan *sc)
+{
+	struct lgfs2_metaimg *mi = sc->mi;
+	uint64_t n;
+	uint64_t size;
+
+	/* The last record's data was cut short */
+	if (sc->skip > 0)
+		mi->nents--;
+	n = mi->nents = ents_sort(mi->ents, mi->nents);
+	mi->size = sc->fs_bytes;
+	size = n ? (mi->ents[n - 1].blk + 1) * mi->bsize : 0;
+	if (size > mi->size)
+		mi->size = size;
+}
+
+static void metaimg_reset(struct lgfs2_metaimg *mi)
+{
+	free(mi->ents);
+	mi->ents = NULL;
+	mi->nents = 0;
+	if (mi->chunks != NULL) {
+		for (uint64_t i = 0; i < mi->nmembers; i++)
+			free(mi->chunks[i].ents);
+	}
+	free(mi->chunks);
+	mi->chunks = NULL;
+	free(mi->by_first);
+	mi->by_first = NULL;
+	free(mi->last_max);
+	mi->last_max = NULL;
+	free(mi->members);
+	mi->members = NULL;
+	mi->nmembers = 0;
+}
+
+/* Index the records in the stream, decompressing it to mi->spill_fd if that is
+   open. Returns the size of the largest gzip member or -1 with errno set. */
+static int64_t metaimg_index(struct lgfs2_metaimg *mi)
+{
+	struct metaimg_scan *sc;
+	struct metaimg_in in = { .fd = mi->fd };
+	int64_t ret = -1;
+	int err;
+
+	sc = calloc(1, sizeof(*sc));
+	in.buf = malloc(METAIMG_CHUNK);
+	if (sc == NULL || in.buf == NULL)
+		goto out;
+	sc->mi = mi;
+	if (mi->type == METAIMG_GZIP)
+		err = scan_gzip(sc, &in);
+	else if (mi->type == METAIMG_BZIP2)
+		err = scan_bzip2(sc, &in);
+	else
+		err = scan_raw(sc, &in);
+	if (err == 0 && !sc->found)
+		err = scan_preamble(sc);
+	if (err != 0)
+		goto out;
+	scan_finish(sc);
+	ret = sc->member_max;
+out:
+	if (ret < 0)
+		metaimg_reset(mi);
+	free(in.buf);
+	free(sc);
+	return ret;
+}
+
+static int metaimg_spill_open(void)
+{
+	const char *dir = getenv("TMPDIR");
+	char *path;
+	int fd;
+
+	if (dir == NULL || *dir == '\0')
+		dir = "/tmp";
+	if (asprintf(&path, "%s/gfs2meta.XXXXXX", dir) < 0)
+		return -1;
+	fd = mkostemp(path, O_CLOEXEC);
+	if (fd >= 0)
+		unlink(path);
+	free(path);
+	return fd;
+}
+
+static void metaimg_free(struct lgfs2_metaimg *mi)
+{
+	metaimg_reset(mi);
+	for (unsigned i = 0; i < METAIMG_CACHED; i++)
+		free(mi->cache[i].buf);
+	if (mi->spill_fd >= 0)
+		close(mi->spill_fd);
+	pthread_mutex_destroy(&mi->lock);
+	free(mi);
+}
+
+static const char *metaimg_member(struct lgfs2_metaimg *mi, uint64_t idx)
+{
+	const struct metaimg_member *m = &mi->members[idx];
+	struct metaimg_cached *c = &mi->cache[0];
+	z_stream zs = {0};
+	unsigned char *in;
+	ssize_t n;
+	int zret;
+
+	for (unsigned i = 0; i < METAIMG_CACHED; i++) {
+		if (mi->cache[i].buf != NULL && mi->cache[i].member == idx) {
+			mi->cache[i].used = ++mi->tick;
+			return mi->cache[i].buf;
+		}
+		if (mi->cache[i].used < c->used)
+			c = &mi->cache[i];
+	}
+	free(c->buf);
+	c->buf = malloc(m->len);
+	in = malloc(m->inlen);
+	if (c->buf == NULL || in == NULL)
+		goto fail;
+	n = pread(mi->fd, in, m->inlen, m->in);
+	if (n < 0)
+		goto fail;
+	if (inflateInit2(&zs, 16 + MAX_WBITS) != Z_OK) {
+		errno = ENOMEM;
+		goto fail;
+	}
+	zs.next_in = in;
+	zs.avail_in = n;
+	zs.next_out = (unsigned char *)c->buf;
+	zs.avail_out = m->len;
+	zret = inflate(&zs, Z_FINISH);
+	inflateEnd(&zs);
+	/* The file has changed since it was indexed */
+	if ((zret != Z_STREAM_END && zret != Z_OK && zret != Z_BUF_ERROR) || zs.avail_out != 0) {
+		errno = EIO;
+		goto fail;
+	}
+	free(in);
+	c->member = idx;
+	c->used = ++mi->tick;
+	return c->buf;
+fail:
+	free(in);
+	free(c->buf);
+	c->buf = NULL;
+	c->used = 0;
+	return NULL;
+}
+
+/* The start of the empty gzip member which ends a format 2 file. It has a 16
+   byte extra field subfield called "SM" which holds the index's location. */
+static const unsigned char trailer_head[] = {
+	0x1f, 0x8b, Z_DEFLATED, 0x04 /* FEXTRA */, 0, 0, 0, 0, 0, 0xff,
+	20, 0, 'S', 'M', 16, 0
+};
+
+/**
+ * Fill in the trailer of a format 2 savemeta file.
+ * buf: SAVEMETA_TRAILER_LEN bytes
+ * index: where the index's gzip member starts in the file
+ * index_len: the length of the index's gzip member
+ * chunks: the number of chunks in the index
+ */
+void lgfs2_savemeta_trailer(char *buf, uint64_t index, uint32_t index_len, uint32_t chunks)
+{
+	__be64 off = cpu_to_be64(index);
+	__be32 len = cpu_to_be32(index_len);
+	__be32 count = cpu_to_be32(chunks);
+	char *p = buf + sizeof(trailer_head);
+
+	memset(buf, 0, SAVEMETA_TRAILER_LEN);
+	memcpy(buf, trailer_head, sizeof(trailer_head));
+	memcpy(p, &off, sizeof(off));
+	memcpy(p + 8, &len, sizeof(len));
+	memcpy(p + 12, &count, sizeof(count));
+	/* An empty, final block of fixed codes. The CRC and size are 0. */
+	p[16] = 0x03;
+}
+
+/**
+ * Read and decompress a chunk of a format 2 savemeta file.
+ * buf: c->size bytes for the chunk's contents
+ * Returns 0 on success or -1 with errno set on failure, EBADMSG if the chunk's
+ * contents don't match the index.
+ */
+int lgfs2_savemeta_chunk_read(int fd, const struct lgfs2_savemeta_chunk *c, char *buf)
+{
+	z_stream zs = {0};
+	unsigned char *in;
+	ssize_t n;
+	int zret;
+
+	in = malloc(c->len);
+	if (in == NULL)
+		return -1;
+	n = pread(fd, in, c->len, c->offset);
+	if (n < 0) {
+		free(in);
+		return -1;
+	}
+	if (inflateInit2(&zs, 16 + MAX_WBITS) != Z_OK) {
+		free(in);
+		errno = ENOMEM;
+		return -1;
+	}
+	zs.next_in = in;
+	zs.avail_in = n;
+	zs.next_out = (unsigned char *)buf;
+	zs.avail_out = c->size;
+	zret = inflate(&zs, Z_FINISH);
+	inflateEnd(&zs);
+	free(in);
+	if (zret != Z_STREAM_END || zs.avail_out != 0) {
+		errno = EBADMSG;
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Read the index of a format 2 savemeta file.
+ * chunks: set to an array of the chunks in the file, to be freed by the caller
+ * count: set to the number of chunks
+ * Returns 0 on success, 1 if the file doesn't end with an index, as when it is
+ * in an older format or was cut short, or -1 with errno set on failure.
+ */
+int lgfs2_savemeta_index(int fd, struct lgfs2_savemeta_chunk **chunks, uint32_t *count)
+{
+	unsigned char trailer[SAVEMETA_TRAILER_LEN];
+	const unsigned char *p = trailer + sizeof(trailer_head);
+	struct lgfs2_savemeta_chunk idx = {0};
+	const struct saved_metablock *end;
+	const struct savemeta_chunk *sc;
+	struct lgfs2_savemeta_chunk *c;
+	uint64_t prev_end = 0;
+	struct stat st;
+	uint32_t n;
+	char *buf;
+	ssize_t ret;
+
+	if (fstat(fd, &st) != 0)
+		return -1;
+	if (!S_ISREG(st.st_mode) || st.st_size < (off_t)sizeof(trailer))
+		return 1;
+	ret = pread(fd, trailer, sizeof(trailer), st.st_size - sizeof(trailer));
+	if (ret < 0)
+		return -1;
+	if (ret != sizeof(trailer) || memcmp(trailer, trailer_head, sizeof(trailer_head)) != 0)
+		return 1;
+	idx.offset = be64_to_cpu(*(__be64 *)p);
+	idx.len = be32_to_cpu(*(__be32 *)(p + 8));
+	n = be32_to_cpu(*(__be32 *)(p + 12));
+	if (n == 0 || n > (UINT32_MAX - sizeof(*end)) / sizeof(*sc) ||
+	    idx.offset + idx.len + sizeof(trailer) != (uint64_t)st.st_size)
+		return 1;
+	idx.size = sizeof(*end) + n * sizeof(*sc);
+	buf = malloc(idx.size);
+	c = calloc(n, sizeof(*c));
+	if (buf == NULL || c == NULL)
+		goto fail;
+	if (lgfs2_savemeta_chunk_read(fd, &idx, buf) != 0) {
+		if (errno != EBADMSG)
+			goto fail;
+		goto no_index;
+	}
+	end = (const void *)buf;
+	if (be64_to_cpu(end->blk) != SAVEMETA_END_BLK)
+		goto no_index;
+	sc = (const void *)(end + 1);
+	for (uint32_t i = 0; i < n; i++) {
+		c[i].offset = be64_to_cpu(sc[i].sc_offset);
+		c[i].len = be32_to_cpu(sc[i].sc_len);
+		c[i].size = be32_to_cpu(sc[i].sc_size);
+		c[i].first = be64_to_cpu(sc[i].sc_first);
+		c[i].last = be64_to_cpu(sc[i].sc_last);
+		if (c[i].offset < prev_end || c[i].offset + c[i].len > idx.offset ||
+		    c[i].size == 0 || c[i].first > c[i].last)
+			goto no_index;
+		prev_end = c[i].offset + c[i].len;
+	}
+	free(buf);
+	*chunks = c;
+	*count = n;
+	return 0;
+no_index:
+	free(buf);
+	free(c);
+	return 1;
+fail:
+	ret = errno;
+	free(buf);
+	free(c);
+	errno = ret;
+	return -1;
+}
+
+static int first_cmp(const void *a, const void *b, void *arg)
+{
+	const struct metaimg_chunk *chunks = arg;
+	uint64_t x = chunks[*(const uint32_t *)a].first;
+	uint64_t y = chunks[*(const uint32_t *)b].first;
+
+	return (x > y) - (x < y);
+}
+
+/* Set up the members of a format 2 file from its index. Returns 0 on success,
+   1 if the file has no index or -1 with errno set on failure. */
+static int metaimg_chunks_open(struct lgfs2_metaimg *mi)
+{
+	struct lgfs2_savemeta_chunk *sc;
+	uint64_t fs_bytes = 0;
+	uint64_t start = 0;
+	uint64_t size;
+	const char *data;
+	size_t first;
+	uint32_t n;
+	int ret;
+
+	ret = lgfs2_savemeta_index(mi->fd, &sc, &n);
+	if (ret != 0)
+		return ret;
+	mi->members = calloc(n, sizeof(*mi->members));
+	mi->chunks = calloc(n, sizeof(*mi->chunks));
+	mi->by_first = calloc(n, sizeof(*mi->by_first));
+	mi->last_max = calloc(n, sizeof(*mi->last_max));
+	if (mi->members == NULL || mi->chunks == NULL ||
+	    mi->by_first == NULL || mi->last_max == NULL) {
+		free(sc);
+		return -1;
+	}
+	mi->nmembers = n;
+	for (uint32_t i = 0; i < n; i++) {
+		mi->members[i].in = sc[i].offset;
+		mi->members[i].inlen = sc[i].len;
+		mi->members[i].start = start;
+		mi->members[i].len = sc[i].size;
+		start += sc[i].size;
+		mi->chunks[i].first = sc[i].first;
+		mi->chunks[i].last = sc[i].last;
+		mi->by_first[i] = i;
+	}
+	free(sc);
+	qsort_r(mi->by_first, n, sizeof(*mi->by_first), first_cmp, mi->chunks);
+	for (uint32_t i = 0; i < n; i++) {
+		uint64_t last = mi->chunks[mi->by_first[i]].last;
+
+		mi->last_max[i] = (i > 0 && mi->last_max[i - 1] > last) ? mi->last_max[i - 1] : last;
+	}
+	data = metaimg_member(mi, 0);
+	if (data == NULL)
+		return -1;
+	if (preamble_parse(mi, data, mi->members[0].len, &fs_bytes, &first) != 0)
+		return -1;
+	mi->rec_start = first;
+	mi->size = fs_bytes;
+	size = (mi->last_max[n - 1] + 1) * mi->bsize;
+	if (size > mi->size)
+		mi->size = size;
+	return 0;
+}
+
+/* Index the records in a chunk of a format 2 file */
+static int metaimg_chunk_index(struct lgfs2_metaimg *mi, uint32_t idx)
+{
+	const struct metaimg_member *m = &mi->members[idx];
+	struct metaimg_chunk *c = &mi->chunks[idx];
+	uint64_t off = idx == 0 ? mi->rec_start : 0;
+	uint64_t alloc = 0;
+	const char *data;
+
+	data = metaimg_member(mi, idx);
+	if (data == NULL)
+		return -1;
+	while (off + sizeof(struct saved_metablock) <= m->len) {
+		struct saved_metablock svb;
+		uint16_t siglen;
+		uint64_t blk;
+
+		memcpy(&svb, data + off, sizeof(svb));
+		blk = be64_to_cpu(svb.blk);
+		siglen = be16_to_cpu(svb.siglen);
+		off += sizeof(svb);
+		if (blk == SAVEMETA_END_BLK)
+			break;
+		if (siglen > mi->bsize || off + siglen > m->len) {
+			errno = EBADMSG;
+			return -1;
+		}
+		if (ents_add(&c->ents, &c->nents, &alloc, blk, m->start + off, siglen) != 0)
+			return -1;
+		off += siglen;
+	}
+	c->nents = ents_sort(c->ents, c->nents);
+	c->indexed = 1;
+	return 0;
+}
+
+/**
+ * Open the file system's device as a savemeta image if it is one. The
+ * superblock record is looked for in regular files which aren't compressed,
+ * and compressed ones must be savemeta images.
+ * Returns 0 on success, with sdp->metaimg set if the device is an image, or -1
+ * with errno set on failure.
+ */
+int lgfs2_metaimg_open(struct gfs2_sbd *sdp)
+{
+	struct lgfs2_metaimg *mi;
+	unsigned char magic[3];
+	struct stat st;
+	int64_t member_max;
+	ssize_t n;
+
+	if (fstat(sdp->device_fd, &st) != 0)
+		return -1;
+	if (!S_ISREG(st.st_mode))
+		return 0;
+	n = pread(sdp->device_fd, magic, sizeof(magic), 0);
+	if (n < 0)
+		return -1;
+	mi = calloc(1, sizeof(*mi));
+	if (mi == NULL)
+		return -1;
+	pthread_mutex_init(&mi->lock, NULL);
+	mi->fd = sdp->device_fd;
+	mi->spill_fd = -1;
+	if (n >= 2 && magic[0] == 0x1f && magic[1] == 0x8b)
+		mi->type = METAIMG_GZIP;
+	else if (n == 3 && memcmp(magic, "BZh", 3) == 0)
+		mi->type = METAIMG_BZIP2;
+
+	if (mi->type == METAIMG_GZIP) {
+		int ret = metaimg_chunks_open(mi);
+
+		if (ret < 0)
+			goto fail;
+		if (ret == 0) {
+			sdp->metaimg = mi;
+			return 0;
+		}
+		metaimg_reset(mi);
+	}
+	if (mi->type == METAIMG_BZIP2 && (mi->spill_fd = metaimg_spill_open()) < 0)
+		goto fail;
+	member_max = metaimg_index(mi);
+	if (member_max < 0) {
+		/* Not an image, just a file system in a file */
+		if (mi->type == METAIMG_RAW && errno == EINVAL) {
+			metaimg_free(mi);
+			return 0;
+		}
+		goto fail;
+	}
+	if (mi->type == METAIMG_GZIP && member_max > METAIMG_MEMBER_MAX) {
+		metaimg_reset(mi);
+		mi->spill_fd = metaimg_spill_open();
+		if (mi->spill_fd < 0 || metaimg_index(mi) < 0)
+			goto fail;
+	}
+	sdp->metaimg = mi;
+	return 0;
+fail:
+	n = errno;
+	metaimg_free(mi);
+	errno = n;
+	return -1;
+}
+
+/**
+ * Fill in the device info of a savemeta image, as lgfs2_get_dev_info() would
+ * for the device it was saved from
+ * Returns 0 on success or -1 with errno set on failure.
+ */
+int lgfs2_metaimg_dev_info(const struct lgfs2_metaimg *mi, struct lgfs2_dev_info *i)
+{
+	memset(i, 0, sizeof(*i));
+	if (fstat(mi->fd, &i->stat) != 0)
+		return -1;
+	i->readonly = 1;
+	i->size = mi->size;
+	i->io_optimal_size = mi->bsize;
+	return 0;
+}
+
+/**
+ * The size of the file system's device in bytes, which for a savemeta image is
+ * the size of the file system it was saved from
+ */
+off_t lgfs2_dev_size(const struct gfs2_sbd *sdp)
+{
+	if (sdp->metaimg != NULL)
+		return sdp->metaimg->size;
+	return lseek(sdp->device_fd, 0, SEEK_END);
+}
+
+/* Read from the decompressed stream */
+static int metaimg_read(struct lgfs2_metaimg *mi, char *buf, size_t len, uint64_t off)
+{
+	if (mi->type == METAIMG_RAW || mi->spill_fd >= 0) {
+		int fd = mi->spill_fd >= 0 ? mi->spill_fd : mi->fd;
+		ssize_t n = pread(fd, buf, len, off);
+
+		if (n < 0)
+			return -1;
+		if ((size_t)n != len) {
+			errno = EIO;
+			return -1;
+		}
+		return 0;
+	}
+	while (len > 0) {
+		uint64_t lo = 0, hi = mi->nmembers;
+		const struct metaimg_member *m;
+		const char *data;
+		size_t n;
+
+		/* Find the last member which starts at or before off */
+		while (hi - lo > 1) {
+			uint64_t mid = lo + (hi - lo) / 2;
+
+			if (mi->members[mid].start <= off)
+				lo = mid;
+			else
+				hi = mid;
+		}
+		m = &mi->members[lo];
+		if (hi == 0 || off < m->start || off >= m->start + m->len) {
+			errno = EIO;
+			return -1;
+		}
+		data = metaimg_member(mi, lo);
+		if (data == NULL)
+			return -1;
+		n = m->start + m->len - off;
+		if (n > len)
+			n = len;
+		memcpy(buf, data + (off - m->start), n);
+		buf += n;
+		len -= n;
+		off += n;
+	}
+	return 0;
+}
+
+static const struct metaimg_ent *ents_find(const struct metaimg_ent *ents, uint64_t nents,
+                                           uint64_t blk)
+{
+	uint64_t lo = 0, hi = nents;
+
+	while (lo < hi) {
+		uint64_t mid = lo + (hi - lo) / 2;
+
+		if (ents[mid].blk == blk)
+			return &ents[mid];
+		if (ents[mid].blk < blk)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return NULL;
+}
+
+/* Find the last copy of a block in the image. Sets *e to NULL if the block
+   wasn't saved. Returns 0 on success or -1 with errno set on failure. */
+static int metaimg_find(struct lgfs2_metaimg *mi, uint64_t blk, const struct metaimg_ent **e)
+{
+	uint64_t lo = 0, hi = mi->nmembers;
+
+	if (mi->chunks == NULL) {
+		*e = ents_find(mi->ents, mi->nents, blk);
+		return 0;
+	}
+	*e = NULL;
+	/* Count the chunks whose ranges start at or before blk */
+	while (lo < hi) {
+		uint64_t mid = lo + (hi - lo) / 2;
+
+		if (mi->chunks[mi->by_first[mid]].first <= blk)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	/* Of those, look in the ones whose ranges cover blk */
+	for (uint64_t i = lo; i > 0 && mi->last_max[i - 1] >= blk; i--) {
+		uint32_t idx = mi->by_first[i - 1];
+		struct metaimg_chunk *c = &mi->chunks[idx];
+		const struct metaimg_ent *found;
+
+		if (c->last < blk)
+			continue;
+		if (!c->indexed && metaimg_chunk_index(mi, idx) != 0)
+			return -1;
+		found = ents_find(c->ents, c->nents, blk);
+		/* Later chunks are further into the stream */
+		if (found != NULL && (*e == NULL || found->loc > (*e)->loc))
+			*e = found;
+	}
+	return 0;
+}
+
+/**
+ * Read from a savemeta image as from the device it was saved from. Blocks
+ * which weren't saved read as zeroes.
+ * Returns the number of bytes read, which is short only at the end of the
+ * device, or -1 with errno set on failure.
+ */
+ssize_t lgfs2_metaimg_pread(struct lgfs2_metaimg *mi, void *buf, size_t count, off_t offset)
+{
+	char *p = buf;
+	size_t done = 0;
+
+	if (offset < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	if ((uint64_t)offset >= mi->size)
+		return 0;
+	if (count > mi->size - offset)
+		count = mi->size - offset;
+	pthread_mutex_lock(&mi->lock);
+	while (done < count) {
+		uint64_t off = offset + done;
+		unsigned boff = off % mi->bsize;
+		size_t n = mi->bsize - boff;
+		const struct metaimg_ent *e;
+
+		if (n > count - done)
+			n = count - done;
+		memset(p + done, 0, n);
+		if (metaimg_find(mi, off / mi->bsize, &e) != 0) {
+			pthread_mutex_unlock(&mi->lock);
+			return -1;
+		}
+		if (e != NULL && boff < (e->loc & 0xffff)) {
+			size_t len = (e->loc & 0xffff) - boff;
+
+			if (len > n)
+				len = n;
+			if (metaimg_read(mi, p + done, len, (e->loc >> 16) + boff) != 0) {
+				pthread_mutex_unlock(&mi->lock);
+				return -1;
+			}
+		}
+		done += n;
+	}
+	pthread_mutex_unlock(&mi->lock);
+	return count;
+}
+
+void lgfs2_metaimg_free(struct gfs2_sbd *sdp)
+{
+	if (sdp->metaimg == NULL)
+		return;
+	metaimg_free(sdp->metaimg);
+	sdp->metaimg = NULL;
+}
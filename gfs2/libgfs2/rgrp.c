@@ -1,5 +1,6 @@
 #include "clusterautoconfig.h"
 
+#include <errno.h>
 #include <inttypes.h>
 #include <limits.h>
 #include <stdio.h>
@@ -79,14 +80,100 @@ errbits:
 }
 
 
+/* A sorted array of the resource groups with a table of slots, one for each
+   2^shift blocks, to narrow down the search. */
+struct lgfs2_rgindex {
+	struct rgrp_tree **rgds;
+	uint64_t *start;
+	uint32_t *slots; /* The last rgrp starting at or before each slot */
+	uint64_t nslots;
+	uint32_t count;
+	unsigned shift;
+};
+
+void lgfs2_rgrp_index_free(struct gfs2_sbd *sdp)
+{
+	struct lgfs2_rgindex *ri = sdp->rgindex;
+
+	if (ri == NULL)
+		return;
+	free(ri->rgds);
+	free(ri->start);
+	free(ri->slots);
+	free(ri);
+	sdp->rgindex = NULL;
+}
+
 /**
- * blk2rgrpd - Find resource group for a given data block number
- * @sdp: The GFS superblock
- * @n: The data block number
- *
- * Returns: Ths resource group, or NULL if not found
+ * Build an index of the resource groups in sdp->rgtree to speed up
+ * gfs2_blk2rgrpd(). Resource groups added to the tree later are still found
+ * but more slowly, so the index should be rebuilt when the tree is complete.
+ * Returns 0 on success or -1 with errno set. EINVAL means the resource groups
+ * overlap, in which case the tree is used directly.
  */
-struct rgrp_tree *gfs2_blk2rgrpd(struct gfs2_sbd *sdp, uint64_t blk)
+int lgfs2_rgrp_index_build(struct gfs2_sbd *sdp)
+{
+	struct lgfs2_rgindex *ri;
+	struct osi_node *n;
+	uint64_t minspan = UINT64_MAX;
+	uint64_t prev_end = 0;
+	uint64_t s;
+	uint32_t i;
+
+	lgfs2_rgrp_index_free(sdp);
+	ri = calloc(1, sizeof(*ri));
+	if (ri == NULL)
+		return -1;
+	for (n = osi_first(&sdp->rgtree); n; n = osi_next(n))
+		ri->count++;
+	if (ri->count == 0)
+		goto out_inval;
+	ri->rgds = calloc(ri->count, sizeof(*ri->rgds));
+	ri->start = calloc(ri->count, sizeof(*ri->start));
+	if (ri->rgds == NULL || ri->start == NULL)
+		goto out_free;
+
+	for (i = 0, n = osi_first(&sdp->rgtree); n; n = osi_next(n), i++) {
+		struct rgrp_tree *rgd = (struct rgrp_tree *)n;
+		uint64_t end = rgd->rt_data0 + rgd->rt_data;
+
+		if (end <= rgd->rt_addr || (i > 0 && rgd->rt_addr < prev_end))
+			goto out_inval;
+		if (end - rgd->rt_addr < minspan)
+			minspan = end - rgd->rt_addr;
+		ri->rgds[i] = rgd;
+		ri->start[i] = rgd->rt_addr;
+		prev_end = end;
+	}
+	/* With slots no bigger than the smallest rgrp a lookup only has to
+	   choose between two rgrps. Irregular layouts get bigger slots and
+	   a binary search within them. */
+	while (ri->shift < 63 && (2ULL << ri->shift) <= minspan)
+		ri->shift++;
+	while ((prev_end >> ri->shift) > 2ULL * ri->count + 64)
+		ri->shift++;
+	ri->nslots = (prev_end >> ri->shift) + 1;
+	ri->slots = calloc(ri->nslots, sizeof(*ri->slots));
+	if (ri->slots == NULL)
+		goto out_free;
+	for (i = 0, s = 0; s < ri->nslots; s++) {
+		while (i + 1 < ri->count && ri->start[i + 1] <= (s << ri->shift))
+			i++;
+		ri->slots[s] = i;
+	}
+	sdp->rgindex = ri;
+	return 0;
+
+out_inval:
+	errno = EINVAL;
+out_free:
+	free(ri->rgds);
+	free(ri->start);
+	free(ri);
+	return -1;
+}
+
+static struct rgrp_tree *rgrp_tree_find(struct gfs2_sbd *sdp, uint64_t blk)
 {
 	struct rgrp_tree *rgd = (struct rgrp_tree *)sdp->rgtree.osi_node;
 	while (rgd) {
@@ -100,6 +187,43 @@ struct rgrp_tree *gfs2_blk2rgrpd(struct gfs2_sbd *sdp, uint64_t blk)
 	return NULL;
 }
 
+/**
+ * blk2rgrpd - Find resource group for a given data block number
+ * @sdp: The GFS superblock
+ * @n: The data block number
+ *
+ * Returns: Ths resource group, or NULL if not found
+ */
+struct rgrp_tree *gfs2_blk2rgrpd(struct gfs2_sbd *sdp, uint64_t blk)
+{
+	struct lgfs2_rgindex *ri = sdp->rgindex;
+	struct rgrp_tree *rgd;
+	uint64_t s;
+	uint32_t lo, hi;
+
+	if (ri == NULL)
+		return rgrp_tree_find(sdp, blk);
+
+	s = blk >> ri->shift;
+	if (s >= ri->nslots)
+		s = ri->nslots - 1;
+	lo = ri->slots[s];
+	hi = (s + 1 < ri->nslots) ? ri->slots[s + 1] : ri->count - 1;
+	while (lo < hi) {
+		uint32_t mid = hi - (hi - lo) / 2;
+
+		if (ri->start[mid] <= blk)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+	/* The tree may have changed since the index was built */
+	rgd = ri->rgds[lo];
+	if (blk >= rgd->rt_addr && blk < rgd->rt_data0 + rgd->rt_data)
+		return rgd;
+	return rgrp_tree_find(sdp, blk);
+}
+
 /**
  * Allocate a multi-block buffer for a resource group's bitmaps. This is done
  * as one chunk and should be freed using lgfs2_rgrp_bitbuf_free().
@@ -182,12 +306,55 @@ void lgfs2_rgrp_crc_set(char *buf)
 	rg->rg_crc = cpu_to_be32(crc);
 }
 
+/*
+ * When a resource group cache is set up, the bitmaps of resource groups which
+ * have been read once are loaded again on demand after they have been
+ * evicted. Resident resource groups are kept on a list, most recently used
+ * first, and lgfs2_rgcache_trim() evicts from the end of it to keep the
+ * memory they use under a limit. Eviction only happens when the caller asks
+ * for it, so pointers into bitmaps stay valid in between.
+ */
+struct lgfs2_rgcache {
+	struct gfs2_sbd *sdp;
+	osi_list_t lru;
+	size_t limit;
+	size_t used;
+	struct lgfs2_rgcache_stats stats;
+};
+
+static int rgcache_linked(const struct rgrp_tree *rgd)
+{
+	return rgd->rt_lru.next != NULL;
+}
+
+static void rgcache_unlink(struct rgrp_tree *rgd)
+{
+	struct lgfs2_rgcache *rc = rgd->rt_cache;
+
+	if (!rgcache_linked(rgd))
+		return;
+	osi_list_del(&rgd->rt_lru);
+	rgd->rt_lru.next = rgd->rt_lru.prev = NULL;
+	rc->used -= (size_t)rgd->rt_length * rc->sdp->sd_bsize;
+}
+
+static void rgcache_link(struct lgfs2_rgcache *rc, struct rgrp_tree *rgd)
+{
+	if (rgd->rt_cache == rc && rgcache_linked(rgd)) {
+		osi_list_del(&rgd->rt_lru);
+	} else {
+		rgd->rt_cache = rc;
+		rc->used += (size_t)rgd->rt_length * rc->sdp->sd_bsize;
+	}
+	osi_list_add(&rgd->rt_lru, &rc->lru);
+}
+
 /**
- * gfs2_rgrp_read - read in the resource group information from disk.
- * @rgd - resource group structure
- * returns: 0 if no error, otherwise the block number that failed
+ * Read the header and bitmap blocks of a resource group into a new buffer.
+ * Returns 0 on success, -1 on failure or the address of a block which is not
+ * of the right type.
  */
-uint64_t gfs2_rgrp_read(struct gfs2_sbd *sdp, struct rgrp_tree *rgd)
+static uint64_t rgrp_read_bitmaps(struct gfs2_sbd *sdp, struct rgrp_tree *rgd)
 {
 	unsigned length = rgd->rt_length * sdp->sd_bsize;
 	off_t offset = rgd->rt_addr * sdp->sd_bsize;
@@ -200,7 +367,8 @@ uint64_t gfs2_rgrp_read(struct gfs2_sbd *sdp, struct rgrp_tree *rgd)
 	if (buf == NULL)
 		return -1;
 
-	if (pread(sdp->device_fd, buf, length, offset) != length) {
+	lgfs2_bcache_flush(sdp, rgd->rt_addr, rgd->rt_length);
+	if (lgfs2_pread(sdp, sdp->device_fd, buf, length, offset) != length) {
 		free(buf);
 		return -1;
 	}
@@ -215,22 +383,89 @@ uint64_t gfs2_rgrp_read(struct gfs2_sbd *sdp, struct rgrp_tree *rgd)
 			return rgd->rt_addr + i;
 		}
 	}
+	return 0;
+}
+
+/**
+ * gfs2_rgrp_read - read in the resource group information from disk.
+ * @rgd - resource group structure
+ * returns: 0 if no error, otherwise the block number that failed
+ */
+uint64_t gfs2_rgrp_read(struct gfs2_sbd *sdp, struct rgrp_tree *rgd)
+{
+	uint64_t errblock;
+	char *buf;
+
+	errblock = rgrp_read_bitmaps(sdp, rgd);
+	if (errblock)
+		return errblock;
+	buf = rgd->bits[0].bi_data;
 	if (sdp->gfs1)
 		lgfs2_gfs_rgrp_in(rgd, buf);
 	else {
 		if (lgfs2_rgrp_crc_check(buf)) {
 			free(buf);
+			rgd->bits[0].bi_data = NULL;
 			return rgd->rt_addr;
 		}
 		lgfs2_rgrp_in(rgd, buf);
 	}
+	if (sdp->rgcache != NULL)
+		rgcache_link(sdp->rgcache, rgd);
 	return 0;
 }
 
-void gfs2_rgrp_relse(struct gfs2_sbd *sdp, struct rgrp_tree *rgd)
+/**
+ * Read and check the header of a resource group without its bitmaps, which
+ * lgfs2_rgrp_load() reads when they are first needed. This needs a resource
+ * group cache to have been set up.
+ * Returns 0 on success, -1 on failure or the address of the header if it is
+ * not a valid resource group header.
+ */
+uint64_t lgfs2_rgrp_read_header(struct gfs2_sbd *sdp, struct rgrp_tree *rgd)
 {
+	char *buf;
+
+	if (sdp->rgcache == NULL || rgd->bits == NULL || rgd->rt_length == 0 ||
+	    gfs2_check_range(sdp, rgd->rt_addr)) {
+		errno = EINVAL;
+		return -1;
+	}
+	buf = malloc(sdp->sd_bsize);
+	if (buf == NULL)
+		return -1;
+	lgfs2_bcache_flush(sdp, rgd->rt_addr, 1);
+	if (lgfs2_pread(sdp, sdp->device_fd, buf, sdp->sd_bsize,
+	                rgd->rt_addr * sdp->sd_bsize) != sdp->sd_bsize) {
+		free(buf);
+		return -1;
+	}
+	if (gfs2_check_meta(buf, GFS2_METATYPE_RG) ||
+	    (!sdp->gfs1 && lgfs2_rgrp_crc_check(buf))) {
+		free(buf);
+		return rgd->rt_addr;
+	}
+	if (sdp->gfs1)
+		lgfs2_gfs_rgrp_in(rgd, buf);
+	else
+		lgfs2_rgrp_in(rgd, buf);
+	free(buf);
+	rgd->rt_cache = sdp->rgcache;
+	return 0;
+}
+
+/**
+ * Write out the modified bitmap blocks of a resource group and free its
+ * bitmaps. If a block can't be written the bitmaps are kept in memory, still
+ * marked as modified, so that the changes are not lost.
+ * Returns 0 on success or -1 with errno set if a block could not be written.
+ */
+int gfs2_rgrp_relse(struct gfs2_sbd *sdp, struct rgrp_tree *rgd)
+{
+	int error = 0;
+
 	if (rgd->bits == NULL)
-		return;
+		return 0;
 	for (unsigned i = 0; i < rgd->rt_length; i++) {
 		off_t offset = sdp->sd_bsize * (rgd->rt_addr + i);
 		ssize_t ret;
@@ -238,16 +473,151 @@ void gfs2_rgrp_relse(struct gfs2_sbd *sdp, struct rgrp_tree *rgd)
 		if (rgd->bits[i].bi_data == NULL || !rgd->bits[i].bi_modified)
 			continue;
 
-		ret = pwrite(sdp->device_fd, rgd->bits[i].bi_data, sdp->sd_bsize, offset);
+		lgfs2_bcache_forget(sdp, rgd->rt_addr + i, 1);
+		ret = lgfs2_pwrite(sdp, sdp->device_fd, rgd->bits[i].bi_data, sdp->sd_bsize, offset);
 		if (ret != sdp->sd_bsize) {
 			fprintf(stderr, "Failed to write modified resource group at block %"PRIu64": %s\n",
 			        rgd->rt_addr, strerror(errno));
+			error = errno ? errno : EIO;
+			continue;
 		}
 		rgd->bits[i].bi_modified = 0;
 	}
+	if (error) {
+		errno = error;
+		return -1;
+	}
+	rgcache_unlink(rgd);
 	free(rgd->bits[0].bi_data);
 	for (unsigned i = 0; i < rgd->rt_length; i++)
 		rgd->bits[i].bi_data = NULL;
+	return 0;
+}
+
+/**
+ * Make sure the bitmaps of a resource group are in memory, loading them again
+ * if they have been evicted from the resource group cache. The resource group
+ * header fields are left as they are, as any changes to them were written
+ * out with the bitmaps.
+ * Returns 0 on success or -1 with errno set on failure.
+ */
+int lgfs2_rgrp_load(struct rgrp_tree *rgd)
+{
+	struct lgfs2_rgcache *rc = rgd->rt_cache;
+
+	if (rgd->bits != NULL && rgd->bits[0].bi_data != NULL) {
+		if (rc != NULL && rgcache_linked(rgd))
+			rgcache_link(rc, rgd);
+		return 0;
+	}
+	if (rc == NULL || rgd->bits == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (rgrp_read_bitmaps(rc->sdp, rgd) != 0) {
+		errno = EIO;
+		return -1;
+	}
+	rc->stats.loads++;
+	rgcache_link(rc, rgd);
+	return 0;
+}
+
+/**
+ * Set up a resource group cache for a file system. Resource groups read with
+ * gfs2_rgrp_read() afterwards can have their bitmaps evicted by
+ * lgfs2_rgcache_trim() and are loaded again when they are needed.
+ * limit: The amount of bitmap memory, in bytes, to keep after trimming
+ * Returns 0 on success or -1 with errno set on failure.
+ */
+int lgfs2_rgcache_init(struct gfs2_sbd *sdp, size_t limit)
+{
+	struct lgfs2_rgcache *rc;
+
+	if (sdp->rgcache != NULL || sdp->sd_bsize == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	rc = calloc(1, sizeof(*rc));
+	if (rc == NULL)
+		return -1;
+	rc->sdp = sdp;
+	rc->limit = limit;
+	osi_list_init(&rc->lru);
+	sdp->rgcache = rc;
+	return 0;
+}
+
+/**
+ * Evict the least recently used resource groups from the cache until the
+ * memory used by the remaining ones is under the limit, writing out any which
+ * have been modified. This must not be called while pointers into the bitmaps
+ * of resource groups other than the most recently loaded one are held.
+ * Resource groups which can't be written out stay in the cache.
+ * Returns 0 on success or -1 with errno set if any could not be written.
+ */
+int lgfs2_rgcache_trim(struct gfs2_sbd *sdp)
+{
+	struct lgfs2_rgcache *rc = sdp->rgcache;
+	osi_list_t *pos, *prev;
+	int error = 0;
+
+	if (rc == NULL)
+		return 0;
+	/* Never evict the most recently used one */
+	for (pos = rc->lru.prev; rc->used > rc->limit && pos != rc->lru.next; pos = prev) {
+		struct rgrp_tree *rgd = osi_list_entry(pos, struct rgrp_tree, rt_lru);
+		unsigned modified = 0;
+
+		prev = pos->prev;
+		for (unsigned i = 0; i < rgd->rt_length; i++)
+			if (rgd->bits[i].bi_modified)
+				modified++;
+		if (gfs2_rgrp_relse(sdp, rgd) != 0) {
+			error = errno;
+			continue;
+		}
+		rc->stats.writebacks += modified;
+		rc->stats.evictions++;
+	}
+	if (error) {
+		errno = error;
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Get the resource group cache statistics for a file system.
+ * Returns 0 on success or -1 if no cache has been set up.
+ */
+int lgfs2_rgcache_stats(const struct gfs2_sbd *sdp, struct lgfs2_rgcache_stats *st)
+{
+	if (sdp->rgcache == NULL)
+		return -1;
+	*st = sdp->rgcache->stats;
+	return 0;
+}
+
+/**
+ * Free the resource group cache of a file system. Resource groups which are
+ * in memory stay there and evicted ones are no longer loaded on demand.
+ */
+void lgfs2_rgcache_free(struct gfs2_sbd *sdp)
+{
+	struct lgfs2_rgcache *rc = sdp->rgcache;
+	struct osi_node *n;
+
+	if (rc == NULL)
+		return;
+	for (n = osi_first(&sdp->rgtree); n; n = osi_next(n)) {
+		struct rgrp_tree *rgd = (struct rgrp_tree *)n;
+
+		rgcache_unlink(rgd);
+		rgd->rt_cache = NULL;
+	}
+	free(rc);
+	sdp->rgcache = NULL;
 }
 
 struct rgrp_tree *rgrp_insert(struct osi_root *rgtree, uint64_t rgblock)
@@ -289,12 +659,18 @@ void gfs2_rgrp_free(struct gfs2_sbd *sdp, struct osi_root *rgrp_tree)
 	while ((n = osi_first(rgrp_tree))) {
 		rgd = (struct rgrp_tree *)n;
 
-		gfs2_rgrp_relse(sdp, rgd);
+		if (gfs2_rgrp_relse(sdp, rgd) != 0) {
+			/* The changes are lost but the failure has been reported */
+			rgcache_unlink(rgd);
+			free(rgd->bits[0].bi_data);
+		}
 		free(rgd->bits);
 		rgd->bits = NULL;
 		osi_erase(&rgd->node, rgrp_tree);
 		free(rgd);
 	}
+	if (rgrp_tree == &sdp->rgtree)
+		lgfs2_rgrp_index_free(sdp);
 }
 
 static uint64_t align_block(const uint64_t base, const uint64_t align)
@@ -608,6 +984,7 @@ unsigned lgfs2_rgsize_for_data(uint64_t blksreq, unsigned bsize)
 // Temporary function to aid in API migration
 void lgfs2_attach_rgrps(struct gfs2_sbd *sdp, lgfs2_rgrps_t rgs)
 {
+	lgfs2_rgrp_index_free(sdp);
 	sdp->rgtree.osi_node = rgs->root.osi_node;
 }
 
@@ -689,7 +1066,8 @@ int lgfs2_rgrp_write(int fd, const lgfs2_rgrp_t rg)
 	if (rg->rgrps->align > 0)
 		len = ROUND_UP(len, rg->rgrps->align * sdp->sd_bsize);
 
-	ret = pwrite(fd, rg->bits[0].bi_data, len, rg->rt_addr * sdp->sd_bsize);
+	lgfs2_bcache_forget(sdp, rg->rt_addr, len / sdp->sd_bsize);
+	ret = lgfs2_pwrite(sdp, fd, rg->bits[0].bi_data, len, rg->rt_addr * sdp->sd_bsize);
 
 	if (freebufs)
 		lgfs2_rgrp_bitbuf_free(rg);
@@ -0,0 +1,415 @@
+#include "clusterautoconfig.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "libgfs2.h"
+
+/*
+ * Simulated device
+ *
+ * Makes the device behave like a slower one, so that the I/O scheduling of the
+ * tools can be tuned and tested against an image file. The lgfs2_pread()
+ * family of wrappers still do the I/O on the image but then wait until the
+ * simulated device would have completed it. The device serves up to 'qd'
+ * requests at a time, each taking 'lat' microseconds plus its transfer time at
+ * 'bw' MiB/s, and requests larger than 'maxio' KiB are split. In front of it
+ * sits a page cache of 'cache' MiB, which lgfs2_fadvise() fills ahead of time
+ * for POSIX_FADV_WILLNEED and empties for POSIX_FADV_DONTNEED, so read-ahead
+ * pays off as it would on a real device. Writes are written through. Each
+ * request can be logged to a 'trace' file as
+ *
+ *   <usecs since start> <R|W|A> <offset> <length> <bytes missed> <usecs waited>
+ *
+ * where A is read-ahead.
+ */
+
+#define SIMDEV_PAGE (4096)
+#define SIMDEV_WAYS (8)
+#define SIMDEV_EMPTY (UINT64_MAX)
+#define SIMDEV_AHEAD (2) /* After LGFS2_IO_READ and LGFS2_IO_WRITE */
+
+struct simdev_page {
+	uint64_t page;
+	uint64_t ready;  /* When the page will be in the cache */
+	uint64_t used;   /* For choosing the least recently used way */
+	int ahead;       /* Read ahead and not yet used */
+};
+
+struct lgfs2_simdev {
+	pthread_mutex_t lock;
+	uint64_t lat;    /* Nanoseconds per request */
+	uint64_t bw;     /* Bytes per second */
+	uint64_t maxio;  /* Bytes per request */
+	unsigned qd;
+	uint64_t *busy;  /* When each queue slot becomes free */
+	struct simdev_page *pages;
+	uint64_t nsets;
+	uint64_t tick;
+	uint64_t start;
+	FILE *trace;
+	struct lgfs2_simdev_stats stats;
+};
+
+static uint64_t sd_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static struct simdev_page *sd_set(struct lgfs2_simdev *sd, uint64_t page)
+{
+	return &sd->pages[((page * 0x9e3779b97f4a7c15ULL) >> 17) % sd->nsets * SIMDEV_WAYS];
+}
+
+static struct simdev_page *sd_lookup(struct lgfs2_simdev *sd, uint64_t page)
+{
+	struct simdev_page *set = sd_set(sd, page);
+
+	for (unsigned i = 0; i < SIMDEV_WAYS; i++)
+		if (set[i].page == page)
+			return &set[i];
+	return NULL;
+}
+
+static void sd_insert(struct lgfs2_simdev *sd, uint64_t page, uint64_t ready, int ahead)
+{
+	struct simdev_page *set = sd_set(sd, page);
+	struct simdev_page *victim = &set[0];
+
+	for (unsigned i = 0; i < SIMDEV_WAYS; i++) {
+		if (set[i].page == SIMDEV_EMPTY) {
+			victim = &set[i];
+			break;
+		}
+		if (set[i].used < victim->used)
+			victim = &set[i];
+	}
+	victim->page = page;
+	victim->ready = ready;
+	victim->used = sd->tick++;
+	victim->ahead = ahead;
+}
+
+/* Queue a transfer of len bytes at time now, returning when it completes */
+static uint64_t sd_queue(struct lgfs2_simdev *sd, uint64_t now, uint64_t len)
+{
+	uint64_t done = now;
+
+	sd->stats.requests++;
+	while (len > 0) {
+		uint64_t n = len < sd->maxio ? len : sd->maxio;
+		uint64_t *slot = &sd->busy[0];
+		uint64_t start;
+
+		for (unsigned i = 1; i < sd->qd; i++)
+			if (sd->busy[i] < *slot)
+				slot = &sd->busy[i];
+		start = *slot > now ? *slot : now;
+		*slot = start + sd->lat + n * 1000000000ULL / sd->bw;
+		if (*slot > done)
+			done = *slot;
+		len -= n;
+	}
+	return done;
+}
+
+/*
+ * Work out when an I/O, or read-ahead, submitted at time now would complete,
+ * updating the cache to match. Called with the lock held.
+ */
+static uint64_t sd_access(struct lgfs2_simdev *sd, int op, uint64_t offset, uint64_t len,
+                          uint64_t now, uint64_t *missed)
+{
+	uint64_t first = offset / SIMDEV_PAGE;
+	uint64_t last = (offset + len + SIMDEV_PAGE - 1) / SIMDEV_PAGE;
+	uint64_t due = now;
+	uint64_t miss = 0;
+	uint64_t p;
+
+	*missed = 0;
+	if (len == 0)
+		return now;
+	if (op == LGFS2_IO_WRITE) {
+		due = sd_queue(sd, now, len);
+		for (p = first; p < last; p++) {
+			struct simdev_page *pg = sd_lookup(sd, p);
+
+			if (pg == NULL)
+				sd_insert(sd, p, due, 0);
+			else
+				pg->ready = due;
+		}
+		sd->stats.written += len;
+		return due;
+	}
+	for (p = first; p < last; p++) {
+		struct simdev_page *pg = sd_lookup(sd, p);
+
+		if (pg == NULL) {
+			miss++;
+			continue;
+		}
+		pg->used = sd->tick++;
+		if (op == SIMDEV_AHEAD)
+			continue;
+		if (pg->ahead) {
+			sd->stats.ahead_used++;
+			pg->ahead = 0;
+		}
+		if (pg->ready > due)
+			due = pg->ready;
+		sd->stats.hits++;
+	}
+	if (miss == 0)
+		return due;
+	if (op == SIMDEV_AHEAD)
+		sd->stats.ahead += miss;
+	else
+		sd->stats.misses += miss;
+	*missed = miss * SIMDEV_PAGE;
+	/* Read the missing pages in one go, as if they were contiguous */
+	p = sd_queue(sd, now, miss * SIMDEV_PAGE);
+	if (p > due)
+		due = p;
+	for (p = first; p < last; p++)
+		if (sd_lookup(sd, p) == NULL)
+			sd_insert(sd, p, due, op == SIMDEV_AHEAD);
+	return due;
+}
+
+static void sd_trace(struct lgfs2_simdev *sd, int op, uint64_t offset, uint64_t len,
+                     uint64_t missed, uint64_t now, uint64_t due)
+{
+	if (sd->trace == NULL)
+		return;
+	fprintf(sd->trace, "%"PRIu64" %c %"PRIu64" %"PRIu64" %"PRIu64" %"PRIu64"\n",
+	        (now - sd->start) / 1000, "RWA"[op],
+	        offset, len, missed, (due - now) / 1000);
+}
+
+/**
+ * Work out when an I/O of len bytes at offset, made now, would complete on
+ * the simulated device.
+ * dir: LGFS2_IO_READ or LGFS2_IO_WRITE
+ * Returns the time, in nanoseconds on the monotonic clock, to wait until.
+ */
+uint64_t lgfs2_simdev_submit(struct lgfs2_simdev *sd, int dir, uint64_t offset, uint64_t len)
+{
+	uint64_t now = sd_now();
+	uint64_t missed = 0;
+	uint64_t due;
+
+	pthread_mutex_lock(&sd->lock);
+	due = sd_access(sd, dir, offset, len, now, &missed);
+	sd->stats.waited += due - now;
+	sd_trace(sd, dir, offset, len, missed, now, due);
+	pthread_mutex_unlock(&sd->lock);
+	return due;
+}
+
+/**
+ * Wait until a time returned by lgfs2_simdev_submit(), leaving errno as it was.
+ */
+void lgfs2_simdev_wait(uint64_t due)
+{
+	int saved_errno = errno;
+	struct timespec ts = {
+		.tv_sec = due / 1000000000ULL,
+		.tv_nsec = due % 1000000000ULL
+	};
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+	errno = saved_errno;
+}
+
+/**
+ * posix_fadvise() for a file system's device, which the simulated device, if
+ * there is one, uses to read ahead and drop pages from its cache instead.
+ * Returns the result of posix_fadvise(), or 0 for the simulated device.
+ */
+int lgfs2_fadvise(const struct gfs2_sbd *sdp, int fd, off_t offset, off_t len, int advice)
+{
+	struct lgfs2_simdev *sd = sdp->simdev;
+	uint64_t now, missed, due, max;
+
+	if (sd == NULL || fd != sdp->device_fd)
+		return posix_fadvise(fd, offset, len, advice);
+
+	max = sd->nsets * SIMDEV_WAYS * SIMDEV_PAGE;
+	pthread_mutex_lock(&sd->lock);
+	switch (advice) {
+	case POSIX_FADV_WILLNEED:
+		/* No more than would fit in the cache */
+		if (len == 0 || (uint64_t)len > max)
+			len = max;
+		now = sd_now();
+		due = sd_access(sd, SIMDEV_AHEAD, offset, len, now, &missed);
+		sd_trace(sd, SIMDEV_AHEAD, offset, len, missed, now, due);
+		break;
+	case POSIX_FADV_DONTNEED:
+		for (uint64_t i = 0; i < sd->nsets * SIMDEV_WAYS; i++) {
+			struct simdev_page *pg = &sd->pages[i];
+
+			if (pg->page != SIMDEV_EMPTY && pg->page >= (uint64_t)offset / SIMDEV_PAGE &&
+			    (len == 0 || pg->page < (uint64_t)(offset + len) / SIMDEV_PAGE))
+				pg->page = SIMDEV_EMPTY;
+		}
+		break;
+	}
+	pthread_mutex_unlock(&sd->lock);
+	return 0;
+}
+
+static int sd_parse(struct lgfs2_simdev *sd, const char *spec, char **trace)
+{
+	char *s = strdup(spec);
+	char *opt, *save = NULL;
+	uint64_t cache = 256;
+
+	if (s == NULL)
+		return -1;
+	for (opt = strtok_r(s, ",", &save); opt != NULL; opt = strtok_r(NULL, ",", &save)) {
+		char *val = strchr(opt, '=');
+		char *end;
+		uint64_t n;
+
+		if (val == NULL)
+			goto inval;
+		*val++ = '\0';
+		if (strcmp(opt, "trace") == 0) {
+			free(*trace);
+			*trace = strdup(val);
+			if (*trace == NULL)
+				goto fail;
+			continue;
+		}
+		errno = 0;
+		n = strtoull(val, &end, 10);
+		if (errno != 0 || end == val || *end != '\0')
+			goto inval;
+		if (strcmp(opt, "lat") == 0)
+			sd->lat = n * 1000;
+		else if (strcmp(opt, "bw") == 0 && n > 0)
+			sd->bw = n << 20;
+		else if (strcmp(opt, "qd") == 0 && n > 0)
+			sd->qd = n;
+		else if (strcmp(opt, "maxio") == 0 && n > 0)
+			sd->maxio = n << 10;
+		else if (strcmp(opt, "cache") == 0)
+			cache = n;
+		else
+			goto inval;
+	}
+	free(s);
+	/* At least one set of pages */
+	sd->nsets = (cache << 20) / (SIMDEV_PAGE * SIMDEV_WAYS);
+	if (sd->nsets == 0)
+		sd->nsets = 1;
+	return 0;
+inval:
+	errno = EINVAL;
+fail:
+	free(s);
+	return -1;
+}
+
+/**
+ * Put a simulated device in front of a file system's device. spec is a comma
+ * separated list of lat=<usecs>, bw=<MiB/s>, qd=<requests>, maxio=<KiB>,
+ * cache=<MiB> and trace=<file>, any of which may be left out.
+ * Returns 0 on success, or when spec is NULL, or -1 with errno set on failure.
+ */
+int lgfs2_simdev_init(struct gfs2_sbd *sdp, const char *spec)
+{
+	struct lgfs2_simdev *sd;
+	char *trace = NULL;
+
+	if (spec == NULL)
+		return 0;
+	if (sdp->simdev != NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	sd = calloc(1, sizeof(*sd));
+	if (sd == NULL)
+		return -1;
+	sd->lat = 500000;
+	sd->bw = 500ULL << 20;
+	sd->qd = 16;
+	sd->maxio = 512 << 10;
+	if (sd_parse(sd, spec, &trace) != 0)
+		goto fail;
+	sd->busy = calloc(sd->qd, sizeof(*sd->busy));
+	sd->pages = malloc(sd->nsets * SIMDEV_WAYS * sizeof(*sd->pages));
+	if (sd->busy == NULL || sd->pages == NULL)
+		goto fail;
+	for (uint64_t i = 0; i < sd->nsets * SIMDEV_WAYS; i++)
+		sd->pages[i].page = SIMDEV_EMPTY;
+	if (trace != NULL) {
+		sd->trace = fopen(trace, "w");
+		if (sd->trace == NULL)
+			goto fail;
+		free(trace);
+	}
+	pthread_mutex_init(&sd->lock, NULL);
+	sd->start = sd_now();
+	sdp->simdev = sd;
+	return 0;
+fail:
+	free(trace);
+	free(sd->busy);
+	free(sd->pages);
+	free(sd);
+	return -1;
+}
+
+/**
+ * Get the simulated device's statistics.
+ * Returns 0 on success or -1 if there is no simulated device.
+ */
+int lgfs2_simdev_stats(const struct gfs2_sbd *sdp, struct lgfs2_simdev_stats *st)
+{
+	struct lgfs2_simdev *sd = sdp->simdev;
+
+	if (sd == NULL)
+		return -1;
+	pthread_mutex_lock(&sd->lock);
+	*st = sd->stats;
+	pthread_mutex_unlock(&sd->lock);
+	return 0;
+}
+
+/**
+ * Remove the simulated device, adding its statistics to the end of the trace.
+ */
+void lgfs2_simdev_free(struct gfs2_sbd *sdp)
+{
+	struct lgfs2_simdev *sd = sdp->simdev;
+
+	if (sd == NULL)
+		return;
+	if (sd->trace != NULL) {
+		struct lgfs2_simdev_stats *st = &sd->stats;
+
+		fprintf(sd->trace, "# requests %"PRIu64" hits %"PRIu64" misses %"PRIu64" ahead %"PRIu64
+		        " ahead_used %"PRIu64" written %"PRIu64" waited_us %"PRIu64"\n",
+		        st->requests, st->hits, st->misses, st->ahead, st->ahead_used,
+		        st->written, st->waited / 1000);
+		fclose(sd->trace);
+	}
+	pthread_mutex_destroy(&sd->lock);
+	free(sd->busy);
+	free(sd->pages);
+	free(sd);
+	sdp->simdev = NULL;
+}
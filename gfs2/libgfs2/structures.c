@@ -70,7 +70,7 @@ int lgfs2_sb_write(const struct gfs2_sbd *sdp, int fd)
 	lgfs2_sb_out(sdp, buf + sdp->sd_bsize);
 	iov[sb_addr].iov_base = buf + sdp->sd_bsize;
 
-	if (pwritev(fd, iov, len, 0) < (len * sdp->sd_bsize))
+	if (lgfs2_pwritev(sdp, fd, iov, len, 0) < (len * sdp->sd_bsize))
 		goto out_iov;
 
 	err = 0;
@@ -98,6 +98,89 @@ uint32_t lgfs2_log_header_crc(char *buf, unsigned bsize)
 	return crc32c(~0, lb + v1_end + 4, bsize - v1_end - 4);
 }
 
+/* Journal blocks are written in chunks of up to this size */
+#define JOURNAL_WRITE_SIZE (4 << 20)
+
+/**
+ * Build the log headers for a run of new journal blocks.
+ * buf: A zeroed buffer for count blocks. Only the log header parts of the
+ *      blocks are changed so it can be reused for the next run.
+ * bsize: The file system block size
+ * count: The number of blocks in the run
+ * jinode: The address of the journal's inode
+ * lbn: The logical block number of the first block in the journal
+ * addr: The address of the first block on the device
+ * seq: The sequence number of the first block
+ * blocks: The number of blocks in the journal, where the sequence wraps
+ * Returns the sequence number for the block following the run.
+ */
+uint64_t lgfs2_log_headers_fill(char *buf, unsigned bsize, unsigned count, uint64_t jinode,
+                                uint32_t lbn, uint64_t addr, uint64_t seq, uint64_t blocks)
+{
+	unsigned i;
+
+	crc32c_optimization_init();
+	for (i = 0; i < count; i++) {
+		struct gfs2_log_header *lh = (void *)(buf + (size_t)i * bsize);
+		uint32_t hash;
+
+		lh->lh_header.mh_magic = cpu_to_be32(GFS2_MAGIC);
+		lh->lh_header.mh_type = cpu_to_be32(GFS2_METATYPE_LH);
+		lh->lh_header.mh_format = cpu_to_be32(GFS2_FORMAT_LH);
+		lh->lh_flags = cpu_to_be32(GFS2_LOG_HEAD_UNMOUNT | GFS2_LOG_HEAD_USERSPACE);
+		lh->lh_jinode = cpu_to_be64(jinode);
+		lh->lh_sequence = cpu_to_be64(seq);
+		lh->lh_blkno = cpu_to_be32(lbn + i);
+		lh->lh_hash = 0;
+		lh->lh_crc = 0;
+		hash = lgfs2_log_header_hash((char *)lh);
+		lh->lh_hash = cpu_to_be32(hash);
+		lh->lh_addr = cpu_to_be64(addr + i);
+		hash = lgfs2_log_header_crc((char *)lh, bsize);
+		lh->lh_crc = cpu_to_be32(hash);
+
+		if (++seq == blocks)
+			seq = 0;
+	}
+	return seq;
+}
+
+/**
+ * Write a run of contiguous journal blocks, a buffer's worth at a time.
+ * buf: A zeroed buffer of bufblks blocks
+ * Returns 0 on success or -1 with errno set on error.
+ */
+static int write_lh_run(struct gfs2_inode *ip, char *buf, unsigned bufblks, uint32_t lbn,
+                        uint64_t addr, unsigned count, uint64_t *seq, uint64_t blocks)
+{
+	struct gfs2_sbd *sdp = ip->i_sbd;
+
+	while (count > 0) {
+		unsigned n = count < bufblks ? count : bufblks;
+		size_t len = (size_t)n * sdp->sd_bsize;
+
+		*seq = lgfs2_log_headers_fill(buf, sdp->sd_bsize, n, ip->i_num.in_addr,
+		                              lbn, addr, *seq, blocks);
+		lgfs2_bcache_forget(sdp, addr, n);
+		if (lgfs2_pwrite(sdp, sdp->device_fd, buf, len, addr * sdp->sd_bsize) != len)
+			return -1;
+		lbn += n;
+		addr += n;
+		count -= n;
+	}
+	return 0;
+}
+
+static char *journal_buf(struct gfs2_sbd *sdp, unsigned blocks, unsigned *bufblks)
+{
+	*bufblks = JOURNAL_WRITE_SIZE >> sdp->sd_bsize_shift;
+	if (*bufblks > blocks)
+		*bufblks = blocks;
+	if (*bufblks == 0)
+		*bufblks = 1;
+	return calloc(*bufblks, sdp->sd_bsize);
+}
+
 /**
  * Intialise and write the data blocks for a new journal as a contiguous
  * extent. The indirect blocks pointing to these data blocks should have been
@@ -112,48 +195,17 @@ int lgfs2_write_journal_data(struct gfs2_inode *ip)
 	unsigned blocks = (ip->i_size + sdp->sd_bsize - 1) / sdp->sd_bsize;
 	uint64_t jext0 = ip->i_num.in_addr + ip->i_blocks - blocks;
 	uint64_t seq = ((blocks) * (random() / (RAND_MAX + 1.0)));
-	struct gfs2_log_header *lh;
-	uint64_t jblk = jext0;
+	unsigned bufblks;
 	char *buf;
+	int ret;
 
-	buf = calloc(1, sdp->sd_bsize);
+	buf = journal_buf(sdp, blocks, &bufblks);
 	if (buf == NULL)
 		return -1;
 
-	lh = (void *)buf;
-	lh->lh_header.mh_magic = cpu_to_be32(GFS2_MAGIC);
-	lh->lh_header.mh_type = cpu_to_be32(GFS2_METATYPE_LH);
-	lh->lh_header.mh_format = cpu_to_be32(GFS2_FORMAT_LH);
-	lh->lh_flags = cpu_to_be32(GFS2_LOG_HEAD_UNMOUNT | GFS2_LOG_HEAD_USERSPACE);
-	lh->lh_jinode = cpu_to_be64(ip->i_num.in_addr);
-
-	crc32c_optimization_init();
-	do {
-		uint32_t hash;
-
-		lh->lh_sequence = cpu_to_be64(seq);
-		lh->lh_blkno = cpu_to_be32(jblk - jext0);
-		hash = lgfs2_log_header_hash(buf);
-		lh->lh_hash = cpu_to_be32(hash);
-		lh->lh_addr = cpu_to_be64(jblk);
-		hash = lgfs2_log_header_crc(buf, sdp->sd_bsize);
-		lh->lh_crc = cpu_to_be32(hash);
-
-		if (pwrite(sdp->device_fd, buf, sdp->sd_bsize, jblk * sdp->sd_bsize) != sdp->sd_bsize) {
-			free(buf);
-			return -1;
-		}
-
-		lh->lh_crc = 0;
-		lh->lh_hash = 0;
-
-		if (++seq == blocks)
-			seq = 0;
-
-	} while (++jblk < jext0 + blocks);
-
+	ret = write_lh_run(ip, buf, bufblks, 0, jext0, blocks, &seq, blocks);
 	free(buf);
-	return 0;
+	return ret;
 }
 
 static struct gfs2_buffer_head *get_file_buf(struct gfs2_inode *ip, uint64_t lbn, int prealloc)
@@ -182,53 +234,59 @@ static struct gfs2_buffer_head *get_file_buf(struct gfs2_inode *ip, uint64_t lbn
 
 int write_journal(struct gfs2_inode *jnl, unsigned bsize, unsigned int blocks)
 {
-	struct gfs2_log_header *lh;
-	uint32_t x;
+	struct gfs2_sbd *sdp = jnl->i_sbd;
 	uint64_t seq = ((blocks) * (random() / (RAND_MAX + 1.0)));
-	uint32_t hash;
 	unsigned int height;
+	unsigned bufblks;
+	uint32_t x, extlen;
+	uint64_t dbn;
+	char *buf;
+	int new;
 
 	/* Build the height up so our journal blocks will be contiguous and */
 	/* not broken up by indirect block pages.                           */
 	height = calc_tree_height(jnl, (blocks + 1) * bsize);
 	build_height(jnl, height);
 
+	/* Allocate the indirect blocks first, then the data blocks. The data
+	   blocks are written in large chunks below so they aren't read in. */
+	if (jnl->i_height == 0)
+		unstuff_dinode(jnl);
 	for (x = 0; x < blocks; x++) {
-		struct gfs2_buffer_head *bh = get_file_buf(jnl, x, 1);
-		if (!bh)
+		new = 1;
+		block_map(jnl, x, &new, &dbn, NULL, 1);
+		if (!dbn)
 			return -1;
-		bmodified(bh);
-		brelse(bh);
 	}
-	crc32c_optimization_init();
 	for (x = 0; x < blocks; x++) {
-		struct gfs2_buffer_head *bh = get_file_buf(jnl, x, 0);
-		if (!bh)
+		new = 1;
+		block_map(jnl, x, &new, &dbn, NULL, 0);
+		if (!dbn)
 			return -1;
-
-		memset(bh->b_data, 0, bsize);
-		lh = (void *)bh->b_data;
-		lh->lh_header.mh_magic = cpu_to_be32(GFS2_MAGIC);
-		lh->lh_header.mh_type = cpu_to_be32(GFS2_METATYPE_LH);
-		lh->lh_header.mh_format = cpu_to_be32(GFS2_FORMAT_LH);
-		lh->lh_flags = cpu_to_be32(GFS2_LOG_HEAD_UNMOUNT | GFS2_LOG_HEAD_USERSPACE);
-		lh->lh_jinode = cpu_to_be64(jnl->i_num.in_addr);
-		lh->lh_sequence = cpu_to_be64(seq);
-		lh->lh_blkno = cpu_to_be32(x);
-
-		hash = lgfs2_log_header_hash(bh->b_data);
-		lh->lh_hash = cpu_to_be32(hash);
-		lh->lh_addr = cpu_to_be64(bh->b_blocknr);
-
-		hash = lgfs2_log_header_crc(bh->b_data, bsize);
-		lh->lh_crc = cpu_to_be32(hash);
-		bmodified(bh);
-		brelse(bh);
-
-		if (++seq == blocks)
-			seq = 0;
+		if (new && jnl->i_size < ((uint64_t)x + 1) << sdp->sd_bsize_shift) {
+			bmodified(jnl->i_bh);
+			jnl->i_size = ((uint64_t)x + 1) << sdp->sd_bsize_shift;
+		}
 	}
 
+	buf = journal_buf(sdp, blocks, &bufblks);
+	if (buf == NULL)
+		return -1;
+	for (x = 0; x < blocks; x += extlen) {
+		new = 0;
+		block_map(jnl, x, &new, &dbn, &extlen, 0);
+		if (!dbn) {
+			free(buf);
+			return -1;
+		}
+		if (extlen > blocks - x)
+			extlen = blocks - x;
+		if (write_lh_run(jnl, buf, bufblks, x, dbn, extlen, &seq, blocks)) {
+			free(buf);
+			return -1;
+		}
+	}
+	free(buf);
 	return 0;
 }
 
@@ -638,16 +696,9 @@ int gfs2_check_meta(const char *buf, int type)
 unsigned lgfs2_bm_scan(struct rgrp_tree *rgd, unsigned idx, uint64_t *buf, uint8_t state)
 {
 	struct gfs2_bitmap *bi = &rgd->bits[idx];
-	unsigned n = 0;
-	uint32_t blk = 0;
-
-	while(blk < (bi->bi_len * GFS2_NBBY)) {
-		blk = gfs2_bitfit((uint8_t *)bi->bi_data + bi->bi_offset,
-				  bi->bi_len, blk, state);
-		if (blk == BFITNOENT)
-			break;
-		buf[n++] = blk + (bi->bi_start * GFS2_NBBY) + rgd->rt_data0;
-		blk++;
-	}
-	return n;
+
+	if (bi->bi_data == NULL && lgfs2_rgrp_load(rgd) != 0)
+		return 0;
+	return lgfs2_bitmap_scan((uint8_t *)bi->bi_data + bi->bi_offset, bi->bi_len, state,
+	                         (bi->bi_start * GFS2_NBBY) + rgd->rt_data0, buf);
 }
@@ -129,7 +129,7 @@ int read_sb(struct gfs2_sbd *sdp)
 		errno = E2BIG;
 		return -1;
 	}
-	sdp->fssize = lseek(sdp->device_fd, 0, SEEK_END) / sdp->sd_bsize;
+	sdp->fssize = lgfs2_dev_size(sdp) / sdp->sd_bsize;
 	sdp->sd_blocks_per_bitmap = (sdp->sd_bsize - sizeof(struct gfs2_meta_header))
 	                             * GFS2_NBBY;
 	sdp->qcsize = GFS2_DEFAULT_QCSIZE;
@@ -207,6 +207,7 @@ int rindex_read(struct gfs2_sbd *sdp, uint64_t *rgcount, int *ok)
 
 	*ok = 1;
 	*rgcount = 0;
+	lgfs2_rgrp_index_free(sdp);
 	if (sdp->md.riinode->i_size % sizeof(struct gfs2_rindex))
 		*ok = 0; /* rindex file size must be a multiple of 96 */
 	for (rg = 0; ; rg++) {
@@ -256,5 +257,7 @@ int rindex_read(struct gfs2_sbd *sdp, uint64_t *rgcount, int *ok)
 	}
 	if (*rgcount == 0)
 		return -1;
+	/* Without the index lookups just walk the tree, so ignore failures */
+	lgfs2_rgrp_index_build(sdp);
 	return 0;
 }
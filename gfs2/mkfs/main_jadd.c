@@ -456,12 +456,18 @@ out:
 	return ret;
 }
 
-static uint64_t find_block_address(int fd, off_t offset, unsigned bsize)
+/**
+ * Find the device address of the block at a file offset and the number of
+ * blocks which follow it contiguously, up to the end of its extent.
+ * Returns the block address or 0 on error.
+ */
+static uint64_t find_block_address(int fd, off_t offset, unsigned bsize, unsigned *count)
 {
 	struct {
 		struct fiemap fm;
 		struct fiemap_extent fe;
 	} fme;
+	uint64_t end;
 	int ret;
 
 	fme.fm.fm_start = offset;
@@ -470,11 +476,16 @@ static uint64_t find_block_address(int fd, off_t offset, unsigned bsize)
 	fme.fm.fm_extent_count = 1;
 
 	ret = ioctl(fd, FS_IOC_FIEMAP, &fme.fm);
-	if (ret != 0 || fme.fm.fm_mapped_extents != 1) {
+	if (ret != 0 || fme.fm.fm_mapped_extents != 1 ||
+	    offset < fme.fe.fe_logical) {
 		fprintf(stderr, "Failed to find log header block address\n");
 		return 0;
 	}
-	return fme.fe.fe_physical / bsize;
+	end = fme.fe.fe_logical + fme.fe.fe_length;
+	*count = 1;
+	if (end > offset + bsize)
+		*count = (end - offset) / bsize;
+	return (fme.fe.fe_physical + (offset - fme.fe.fe_logical)) / bsize;
 }
 
 static int alloc_new_journal(int fd, unsigned bytes)
@@ -519,11 +530,14 @@ static int add_j(struct gfs2_sbd *sdp, struct jadd_opts *opts)
 	int fd, error = 0;
 	char new_name[256], *buf;
 	uint32_t x, blocks = sdp->jsize << (20 - sdp->sd_bsize_shift);
-	struct gfs2_log_header *lh;
+	uint32_t bufblks = ALLOC_BUF_SIZE >> sdp->sd_bsize_shift;
+	unsigned count;
 	uint64_t seq = RANDOM(blocks), addr = 0;
 	off_t off = 0;
 
-	buf = calloc(1, sdp->sd_bsize);
+	if (bufblks > blocks)
+		bufblks = blocks;
+	buf = calloc(bufblks, sdp->sd_bsize);
 	if (buf == NULL)
 		return -1;
 
@@ -548,39 +562,28 @@ static int add_j(struct gfs2_sbd *sdp, struct jadd_opts *opts)
 		goto close_fd;
 	}
 
-	lh = (void *)buf;
-	lh->lh_header.mh_magic = cpu_to_be32(GFS2_MAGIC);
-	lh->lh_header.mh_type = cpu_to_be32(GFS2_METATYPE_LH);
-	lh->lh_header.mh_format = cpu_to_be32(GFS2_FORMAT_LH);
-	lh->lh_flags = cpu_to_be32(GFS2_LOG_HEAD_UNMOUNT | GFS2_LOG_HEAD_USERSPACE);
-	lh->lh_jinode = cpu_to_be64(addr);
+	/* Write the log headers an extent, or a buffer's worth, at a time */
+	for (x = 0; x < blocks; x += count) {
+		uint64_t blk_addr;
+		ssize_t len;
 
-	for (x=0; x<blocks; x++) {
-		uint32_t hash;
-		uint64_t blk_addr = 0;
-		lh->lh_sequence = cpu_to_be64(seq);
-		lh->lh_blkno = cpu_to_be32(x);
-		hash = lgfs2_log_header_hash(buf);
-		lh->lh_hash = cpu_to_be32(hash);
-		if (!(blk_addr = find_block_address(fd, off, sdp->sd_bsize))) {
+		if (!(blk_addr = find_block_address(fd, off, sdp->sd_bsize, &count))) {
 			error = -1;
 			goto close_fd;
 		}
-		lh->lh_addr = cpu_to_be64(blk_addr);
-		hash = lgfs2_log_header_crc(buf, sdp->sd_bsize);
-		lh->lh_crc = cpu_to_be32(hash);
-		if (write(fd, buf, sdp->sd_bsize) != sdp->sd_bsize) {
+		if (count > blocks - x)
+			count = blocks - x;
+		if (count > bufblks)
+			count = bufblks;
+		seq = lgfs2_log_headers_fill(buf, sdp->sd_bsize, count, addr, x,
+		                             blk_addr, seq, blocks);
+		len = (ssize_t)count * sdp->sd_bsize;
+		if (write(fd, buf, len) != len) {
 			perror("add_j write");
 			error = -1;
 			goto close_fd;
 		}
-		lh->lh_crc = 0;
-		lh->lh_hash = 0;
-
-		if (++seq == blocks)
-			seq = 0;
-		off += sdp->sd_bsize;
-
+		off += len;
 	}
 	error = fsync(fd);
 	if (error != 0) {
@@ -23,6 +23,7 @@
 #include <blkid.h>
 #include <locale.h>
 #include <uuid.h>
+#include <pthread.h>
 
 #define _(String) gettext(String)
 
@@ -78,6 +79,7 @@ static void print_ext_opts(void)
 		"sunit=N", _("Specify the stripe unit of the device, overriding probed values"),
 		"align=[0|1]", _("Disable or enable alignment of resource groups"),
 		"format=N", _("Specify the format version number"),
+		"iostats=F", _("Print I/O statistics, F is table|json[:file]"),
 		NULL, NULL
 	};
 	printf(_("Extended options:\n"));
@@ -120,6 +122,7 @@ struct mkfs_opts {
 	int journals;
 	const char *lockproto;
 	const char *locktable;
+	const char *iostats;
 	struct mkfs_dev dev;
 	unsigned discard:1;
 
@@ -335,6 +338,12 @@ static int opt_parse_extended(char *str, struct mkfs_opts *opts)
 		} else if (strcmp("format", key) == 0) {
 			if (parse_format(opts, val) != 0)
 				return -1;
+		} else if (strcmp("iostats", key) == 0) {
+			if (val == NULL || lgfs2_iostats_format(val, NULL) < 0) {
+				fprintf(stderr, _("Invalid I/O statistics format '%s'\n"), val ? val : "");
+				return -1;
+			}
+			opts->iostats = val;
 		} else if (strcmp("help", key) == 0) {
 			print_ext_opts();
 			return 1;
@@ -706,7 +715,7 @@ static int zero_gap(struct gfs2_sbd *sdp, uint64_t addr, size_t blocks)
 		iov[i].iov_base = zerobuf;
 		iov[i].iov_len = sdp->sd_bsize;
 	}
-	wrote = pwritev(sdp->device_fd, iov, blocks, addr * sdp->sd_bsize);
+	wrote = lgfs2_pwritev(sdp, sdp->device_fd, iov, blocks, addr * sdp->sd_bsize);
 	if (wrote != blocks * sdp->sd_bsize) {
 		fprintf(stderr, _("Zeroing write failed at block %"PRIu64"\n"), addr);
 		free(zerobuf);
@@ -768,7 +777,12 @@ static lgfs2_rgrps_t rgs_init(struct mkfs_opts *opts, struct gfs2_sbd *sdp)
 	return rgs;
 }
 
-static int place_rgrp(struct gfs2_sbd *sdp, lgfs2_rgrp_t rg, int debug)
+/**
+ * Zero the gap between a resource group and the previous one and write the
+ * resource group. This only reads the resource group tree so it can be used
+ * from more than one thread once the tree is built.
+ */
+static int write_rgrp(struct gfs2_sbd *sdp, lgfs2_rgrp_t rg)
 {
 	uint64_t prev_end = (GFS2_SB_ADDR * GFS2_BASIC_BLOCK / sdp->sd_bsize) + 1;
 	lgfs2_rgrp_t prev = lgfs2_rgrp_prev(rg);
@@ -799,6 +813,14 @@ static int place_rgrp(struct gfs2_sbd *sdp, lgfs2_rgrp_t rg, int debug)
 		perror(_("Failed to write resource group"));
 		return -1;
 	}
+	return 0;
+}
+
+static void count_rgrp(struct gfs2_sbd *sdp, lgfs2_rgrp_t rg, int debug)
+{
+	struct gfs2_rindex ri;
+
+	lgfs2_rindex_out(rg, &ri);
 	if (debug) {
 		lgfs2_rindex_print(&ri);
 		printf("\n");
@@ -806,6 +828,13 @@ static int place_rgrp(struct gfs2_sbd *sdp, lgfs2_rgrp_t rg, int debug)
 	sdp->blks_total += be32_to_cpu(ri.ri_data);
 	sdp->fssize = be64_to_cpu(ri.ri_data0) + be32_to_cpu(ri.ri_data);
 	sdp->rgrps++;
+}
+
+static int place_rgrp(struct gfs2_sbd *sdp, lgfs2_rgrp_t rg, int debug)
+{
+	if (write_rgrp(sdp, rg) != 0)
+		return -1;
+	count_rgrp(sdp, rg, debug);
 	return 0;
 }
 
@@ -908,30 +937,126 @@ static int place_journals(struct gfs2_sbd *sdp, lgfs2_rgrps_t rgs, struct mkfs_o
 	return 0;
 }
 
+/* Resource groups are written by this many threads at once */
+#define RG_WRITERS (8)
+
+struct rg_writers {
+	struct gfs2_sbd *sdp;
+	lgfs2_rgrp_t *rgs;
+	unsigned count;
+	unsigned next;
+	unsigned done;
+	int error;
+	pthread_mutex_t lock;
+	pthread_cond_t progress;
+};
+
+static void *rg_writer(void *arg)
+{
+	struct rg_writers *w = arg;
+
+	pthread_mutex_lock(&w->lock);
+	while (!w->error && w->next < w->count) {
+		lgfs2_rgrp_t rg = w->rgs[w->next++];
+		int err;
+
+		pthread_mutex_unlock(&w->lock);
+		err = write_rgrp(w->sdp, rg);
+		pthread_mutex_lock(&w->lock);
+		if (err)
+			w->error = 1;
+		w->done++;
+		pthread_cond_signal(&w->progress);
+	}
+	pthread_mutex_unlock(&w->lock);
+	return NULL;
+}
+
+/**
+ * Write a list of resource groups, which are independent of each other, from
+ * several threads so that the latency of the writes overlaps.
+ */
+static int write_rgrps(struct gfs2_sbd *sdp, lgfs2_rgrp_t *rgs, unsigned count,
+                       struct gfs2_progress_bar *progress)
+{
+	struct rg_writers w = {
+		.sdp = sdp,
+		.rgs = rgs,
+		.count = count,
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.progress = PTHREAD_COND_INITIALIZER,
+	};
+	pthread_t threads[RG_WRITERS];
+	unsigned nthreads = 0;
+	unsigned done;
+
+	while (nthreads < RG_WRITERS && nthreads < count) {
+		if (pthread_create(&threads[nthreads], NULL, rg_writer, &w) != 0)
+			break;
+		nthreads++;
+	}
+	if (nthreads == 0)
+		rg_writer(&w);
+
+	/* Stop waiting when all of the writes are done, or after an error
+	   when the writes which were started are done */
+	pthread_mutex_lock(&w.lock);
+	while (w.done < w.next || (!w.error && w.done < w.count)) {
+		done = w.done;
+		pthread_mutex_unlock(&w.lock);
+		gfs2_progress_update(progress, sdp->rgrps - count + done);
+		pthread_mutex_lock(&w.lock);
+		if (w.done == done)
+			pthread_cond_wait(&w.progress, &w.lock);
+	}
+	pthread_mutex_unlock(&w.lock);
+
+	while (nthreads > 0)
+		pthread_join(threads[--nthreads], NULL);
+	return w.error ? -1 : 0;
+}
+
 static int place_rgrps(struct gfs2_sbd *sdp, lgfs2_rgrps_t rgs, uint64_t *rgaddr, struct mkfs_opts *opts)
 {
 	struct gfs2_progress_bar progress;
 	uint32_t rgblks = ((opts->rgsize << 20) / sdp->sd_bsize);
 	uint32_t rgnum;
+	lgfs2_rgrp_t *list;
+	unsigned count = 0;
 	int result;
 
 	rgnum = lgfs2_rgrps_plan(rgs, sdp->device.length - *rgaddr, rgblks);
 	gfs2_progress_init(&progress, (rgnum + opts->journals), _("Building resource groups: "), opts->quiet);
 
+	list = calloc(rgnum + 1, sizeof(*list));
+	if (list == NULL) {
+		perror(_("Failed to build resource groups"));
+		return -1;
+	}
+	/* Lay out all of the resource groups before writing any of them */
 	while (1) {
 		lgfs2_rgrp_t rg;
 		result = add_rgrp(rgs, rgaddr, 0, &rg);
 		if (result > 0)
 			break;
-		else if (result < 0)
+		else if (result < 0) {
+			free(list);
 			return result;
-
-		result = place_rgrp(sdp, rg, opts->debug);
-		if (result != 0) {
+		}
+		if (count == rgnum + 1) {
+			/* lgfs2_rgrps_plan() should not allow this */
 			fprintf(stderr, _("Failed to build resource groups\n"));
-			return result;
+			free(list);
+			return -1;
 		}
-		gfs2_progress_update(&progress, (sdp->rgrps));
+		list[count++] = rg;
+		count_rgrp(sdp, rg, opts->debug);
+	}
+	result = write_rgrps(sdp, list, count, &progress);
+	free(list);
+	if (result != 0) {
+		fprintf(stderr, _("Failed to build resource groups\n"));
+		return result;
 	}
 	if (lgfs2_rgrps_write_final(sdp->device_fd, rgs) != 0) {
 		perror(_("Failed to write final resource group"));
@@ -1154,6 +1279,12 @@ int main(int argc, char *argv[])
 	}
 	if (sbd_init(&sbd, &opts, bsize) != 0)
 		exit(-1);
+	if (opts.iostats != NULL && lgfs2_iostats_init(&sbd) != 0)
+		perror(_("Failed to set up I/O statistics"));
+	if (lgfs2_simdev_init(&sbd, getenv("LGFS2_SIMDEV")) != 0) {
+		perror(_("Failed to set up the simulated device"));
+		exit(-1);
+	}
 	if (opts.debug) {
 		printf(_("File system options:\n"));
 		printf("  bsize = %u\n", sbd.sd_bsize);
@@ -1189,11 +1320,13 @@ int main(int argc, char *argv[])
 			printf("%s", _("Done\n"));
 	}
 	rgaddr = lgfs2_rgrp_align_addr(rgs, LGFS2_SB_ADDR(&sbd) + 1);
+	lgfs2_iostats_phase(&sbd, "journals");
 	error = place_journals(&sbd, rgs, &opts, &rgaddr);
 	if (error != 0) {
 		fprintf(stderr, _("Failed to create journals\n"));
 		exit(1);
 	}
+	lgfs2_iostats_phase(&sbd, "rgrps");
 	error = place_rgrps(&sbd, rgs, &rgaddr, &opts);
 	if (error) {
 		fprintf(stderr, _("Failed to build resource groups\n"));
@@ -1201,6 +1334,7 @@ int main(int argc, char *argv[])
 	}
 	lgfs2_attach_rgrps(&sbd, rgs); // Temporary
 
+	lgfs2_iostats_phase(&sbd, "structures");
 	error = build_master(&sbd);
 	if (error) {
 		fprintf(stderr, _("Error building '%s': %s\n"), "master", strerror(errno));
@@ -1271,6 +1405,7 @@ int main(int argc, char *argv[])
 		fflush(stdout);
 	}
 
+	lgfs2_iostats_phase(&sbd, "superblock");
 	error = lgfs2_sb_write(&sbd, opts.dev.fd);
 	if (error) {
 		perror(_("Failed to write superblock\n"));
@@ -1292,6 +1427,12 @@ int main(int argc, char *argv[])
 		printf("%s", _("Done\n"));
 		print_results(&sbd, &opts);
 	}
+	if (sbd.iostats != NULL) {
+		if (lgfs2_iostats_report(&sbd, opts.iostats) != 0)
+			perror(_("Failed to print I/O statistics"));
+		lgfs2_iostats_free(&sbd);
+	}
+	lgfs2_simdev_free(&sbd);
 	return 0;
 }
 #endif /* UNITTESTS */
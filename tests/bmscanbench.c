@@ -0,0 +1,101 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <libgfs2.h>
+
+/* Compares the ways of finding all the blocks of a given state in a bitmap */
+
+static const char *prog_name = "bmscanbench";
+
+#define BITMAP_LEN (4096 - sizeof(struct gfs2_meta_header))
+
+static unsigned scan_bitfit(const unsigned char *buf, unsigned len, uint8_t state, uint64_t *out)
+{
+	unsigned long blk = 0;
+	unsigned n = 0;
+
+	while (blk < len * GFS2_NBBY) {
+		blk = gfs2_bitfit(buf, len, blk, state);
+		if (blk == BFITNOENT)
+			break;
+		out[n++] = blk;
+		blk++;
+	}
+	return n;
+}
+
+static unsigned scan_single_pass(const unsigned char *buf, unsigned len, uint8_t state, uint64_t *out)
+{
+	return lgfs2_bitmap_scan(buf, len, state, 0, out);
+}
+
+static double elapsed(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void bench(const char *name, unsigned char *bitmaps, unsigned nbitmaps, uint64_t *out,
+                  unsigned (*scan)(const unsigned char *, unsigned, uint8_t, uint64_t *))
+{
+	struct timespec start;
+	uint64_t found = 0;
+	double secs;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (unsigned i = 0; i < nbitmaps; i++)
+		found += scan(bitmaps + (i * 4096), BITMAP_LEN, GFS2_BLKST_DINODE, out);
+	secs = elapsed(&start);
+	printf("  %-12s %10"PRIu64" found %8.3fs %10.1f MB/s\n", name, found, secs,
+	       (double)nbitmaps * BITMAP_LEN / secs / (1 << 20));
+}
+
+/* Fill the bitmaps with used blocks and every 'every'th block a dinode */
+static void fill(unsigned char *bitmaps, unsigned nbitmaps, unsigned every)
+{
+	uint64_t blocks = (uint64_t)nbitmaps * 4096 * GFS2_NBBY;
+
+	memset(bitmaps, 0x55, (size_t)nbitmaps * 4096);
+	for (uint64_t b = 0; b < blocks; b += every)
+		bitmaps[b / GFS2_NBBY] |= GFS2_BLKST_DINODE << ((b % GFS2_NBBY) * GFS2_BIT_SIZE);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned nbitmaps = 16384; /* 64MB of bitmaps */
+	const unsigned densities[] = { 1, 2, 16, 1000, 100000 };
+	unsigned char *bitmaps;
+	uint64_t *out;
+
+	if (argc > 1) {
+		nbitmaps = strtoul(argv[1], NULL, 10);
+		if (nbitmaps == 0) {
+			fprintf(stderr, "Usage: %s [<number of 4K bitmap blocks>]\n", prog_name);
+			return 1;
+		}
+	}
+	bitmaps = malloc((size_t)nbitmaps * 4096);
+	out = malloc(BITMAP_LEN * GFS2_NBBY * sizeof(*out));
+	if (bitmaps == NULL || out == NULL) {
+		perror(prog_name);
+		return 1;
+	}
+	for (unsigned i = 0; i < sizeof(densities) / sizeof(densities[0]); i++) {
+		fill(bitmaps, nbitmaps, densities[i]);
+		printf("One dinode every %u blocks:\n", densities[i]);
+		bench("gfs2_bitfit", bitmaps, nbitmaps, out, scan_bitfit);
+		bench("single pass", bitmaps, nbitmaps, out, scan_single_pass);
+	}
+	free(out);
+	free(bitmaps);
+	return 0;
+}
+
+/* This function is for libgfs2's sake. */
+void print_it(const char *label, const char *fmt, const char *fmt2, ...) {}
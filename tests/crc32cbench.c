@@ -0,0 +1,70 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <crc32c.h>
+#include <libgfs2.h>
+
+/* Compares the CRC32C implementations which this machine supports */
+
+static const char *prog_name = "crc32cbench";
+
+static double elapsed(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void bench(const struct crc32c_impl *impl, const unsigned char *buf, size_t total, size_t len)
+{
+	struct timespec start;
+	uint32_t crc = 0;
+	double secs;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (size_t off = 0; off + len <= total; off += len)
+		crc ^= impl->fn(~0, buf + off, len);
+	secs = elapsed(&start);
+	printf("  %-12s %08"PRIx32" %8.3fs %10.1f MB/s\n", impl->name, crc, secs,
+	       (double)(total - total % len) / secs / (1 << 20));
+}
+
+int main(int argc, char **argv)
+{
+	/* A log header's crc covers all of the block but its first 56 bytes */
+	const size_t lens[] = { 64, 4096 - 56, 1 << 20 };
+	size_t total = 256 << 20;
+	unsigned char *buf;
+
+	if (argc > 1) {
+		total = strtoull(argv[1], NULL, 10) << 20;
+		if (total == 0) {
+			fprintf(stderr, "Usage: %s [<MB to checksum per test>]\n", prog_name);
+			return 1;
+		}
+	}
+	buf = malloc(total);
+	if (buf == NULL) {
+		perror(prog_name);
+		return 1;
+	}
+	srandom(1);
+	for (size_t i = 0; i < total; i++)
+		buf[i] = random();
+
+	for (unsigned i = 0; i < sizeof(lens) / sizeof(lens[0]); i++) {
+		printf("%zu byte buffers:\n", lens[i]);
+		for (const struct crc32c_impl *impl = crc32c_impls(); impl->name != NULL; impl++)
+			bench(impl, buf, total, lens[i]);
+	}
+	free(buf);
+	return 0;
+}
+
+/* This function is for libgfs2's sake. */
+void print_it(const char *label, const char *fmt, const char *fmt2, ...) {}
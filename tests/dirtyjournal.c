@@ -0,0 +1,308 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <libgfs2.h>
+
+/*
+ * Writes an unclean log into journal0 which re-logs every resource group
+ * header and bitmap block, with their current contents, as many times as will
+ * fit, followed by a number of revokes of unrelated blocks. Replaying it
+ * leaves the file system unchanged, so it can be used to test and time
+ * journal replay in fsck.gfs2.
+ */
+
+static const char *prog_name = "dirtyjournal";
+
+static void usage(void)
+{
+	printf("%s writes a dirty log into journal0 of a gfs2 file system.\n", prog_name);
+	printf("\n");
+	printf("Usage:\n");
+	printf("    %s [-r <revokes>] <device>\n", prog_name);
+	printf("\n");
+	printf("      -r: Number of revokes to add to the log (default 1000)\n");
+}
+
+struct jlog {
+	struct gfs2_sbd *sdp;
+	struct gfs2_inode *jip;
+	uint32_t jblocks;
+	uint32_t lbn;
+	char *buf;
+};
+
+static int jlog_write(struct jlog *jl, uint32_t lbn, const char *buf)
+{
+	struct gfs2_sbd *sdp = jl->sdp;
+	uint64_t dblock = 0;
+	int new = 0;
+
+	block_map(jl->jip, lbn, &new, &dblock, NULL, 0);
+	if (dblock == 0) {
+		fprintf(stderr, "Journal block %"PRIu32" is not mapped\n", lbn);
+		return -1;
+	}
+	if (pwrite(sdp->device_fd, buf, sdp->sd_bsize, dblock * sdp->sd_bsize) != sdp->sd_bsize) {
+		perror("Failed to write journal block");
+		return -1;
+	}
+	return 0;
+}
+
+static int jlog_header(struct jlog *jl, uint32_t lbn, uint64_t seq, uint32_t flags)
+{
+	struct gfs2_log_header *lh = (void *)jl->buf;
+
+	memset(jl->buf, 0, jl->sdp->sd_bsize);
+	lh->lh_header.mh_magic = cpu_to_be32(GFS2_MAGIC);
+	lh->lh_header.mh_type = cpu_to_be32(GFS2_METATYPE_LH);
+	lh->lh_header.mh_format = cpu_to_be32(GFS2_FORMAT_LH);
+	lh->lh_flags = cpu_to_be32(flags);
+	lh->lh_jinode = cpu_to_be64(jl->jip->i_num.in_addr);
+	lh->lh_sequence = cpu_to_be64(seq);
+	lh->lh_tail = 0;
+	lh->lh_blkno = cpu_to_be32(lbn);
+	lh->lh_hash = cpu_to_be32(lgfs2_log_header_hash(jl->buf));
+	lh->lh_crc = cpu_to_be32(lgfs2_log_header_crc(jl->buf, jl->sdp->sd_bsize));
+	return jlog_write(jl, lbn, jl->buf);
+}
+
+static void jlog_descriptor(struct jlog *jl, uint32_t type, uint32_t length, uint32_t data1)
+{
+	struct gfs2_log_descriptor *ld = (void *)jl->buf;
+
+	memset(jl->buf, 0, jl->sdp->sd_bsize);
+	ld->ld_header.mh_magic = cpu_to_be32(GFS2_MAGIC);
+	ld->ld_header.mh_type = cpu_to_be32(GFS2_METATYPE_LD);
+	ld->ld_header.mh_format = cpu_to_be32(GFS2_FORMAT_LD);
+	ld->ld_type = cpu_to_be32(type);
+	ld->ld_length = cpu_to_be32(length);
+	ld->ld_data1 = cpu_to_be32(data1);
+}
+
+/* Log the blocks in blks[], returning the number logged */
+static unsigned jlog_metadata(struct jlog *jl, const uint64_t *blks, unsigned n)
+{
+	struct gfs2_sbd *sdp = jl->sdp;
+	unsigned max = (sdp->sd_bsize - sizeof(struct gfs2_log_descriptor)) / sizeof(__be64);
+	__be64 *ptr = (__be64 *)(jl->buf + sizeof(struct gfs2_log_descriptor));
+	uint32_t lbn = jl->lbn;
+	char *data;
+
+	if (n > max)
+		n = max;
+	if (jl->lbn + 1 + n >= jl->jblocks)
+		return 0;
+	jlog_descriptor(jl, GFS2_LOG_DESC_METADATA, n + 1, n);
+	for (unsigned i = 0; i < n; i++)
+		ptr[i] = cpu_to_be64(blks[i]);
+	if (jlog_write(jl, lbn++, jl->buf) != 0)
+		return 0;
+
+	data = malloc(sdp->sd_bsize);
+	if (data == NULL)
+		return 0;
+	for (unsigned i = 0; i < n; i++) {
+		if (pread(sdp->device_fd, data, sdp->sd_bsize, blks[i] * sdp->sd_bsize) != sdp->sd_bsize ||
+		    jlog_write(jl, lbn++, data) != 0) {
+			free(data);
+			return 0;
+		}
+	}
+	free(data);
+	jl->lbn = lbn;
+	return n;
+}
+
+static int jlog_revokes(struct jlog *jl, uint64_t first, unsigned count)
+{
+	struct gfs2_sbd *sdp = jl->sdp;
+	unsigned first_max = (sdp->sd_bsize - sizeof(struct gfs2_log_descriptor)) / sizeof(__be64);
+	unsigned next_max = (sdp->sd_bsize - sizeof(struct gfs2_meta_header)) / sizeof(__be64);
+	unsigned length = 1;
+	unsigned offset;
+
+	if (count > first_max)
+		length += (count - first_max + next_max - 1) / next_max;
+	if (jl->lbn + length >= jl->jblocks) {
+		fprintf(stderr, "Too many revokes for the journal\n");
+		return -1;
+	}
+	jlog_descriptor(jl, GFS2_LOG_DESC_REVOKE, length, count);
+	offset = sizeof(struct gfs2_log_descriptor);
+	for (unsigned i = 0; i < count; i++) {
+		if (offset + sizeof(__be64) > sdp->sd_bsize) {
+			struct gfs2_meta_header *mh = (void *)jl->buf;
+
+			if (jlog_write(jl, jl->lbn++, jl->buf) != 0)
+				return -1;
+			memset(jl->buf, 0, sdp->sd_bsize);
+			mh->mh_magic = cpu_to_be32(GFS2_MAGIC);
+			mh->mh_type = cpu_to_be32(GFS2_METATYPE_LB);
+			mh->mh_format = cpu_to_be32(GFS2_FORMAT_LB);
+			offset = sizeof(struct gfs2_meta_header);
+		}
+		*(__be64 *)(jl->buf + offset) = cpu_to_be64(first + i);
+		offset += sizeof(__be64);
+	}
+	return jlog_write(jl, jl->lbn++, jl->buf);
+}
+
+static int fill_super_block(struct gfs2_sbd *sdp)
+{
+	uint64_t rgcount;
+	int ok;
+
+	sdp->sd_bsize = GFS2_BASIC_BLOCK;
+	if (compute_constants(sdp) != 0) {
+		fprintf(stderr, "Failed to compute file system constants.\n");
+		return 1;
+	}
+	if (read_sb(sdp) != 0) {
+		perror("Failed to read superblock\n");
+		return 1;
+	}
+	sdp->master_dir = lgfs2_inode_read(sdp, sdp->sd_meta_dir.in_addr);
+	if (sdp->master_dir == NULL) {
+		fprintf(stderr, "Failed to read master directory inode.\n");
+		return 1;
+	}
+	gfs2_lookupi(sdp->master_dir, "rindex", 6, &sdp->md.riinode);
+	if (sdp->md.riinode == NULL || rindex_read(sdp, &rgcount, &ok) != 0) {
+		fprintf(stderr, "Failed to read rindex.\n");
+		return 1;
+	}
+	return 0;
+}
+
+static struct gfs2_inode *journal0(struct gfs2_sbd *sdp)
+{
+	struct gfs2_inode *jindex = NULL;
+	struct gfs2_inode *jip = NULL;
+
+	gfs2_lookupi(sdp->master_dir, "jindex", 6, &jindex);
+	if (jindex == NULL) {
+		fprintf(stderr, "Failed to look up jindex.\n");
+		return NULL;
+	}
+	gfs2_lookupi(jindex, "journal0", 8, &jip);
+	inode_put(&jindex);
+	if (jip == NULL)
+		fprintf(stderr, "Failed to look up journal0.\n");
+	return jip;
+}
+
+static uint64_t *rgrp_blocks(struct gfs2_sbd *sdp, unsigned *count, uint64_t *data0)
+{
+	struct osi_node *n;
+	uint64_t *blks = NULL;
+	unsigned nblks = 0;
+
+	for (n = osi_first(&sdp->rgtree); n; n = osi_next(n)) {
+		struct rgrp_tree *rgd = (struct rgrp_tree *)n;
+		uint64_t *p = realloc(blks, (nblks + rgd->rt_length) * sizeof(*blks));
+
+		if (p == NULL) {
+			free(blks);
+			return NULL;
+		}
+		blks = p;
+		for (unsigned i = 0; i < rgd->rt_length; i++)
+			blks[nblks++] = rgd->rt_addr + i;
+		*data0 = rgd->rt_data0;
+	}
+	*count = nblks;
+	return blks;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned revokes = 1000;
+	unsigned nblks, logged = 0;
+	struct gfs2_sbd sbd;
+	struct jlog jl = { .sdp = &sbd };
+	uint64_t data0 = 0;
+	uint64_t *blks;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "hr:")) != -1) {
+		switch (opt) {
+		case 'r':
+			revokes = strtoul(optarg, NULL, 10);
+			break;
+		case 'h':
+			usage();
+			exit(0);
+		default:
+			usage();
+			exit(1);
+		}
+	}
+	if (optind != argc - 1) {
+		fprintf(stderr, "No device specified.\n");
+		usage();
+		exit(1);
+	}
+	memset(&sbd, 0, sizeof(sbd));
+	if ((sbd.device_fd = open(argv[optind], O_RDWR)) < 0) {
+		perror(argv[optind]);
+		exit(1);
+	}
+	if (fill_super_block(&sbd) != 0)
+		exit(1);
+	jl.jip = journal0(&sbd);
+	if (jl.jip == NULL)
+		exit(1);
+	jl.jblocks = jl.jip->i_size / sbd.sd_bsize;
+	jl.buf = malloc(sbd.sd_bsize);
+	blks = rgrp_blocks(&sbd, &nblks, &data0);
+	if (jl.buf == NULL || blks == NULL) {
+		perror(prog_name);
+		exit(1);
+	}
+
+	jl.lbn = 1;
+	/* Leave room for the revokes, which are replayed in the first pass */
+	jl.jblocks -= 2 + (revokes * sizeof(__be64) + sbd.sd_bsize - 1) / sbd.sd_bsize;
+	for (unsigned i = 0;; ) {
+		unsigned n = jlog_metadata(&jl, blks + i, nblks - i);
+
+		if (n == 0)
+			break;
+		logged += n;
+		i = (i + n) % nblks;
+	}
+	jl.jblocks = jl.jip->i_size / sbd.sd_bsize;
+	if (revokes && jlog_revokes(&jl, data0, revokes) != 0)
+		exit(1);
+	/* The log runs from the tail in block 0 to the head. The blocks after the
+	   head are older headers, so the sequence numbers increase from there. */
+	if (jlog_header(&jl, 0, jl.jblocks - jl.lbn, 0) != 0 ||
+	    jlog_header(&jl, jl.lbn, jl.jblocks - jl.lbn + 1, 0) != 0)
+		exit(1);
+	for (uint32_t lbn = jl.lbn + 1; lbn < jl.jblocks; lbn++)
+		if (jlog_header(&jl, lbn, lbn - jl.lbn, GFS2_LOG_HEAD_UNMOUNT) != 0)
+			exit(1);
+	printf("Logged %u blocks and %u revokes in %"PRIu32" journal blocks.\n",
+	       logged, revokes, jl.lbn + 1);
+
+	free(blks);
+	free(jl.buf);
+	inode_put(&jl.jip);
+	inode_put(&sbd.md.riinode);
+	inode_put(&sbd.master_dir);
+	gfs2_rgrp_free(&sbd, &sbd.rgtree);
+	fsync(sbd.device_fd);
+	close(sbd.device_fd);
+	exit(0);
+}
+
+/* This function is for libgfs2's sake. */
+void print_it(const char *label, const char *fmt, const char *fmt2, ...) {}
@@ -0,0 +1,99 @@
+#!/bin/bash
+
+# Generate a large file system with fsgen and time fsck.gfs2, savemeta and
+# restoremeta on it
+# Usage:
+#   fsbench.sh [-s <size>] [-r <restore path>] [-k] <path> [<fsgen options>]
+#
+#     -s: Size of the sparse files to create (default 1T, ignored for block
+#         devices)
+#     -r: Path to restore the metadata to (default <path>.restored)
+#     -k: Keep the file systems, metadata file and logs afterwards
+#   path: Path of the writable device or file to test on (contents will be destroyed)
+#
+# The logs of each step are written to <path>.<step>.log and the fsck.gfs2
+# performance report to <path>.fsck.json. To test different tools adjust your
+# PATH accordingly.
+
+FSGEN=fsgen
+MKFS=mkfs.gfs2
+FSCK=fsck.gfs2
+GFS2EDIT=gfs2_edit
+
+size=1T
+keep=0
+restored=
+while getopts "s:r:k" opt
+do
+	case $opt in
+	s) size="$OPTARG" ;;
+	r) restored="$OPTARG" ;;
+	k) keep=1 ;;
+	*) exit 1 ;;
+	esac
+done
+shift $((OPTIND - 1))
+
+device="$1"
+if [ -z "$device" ]
+then
+	echo "Usage: $0 [-s <size>] [-r <restore path>] [-k] <path> [<fsgen options>]" >&2
+	exit 1
+fi
+shift
+
+restored="${restored:-${device}.restored}"
+metafile="${device}.meta"
+
+function now()
+{
+	date +%s.%N
+}
+
+function prepare()
+{
+	if [ ! -b "$1" ]
+	then
+		rm -f "$1" && truncate -s "$size" "$1" || exit 1
+	fi
+}
+
+# Usage: step <name> <command...>
+function step()
+{
+	local name="$1" start end
+	shift
+	start=$(now)
+	"$@" > "${device}.${name}.log" 2>&1
+	ret=$?
+	end=$(now)
+	awk "BEGIN { printf \"%-20s %10.3fs\\n\", \"$name\", $end - $start }"
+	if [ $ret -ne 0 ]
+	then
+		echo "$name failed with exit code $ret, see ${device}.${name}.log" >&2
+		exit 1
+	fi
+}
+
+prepare "$device"
+step mkfs $MKFS -O -p lock_nolock "$device"
+step fsgen $FSGEN "$@" "$device"
+tail -1 "${device}.fsgen.log"
+
+step fsck $FSCK -n -S "${device}.fsck.json" "$device"
+sed -n 's/^\(.*\) completed in \(.*\)$/  \1: \2/p' "${device}.fsck.log"
+
+rm -f "$metafile"
+step savemeta $GFS2EDIT savemeta "$device" "$metafile"
+prepare "$restored"
+step restoremeta $GFS2EDIT restoremeta "$metafile" "$restored"
+step fsck-restored $FSCK -n "$restored"
+
+if [ $keep -eq 0 ]
+then
+	for f in "$device" "$restored"
+	do
+		[ -b "$f" ] || rm -f "$f"
+	done
+	rm -f "$metafile" "${device}".*.log "${device}.fsck.json"
+fi
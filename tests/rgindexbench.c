@@ -0,0 +1,105 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <libgfs2.h>
+
+/* Compares resource group lookups with and without the rgrp index */
+
+static const char *prog_name = "rgindexbench";
+
+#define RG_BLOCKS (65536)
+#define LOOKUPS (10000000)
+
+static double elapsed(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void bench(const char *name, struct gfs2_sbd *sdp, uint64_t *blks, unsigned nblks)
+{
+	struct timespec start;
+	unsigned found = 0;
+	double secs;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (unsigned i = 0; i < LOOKUPS; i++)
+		found += gfs2_blk2rgrpd(sdp, blks[i % nblks]) != NULL;
+	secs = elapsed(&start);
+	printf("  %-10s %10u found %8.3fs %12.0f lookups/s\n", name, found, secs, LOOKUPS / secs);
+}
+
+/* Add rgrps of RG_BLOCKS blocks, with a smaller one every 'every' rgrps */
+static uint64_t build_tree(struct gfs2_sbd *sdp, unsigned count, unsigned every)
+{
+	uint64_t addr = 17;
+
+	for (unsigned i = 0; i < count; i++) {
+		struct rgrp_tree *rgd = rgrp_insert(&sdp->rgtree, addr);
+		uint32_t len = (every && i % every == every - 1) ? RG_BLOCKS / 64 : RG_BLOCKS;
+
+		if (rgd == NULL) {
+			perror(prog_name);
+			exit(1);
+		}
+		rgd->rt_length = 1;
+		rgd->rt_data0 = addr + 1;
+		rgd->rt_data = len - 1;
+		addr += len;
+	}
+	return addr;
+}
+
+int main(int argc, char **argv)
+{
+	const unsigned layouts[] = { 0, 100, 2 };
+	unsigned count = 100000;
+	unsigned nblks = 1 << 20;
+	struct gfs2_sbd sbd;
+	uint64_t *blks;
+
+	if (argc > 1) {
+		count = strtoul(argv[1], NULL, 10);
+		if (count == 0) {
+			fprintf(stderr, "Usage: %s [<number of resource groups>]\n", prog_name);
+			return 1;
+		}
+	}
+	blks = malloc(nblks * sizeof(*blks));
+	if (blks == NULL) {
+		perror(prog_name);
+		return 1;
+	}
+	srandom(1);
+	for (unsigned i = 0; i < sizeof(layouts) / sizeof(layouts[0]); i++) {
+		uint64_t end;
+
+		memset(&sbd, 0, sizeof(sbd));
+		end = build_tree(&sbd, count, layouts[i]);
+		for (unsigned j = 0; j < nblks; j++)
+			blks[j] = (((uint64_t)random() << 31) | random()) % end;
+
+		if (layouts[i])
+			printf("%u resource groups, one in %u small:\n", count, layouts[i]);
+		else
+			printf("%u resource groups of %u blocks:\n", count, RG_BLOCKS);
+		bench("rbtree", &sbd, blks, nblks);
+		if (lgfs2_rgrp_index_build(&sbd) != 0) {
+			perror(prog_name);
+			return 1;
+		}
+		bench("index", &sbd, blks, nblks);
+		gfs2_rgrp_free(&sbd, &sbd.rgtree);
+	}
+	free(blks);
+	return 0;
+}
+
+/* This function is for libgfs2's sake. */
+void print_it(const char *label, const char *fmt, const char *fmt2, ...) {}